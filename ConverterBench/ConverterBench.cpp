@@ -0,0 +1,608 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+using namespace xlw;
+
+// xlcall.cpp looks up MdCallBack12 in the host executable; MockExcel's XLCALL32.DLL,
+// copied beside us by the post-build step, looks up MdCallBack.
+#pragma comment (linker, "/export:MdCallBack=_MdCallBack@16")
+#pragma comment (linker, "/export:MdCallBack12=_MdCallBack12@16")
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Micro-benchmarks of the conversions between Excel and Python, to measure every
+// marshaling change against. Each converter is timed over a sweep of shapes
+// (1x1, 1xN, Nx1, NxM and ragged rows, which a CellMatrix pads out to NxM) and
+// contents (numbers, strings, a mix, and mostly-empty ranges):
+//
+//      CellMatrixToPy      ConvertCellMatrixToPyObject
+//      XlfOperToPy         ConvertXlfOperToPyObject, PyCall's direct XLOPER12 path
+//      PyToCellMatrix      ConvertPyObjectToCellMatrix
+//      ConvertToCellMatrix XlfOperImpl12::ConvertToCellMatrix (XlfOper::AsCellMatrix)
+//      SetCellMatrix       XlfOper12::Set(CellMatrix)
+//      GetMemory           XlfExcel::GetMemory, as Set(CellMatrix) calls it
+//      PushBottom          CellMatrix::PushBottom, a row at a time
+//
+// xlw only takes its Excel 2007 paths if Excel says it's Excel 2007, so this
+// program answers the two callbacks xlw makes at startup itself; nothing here
+// needs any other. Each case is run until a sample takes SAMPLE_MS, and the
+// best and median of SAMPLES samples are reported.
+//
+// Results are CSV, one line per case, keyed by benchmark, shape, content and
+// Python version. Given a baseline file from an earlier run, each line also
+// carries the baseline time and the ratio, and the exit code is 1 if any case
+// is slower than the baseline by more than the threshold.
+//
+//     ConverterBench [-n rows] [-m cols] [-f filter] [-o results.csv]
+//                    [-b baseline.csv] [-t threshold]
+
+namespace {
+
+    const double SAMPLE_MS = 20.0;
+    const int    SAMPLES = 5;
+
+    LARGE_INTEGER g_freq;
+
+    double
+    NowMs()
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return 1000.0 * (double) now.QuadPart / (double) g_freq.QuadPart;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The data one case is run over, in every form the converters take
+
+    struct Fixture
+    {
+        long                    rows;
+        long                    cols;
+        long                    cells;          // non-padding cells
+        std::vector<size_t>     stringBytes;    // what Set(CellMatrix) allocates per string
+        std::vector<long>       widths;         // per row; all cols unless ragged
+        CellMatrix              cm;             // padded to rows x cols
+        std::vector<CellMatrix> rowMatrices;    // for PushBottom
+        PyObject*               pObj;           // as a Python script would return it
+        XLOPER12                multi;          // as Excel would pass it
+        std::vector<XLOPER12>   multiCells;
+        std::vector<wchar_t>    multiText;
+
+        Fixture() : rows(0), cols(0), cells(0), pObj(NULL) {}
+        ~Fixture() { Py_XDECREF(pObj); }
+    };
+
+    CellValue
+    MakeCell( const std::string& content, long i )
+    {
+        if (content == "numeric") {
+            return CellValue(i * 0.5);
+        } else if (content == "string") {
+            // Labels repeat, as column headers and codes do
+            wchar_t text[32];
+            swprintf(text, NELEMS(text), L"label%ld", i % 50);
+            return CellValue(std::wstring(text));
+        } else if (content == "mixed") {
+            switch (i % 3) {
+                case 0:  return CellValue(i * 0.5);
+                case 1:  return CellValue(std::wstring(L"text"));
+                default: return CellValue(i % 2 == 0);
+            }
+        } else { // empty-heavy: nine cells in ten empty
+            return (i % 10 == 0) ? CellValue(i * 0.5) : CellValue();
+        }
+    }
+
+    PyObject*
+    MakePyCell( const CellValue& cv )
+    {
+        if (cv.IsANumber()) {
+            return PyFloat_FromDouble(cv.NumericValue());
+        } else if (cv.IsBoolean()) {
+            return PyBool_FromLong(cv.BooleanValue());
+        } else if (cv.IsAWstring()) {
+            const std::wstring& w = cv.WstringValue();
+            return PyUnicode_FromWideChar(w.c_str(), (Py_ssize_t) w.size());
+        }
+        Py_RETURN_NONE;
+    }
+
+    // Ragged results are lists of lists of differing lengths, which only a script
+    // produces; anything else takes the shapes PyCall passes in
+    PyObject*
+    MakeRaggedPyObject( const Fixture& f )
+    {
+        PyObject* pRows = PyList_New(f.rows);
+        for (long i = 0; pRows && i < f.rows; ++i) {
+            PyObject* pRow = PyList_New(f.widths[i]);
+            for (long j = 0; pRow && j < f.widths[i]; ++j) {
+                PyList_SET_ITEM(pRow, j, MakePyCell(f.cm(i, j)));
+            }
+            PyList_SET_ITEM(pRows, i, pRow);
+        }
+        return pRows;
+    }
+
+    // A copy of the matrix as an xltypeMulti in the fixture's own memory; XLW's
+    // temporary memory is reset by some of the cases
+    void
+    MakeMulti( Fixture& f )
+    {
+        size_t chars = 0;
+        for (long i = 0; i < f.rows; ++i) {
+            for (long j = 0; j < f.cols; ++j) {
+                if (f.cm(i, j).IsAWstring()) {
+                    chars += f.cm(i, j).WstringValue().size() + 1;
+                }
+            }
+        }
+        f.multiCells.resize(f.rows * f.cols);
+        f.multiText.resize(chars + 1);
+
+        wchar_t* pText = &f.multiText[0];
+        for (long i = 0; i < f.rows; ++i) {
+            for (long j = 0; j < f.cols; ++j) {
+                const CellValue& cv = f.cm(i, j);
+                XLOPER12& x = f.multiCells[i * f.cols + j];
+                if (cv.IsANumber()) {
+                    x.xltype = xltypeNum;
+                    x.val.num = cv.NumericValue();
+                } else if (cv.IsBoolean()) {
+                    x.xltype = xltypeBool;
+                    x.val.xbool = cv.BooleanValue();
+                } else if (cv.IsAWstring()) {
+                    const std::wstring& w = cv.WstringValue();
+                    pText[0] = (wchar_t) w.size();
+                    std::copy(w.begin(), w.end(), pText + 1);
+                    x.xltype = xltypeStr;
+                    x.val.str = pText;
+                    pText += w.size() + 1;
+                } else {
+                    x.xltype = xltypeNil;
+                }
+            }
+        }
+        f.multi.xltype = xltypeMulti;
+        f.multi.val.array.rows = f.rows;
+        f.multi.val.array.columns = f.cols;
+        f.multi.val.array.lparray = &f.multiCells[0];
+    }
+
+    bool
+    MakeFixture( Fixture& f, const std::string& shape, const std::string& content, long n, long m )
+    {
+        long rows = 1, cols = 1;
+        if (shape == "1xN") {
+            cols = n;
+        } else if (shape == "Nx1") {
+            rows = n;
+        } else if (shape == "NxM" || shape == "ragged") {
+            rows = n;
+            cols = m;
+        }
+
+        f.rows = rows;
+        f.cols = cols;
+        f.cm = CellMatrix(rows, cols);
+        long k = 0;
+        for (long i = 0; i < rows; ++i) {
+            long width = (shape == "ragged") ? 1 + (i % cols) : cols;
+            f.widths.push_back(width);
+            CellMatrix row(1, width);
+            for (long j = 0; j < width; ++j, ++k) {
+                row(0, j) = MakeCell(content, k);
+                f.cm(i, j) = row(0, j);
+                if (row(0, j).IsAWstring()) {
+                    f.stringBytes.push_back(2 * row(0, j).WstringValue().size() + 2);
+                }
+            }
+            f.rowMatrices.push_back(row);
+        }
+        f.cells = k;
+
+        MakeMulti(f);
+        if (shape == "ragged") {
+            f.pObj = MakeRaggedPyObject(f);
+        } else if (!ConvertCellMatrixToPyObject(f.cm, f.pObj)) {
+            f.pObj = NULL;
+        }
+        return f.pObj != NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The cases. Each runs its conversion iterations times.
+
+    typedef void (*BenchFn)( Fixture& f, long iterations );
+
+    void
+    BenchCellMatrixToPy( Fixture& f, long iterations )
+    {
+        PyObject* pObj;
+        for (long i = 0; i < iterations; ++i) {
+            if (ConvertCellMatrixToPyObject(f.cm, pObj)) {
+                Py_DECREF(pObj);
+            }
+        }
+    }
+
+    void
+    BenchXlfOperToPy( Fixture& f, long iterations )
+    {
+        XlfOper oper((LPXLFOPER) &f.multi);
+        PyObject* pObj;
+        for (long i = 0; i < iterations; ++i) {
+            if (ConvertXlfOperToPyObject(oper, pObj, NULL)) {
+                Py_DECREF(pObj);
+            }
+        }
+    }
+
+    void
+    BenchPyToCellMatrix( Fixture& f, long iterations )
+    {
+        for (long i = 0; i < iterations; ++i) {
+            CellMatrix cm;
+            ConvertPyObjectToCellMatrix(f.pObj, cm);
+        }
+    }
+
+    void
+    BenchConvertToCellMatrix( Fixture& f, long iterations )
+    {
+        XlfOper oper((LPXLFOPER) &f.multi);
+        for (long i = 0; i < iterations; ++i) {
+            CellMatrix cm(oper.AsCellMatrix());
+        }
+    }
+
+    // Every XLL call starts by resetting XLW's memory (EXCEL_BEGIN), so each iteration does too
+    void
+    BenchSetCellMatrix( Fixture& f, long iterations )
+    {
+        for (long i = 0; i < iterations; ++i) {
+            {
+                XlfOper12 oper(f.cm);
+            }
+            XlfExcel::Instance().FreeMemory();
+        }
+    }
+
+    void
+    BenchGetMemory( Fixture& f, long iterations )
+    {
+        XlfExcel& excel = XlfExcel::Instance();
+        for (long i = 0; i < iterations; ++i) {
+            excel.GetMemory(sizeof(XLOPER12));
+            excel.GetMemory(f.rows * f.cols * sizeof(XLOPER12));
+            for (size_t s = 0; s < f.stringBytes.size(); ++s) {
+                excel.GetMemory(f.stringBytes[s]);
+            }
+            excel.FreeMemory();
+        }
+    }
+
+    void
+    BenchPushBottom( Fixture& f, long iterations )
+    {
+        for (long i = 0; i < iterations; ++i) {
+            CellMatrix cm;
+            for (size_t r = 0; r < f.rowMatrices.size(); ++r) {
+                cm.PushBottom(f.rowMatrices[r]);
+            }
+        }
+    }
+
+    struct Benchmark
+    {
+        const char* pName;
+        BenchFn     fn;
+    };
+
+    const Benchmark g_benchmarks[] = {
+        { "CellMatrixToPy",      BenchCellMatrixToPy },
+        { "XlfOperToPy",         BenchXlfOperToPy },
+        { "PyToCellMatrix",      BenchPyToCellMatrix },
+        { "ConvertToCellMatrix", BenchConvertToCellMatrix },
+        { "SetCellMatrix",       BenchSetCellMatrix },
+        { "GetMemory",           BenchGetMemory },
+        { "PushBottom",          BenchPushBottom }
+    };
+
+    const char* g_shapes[] = { "1x1", "1xN", "Nx1", "NxM", "ragged" };
+    const char* g_contents[] = { "numeric", "string", "mixed", "empty-heavy" };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    struct Timing
+    {
+        long    iterations;
+        double  bestMs;     // per call
+        double  medianMs;
+    };
+
+    Timing
+    TimeBenchmark( BenchFn fn, Fixture& f )
+    {
+        Timing t;
+
+        // Double the count until a sample is long enough to time
+        t.iterations = 1;
+        while (true) {
+            double start = NowMs();
+            fn(f, t.iterations);
+            double elapsed = NowMs() - start;
+            if (elapsed >= SAMPLE_MS || t.iterations >= (1L << 24)) {
+                break;
+            }
+            t.iterations *= 2;
+        }
+
+        std::vector<double> samples;
+        for (int s = 0; s < SAMPLES; ++s) {
+            double start = NowMs();
+            fn(f, t.iterations);
+            samples.push_back((NowMs() - start) / t.iterations);
+        }
+        std::sort(samples.begin(), samples.end());
+        t.bestMs = samples[0];
+        t.medianMs = samples[SAMPLES / 2];
+        return t;
+    }
+
+    std::string
+    PythonVersion()
+    {
+        char version[16];
+        _snprintf(version, NELEMS(version), "%d.%d.%d", PY_MAJOR_VERSION, PY_MINOR_VERSION, PY_MICRO_VERSION);
+        version[NELEMS(version) - 1] = 0;
+        return version;
+    }
+
+    std::string
+    ResultKey( const std::string& benchmark, const std::string& shape, 
+               const std::string& content, const std::string& python )
+    {
+        return benchmark + "," + shape + "," + content + "," + python;
+    }
+
+    // Baseline ns/cell by key, from an earlier run's output
+    bool
+    ReadBaseline( const char* pFilename, std::map<std::string, double>& rBaseline )
+    {
+        FILE* pFile = fopen(pFilename, "r");
+        if (!pFile) {
+            fprintf(stderr, "Couldn't open baseline %s\n", pFilename);
+            return false;
+        }
+        char line[1024];
+        while (fgets(line, sizeof(line), pFile)) {
+            // benchmark,shape,content,python,build,rows,cols,cells,iterations,best_us,median_us,best_ns_per_cell[,...]
+            std::vector<std::string> fields;
+            std::string field;
+            for (const char* p = line; *p && *p != '\n' && *p != '\r'; ++p) {
+                if (*p == ',') {
+                    fields.push_back(field);
+                    field.clear();
+                } else {
+                    field += *p;
+                }
+            }
+            fields.push_back(field);
+            if (fields.size() >= 12 && fields[0] != "benchmark") {
+                rBaseline[ResultKey(fields[0], fields[1], fields[2], fields[3])] = atof(fields[11].c_str());
+            }
+        }
+        fclose(pFile);
+        return true;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Just enough of Excel for XlfExcel::InitLibrary to decide it's talking to Excel
+// 2007: the workspace version, and coercing it to an integer. MockExcel.exe
+// answers the full set; see MockExcel.cpp.
+
+extern "C" int __stdcall
+MdCallBack12( int xlfn, int count, LPXLOPER12* args, LPXLOPER12 pRes )
+{
+    return (xlfn == xlFree) ? xlretSuccess : xlretFailed;
+}
+
+extern "C" int __stdcall
+MdCallBack( int xlfn, int count, LPXLOPER* args, LPXLOPER pRes )
+{
+    switch (xlfn) {
+        case xlFree:
+            return xlretSuccess;
+
+        case xlfGetWorkspace:
+            pRes->xltype = xltypeNum;
+            pRes->val.num = 12.0;
+            return xlretSuccess;
+
+        case xlCoerce:
+            if (count == 2 && args[0]->xltype == xltypeNum) {
+                pRes->xltype = xltypeInt;
+                pRes->val.w = (short) args[0]->val.num;
+                return xlretSuccess;
+            }
+            break;
+    }
+    return xlretFailed;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+    long n = 1000, m = 10;
+    double threshold = 1.10;
+    const char* pFilter = NULL;
+    const char* pOutput = NULL;
+    const char* pBaseline = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string flag(argv[i]);
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Usage: ConverterBench [-n rows] [-m cols] [-f filter] [-o results.csv] [-b baseline.csv] [-t threshold]\n");
+            return 2;
+        }
+        const char* pValue = argv[++i];
+        if (flag == "-n") {
+            n = atol(pValue);
+        } else if (flag == "-m") {
+            m = atol(pValue);
+        } else if (flag == "-f") {
+            pFilter = pValue;
+        } else if (flag == "-o") {
+            pOutput = pValue;
+        } else if (flag == "-b") {
+            pBaseline = pValue;
+        } else if (flag == "-t") {
+            threshold = atof(pValue);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", flag.c_str());
+            return 2;
+        }
+    }
+    if (n < 1 || m < 1) {
+        fprintf(stderr, "Rows and cols must be at least 1\n");
+        return 2;
+    }
+
+    std::map<std::string, double> baseline;
+    if (pBaseline && !ReadBaseline(pBaseline, baseline)) {
+        return 2;
+    }
+
+    FILE* pOut = pOutput ? fopen(pOutput, "w") : stdout;
+    if (!pOut) {
+        fprintf(stderr, "Couldn't open %s\n", pOutput);
+        return 2;
+    }
+
+    QueryPerformanceFrequency(&g_freq);
+    try {
+        if (!XlfExcel::Instance().excel12()) {
+            fprintf(stderr, "xlw didn't find Excel 2007 callbacks; is MockExcel's XLCALL32.DLL beside ConverterBench.exe?\n");
+            return 2;
+        }
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+#if PY_MAJOR_VERSION < 3    
+    Py_SetProgramName("Excel");
+#else
+    Py_SetProgramName(L"Excel");
+#endif
+    Py_Initialize();
+
+#ifdef _DEBUG
+    const char* pBuild = "Debug";
+#else
+    const char* pBuild = "Release";
+#endif
+    std::string python = PythonVersion();
+
+    fprintf(pOut, "benchmark,shape,content,python,build,rows,cols,cells,iterations,best_us,median_us,best_ns_per_cell%s\n",
+            pBaseline ? ",baseline_ns_per_cell,ratio" : "");
+
+    int regressions = 0;
+    for (size_t s = 0; s < NELEMS(g_shapes); ++s) {
+        for (size_t c = 0; c < NELEMS(g_contents); ++c) {
+            Fixture f;
+            if (!MakeFixture(f, g_shapes[s], g_contents[c], n, m)) {
+                fprintf(stderr, "Couldn't build the %s %s data\n", g_shapes[s], g_contents[c]);
+                PyErr_Clear();
+                continue;
+            }
+
+            for (size_t b = 0; b < NELEMS(g_benchmarks); ++b) {
+                const Benchmark& bench = g_benchmarks[b];
+                if (pFilter && !strstr(bench.pName, pFilter)) {
+                    continue;
+                }
+
+                Timing t = TimeBenchmark(bench.fn, f);
+                double nsPerCell = 1.0e6 * t.bestMs / f.cells;
+                fprintf(pOut, "%s,%s,%s,%s,%s,%ld,%ld,%ld,%ld,%.3f,%.3f,%.2f", 
+                        bench.pName, g_shapes[s], g_contents[c], python.c_str(), pBuild,
+                        f.rows, f.cols, f.cells, t.iterations, 1000.0 * t.bestMs, 1000.0 * t.medianMs, nsPerCell);
+
+                if (pBaseline) {
+                    std::map<std::string, double>::const_iterator it = 
+                        baseline.find(ResultKey(bench.pName, g_shapes[s], g_contents[c], python));
+                    if (it != baseline.end() && it->second > 0) {
+                        double ratio = nsPerCell / it->second;
+                        fprintf(pOut, ",%.2f,%.3f", it->second, ratio);
+                        if (ratio > threshold) {
+                            fprintf(stderr, "Slower: %s %s %s, %.2f ns/cell against %.2f\n",
+                                    bench.pName, g_shapes[s], g_contents[c], nsPerCell, it->second);
+                            ++regressions;
+                        }
+                    } else {
+                        fprintf(pOut, ",,");
+                    }
+                }
+                fprintf(pOut, "\n");
+                fflush(pOut);
+            }
+        }
+    }
+
+    if (pOut != stdout) {
+        fclose(pOut);
+    }
+    Py_Finalize();
+    return regressions ? 1 : 0;
+}
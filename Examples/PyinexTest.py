@@ -179,12 +179,22 @@ def HasVarargs( firstParam, *allTheRest ):
 
 ###############################################################################
 #
-# Trivial function exercised by TestHarness code
+# Trivial functions exercised by TestHarness code
 #
 
 def TestHarnessFunc( i ):
     return (i, 2*i)   
 
+def TestHarnessScalar( x ):
+    return x
+
+def TestHarnessSpin( seconds ):
+    import time
+    end = time.time() + seconds
+    while time.time() < end:
+        pass
+    return seconds
+
 ###############################################################################  
            
  
@@ -0,0 +1,1405 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+
+// Export the callback entry points under the names Excel uses. xlcall.cpp looks up
+// MdCallBack12 in the host executable; our XLCALL32.DLL looks up MdCallBack.
+#pragma comment (linker, "/export:MdCallBack=_MdCallBack@16")
+#pragma comment (linker, "/export:MdCallBack12=_MdCallBack12@16")
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// MockExcel is a stand-in for Excel 2007: a console program that loads an XLL,
+// answers its callbacks, and calls its worksheet functions from a script, so that
+// Pyinex (and anything else built on xlw) can be run and timed without Excel -
+// on a build machine, or on Linux under Wine.
+//
+// An XLL reaches Excel two ways. Excel12/Excel12v (xlw's xlcall.cpp) look up
+// MdCallBack12 in the executable that loaded them, which is us. Excel4/Excel4v
+// come from XLCALL32.DLL, which xlw loads by name; the XLCALL32.DLL built next
+// to MockExcel.exe (XlCall32/) forwards them to our MdCallBack. Both arrive at
+// the same handlers; XLOPERs are converted to XLOPER12s on the way in and back on
+// the way out.
+//
+// Emulated callbacks: xlCoerce, xlFree, xlfCaller, xlSheetNm, xlSheetId, xlAbort,
+// xlGetName, xlfRegister, xlfUnregister, xlfGetWorkspace, xlcMessage and xlcAlert.
+// Anything else fails with xlretFailed and is reported once. Values the XLL
+// returns with xlbitDLLFree set are handed back to its xlAutoFree12.
+//
+// The workbook is a set of sheets of cells, built up by the script. A script is a
+// text file of commands, one per line; # starts a comment:
+//
+//     xll ..\Bin\Pyinex.xll          load an XLL and call its xlAutoOpen
+//     sheet Data                      select a sheet, adding it if it's new
+//     set A1 1.5                      put a value in a cell: a number, "text",
+//                                     TRUE/FALSE, #N/A (or another error), or
+//                                     nothing for an empty cell
+//     fill A2:C1000 seq               fill a range with a value, with 1, 2, 3...
+//                                     (seq), or with numbers in [0, 1) (rand)
+//     uncalc A1:A10, calc A1:A10      mark cells uncalculated, as they are while
+//                                     Excel works through a recalc, and back
+//     call B1 PyCall("f.py", "g", A1, Data!A2:C1000)
+//     call x1000 B1 PyCall(...)       call a function from cell B1, 1000 times
+//     escape                          the next xlAbort reports ESC pressed
+//     idle 500                        sit idle for 500 ms, running the XLL's
+//                                     timers, as Excel does between recalcs
+//     show B1:D3                      print cells
+//     expect B1 42                    check a cell's value
+//     echo text                       print text
+//     close                           call xlAutoClose
+//
+// Calls print their time. Arguments are literals (as for set), references, or
+// omitted. References are passed as values to "Q" arguments and as xltypeRef to
+// "U" arguments, as Excel does. An array result fills cells from the calling one.
+// The XLL's thread timers (SetTimer) that are due also run between commands.
+// Paths are relative to the current directory.
+//
+// MockExcel exits with 1 if any command or expect failed. It only emulates the
+// Excel 2007 API (XLL functions with Q and U arguments), and only in a 32-bit
+// build, which is what Pyinex is.
+
+namespace {
+
+    typedef std::pair<int, int> CellPos;    // row, col; zero-based
+
+    struct Sheet
+    {
+        std::wstring                    name;
+        std::map<CellPos, XLOPER12>     cells;
+        std::set<CellPos>               uncalced;
+    };
+
+    struct Function
+    {
+        std::string     proc;
+        std::string     types;      // return type, then one per argument
+        FARPROC         pfn;
+    };
+
+    struct Reference
+    {
+        int             sheet;      // index in g_sheets
+        XLREF12         ref;
+    };
+
+    std::vector<Sheet*>                 g_sheets;
+    int                                 g_current = 0;      // selected sheet
+    std::map<std::wstring, Function>    g_functions;        // by upper-case name
+    std::set<int>                       g_reported;         // unemulated callbacks
+
+    HMODULE         g_hXll = NULL;
+    std::wstring    g_xllPath;
+    bool            g_bVerbose = false;
+    bool            g_bAbortPending = false;
+    int             g_failures = 0;
+
+    // The cell whose function is being called; xlfCaller fails outside a call
+    bool            g_bInCall = false;
+    int             g_callerSheet = 0;
+    CellPos         g_callerPos;
+
+    const XCHAR     WORKBOOK_NAME[] = L"[Book1]";
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Values owned by MockExcel - cells, and results handed to the XLL - hold
+    // strings, arrays and references from new[], released by FreeValue().
+
+    void
+    FreeValue( XLOPER12& x )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeStr:
+                delete[] x.val.str;
+                break;
+            case xltypeMulti: {
+                int n = x.val.array.rows * x.val.array.columns;
+                for (int i = 0; i < n; ++i) {
+                    FreeValue(x.val.array.lparray[i]);
+                }
+                delete[] x.val.array.lparray;
+                break;
+            }
+            case xltypeRef:
+                delete x.val.mref.lpmref;
+                break;
+        }
+        x.xltype = xltypeNil;
+    }
+
+    void
+    SetText( XLOPER12& x, const XCHAR* pText, size_t len )
+    {
+        if (len > 32767) {
+            len = 32767;
+        }
+        x.xltype = xltypeStr;
+        x.val.str = new XCHAR[len + 2];
+        x.val.str[0] = (XCHAR)len;
+        wmemcpy(x.val.str + 1, pText, len);
+        x.val.str[len + 1] = 0;
+    }
+
+    void
+    SetText( XLOPER12& x, const std::wstring& text )
+    {
+        SetText(x, text.c_str(), text.size());
+    }
+
+    void
+    SetError( XLOPER12& x, int err )
+    {
+        x.xltype = xltypeErr;
+        x.val.err = err;
+    }
+
+    void
+    CopyValue( const XLOPER12& src, XLOPER12& rDst )
+    {
+        int type = src.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        switch (type) {
+            case xltypeStr:
+                SetText(rDst, src.val.str + 1, (size_t)src.val.str[0]);
+                break;
+            case xltypeMulti: {
+                int n = src.val.array.rows * src.val.array.columns;
+                rDst.xltype = xltypeMulti;
+                rDst.val.array.rows = src.val.array.rows;
+                rDst.val.array.columns = src.val.array.columns;
+                rDst.val.array.lparray = new XLOPER12[n > 0 ? n : 1];
+                for (int i = 0; i < n; ++i) {
+                    CopyValue(src.val.array.lparray[i], rDst.val.array.lparray[i]);
+                }
+                break;
+            }
+            case xltypeRef:
+                rDst = src;
+                rDst.xltype = xltypeRef;
+                rDst.val.mref.lpmref = new XLMREF12(*src.val.mref.lpmref);
+                break;
+            default:
+                rDst = src;
+                rDst.xltype = type;
+                break;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    const struct { int err; const wchar_t* pText; } g_errors[] = {
+        { xlerrNull,  L"#NULL!" },
+        { xlerrDiv0,  L"#DIV/0!" },
+        { xlerrValue, L"#VALUE!" },
+        { xlerrRef,   L"#REF!" },
+        { xlerrName,  L"#NAME?" },
+        { xlerrNum,   L"#NUM!" },
+        { xlerrNA,    L"#N/A" }
+    };
+
+    std::wstring
+    NumberText( double d )
+    {
+        wchar_t buf[32];
+        swprintf(buf, NELEMS(buf), L"%.15g", d);
+        return buf;
+    }
+
+    std::wstring
+    ValueText( const XLOPER12& x )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:     return NumberText(x.val.num);
+            case xltypeInt:     return NumberText(x.val.w);
+            case xltypeStr:     return std::wstring(x.val.str + 1, x.val.str[0]);
+            case xltypeBool:    return x.val.xbool ? L"TRUE" : L"FALSE";
+            case xltypeErr:
+                for (size_t i = 0; i < NELEMS(g_errors); ++i) {
+                    if (g_errors[i].err == x.val.err) {
+                        return g_errors[i].pText;
+                    }
+                }
+                return L"#ERR";
+            case xltypeMulti: {
+                wchar_t buf[64];
+                swprintf(buf, NELEMS(buf), L"{%d x %d}", x.val.array.rows, x.val.array.columns);
+                return buf;
+            }
+            case xltypeRef:
+            case xltypeSRef:    return L"<reference>";
+            case xltypeMissing: return L"<missing>";
+            default:            return L"";
+        }
+    }
+
+    bool
+    SameValue( const XLOPER12& a, const XLOPER12& b )
+    {
+        int type = a.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        if (type != (int)(b.xltype & ~(xlbitXLFree | xlbitDLLFree))) {
+            return false;
+        }
+        switch (type) {
+            case xltypeNum:
+                return fabs(a.val.num - b.val.num) <= 1e-9 * (fabs(a.val.num) + fabs(b.val.num) + 1e-300);
+            case xltypeBool:
+                return !a.val.xbool == !b.val.xbool;
+            default:
+                return ValueText(a) == ValueText(b);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The workbook
+
+    int
+    SelectSheet( const std::wstring& name )
+    {
+        for (size_t i = 0; i < g_sheets.size(); ++i) {
+            if (_wcsicmp(g_sheets[i]->name.c_str(), name.c_str()) == 0) {
+                return (int)i;
+            }
+        }
+        Sheet* pSheet = new Sheet;
+        pSheet->name = name;
+        g_sheets.push_back(pSheet);
+        return (int)g_sheets.size() - 1;
+    }
+
+    // Sheet IDs are never zero, since Excel treats zero as "the current sheet"
+    inline DWORD SheetId( int sheet )           { return (DWORD)sheet + 1; }
+
+    int
+    SheetFromId( DWORD idSheet )
+    {
+        return (idSheet >= 1 && idSheet <= g_sheets.size()) ? (int)idSheet - 1 : -1;
+    }
+
+    // Empty cells are null
+    const XLOPER12*
+    GetCell( int sheet, int row, int col )
+    {
+        std::map<CellPos, XLOPER12>& cells = g_sheets[sheet]->cells;
+        std::map<CellPos, XLOPER12>::const_iterator it = cells.find(CellPos(row, col));
+        return it == cells.end() ? NULL : &it->second;
+    }
+
+    void
+    SetCell( int sheet, int row, int col, const XLOPER12& value )
+    {
+        std::map<CellPos, XLOPER12>& cells = g_sheets[sheet]->cells;
+        std::map<CellPos, XLOPER12>::iterator it = cells.find(CellPos(row, col));
+        if (it != cells.end()) {
+            FreeValue(it->second);
+            cells.erase(it);
+        }
+        int type = value.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        if (type != xltypeNil && type != xltypeMissing) {
+            CopyValue(value, cells[CellPos(row, col)]);
+        }
+    }
+
+    bool
+    AnyUncalced( const Reference& r )
+    {
+        const std::set<CellPos>& uncalced = g_sheets[r.sheet]->uncalced;
+        for (std::set<CellPos>::const_iterator it = uncalced.begin(); it != uncalced.end(); ++it) {
+            if (it->first >= r.ref.rwFirst && it->first <= r.ref.rwLast &&
+                it->second >= r.ref.colFirst && it->second <= r.ref.colLast) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A single cell as itself, anything bigger as an array, empty cells as xltypeNil
+    void
+    ReadReference( const Reference& r, XLOPER12& rResult )
+    {
+        int rows = r.ref.rwLast - r.ref.rwFirst + 1;
+        int cols = r.ref.colLast - r.ref.colFirst + 1;
+        if (rows == 1 && cols == 1) {
+            const XLOPER12* pCell = GetCell(r.sheet, r.ref.rwFirst, r.ref.colFirst);
+            if (pCell) {
+                CopyValue(*pCell, rResult);
+            } else {
+                rResult.xltype = xltypeNil;
+            }
+            return;
+        }
+
+        rResult.xltype = xltypeMulti;
+        rResult.val.array.rows = rows;
+        rResult.val.array.columns = cols;
+        rResult.val.array.lparray = new XLOPER12[rows * cols];
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < cols; ++j) {
+                XLOPER12& x = rResult.val.array.lparray[i * cols + j];
+                const XLOPER12* pCell = GetCell(r.sheet, r.ref.rwFirst + i, r.ref.colFirst + j);
+                if (pCell) {
+                    CopyValue(*pCell, x);
+                } else {
+                    x.xltype = xltypeNil;
+                }
+            }
+        }
+    }
+
+    void
+    MakeRefOper( const Reference& r, XLOPER12& rResult )
+    {
+        rResult.xltype = xltypeRef;
+        rResult.val.mref.idSheet = SheetId(r.sheet);
+        rResult.val.mref.lpmref = new XLMREF12;
+        rResult.val.mref.lpmref->count = 1;
+        rResult.val.mref.lpmref->reftbl[0] = r.ref;
+    }
+
+    // SRefs are on the calling sheet; multi-area references aren't supported
+    bool
+    ReferenceFromOper( const XLOPER12& x, Reference& rRef )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeSRef:
+                rRef.sheet = g_bInCall ? g_callerSheet : g_current;
+                rRef.ref = x.val.sref.ref;
+                return true;
+            case xltypeRef:
+                rRef.sheet = SheetFromId(x.val.mref.idSheet);
+                if (x.val.mref.idSheet == 0) {
+                    rRef.sheet = g_bInCall ? g_callerSheet : g_current;
+                }
+                if (rRef.sheet < 0 || !x.val.mref.lpmref || x.val.mref.lpmref->count != 1) {
+                    return false;
+                }
+                rRef.ref = x.val.mref.lpmref->reftbl[0];
+                return true;
+        }
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // xlCoerce of a value to one of the types in mask
+
+    void
+    CoerceValue( const XLOPER12& src, int mask, XLOPER12& rResult )
+    {
+        int type = src.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        if (type & mask) {
+            CopyValue(src, rResult);
+            return;
+        }
+        if (type == xltypeMulti) {
+            // Excel takes the top-left value
+            if (src.val.array.rows * src.val.array.columns > 0) {
+                CoerceValue(src.val.array.lparray[0], mask, rResult);
+            } else {
+                SetError(rResult, xlerrValue);
+            }
+            return;
+        }
+        if (mask & xltypeMulti) {
+            rResult.xltype = xltypeMulti;
+            rResult.val.array.rows = 1;
+            rResult.val.array.columns = 1;
+            rResult.val.array.lparray = new XLOPER12[1];
+            CopyValue(src, rResult.val.array.lparray[0]);
+            return;
+        }
+
+        if (type == xltypeErr) {
+            rResult = src;
+            return;
+        }
+
+        double d = 0.0;
+        bool bNumber = true;
+        switch (type) {
+            case xltypeNum:     d = src.val.num;                break;
+            case xltypeInt:     d = src.val.w;                  break;
+            case xltypeBool:    d = src.val.xbool ? 1.0 : 0.0;  break;
+            case xltypeStr: {
+                std::wstring text(src.val.str + 1, src.val.str[0]);
+                wchar_t* pEnd = NULL;
+                d = wcstod(text.c_str(), &pEnd);
+                bNumber = !text.empty() && pEnd && *pEnd == 0;
+                if (_wcsicmp(text.c_str(), L"TRUE") == 0 && (mask & xltypeBool)) {
+                    rResult.xltype = xltypeBool;
+                    rResult.val.xbool = TRUE;
+                    return;
+                }
+                if (_wcsicmp(text.c_str(), L"FALSE") == 0 && (mask & xltypeBool)) {
+                    rResult.xltype = xltypeBool;
+                    rResult.val.xbool = FALSE;
+                    return;
+                }
+                break;
+            }
+        }
+
+        if (mask & xltypeStr) {
+            SetText(rResult, type == xltypeNil ? std::wstring() : ValueText(src));
+        } else if (!bNumber) {
+            SetError(rResult, xlerrValue);
+        } else if (mask & xltypeNum) {
+            rResult.xltype = xltypeNum;
+            rResult.val.num = d;
+        } else if (mask & xltypeInt) {
+            rResult.xltype = xltypeInt;
+            rResult.val.w = (int)d;
+        } else if (mask & xltypeBool) {
+            rResult.xltype = xltypeBool;
+            rResult.val.xbool = d != 0.0;
+        } else {
+            SetError(rResult, xlerrValue);
+        }
+    }
+
+    int
+    Coerce( int count, LPXLOPER12* args, LPXLOPER12 pRes )
+    {
+        const int VALUE_TYPES = xltypeNum | xltypeStr | xltypeBool | xltypeErr | xltypeMulti | xltypeNil | xltypeInt;
+        int mask = VALUE_TYPES;
+        if (count >= 2) {
+            XLOPER12 xMask;
+            CoerceValue(*args[1], xltypeInt, xMask);
+            mask = (xMask.xltype == xltypeInt) ? xMask.val.w : VALUE_TYPES;
+        }
+
+        Reference r;
+        if (!ReferenceFromOper(*args[0], r)) {
+            CoerceValue(*args[0], mask, *pRes);
+            return xlretSuccess;
+        }
+
+        if (mask & xltypeRef) {
+            MakeRefOper(r, *pRes);
+            return xlretSuccess;
+        }
+        if (AnyUncalced(r)) {
+            return xlretUncalced;
+        }
+
+        XLOPER12 xValue;
+        ReadReference(r, xValue);
+        CoerceValue(xValue, mask, *pRes);
+        FreeValue(xValue);
+        return xlretSuccess;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // xlfRegister's arguments: module, procedure, type text, function name, ...
+
+    int
+    Register( int count, LPXLOPER12* args, LPXLOPER12 pRes )
+    {
+        if (count < 4) {
+            return xlretInvCount;
+        }
+        XLOPER12 xProc, xTypes, xName;
+        CoerceValue(*args[1], xltypeStr, xProc);
+        CoerceValue(*args[2], xltypeStr, xTypes);
+        CoerceValue(*args[3], xltypeStr, xName);
+
+        int rc = xlretFailed;
+        if (xProc.xltype == xltypeStr && xTypes.xltype == xltypeStr && xName.xltype == xltypeStr) {
+            std::wstring proc = ValueText(xProc), types = ValueText(xTypes), name = ValueText(xName);
+            Function fn;
+            fn.proc.assign(proc.begin(), proc.end());
+            fn.types.assign(types.begin(), types.end());
+            fn.pfn = GetProcAddress(g_hXll, fn.proc.c_str());
+            if (fn.pfn) {
+                std::transform(name.begin(), name.end(), name.begin(), towupper);
+                g_functions[name] = fn;
+                pRes->xltype = xltypeNum;
+                pRes->val.num = (double)g_functions.size();
+                rc = xlretSuccess;
+                if (g_bVerbose) {
+                    wprintf(L"registered %s as %S(%S)\n", name.c_str(), fn.proc.c_str(), fn.types.c_str());
+                }
+            } else {
+                wprintf(L"xlfRegister: %S isn't exported by the XLL\n", fn.proc.c_str());
+            }
+        }
+        FreeValue(xProc);
+        FreeValue(xTypes);
+        FreeValue(xName);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // All callbacks come here, whichever API they were made through
+
+    int
+    Dispatch( int xlfn, int count, LPXLOPER12* args, LPXLOPER12 pRes )
+    {
+        XLOPER12 xDummy;
+        if (!pRes) {
+            pRes = &xDummy;
+        }
+        pRes->xltype = xltypeNil;
+
+        switch (xlfn) {
+            case xlFree:
+                for (int i = 0; i < count; ++i) {
+                    FreeValue(*args[i]);
+                }
+                return xlretSuccess;
+
+            case xlCoerce:
+                return count < 1 ? xlretInvCount : Coerce(count, args, pRes);
+
+            case xlfCaller:
+                if (!g_bInCall) {
+                    SetError(*pRes, xlerrRef);
+                    return xlretSuccess;
+                }
+                pRes->xltype = xltypeSRef;
+                pRes->val.sref.count = 1;
+                pRes->val.sref.ref.rwFirst = pRes->val.sref.ref.rwLast = g_callerPos.first;
+                pRes->val.sref.ref.colFirst = pRes->val.sref.ref.colLast = g_callerPos.second;
+                return xlretSuccess;
+
+            case xlSheetNm: {
+                Reference r;
+                if (count < 1 || !ReferenceFromOper(*args[0], r)) {
+                    return xlretFailed;
+                }
+                SetText(*pRes, WORKBOOK_NAME + g_sheets[r.sheet]->name);
+                return xlretSuccess;
+            }
+
+            case xlSheetId: {
+                int sheet = g_bInCall ? g_callerSheet : g_current;
+                if (count >= 1 && (args[0]->xltype & ~xlbitXLFree) == xltypeStr) {
+                    std::wstring name = ValueText(*args[0]);
+                    if (name.compare(0, NELEMS(WORKBOOK_NAME) - 1, WORKBOOK_NAME) == 0) {
+                        name.erase(0, NELEMS(WORKBOOK_NAME) - 1);
+                    }
+                    sheet = SelectSheet(name);
+                }
+                pRes->xltype = xltypeRef;
+                pRes->val.mref.idSheet = SheetId(sheet);
+                pRes->val.mref.lpmref = NULL;
+                return xlretSuccess;
+            }
+
+            case xlAbort:
+                pRes->xltype = xltypeBool;
+                pRes->val.xbool = g_bAbortPending;
+                if (count >= 1 && (args[0]->xltype & ~xlbitXLFree) == xltypeBool && !args[0]->val.xbool) {
+                    g_bAbortPending = false;
+                }
+                return xlretSuccess;
+
+            case xlGetName:
+                SetText(*pRes, g_xllPath);
+                return xlretSuccess;
+
+            case xlfRegister:
+                return Register(count, args, pRes);
+
+            case xlfUnregister:
+                pRes->xltype = xltypeBool;
+                pRes->val.xbool = TRUE;
+                return xlretSuccess;
+
+            case xlfGetWorkspace:
+                SetText(*pRes, std::wstring(L"12.0"));
+                return xlretSuccess;
+
+            case xlcMessage:
+            case xlcAlert:
+                if (g_bVerbose && count >= 1 && (args[0]->xltype & ~xlbitXLFree) == xltypeStr) {
+                    wprintf(L"%s: %s\n", xlfn == xlcAlert ? L"alert" : L"status", ValueText(*args[0]).c_str());
+                }
+                pRes->xltype = xltypeBool;
+                pRes->val.xbool = TRUE;
+                return xlretSuccess;
+
+            case xlGetHwnd:
+                return xlretFailed; // no window, so never the function wizard
+
+            case xlEventRegister:
+                return xlretInvXlfn; // Excel 2010; Excel 2007 doesn't know it
+        }
+
+        if (g_reported.insert(xlfn).second) {
+            wprintf(L"MockExcel doesn't emulate callback %d (0x%x)\n", xlfn, xlfn);
+        }
+        return xlretFailed;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Excel4 values, converted to and from XLOPER12 at the boundary
+
+    void
+    To12( const XLOPER& x, XLOPER12& rX12 )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:     rX12.xltype = xltypeNum;    rX12.val.num = x.val.num;       break;
+            case xltypeBool:    rX12.xltype = xltypeBool;   rX12.val.xbool = x.val.xbool;   break;
+            case xltypeErr:     rX12.xltype = xltypeErr;    rX12.val.err = x.val.err;       break;
+            case xltypeInt:     rX12.xltype = xltypeInt;    rX12.val.w = x.val.w;           break;
+            case xltypeMissing: rX12.xltype = xltypeMissing;                                break;
+            case xltypeStr: {
+                int len = (unsigned char)x.val.str[0];
+                std::wstring text(len, 0);
+                if (len > 0) {
+                    len = MultiByteToWideChar(CP_ACP, 0, x.val.str + 1, len, &text[0], len);
+                    text.resize(len > 0 ? len : 0);
+                }
+                SetText(rX12, text);
+                break;
+            }
+            case xltypeSRef:
+                rX12.xltype = xltypeSRef;
+                rX12.val.sref.count = 1;
+                rX12.val.sref.ref.rwFirst = x.val.sref.ref.rwFirst;
+                rX12.val.sref.ref.rwLast = x.val.sref.ref.rwLast;
+                rX12.val.sref.ref.colFirst = x.val.sref.ref.colFirst;
+                rX12.val.sref.ref.colLast = x.val.sref.ref.colLast;
+                break;
+            default:            rX12.xltype = xltypeNil;                                    break;
+        }
+    }
+
+    void
+    To4( const XLOPER12& x12, XLOPER& rX )
+    {
+        switch (x12.xltype) {
+            case xltypeNum:     rX.xltype = xltypeNum;      rX.val.num = x12.val.num;               break;
+            case xltypeBool:    rX.xltype = xltypeBool;     rX.val.xbool = (WORD)x12.val.xbool;     break;
+            case xltypeErr:     rX.xltype = xltypeErr;      rX.val.err = (WORD)x12.val.err;         break;
+            case xltypeInt:     rX.xltype = xltypeInt;      rX.val.w = (short)x12.val.w;            break;
+            case xltypeStr: {
+                int len = x12.val.str[0];
+                int n = WideCharToMultiByte(CP_ACP, 0, x12.val.str + 1, len, NULL, 0, NULL, NULL);
+                n = n > 255 ? 255 : (n < 0 ? 0 : n);
+                rX.xltype = xltypeStr;
+                rX.val.str = new char[n + 2];
+                WideCharToMultiByte(CP_ACP, 0, x12.val.str + 1, len, rX.val.str + 1, n, NULL, NULL);
+                rX.val.str[0] = (char)n;
+                rX.val.str[n + 1] = 0;
+                break;
+            }
+            default:
+                rX.xltype = (x12.xltype == xltypeNil) ? xltypeNil : xltypeErr;
+                rX.val.err = xlerrValue;
+                break;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Worksheet function calls. Excel calls XLL functions with the __stdcall
+    // convention and one pointer per argument, however many there are; with no
+    // fixed signature to cast to, the arguments are pushed by hand.
+
+    LPXLOPER12
+    CallStdcall( FARPROC pfn, LPXLOPER12* args, int count )
+    {
+#if defined(_M_IX86)
+        LPXLOPER12 pResult = NULL;
+        __asm {
+            mov     ecx, count
+            mov     edx, args
+        push_next:
+            test    ecx, ecx
+            jz      do_call
+            dec     ecx
+            push    dword ptr [edx + ecx * 4]
+            jmp     push_next
+        do_call:
+            call    pfn
+            mov     pResult, eax
+        }
+        return pResult;
+#else
+        wprintf(L"MockExcel can only call XLL functions in a 32-bit build\n");
+        return NULL;
+#endif
+    }
+
+    struct Argument
+    {
+        bool            bRef;
+        Reference       ref;
+        XLOPER12        value;      // if !bRef
+    };
+
+    // Puts the result in the calling cell, and arrays in the cells from there
+    void
+    StoreResult( const XLOPER12& x )
+    {
+        int type = x.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        if (type != xltypeMulti) {
+            SetCell(g_callerSheet, g_callerPos.first, g_callerPos.second, x);
+            return;
+        }
+        for (int i = 0; i < x.val.array.rows; ++i) {
+            for (int j = 0; j < x.val.array.columns; ++j) {
+                SetCell(g_callerSheet, g_callerPos.first + i, g_callerPos.second + j,
+                    x.val.array.lparray[i * x.val.array.columns + j]);
+            }
+        }
+    }
+
+    bool
+    CallFunction( const std::wstring& name, std::vector<Argument>& args, long repeat, double& rMs )
+    {
+        std::wstring upper(name);
+        std::transform(upper.begin(), upper.end(), upper.begin(), towupper);
+        std::map<std::wstring, Function>::const_iterator it = g_functions.find(upper);
+        if (it == g_functions.end()) {
+            wprintf(L"%s isn't registered\n", name.c_str());
+            return false;
+        }
+        const Function& fn = it->second;
+
+        // Declared arguments; '!' (volatile), '$' (thread-safe) and '#' are flags
+        std::string types;
+        for (size_t i = 1; i < fn.types.size(); ++i) {
+            if (strchr("!$#", fn.types[i]) == NULL) {
+                types += fn.types[i];
+            }
+        }
+        if (fn.types.empty() || (fn.types[0] != 'Q' && fn.types[0] != 'U') || types.find_first_not_of("QU") != std::string::npos) {
+            wprintf(L"%s has type text %S; MockExcel only calls functions of XLOPER12s (Q and U)\n",
+                name.c_str(), fn.types.c_str());
+            return false;
+        }
+        if (args.size() > types.size()) {
+            wprintf(L"%s takes at most %d arguments\n", name.c_str(), (int)types.size());
+            return false;
+        }
+
+        // Q arguments get the referenced values, U arguments the references
+        std::vector<XLOPER12> opers(types.size());
+        std::vector<LPXLOPER12> pOpers(types.size());
+        for (size_t i = 0; i < types.size(); ++i) {
+            if (i >= args.size()) {
+                opers[i].xltype = xltypeMissing;
+            } else if (!args[i].bRef) {
+                CopyValue(args[i].value, opers[i]);
+            } else if (types[i] == 'U') {
+                MakeRefOper(args[i].ref, opers[i]);
+            } else {
+                ReadReference(args[i].ref, opers[i]);
+            }
+            pOpers[i] = &opers[i];
+        }
+
+        typedef void (__stdcall *AUTOFREE12)(LPXLOPER12);
+        AUTOFREE12 pAutoFree = (AUTOFREE12)GetProcAddress(g_hXll, "xlAutoFree12");
+
+        LARGE_INTEGER freq, start, end;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&start);
+
+        bool rc = true;
+        g_bInCall = true;
+        for (long k = 0; k < repeat && rc; ++k) {
+            LPXLOPER12 pResult = CallStdcall(fn.pfn, pOpers.empty() ? NULL : &pOpers[0], (int)pOpers.size());
+            if (!pResult) {
+                wprintf(L"%s returned NULL\n", name.c_str());
+                rc = false;
+                break;
+            }
+            if (k == repeat - 1) {
+                StoreResult(*pResult);
+            }
+            if ((pResult->xltype & xlbitDLLFree) && pAutoFree) {
+                pAutoFree(pResult);
+            }
+        }
+        g_bInCall = false;
+
+        QueryPerformanceCounter(&end);
+        rMs = 1000.0 * (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+
+        for (size_t i = 0; i < opers.size(); ++i) {
+            FreeValue(opers[i]);
+        }
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Script parsing
+
+    std::wstring
+    Trim( const std::wstring& s )
+    {
+        size_t first = s.find_first_not_of(L" \t\r\n");
+        if (first == std::wstring::npos) {
+            return std::wstring();
+        }
+        size_t last = s.find_last_not_of(L" \t\r\n");
+        return s.substr(first, last - first + 1);
+    }
+
+    // Splits off the first word
+    std::wstring
+    NextWord( std::wstring& rLine )
+    {
+        rLine = Trim(rLine);
+        size_t end = rLine.find_first_of(L" \t");
+        std::wstring word = rLine.substr(0, end);
+        rLine = (end == std::wstring::npos) ? std::wstring() : Trim(rLine.substr(end));
+        return word;
+    }
+
+    // A1 -> row 0, col 0
+    bool
+    ParseCell( const std::wstring& text, size_t& rPos, int& rRow, int& rCol )
+    {
+        int col = 0, row = 0;
+        size_t pos = rPos;
+        while (pos < text.size() && iswalpha(text[pos])) {
+            col = col * 26 + (towupper(text[pos]) - L'A' + 1);
+            ++pos;
+        }
+        size_t digits = pos;
+        while (pos < text.size() && iswdigit(text[pos])) {
+            row = row * 10 + (text[pos] - L'0');
+            ++pos;
+        }
+        if (col < 1 || col > 16384 || pos == digits || row < 1 || row > 1048576) {
+            return false;
+        }
+        rRow = row - 1;
+        rCol = col - 1;
+        rPos = pos;
+        return true;
+    }
+
+    // [Sheet!]A1[:B2]; a sheet named here is added if it's new
+    bool
+    ParseReference( const std::wstring& text, Reference& rRef )
+    {
+        std::wstring cells = text;
+        rRef.sheet = g_current;
+        size_t bang = text.find(L'!');
+        if (bang != std::wstring::npos) {
+            rRef.sheet = SelectSheet(text.substr(0, bang));
+            cells = text.substr(bang + 1);
+        }
+
+        size_t pos = 0;
+        int row, col;
+        if (!ParseCell(cells, pos, row, col)) {
+            return false;
+        }
+        rRef.ref.rwFirst = rRef.ref.rwLast = row;
+        rRef.ref.colFirst = rRef.ref.colLast = col;
+        if (pos < cells.size() && cells[pos] == L':') {
+            ++pos;
+            if (!ParseCell(cells, pos, row, col)) {
+                return false;
+            }
+            // B2:A1 is A1:B2
+            if (row < rRef.ref.rwFirst) {
+                rRef.ref.rwFirst = row;
+            } else {
+                rRef.ref.rwLast = row;
+            }
+            if (col < rRef.ref.colFirst) {
+                rRef.ref.colFirst = col;
+            } else {
+                rRef.ref.colLast = col;
+            }
+        }
+        return pos == cells.size();
+    }
+
+    // A number, "text", TRUE/FALSE, an error, or nothing
+    bool
+    ParseValue( const std::wstring& rawText, XLOPER12& rValue )
+    {
+        std::wstring text = Trim(rawText);
+        if (text.empty()) {
+            rValue.xltype = xltypeNil;
+            return true;
+        }
+        if (text[0] == L'"') {
+            std::wstring value;
+            size_t i = 1;
+            for (; i < text.size(); ++i) {
+                if (text[i] == L'"') {
+                    if (i + 1 < text.size() && text[i + 1] == L'"') {
+                        value += L'"';  // "" is a quote
+                        ++i;
+                    } else {
+                        break;
+                    }
+                } else {
+                    value += text[i];
+                }
+            }
+            if (i != text.size() - 1) {
+                return false;
+            }
+            SetText(rValue, value);
+            return true;
+        }
+        if (_wcsicmp(text.c_str(), L"TRUE") == 0 || _wcsicmp(text.c_str(), L"FALSE") == 0) {
+            rValue.xltype = xltypeBool;
+            rValue.val.xbool = (towupper(text[0]) == L'T');
+            return true;
+        }
+        for (size_t i = 0; i < NELEMS(g_errors); ++i) {
+            if (_wcsicmp(text.c_str(), g_errors[i].pText) == 0) {
+                SetError(rValue, g_errors[i].err);
+                return true;
+            }
+        }
+        wchar_t* pEnd = NULL;
+        double d = wcstod(text.c_str(), &pEnd);
+        if (pEnd && *pEnd == 0) {
+            rValue.xltype = xltypeNum;
+            rValue.val.num = d;
+            return true;
+        }
+        return false;
+    }
+
+    // Name(arg, arg, ...): arguments are split at commas outside quotes
+    bool
+    ParseCall( const std::wstring& text, std::wstring& rName, std::vector<Argument>& rArgs )
+    {
+        size_t open = text.find(L'(');
+        if (open == std::wstring::npos || text[text.size() - 1] != L')') {
+            return false;
+        }
+        rName = Trim(text.substr(0, open));
+        std::wstring inner = text.substr(open + 1, text.size() - open - 2);
+
+        std::vector<std::wstring> pieces;
+        std::wstring piece;
+        bool bQuoted = false;
+        for (size_t i = 0; i < inner.size(); ++i) {
+            if (inner[i] == L'"') {
+                bQuoted = !bQuoted;
+            }
+            if (inner[i] == L',' && !bQuoted) {
+                pieces.push_back(piece);
+                piece.clear();
+            } else {
+                piece += inner[i];
+            }
+        }
+        if (!Trim(inner).empty()) {
+            pieces.push_back(piece);
+        }
+
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            Argument arg;
+            std::wstring p = Trim(pieces[i]);
+            arg.bRef = false;
+            if (p.empty()) {
+                arg.value.xltype = xltypeMissing;
+            } else if (!ParseValue(p, arg.value)) {
+                arg.bRef = ParseReference(p, arg.ref);
+                if (!arg.bRef) {
+                    wprintf(L"Can't read argument %d: %s\n", (int)i + 1, p.c_str());
+                    return false;
+                }
+            }
+            rArgs.push_back(arg);
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Script commands
+
+    bool
+    LoadXll( const std::wstring& path )
+    {
+        if (g_hXll) {
+            wprintf(L"An XLL is already loaded\n");
+            return false;
+        }
+        g_hXll = LoadLibraryW(path.c_str());
+        if (!g_hXll) {
+            wprintf(L"Can't load %s (error %lu)\n", path.c_str(), GetLastError());
+            return false;
+        }
+        wchar_t fullPath[MAX_PATH];
+        GetModuleFileNameW(g_hXll, fullPath, MAX_PATH);
+        g_xllPath = fullPath;
+
+        typedef long (__stdcall *AUTOOPEN)(void);
+        AUTOOPEN pAutoOpen = (AUTOOPEN)GetProcAddress(g_hXll, "xlAutoOpen");
+        if (!pAutoOpen) {
+            wprintf(L"%s doesn't export xlAutoOpen\n", path.c_str());
+            return false;
+        }
+        if (pAutoOpen() != 1) {
+            wprintf(L"xlAutoOpen failed\n");
+            return false;
+        }
+        wprintf(L"loaded %s: %d functions\n", g_xllPath.c_str(), (int)g_functions.size());
+        return true;
+    }
+
+    bool
+    CloseXll()
+    {
+        if (!g_hXll) {
+            return true;
+        }
+        typedef long (__stdcall *AUTOCLOSE)(void);
+        AUTOCLOSE pAutoClose = (AUTOCLOSE)GetProcAddress(g_hXll, "xlAutoClose");
+        if (pAutoClose) {
+            pAutoClose();
+        }
+        g_functions.clear();
+        FreeLibrary(g_hXll);
+        g_hXll = NULL;
+        return true;
+    }
+
+    // rand is a fixed sequence, so runs can be compared
+    bool
+    Fill( const Reference& r, const std::wstring& what )
+    {
+        XLOPER12 value;
+        value.xltype = xltypeNil;
+        bool bSeq = (what == L"seq"), bRand = (what == L"rand");
+        if (!bSeq && !bRand && !ParseValue(what, value)) {
+            return false;
+        }
+
+        unsigned long seed = 12345;
+        long n = 0;
+        for (int i = r.ref.rwFirst; i <= r.ref.rwLast; ++i) {
+            for (int j = r.ref.colFirst; j <= r.ref.colLast; ++j) {
+                if (bSeq || bRand) {
+                    value.xltype = xltypeNum;
+                    seed = seed * 1103515245 + 12345;
+                    value.val.num = bSeq ? (double)++n : (double)((seed >> 8) & 0xFFFFFF) / 16777216.0;
+                }
+                SetCell(r.sheet, i, j, value);
+            }
+        }
+        FreeValue(value);
+        return true;
+    }
+
+    void
+    MarkUncalced( const Reference& r, bool bUncalced )
+    {
+        std::set<CellPos>& uncalced = g_sheets[r.sheet]->uncalced;
+        for (int i = r.ref.rwFirst; i <= r.ref.rwLast; ++i) {
+            for (int j = r.ref.colFirst; j <= r.ref.colLast; ++j) {
+                if (bUncalced) {
+                    uncalced.insert(CellPos(i, j));
+                } else {
+                    uncalced.erase(CellPos(i, j));
+                }
+            }
+        }
+    }
+
+    void
+    Show( const Reference& r )
+    {
+        for (int i = r.ref.rwFirst; i <= r.ref.rwLast; ++i) {
+            for (int j = r.ref.colFirst; j <= r.ref.colLast; ++j) {
+                const XLOPER12* pCell = GetCell(r.sheet, i, j);
+                wprintf(L"%s%s", j > r.ref.colFirst ? L"\t" : L"", pCell ? ValueText(*pCell).c_str() : L"");
+            }
+            wprintf(L"\n");
+        }
+    }
+
+    bool
+    Expect( const Reference& r, const std::wstring& text )
+    {
+        XLOPER12 expected;
+        if (!ParseValue(text, expected)) {
+            return false;
+        }
+        XLOPER12 nil;
+        nil.xltype = xltypeNil;
+        const XLOPER12* pCell = GetCell(r.sheet, r.ref.rwFirst, r.ref.colFirst);
+        if (!pCell) {
+            pCell = &nil;
+        }
+        bool rc = SameValue(*pCell, expected);
+        if (!rc) {
+            wprintf(L"expected %s, found %s\n", ValueText(expected).c_str(), ValueText(*pCell).c_str());
+        }
+        FreeValue(expected);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Dispatches the calling thread's messages, as Excel's message loop would,
+    // for the given time; with zero, just the ones already queued
+
+    void
+    PumpMessages( DWORD ms )
+    {
+        DWORD start = GetTickCount();
+        for (;;) {
+            MSG msg;
+            while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
+            DWORD elapsed = GetTickCount() - start;
+            if (elapsed >= ms) {
+                break;
+            }
+            MsgWaitForMultipleObjects(0, NULL, FALSE, ms - elapsed, QS_ALLINPUT);
+        }
+    }
+
+    bool
+    RunCommand( const std::wstring& line )
+    {
+        std::wstring rest = line;
+        std::wstring command = NextWord(rest);
+        Reference r;
+
+        if (command == L"xll") {
+            return LoadXll(rest);
+        }
+        if (command == L"close") {
+            return CloseXll();
+        }
+        if (command == L"sheet") {
+            g_current = SelectSheet(rest);
+            return true;
+        }
+        if (command == L"echo") {
+            wprintf(L"%s\n", rest.c_str());
+            return true;
+        }
+        if (command == L"escape") {
+            g_bAbortPending = true;
+            return true;
+        }
+        if (command == L"idle") {
+            long ms = wcstol(rest.c_str(), NULL, 10);
+            if (ms < 0) {
+                wprintf(L"Bad idle time %s\n", rest.c_str());
+                return false;
+            }
+            PumpMessages((DWORD)ms);
+            return true;
+        }
+        if (command == L"set" || command == L"fill" || command == L"uncalc" || command == L"calc" ||
+            command == L"show" || command == L"expect") {
+            std::wstring where = NextWord(rest);
+            if (!ParseReference(where, r)) {
+                wprintf(L"Bad reference %s\n", where.c_str());
+                return false;
+            }
+            if (command == L"set") {
+                r.ref.rwLast = r.ref.rwFirst;
+                r.ref.colLast = r.ref.colFirst;
+                return Fill(r, rest);
+            }
+            if (command == L"fill")     return Fill(r, rest);
+            if (command == L"uncalc")   { MarkUncalced(r, true); return true; }
+            if (command == L"calc")     { MarkUncalced(r, false); return true; }
+            if (command == L"show")     { Show(r); return true; }
+            return Expect(r, rest);
+        }
+        if (command == L"call") {
+            long repeat = 1;
+            std::wstring where = NextWord(rest);
+            if (!where.empty() && where[0] == L'x' && iswdigit(where.c_str()[1])) {
+                repeat = wcstol(where.c_str() + 1, NULL, 10);
+                where = NextWord(rest);
+            }
+            std::wstring name;
+            std::vector<Argument> args;
+            if (repeat < 1 || !ParseReference(where, r) || !ParseCall(rest, name, args)) {
+                wprintf(L"Bad call\n");
+                return false;
+            }
+
+            g_callerSheet = r.sheet;
+            g_callerPos = CellPos(r.ref.rwFirst, r.ref.colFirst);
+            double ms = 0.0;
+            bool rc = CallFunction(name, args, repeat, ms);
+            if (rc) {
+                const XLOPER12* pCell = GetCell(r.sheet, r.ref.rwFirst, r.ref.colFirst);
+                wprintf(L"%s x %ld: %.3f ms, %.3f us/call -> %s\n", name.c_str(), repeat, ms,
+                    1000.0 * ms / repeat, pCell ? ValueText(*pCell).c_str() : L"");
+            }
+            for (size_t i = 0; i < args.size(); ++i) {
+                if (!args[i].bRef) {
+                    FreeValue(args[i].value);
+                }
+            }
+            return rc;
+        }
+
+        wprintf(L"Unknown command %s\n", command.c_str());
+        return false;
+    }
+
+    bool
+    RunScript( const char* pPath )
+    {
+        FILE* pFile = fopen(pPath, "r");
+        if (!pFile) {
+            printf("Can't open %s\n", pPath);
+            return false;
+        }
+
+        char buf[4096];
+        int lineNum = 0;
+        while (fgets(buf, sizeof(buf), pFile)) {
+            ++lineNum;
+            int len = (int)strlen(buf);
+            std::wstring line(len, 0);
+            if (len > 0) {
+                len = MultiByteToWideChar(CP_ACP, 0, buf, len, &line[0], len);
+                line.resize(len > 0 ? len : 0);
+            }
+            line = Trim(line);
+            if (line.empty() || line[0] == L'#') {
+                continue;
+            }
+            if (g_bVerbose) {
+                wprintf(L"> %s\n", line.c_str());
+            }
+            if (!RunCommand(line)) {
+                printf("%s(%d): failed\n", pPath, lineNum);
+                ++g_failures;
+            }
+            PumpMessages(0);
+        }
+        fclose(pFile);
+        return true;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// The callback entry points
+
+extern "C" int __stdcall
+MdCallBack12( int xlfn, int count, LPXLOPER12* args, LPXLOPER12 pRes )
+{
+    return Dispatch(xlfn, count, args, pRes);
+}
+
+extern "C" int __stdcall
+MdCallBack( int xlfn, int count, LPXLOPER* args, LPXLOPER pRes )
+{
+    if (xlfn == xlFree) {
+        for (int i = 0; i < count; ++i) {
+            if ((args[i]->xltype & ~(xlbitXLFree | xlbitDLLFree)) == xltypeStr) {
+                delete[] args[i]->val.str;
+            }
+            args[i]->xltype = xltypeNil;
+        }
+        return xlretSuccess;
+    }
+
+    std::vector<XLOPER12> args12(count > 0 ? count : 1);
+    std::vector<LPXLOPER12> pArgs12(count > 0 ? count : 1);
+    for (int i = 0; i < count; ++i) {
+        To12(*args[i], args12[i]);
+        pArgs12[i] = &args12[i];
+    }
+
+    XLOPER12 res12;
+    int rc = Dispatch(xlfn, count, &pArgs12[0], &res12);
+    if (pRes) {
+        To4(res12, *pRes);
+    }
+
+    FreeValue(res12);
+    for (int i = 0; i < count; ++i) {
+        FreeValue(args12[i]);
+    }
+    return rc;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char* argv[] )
+{
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        g_bVerbose = true;
+        ++first;
+    }
+    if (first >= argc) {
+        printf("Usage: MockExcel [-v] script...\n");
+        return 2;
+    }
+
+    g_current = SelectSheet(L"Sheet1");
+    for (int i = first; i < argc; ++i) {
+        if (!RunScript(argv[i])) {
+            ++g_failures;
+        }
+    }
+    CloseXll();
+
+    if (g_failures) {
+        printf("%d failures\n", g_failures);
+    }
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include <windows.h>
+#include <stdarg.h>
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// XLCALL32.DLL for MockExcel. xlw loads XLCALL32.DLL by name for Excel4 and
+// Excel4v; built next to MockExcel.exe, this one is found first, and passes
+// each call to the MdCallBack that MockExcel exports, as the real one passes
+// them to Excel. XLOPERs are only passed along, so they're opaque here (and
+// xlcall32.h, which declares Excel4 as a function pointer, isn't included).
+
+namespace {
+
+    typedef void* LPOPER;
+
+    typedef int (__stdcall *HOSTPROC)(int xlfn, int count, LPOPER* opers, LPOPER operRes);
+
+    const int MAX_OPERS = 255;  // as in xlcall.cpp
+    const int RET_FAILED = 32;  // xlretFailed
+    const int RET_INVCOUNT = 4; // xlretInvCount
+
+    HOSTPROC
+    Host()
+    {
+        static HOSTPROC pHost = (HOSTPROC)GetProcAddress(GetModuleHandle(NULL), "MdCallBack");
+        return pHost;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+extern "C" int __cdecl
+Excel4( int xlfn, LPOPER operRes, int count, ... )
+{
+    if (!Host()) {
+        return RET_FAILED;
+    }
+    if (count < 0 || count > MAX_OPERS) {
+        return RET_INVCOUNT;
+    }
+
+    LPOPER opers[MAX_OPERS];
+    va_list ap;
+    va_start(ap, count);
+    for (int i = 0; i < count; ++i) {
+        opers[i] = va_arg(ap, LPOPER);
+    }
+    va_end(ap);
+    return Host()(xlfn, count, opers, operRes);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+extern "C" int __stdcall
+Excel4v( int xlfn, LPOPER operRes, int count, LPOPER opers[] )
+{
+    return Host() ? Host()(xlfn, count, opers, operRes) : RET_FAILED;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+extern "C" int __stdcall
+XLCallVer()
+{
+    return 0x0C00;  // Excel 2007
+}
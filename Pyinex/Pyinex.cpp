@@ -62,18 +62,20 @@ using namespace xlw;
 // The +10 slots are used to pass other info about the call into Excel; I don't know if this is
 // something that's unique to XLW, or generic to Excel (haven't had a chance to read the docs), but
 // it seems to cause function registration failure. For now, I'll lower the input arg count to 15,
-// which should be sufficient for almost anything.
+// which should be sufficient for almost anything (PYCALL_ARGS, in Utils.h).
 //
 // Reminder - anonymous namespaces are the new, C++ way to have static vars
 // and functions, with linkage local to the file
 
 namespace {
-    const long g_numCMArgs = 15; 
+    const long g_numCMArgs = PYCALL_ARGS; 
     const long g_argcountBeyondPyArgs = 2; // Filename + function name
 }
 
-// The only prototype we need from the python add-in functions; no need for a separate header
+// The only prototypes we need from the python add-in functions; no need for a separate header
 PyMODINIT_FUNC PyInit_pyinex(void);
+void ResetCallerContext(void);
+void CallerA1Full( std::wstring& rName );
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -115,6 +117,9 @@ namespace {
             // errors in the Python initialization
             AllocConsole();
             m_hConsoleWindow = GetConsoleWindow();
+
+            // Console output is written by a background thread from here on
+            StartLogWriter();
             
             // Call this now so we can log error
             if (!SetupOutputStreams()) {
@@ -153,12 +158,20 @@ namespace {
             Py_Initialize();
 
             PyImport_ImportModule("pyinex");
+
+            // So that a workbook's first calculation can use a result cache
+            OpenResultCacheFromEnvironment();
         }
 
         ~PyinexGlobalInit()
         {
+            // The profiler's sampler takes the GIL; it mustn't while Python is finalized
+            ShutdownProfiler();
             Py_Finalize();
 
+            // Drain anything still queued for the console before it goes away
+            StopLogWriter();
+
             // For reasons I don't understand, this call:
             //
             // CloseHandle(m_hConsoleWindow);
@@ -176,6 +189,136 @@ namespace {
 
 //////////////////////////////////////////////////////////////////////////////
 
+namespace {
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Scalar and table results are handed back to Excel in this, rather than
+    // through a CellMatrix. PyCall isn't registered as thread-safe, so Excel
+    // copies one result before it makes the next call.
+
+    PyCallResultBuffer g_directResult;
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Marks a PyCall in progress for the calculation cycle tracker (CalcCycle.cpp),
+    // on every way out of the call, including exceptions. Memory limits are checked
+    // as the call finishes.
+
+    class CalcCallScope
+    {
+    public:
+        CalcCallScope() { BeginCalcCall(); }
+        ~CalcCallScope() { EndCalcCall(); CheckMemoryLimits(); }
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A PyCall's span on the timeline, if one is being recorded (see Timeline.cpp):
+    // named "module!function" and labelled with the calling cell, it runs from the
+    // module lookup to the result's conversion. The module name is the file's
+    // basename, as ModuleCache imports it.
+
+    class TimelineCallScope
+    {
+    public:
+        TimelineCallScope( XlfOper& xlFilename, XlfOper& xlFunction ) :
+            m_xlFilename(xlFilename),
+            m_xlFunction(xlFunction),
+            m_startUs(TimelineActive() ? TimelineClock() : -1.0)
+        {
+        }
+
+        ~TimelineCallScope()
+        {
+            if (m_startUs < 0.0) {
+                return;
+            }
+
+            std::wstring file(m_xlFilename.AsWstring());
+            size_t slash = file.find_last_of(L"\\/");
+            if (slash != std::wstring::npos) {
+                file.erase(0, slash + 1);
+            }
+            size_t dot = file.find_last_of(L'.');
+            if (dot != std::wstring::npos) {
+                file.erase(dot);
+            }
+
+            std::string name(file.begin(), file.end());
+            name += "!";
+            name += m_xlFunction.AsString();
+
+            // CallPythonFunctionTraced reset the caller context when the call began, so
+            // this reuses the cell and sheet if the call (or pyinex.caller) already
+            // looked them up, and asks Excel only if nothing did
+            std::wstring cell;
+            CallerA1Full(cell);
+
+            RecordTimelineSpan("pycall", name, m_startUs, TimelineClock() - m_startUs, "cell", cell);
+        }
+
+    private:
+        XlfOper&    m_xlFilename;
+        XlfOper&    m_xlFunction;
+        double      m_startUs;
+
+        TimelineCallScope( const TimelineCallScope& );
+        TimelineCallScope& operator=( const TimelineCallScope& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // CallPythonFunction, plus a record in the call trace if PyTrace has one open,
+    // and the result cache if one is open. The timing covers argument conversion and
+    // result conversion as well as Python.
+
+    XlfOper
+    CallPythonFunctionTraced( XlfOper& xlFilename,
+                              XlfOper& xlFunction,
+                              XlfOper* arrCM[],
+                              bool bRangeArgs )
+    {
+        CalcCallScope calcCall;
+        TimelineCallScope timelineCall(xlFilename, xlFunction);
+
+        // pyinex.caller and the Caller*() functions fetch the calling cell afresh for each call
+        ResetCallerContext();
+
+        bool bCacheable = false;
+        if ((!CallTraceActive() && !ResultCacheActive()) || !XlfExcel::Instance().excel12()) {
+            return CallPythonFunction(xlFilename, xlFunction, arrCM, bRangeArgs, g_directResult, bCacheable);
+        }
+
+        // The cache is only consulted for functions marked with pyinex.Cacheable; see PyCall.cpp
+        PyCallCacheEntry cacheEntry;
+        PyCallCacheEntry* pCacheEntry = ResultCacheActive() ? &cacheEntry : NULL;
+
+        double startSeconds = CallTraceClock();
+        XlfOper result = CallPythonFunction(xlFilename, xlFunction, arrCM, bRangeArgs, g_directResult, bCacheable,
+                                            NULL, pCacheEntry);
+        double elapsedSeconds = CallTraceClock() - startSeconds;
+
+        if (pCacheEntry && cacheEntry.bFound) {
+            return result;
+        }
+        if (pCacheEntry && cacheEntry.bKeyed && bCacheable) {
+            StoreCachedResult(cacheEntry.key, (const xloper12*) result.GetLPXLFOPER());
+        }
+        if (CallTraceActive()) {
+            const xloper12* pArgs[g_numCMArgs];
+            for (int i = 0; i < g_numCMArgs; ++i) {
+                pArgs[i] = (const xloper12*) arrCM[i]->GetLPXLFOPER();
+            }
+            RecordTracedCall(xlFilename.AsWstring(), xlFunction.AsString(), pArgs, g_numCMArgs, bRangeArgs,
+                             (const xloper12*) result.GetLPXLFOPER(), startSeconds, elapsedSeconds);
+        }
+        return result;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 extern "C" {
 
 //////////////////////////////////////////////////////////////////////////////
@@ -206,123 +349,61 @@ extern "C" {
             return XlfOper(true);
         }
 
-        // DON'T DECREMENT THE MODULE POINTER - its lifetime is managed by a separate cache object.
-        PyObject* pModule = NULL, *pFunction = NULL;
-        bool rc =  GetPyModuleAndFunctionObjects(  xlFilename.AsWstring(), 
-                                                   xlFunction.AsString(), 
-                                                   pModule, 
-                                                   pFunction);
-        if (!rc) {
-            assert(!pModule);
-            assert(!pFunction);
-            return XlfOper::Error(0);
-        }
-
-        CellMatrix arrCM[] = {
-               CellMatrix(xlCM1.AsCellMatrix("CM1")),
-               CellMatrix(xlCM2.AsCellMatrix("CM2")),
-               CellMatrix(xlCM3.AsCellMatrix("CM3")),
-               CellMatrix(xlCM4.AsCellMatrix("CM4")),
-               CellMatrix(xlCM5.AsCellMatrix("CM5")),
-               CellMatrix(xlCM6.AsCellMatrix("CM6")),
-               CellMatrix(xlCM7.AsCellMatrix("CM7")),
-               CellMatrix(xlCM8.AsCellMatrix("CM8")),
-               CellMatrix(xlCM9.AsCellMatrix("CM9")),
-               CellMatrix(xlCM10.AsCellMatrix("CM10")),
-               CellMatrix(xlCM11.AsCellMatrix("CM11")),
-               CellMatrix(xlCM12.AsCellMatrix("CM12")),
-               CellMatrix(xlCM13.AsCellMatrix("CM13")),
-               CellMatrix(xlCM14.AsCellMatrix("CM14")),
-               CellMatrix(xlCM15.AsCellMatrix("CM15"))
+        XlfOper* arrCM[] = {
+               &xlCM1,  &xlCM2,  &xlCM3,  &xlCM4,  &xlCM5,
+               &xlCM6,  &xlCM7,  &xlCM8,  &xlCM9,  &xlCM10,
+               &xlCM11, &xlCM12, &xlCM13, &xlCM14, &xlCM15
         };
 
         // Compiler doesn't complain if we have too few initializers (only if too many);
         // need to explicitly test sizing
         assert( NELEMS(arrCM)== g_numCMArgs );
 
-        // Examine the function's PyCodeObject to see how many arguments its definition contains.
-        //
-        // If the function is declared with a vararg param (*varname), pass all possible params to Python,
-        // whether they're empty or not. We can't say if those empty params are meaningful to a user function,
-        // so we pass them all on.
-        //
-        // If the function does not have a vararg param, prune out all params past the number defined, and only
-        // pass that defined number. To do otherwise causes Python to throw a TypeError (see err_args() in ceval.c).
-
-        int pyCallArgcount = 0;
-        if (rc) {
-            assert(pFunction);
-            PyCodeObject* pCO = (PyCodeObject*)PyFunction_GET_CODE(pFunction);
-            assert(pCO);
-            pyCallArgcount = pCO->co_argcount;
-
-            // co_argcount refers to the number  of params in the function's opening "define" statement.
-            // If it exceeds the number of params that Excel can pass in, there's no way to call this function here.
-            // Default param values don't provide a loophole, as Excel has no natural way to support named params.
-            if (pyCallArgcount > g_numCMArgs) {
-                ERROUT("Function %s has %d arguments; this exceeds the maximum allowable number %d", 
-                    xlFunction.AsString(), pyCallArgcount, g_numCMArgs);
-                rc = false;
-            }
+        return CallPythonFunctionTraced(xlFilename, xlFunction, arrCM, false);
 
-            // co_flags has the CO_VARARGS bit set if the function has a vararg param in its definition.
-            if (rc && (pCO->co_flags & CO_VARARGS)) {
-                pyCallArgcount = g_numCMArgs; // Forces us to pass everything Excel has on to Python
-            }
-        }
+        EXCEL_END;
+    }
 
-        // Assemble the args
-        long cmDx;
-        PyObject* pArgs = PyTuple_New(pyCallArgcount);
-        PyObject *pValue = NULL;
-
-        for(cmDx = 0; rc && cmDx < pyCallArgcount; ++cmDx) {
-            CellMatrix& rCM = arrCM[cmDx];
-            rc = ConvertCellMatrixToPyObject( rCM, pValue );
-            if (rc) {
-                assert(pValue);
-                PyTuple_SetItem(pArgs, cmDx, pValue); // pRows reference stolen here
-            } else {
-                // pArgs is freed below, with pFunction and pResult
-                assert(!pValue);
-                ERROUT("Failed to convert argument %d to a PyObject", cmDx);
-            }
-        }
+//////////////////////////////////////////////////////////////////////////////
+//
+// As PyCall, but arguments are registered as references, and single-area ranges
+// reach Python as pyinex.Range objects that read cells on demand
 
-        // Make the call
-        PyObject* pResult = NULL;
-        if (rc) {
-            pResult = PyObject_CallObject(pFunction, pArgs);
-            if (!pResult) {
-                if (PyErr_Occurred()) {
-                    PyErr_Print();
-                }
-                rc = false;
-            }
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyCallRef(    XlfOper xlFilename,  
+                    XlfOper xlFunction,
+                    XlfOper xlRef1,
+                    XlfOper xlRef2,
+                    XlfOper xlRef3,
+                    XlfOper xlRef4,
+                    XlfOper xlRef5,
+                    XlfOper xlRef6,
+                    XlfOper xlRef7,
+                    XlfOper xlRef8,
+                    XlfOper xlRef9,
+                    XlfOper xlRef10,
+                    XlfOper xlRef11,
+                    XlfOper xlRef12,
+                    XlfOper xlRef13,
+                    XlfOper xlRef14,
+                    XlfOper xlRef15 )
+    {
+        EXCEL_BEGIN_PYINEX;
+  
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(true);
         }
 
-        // Unpack results
-        CellMatrix retMatrix;
-        if (rc && pResult != NULL) {
-            rc = ConvertPyObjectToCellMatrix(pResult, retMatrix);
-            if (!rc) {
-                if (PyErr_Occurred()) {
-                    PyErr_Print();
-                }
-            }
-        }
+        XlfOper* arrRef[] = {
+               &xlRef1,  &xlRef2,  &xlRef3,  &xlRef4,  &xlRef5,
+               &xlRef6,  &xlRef7,  &xlRef8,  &xlRef9,  &xlRef10,
+               &xlRef11, &xlRef12, &xlRef13, &xlRef14, &xlRef15
+        };
 
-        // Clean up
-        // Because PyTuple_SetItems steals refs, the decrement of pArgs should free all contained objects
-        Py_XDECREF(pArgs);  
-        Py_XDECREF(pFunction);
-        Py_XDECREF(pResult);
+        assert( NELEMS(arrRef)== g_numCMArgs );
 
-        if (rc) {
-            return XlfOper(retMatrix);
-        } else {
-            return XlfOper::Error(0);
-        }
+        return CallPythonFunctionTraced(xlFilename, xlFunction, arrRef, true);
 
         EXCEL_END;
     }
@@ -555,6 +636,8 @@ extern "C" {
 
         bool bClear = xlClearConsole.AsBool();
         if (bClear) {
+            // Otherwise output queued before the clear may appear after it
+            FlushLog();
             system("cls");
             return XlfOper("Console cleared");
         } else {
@@ -613,6 +696,501 @@ extern "C" {
         EXCEL_END;
     }
 
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyStringInterning(  XlfOper xlIntern )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        bool bOutput;
+        if (xlIntern.IsBool()) {
+            bOutput = xlIntern.AsBool();
+            SetStringInterning( bOutput );
+        } else {
+            bOutput = StringInterningEnabled();
+        }
+
+        return XlfOper(bOutput);
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyBreakInterrupt(  XlfOper xlInterrupt )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        bool bOutput;
+        if (xlInterrupt.IsBool()) {
+            SetBreakInterrupt( xlInterrupt.AsBool() );
+        }
+        bOutput = BreakInterruptEnabled();
+
+        return XlfOper(bOutput);
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyTimeout(  XlfOper xlSeconds )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlSeconds.IsNumber()) {
+            double seconds = xlSeconds.AsDouble();
+            if (seconds < 0) {
+                WARNOUT("Input timeout was %g; min value is zero (no timeout)", seconds);
+                seconds = 0;
+            }
+            SetCallTimeout( seconds );
+        } else if (!xlSeconds.IsMissing() && !xlSeconds.IsNil()) {
+            return XlfOper("Timeout is specified, but is not a number");
+        }
+
+        std::ostringstream ostr;
+        ostr << "Timeout " << CallTimeoutSeconds() << " s, " << TotalCallTimeouts() << " calls timed out";
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyRowLimit(  XlfOper xlRows )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlRows.IsNumber()) {
+            double rows = xlRows.AsDouble();
+            if (rows < 0) {
+                WARNOUT("Input row limit was %g; min value is zero (a full sheet)", rows);
+                rows = 0;
+            }
+            SetResultRowLimit( (unsigned long)rows );
+        } else if (!xlRows.IsMissing() && !xlRows.IsNil()) {
+            return XlfOper("Row limit is specified, but is not a number");
+        }
+
+        return XlfOper((double)ResultRowLimit());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyLog(  XlfOper xlSeverityMask,
+              XlfOper xlLogFile,
+              XlfOper xlMaxFileKB,
+              XlfOper xlKeepFiles )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlSeverityMask.IsNumber()) {
+            int mask = xlSeverityMask.AsInt();
+            if (mask < 0) {
+                return XlfOper("Severity mask must be zero or positive");
+            }
+            SetLogSeverityMask( (unsigned long)mask );
+        } else if (!xlSeverityMask.IsMissing() && !xlSeverityMask.IsNil()) {
+            return XlfOper("Severity mask is specified, but is not a number");
+        }
+
+        if (xlLogFile.IsString()) {
+            double maxKB = 1024.0;
+            if (xlMaxFileKB.IsNumber()) {
+                maxKB = xlMaxFileKB.AsDouble();
+            }
+
+            int keep = 5;
+            if (xlKeepFiles.IsNumber()) {
+                keep = xlKeepFiles.AsInt();
+            }
+
+            if (maxKB < 0 || keep < 0) {
+                return XlfOper("maxFileKB and keepFiles must be zero or positive");
+            }
+
+            // Only reopens the file if its name has changed
+            SetLogFile( xlLogFile.AsWstring(), (unsigned long)(maxKB * 1024.0), (unsigned long)keep );
+        } else if (!xlLogFile.IsMissing() && !xlLogFile.IsNil()) {
+            return XlfOper("Log file is specified, but is not a string");
+        }
+
+        std::ostringstream ostr;
+        ostr << "Mask " << LogSeverityMask() << ", " << LogDroppedCount() << " dropped";
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyTrace(  XlfOper xlTraceFile )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (!XlfExcel::Instance().excel12()) {
+            return XlfOper("Call tracing needs Excel 2007");
+        }
+
+        if (xlTraceFile.IsString()) {
+            // Don't restart (and so empty) the trace on every recalc
+            std::wstring current, requested(xlTraceFile.AsWstring());
+            GetCallTraceFile(current);
+            if (requested.empty()) {
+                StopCallTrace();
+            } else if (_wcsicmp(current.c_str(), requested.c_str()) != 0) {
+                if (!StartCallTrace( requested )) {
+                    return XlfOper("Couldn't open the trace file");
+                }
+            }
+        } else if (xlTraceFile.IsBool()) {
+            if (!xlTraceFile.AsBool()) {
+                StopCallTrace();
+            }
+        } else if (!xlTraceFile.IsMissing() && !xlTraceFile.IsNil()) {
+            return XlfOper("Trace file is specified, but is not a string");
+        }
+
+        std::ostringstream ostr;
+        ostr << (CallTraceActive() ? "Tracing, " : "Not tracing, ") << TracedCallCount() << " calls recorded";
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyGC(  XlfOper xlSchedule,
+             XlfOper xlBudget )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlSchedule.IsBool()) {
+            SetGcScheduling( xlSchedule.AsBool() );
+        } else if (!xlSchedule.IsMissing() && !xlSchedule.IsNil()) {
+            return XlfOper("Schedule flag is specified, but is not TRUE or FALSE");
+        }
+
+        if (xlBudget.IsNumber()) {
+            double budget = xlBudget.AsDouble();
+            if (budget < 0) {
+                WARNOUT("Input allocation budget was %g; min value is zero (no budget)", budget);
+                budget = 0;
+            }
+            SetGcAllocationBudget( (unsigned long)budget );
+        } else if (!xlBudget.IsMissing() && !xlBudget.IsNil()) {
+            return XlfOper("Allocation budget is specified, but is not a number");
+        }
+
+        GcStatistics stats;
+        GetGcStatistics(stats);
+
+        std::ostringstream ostr;
+        ostr << (GcScheduling() ? "Scheduled, " : "Automatic, ") << stats.collections << " collections, "
+             << stats.midCalcCollections << " during calc, max " << stats.maxPauseMs << " ms, total " 
+             << stats.totalPauseMs << " ms";
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyMemory(  XlfOper xlTrack,
+                 XlfOper xlProcessLimitMB,
+                 XlfOper xlModuleLimitMB,
+                 XlfOper xlCollect )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlTrack.IsBool()) {
+            if (!xlTrack.AsBool()) {
+                StopMemoryTracking();
+            } else if (!MemoryTrackingActive() && !StartMemoryTracking()) {
+                return XlfOper("Memory tracking needs Python 3.5 or later");
+            }
+        } else if (!xlTrack.IsMissing() && !xlTrack.IsNil()) {
+            return XlfOper("Tracking flag is specified, but is not TRUE or FALSE");
+        }
+
+        double processMB, moduleMB;
+        bool bCollect;
+        GetMemoryLimits(processMB, moduleMB, bCollect);
+
+        XlfOper* limits[] = { &xlProcessLimitMB, &xlModuleLimitMB };
+        double* values[] = { &processMB, &moduleMB };
+        for (size_t i = 0; i < NELEMS(limits); ++i) {
+            if (limits[i]->IsNumber()) {
+                *values[i] = limits[i]->AsDouble();
+                if (*values[i] < 0) {
+                    WARNOUT("Input memory limit was %g MB; min value is zero (no limit)", *values[i]);
+                    *values[i] = 0;
+                }
+            } else if (!limits[i]->IsMissing() && !limits[i]->IsNil()) {
+                return XlfOper("Memory limit is specified, but is not a number");
+            }
+        }
+
+        if (xlCollect.IsBool()) {
+            bCollect = xlCollect.AsBool();
+        } else if (!xlCollect.IsMissing() && !xlCollect.IsNil()) {
+            return XlfOper("Collect flag is specified, but is not TRUE or FALSE");
+        }
+        SetMemoryLimits(processMB, moduleMB, bCollect);
+
+        // The three biggest modules are enough for a cell; pyinex.memory() has the rest
+        MemoryUsage usage;
+        GetMemoryUsage(usage);
+
+        const double mb = 1024.0 * 1024.0;
+        std::ostringstream ostr;
+        ostr.setf(std::ios::fixed);
+        ostr.precision(0);
+        ostr << (MemoryTrackingActive() ? "Tracking, " : "Not tracking, ") << usage.addressSpaceBytes / mb 
+             << " MB in use, " << usage.addressSpaceFreeBytes / mb << " MB free";
+        for (size_t i = 0; i < usage.modules.size() && i < 3; ++i) {
+            ostr << (i == 0 ? "; " : ", ") << usage.modules[i].second << " " << usage.modules[i].first / mb << " MB";
+        }
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyProfile(  XlfOper xlHz,
+                  XlfOper xlProfileFile,
+                  XlfOper xlCells )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        bool bCells = ProfilerActive() ? ProfilerCells() : true;
+        if (xlCells.IsBool()) {
+            bCells = xlCells.AsBool();
+        } else if (!xlCells.IsMissing() && !xlCells.IsNil()) {
+            return XlfOper("Cells flag is specified, but is not TRUE or FALSE");
+        }
+
+        if (xlHz.IsNumber()) {
+            double hz = xlHz.AsDouble();
+            if (hz <= 0) {
+                StopProfiler();
+            } else if (!ProfilerActive() || hz != ProfilerHz() || bCells != ProfilerCells()) {
+                // Don't restart (and so empty) the profile on every recalc
+                if (!StartProfiler( hz, bCells )) {
+                    return XlfOper("Couldn't start the profiler");
+                }
+            }
+        } else if (xlHz.IsBool()) {
+            if (!xlHz.AsBool()) {
+                StopProfiler();
+            }
+        } else if (!xlHz.IsMissing() && !xlHz.IsNil()) {
+            return XlfOper("Sampling rate is specified, but is not a number or FALSE");
+        }
+
+        std::ostringstream ostr;
+        if (ProfilerActive()) {
+            ostr << "Profiling at " << ProfilerHz() << " Hz, ";
+        } else {
+            ostr << "Not profiling, ";
+        }
+        ostr << ProfileSampleCount() << " samples";
+
+        if (xlProfileFile.IsString()) {
+            std::wstring profileFile(xlProfileFile.AsWstring());
+            if (!profileFile.empty()) {
+                if (!WriteProfile( profileFile )) {
+                    return XlfOper("Couldn't write the profile file");
+                }
+                ostr << " written";
+            }
+        } else if (!xlProfileFile.IsMissing() && !xlProfileFile.IsNil()) {
+            return XlfOper("Profile file is specified, but is not a string");
+        }
+
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyTimeline(  XlfOper xlTimelineFile )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (xlTimelineFile.IsString()) {
+            // Don't restart (and so empty) the timeline on every recalc
+            std::wstring current, requested(xlTimelineFile.AsWstring());
+            GetTimelineFile(current);
+            if (requested.empty()) {
+                StopTimeline();
+            } else if (_wcsicmp(current.c_str(), requested.c_str()) != 0) {
+                if (!StartTimeline( requested )) {
+                    return XlfOper("Couldn't open the timeline file");
+                }
+            }
+        } else if (xlTimelineFile.IsBool()) {
+            if (!xlTimelineFile.AsBool()) {
+                StopTimeline();
+            }
+        } else if (!xlTimelineFile.IsMissing() && !xlTimelineFile.IsNil()) {
+            return XlfOper("Timeline file is specified, but is not a string");
+        }
+
+        std::ostringstream ostr;
+        ostr << (TimelineActive() ? "Recording, " : "Not recording, ") << TimelineEventCount() << " events";
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+
+    LPXLFOPER EXCEL_EXPORT 
+    xlPyResultCache(  XlfOper xlCacheFile,
+                      XlfOper xlSizeMB,
+                      XlfOper xlClear )
+    {
+        EXCEL_BEGIN_PYINEX;
+
+        // Don't execute this call from the function wizard
+        if (XlfExcel::Instance().IsCalledByFuncWiz()) {
+            return XlfOper(false);
+        }
+
+        if (!XlfExcel::Instance().excel12()) {
+            return XlfOper("The result cache needs Excel 2007 or later");
+        }
+
+        unsigned long sizeMB = 0;
+        if (xlSizeMB.IsNumber()) {
+            if (xlSizeMB.AsDouble() < 1) {
+                return XlfOper("Cache size must be at least 1 MB");
+            }
+            sizeMB = (unsigned long) xlSizeMB.AsDouble();
+        } else if (!xlSizeMB.IsMissing() && !xlSizeMB.IsNil()) {
+            return XlfOper("Cache size is specified, but is not a number");
+        }
+
+        if (xlCacheFile.IsString()) {
+            // Don't reopen the cache on every recalc
+            std::wstring current, requested(xlCacheFile.AsWstring());
+            GetResultCacheFile(current);
+            if (requested.empty()) {
+                CloseResultCache();
+            } else if (_wcsicmp(current.c_str(), requested.c_str()) != 0) {
+                if (!OpenResultCache( requested, sizeMB )) {
+                    return XlfOper("Couldn't open the result cache file");
+                }
+            }
+        } else if (xlCacheFile.IsBool()) {
+            if (!xlCacheFile.AsBool()) {
+                CloseResultCache();
+            }
+        } else if (!xlCacheFile.IsMissing() && !xlCacheFile.IsNil()) {
+            return XlfOper("Cache file is specified, but is not a string");
+        }
+
+        if (xlClear.IsBool()) {
+            if (xlClear.AsBool() && ResultCacheActive() && !ClearResultCache()) {
+                return XlfOper("Couldn't clear the result cache");
+            }
+        } else if (!xlClear.IsMissing() && !xlClear.IsNil()) {
+            return XlfOper("Clear flag is specified, but is not TRUE or FALSE");
+        }
+
+        std::ostringstream ostr;
+        if (ResultCacheActive()) {
+            unsigned long entries, hits, misses, stores, megabytes;
+            GetResultCacheStats(entries, hits, misses, stores, megabytes);
+            ostr << "Caching, " << entries << " results in " << megabytes << " MB, " 
+                 << hits << " hits, " << misses << " misses, " << stores << " stored";
+        } else {
+            ostr << "Not caching";
+        }
+        return XlfOper(ostr.str());
+        
+        EXCEL_END;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A command, not a function; Excel 2010 runs it when a calculation ends or is
+// cancelled (see the registration below). It doesn't start Python, and only
+// touches it if a PyCall has.
+
+    int EXCEL_EXPORT 
+    xlPyCalcEnded()
+    {
+        EndCalcCycle(true);
+        return 1;
+    }
+
 //////////////////////////////////////////////////////////////////////////////
 
     LPXLFOPER EXCEL_EXPORT 
@@ -738,6 +1316,135 @@ namespace {
 
     /******************/
 
+    XLRegistration::Arg PyStringInterningArgs[] = {
+        { "intern", "Boolean - when TRUE, repeated strings within the arguments of a PyCall are passed to Python as one shared object", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyStringInterning(
+        "xlPyStringInterning", "PyStringInterning", "Sets and displays the value of a flag determining whether Pyinex interns argument strings",
+        "Pyinex", PyStringInterningArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyBreakInterruptArgs[] = {
+        { "interrupt", "Boolean - when TRUE, pressing Esc while a PyCall is running raises KeyboardInterrupt in the Python script", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyBreakInterrupt(
+        "xlPyBreakInterrupt", "PyBreakInterrupt", "Sets and displays the value of a flag determining whether Esc interrupts running Python scripts",
+        "Pyinex", PyBreakInterruptArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyTimeoutArgs[] = {
+        { "seconds", "Optional - time budget for every PyCall, in seconds; zero means no limit. Functions decorated with pyinex.Timeout use their own budget", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyTimeout(
+        "xlPyTimeout", "PyTimeout", "Sets and displays the PyCall time budget, and the number of calls that have exceeded it",
+        "Pyinex", PyTimeoutArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyRowLimitArgs[] = {
+        { "rows", "Optional - most rows a PyCall may return from an iterator or generator; zero means a full sheet", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyRowLimit(
+        "xlPyRowLimit", "PyRowLimit", "Sets and displays the most rows taken from an iterator result",
+        "Pyinex", PyRowLimitArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyLogArgs[] = {
+        { "severityMask", "Optional - sum of the message types to show: 1 = errors, 2 = warnings, 4 = info, 8 = Python print output. Default is 15 (all)", "XLF_OPER" },
+        { "logFile", "Optional - file to copy console output to; an empty string stops copying", "XLF_OPER" },
+        { "maxFileKB", "Optional - size at which the log file is rotated, in KB; zero means never. Default is 1024", "XLF_OPER" },
+        { "keepFiles", "Optional - number of rotated log files to keep. Default is 5", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyLog(
+        "xlPyLog", "PyLog", "Filters console output and optionally copies it to a rotating log file",
+        "Pyinex", PyLogArgs, 4); 
+
+    /******************/
+
+    XLRegistration::Arg PyTraceArgs[] = {
+        { "traceFile", "Optional - file to record every PyCall to, for replay by TestHarness; an empty string or FALSE stops recording", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyTrace(
+        "xlPyTrace", "PyTrace", "Records PyCalls - arguments, results and timing - to a binary trace file",
+        "Pyinex", PyTraceArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyGCArgs[] = {
+        { "schedule", "Optional - Boolean - when TRUE, Python's garbage collector is held off while Excel calculates, and run once the calculation ends", "XLF_OPER" },
+        { "budget", "Optional - allocations during a calculation that trigger a young collection anyway; zero means none. Default is 100000", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyGC(
+        "xlPyGC", "PyGC", "Sets and displays garbage collection scheduling, with collection counts and pause times",
+        "Pyinex", PyGCArgs, 2); 
+
+    /******************/
+
+    XLRegistration::Arg PyMemoryArgs[] = {
+        { "track", "Optional - Boolean - when TRUE, Python memory is charged to the module that allocated it; FALSE stops and forgets", "XLF_OPER" },
+        { "processLimitMB", "Optional - Excel address space, in MB, above which a warning is written; zero means none", "XLF_OPER" },
+        { "moduleLimitMB", "Optional - memory any one module may hold, in MB, before a warning is written; zero means none", "XLF_OPER" },
+        { "collect", "Optional - Boolean - when TRUE, a full garbage collection is run before warning of a limit", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyMemory(
+        "xlPyMemory", "PyMemory", "Sets memory tracking and soft limits, and displays memory use by module",
+        "Pyinex", PyMemoryArgs, 4); 
+
+    /******************/
+
+    XLRegistration::Arg PyProfileArgs[] = {
+        { "hz", "Optional - samples a second to take of running Python code; zero or FALSE stops profiling. Default is to leave it as it is", "XLF_OPER" },
+        { "profileFile", "Optional - file to write the samples to, as collapsed stacks for a flame graph", "XLF_OPER" },
+        { "cells", "Optional - Boolean - when TRUE, samples are kept by calling cell as well as by function. Default is TRUE", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyProfile(
+        "xlPyProfile", "PyProfile", "Starts and stops sampling Python code for a profile, and writes it out",
+        "Pyinex", PyProfileArgs, 3); 
+
+    /******************/
+
+    XLRegistration::Arg PyTimelineArgs[] = {
+        { "timelineFile", "Optional - file to record a timeline of PyCalls to, as Chrome trace events; an empty string or FALSE stops recording", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyTimeline(
+        "xlPyTimeline", "PyTimeline", "Records a timeline of PyCalls, calculations, module loads and garbage collections",
+        "Pyinex", PyTimelineArgs, 1); 
+
+    /******************/
+
+    XLRegistration::Arg PyResultCacheArgs[] = {
+        { "cacheFile", "Optional - file to keep results of pyinex.Cacheable functions in, across Excel sessions; an empty string or FALSE closes it", "XLF_OPER" },
+        { "sizeMB", "Optional - size of a new cache file, in MB. Default is 64", "XLF_OPER" },
+        { "clear", "Optional - Boolean - when TRUE, every stored result is thrown away", "XLF_OPER" }
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyResultCache(
+        "xlPyResultCache", "PyResultCache", "Opens, closes and clears the persistent cache of PyCall results, and displays its use",
+        "Pyinex", PyResultCacheArgs, 3); 
+
+    /******************/
+
+    const int PyCalcEndedEvents[] = { xlEventCalculationEnded, xlEventCalculationCanceled };
+
+    XLRegistration::XLCommandRegistrationHelper registerPyCalcEnded(
+        "xlPyCalcEnded", "PyCalcEnded", "Ends Pyinex's calculation cycle",
+        PyCalcEndedEvents, NELEMS(PyCalcEndedEvents)); 
+
+    /******************/
+
     XLRegistration::Arg PyLoadedLibraryArgs[] = {
         { "library", "Name of library to look up - can be one of two case-insensitive values: 'Python' or 'Pyinex'", "XLF_OPER" }
     };
@@ -772,6 +1479,30 @@ namespace {
         "xlPyCall", "PyCall", "Call a function in a python file",
         "Pyinex", PyCallArgs, g_numCMArgs + g_argcountBeyondPyArgs); 
 
+    XLRegistration::Arg PyCallRefArgs[] = {
+        { "filename", "Python file to parse", "XLF_OPER" },
+        { "function", "Function to call in the python file", "XLF_OPER" },
+        { "range1",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range2",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range3",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range4",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range5",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range6",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range7",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range8",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range9",  "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range10", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range11", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range12", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range13", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range14", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"},
+        { "range15", "Range whose cells are read only as the function indexes them", "XLF_XLOPER"}
+    };
+
+    XLRegistration::XLFunctionRegistrationHelper registerPyCallRefArgs(
+        "xlPyCallRef", "PyCallRef", "Call a function in a python file, passing ranges that are read on demand",
+        "Pyinex", PyCallRefArgs, g_numCMArgs + g_argcountBeyondPyArgs); 
+
     // Compiler doesn't complain if we have too few initializers (only if too many);
     // need to explicitly test sizing. Nowhere to do this test except in the ctor of a
     // global object.
@@ -779,6 +1510,7 @@ namespace {
     struct RegSizeTest {
         RegSizeTest() { 
             assert( NELEMS(PyCallArgs) == (g_numCMArgs + g_argcountBeyondPyArgs) );
+            assert( NELEMS(PyCallRefArgs) == (g_numCMArgs + g_argcountBeyondPyArgs) );
         }
     };
 
@@ -50,46 +50,230 @@ using namespace xlw;
 //////////////////////////////////////////////////////////////////////////////
 
 namespace {
-    
-    // These are zero-indexed coming back from XLW
-    // Leaving them that way, as that will be useful for A1-style cell calcs
-    // R1C1 callers will increment; A1 callers will not
 
-    void GetCallingSheetColRow( std::string* pSheet, int& rCol, int& rRow )
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Everything the caller functions need - the calling cell and its sheet name -
+    // is fetched from Excel at most once per PyCall, on first use, rather than on
+    // every call to CallerA1() and friends. When xlfCaller hands back an xltypeRef,
+    // it carries the sheet ID, and the name is looked up by that ID in a table that
+    // lives for the calc cycle (see CalcCycle.cpp; a sheet can't be renamed
+    // mid-recalc), so a sheet full of such PyCalls asks Excel for its name once.
+    // An xltypeSRef carries no ID, and getting one would cost a callback of its own,
+    // as much as asking for the name; so the name is asked for directly.
+    //
+    // Rows and cols are zero-indexed, as they come from Excel. That is useful for
+    // A1-style cell calcs; R1C1 callers will increment.
+
+    class CallerContext
     {
-        XlfOper caller;
-        XlfExcel::Instance().Call(xlfCaller,caller, 0);
-        if (!caller.IsSRef()) {
-            rCol = -1;
-            rRow = -1;
-            if (pSheet) {
-                *pSheet = "Function not called from cell; macro or toolbar call?";
+    public:
+        static CallerContext& Factory();
+
+        void Reset();
+
+        bool FromCell()                 { ResolveCell(); return m_bFromCell; }
+        int Row()                       { ResolveCell(); return m_row; }
+        int Col()                       { ResolveCell(); return m_col; }
+        const std::wstring& Sheet()     { ResolveSheet(); return m_sheet; }
+
+    private:
+        CallerContext();
+
+        void ResolveCell();
+        void ResolveSheet();
+
+    private:
+        bool            m_bCellResolved;
+        bool            m_bSheetResolved;
+        bool            m_bFromCell;
+        bool            m_bHaveSheetId;     // the caller came as an xltypeRef
+        int             m_row;
+        int             m_col;
+        DWORD           m_idSheet;
+        std::wstring    m_sheet;
+
+        std::map<DWORD, std::wstring> m_sheetNames;
+        unsigned long   m_cycle;            // the calc cycle m_sheetNames belongs to
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    CallerContext&
+    CallerContext::Factory()
+    {
+        static CallerContext g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    CallerContext::CallerContext() :
+        m_bCellResolved(false),
+        m_bSheetResolved(false),
+        m_bFromCell(false),
+        m_bHaveSheetId(false),
+        m_row(-1),
+        m_col(-1),
+        m_idSheet(0),
+        m_cycle(0)
+    {
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CallerContext::Reset()
+    {
+        m_bCellResolved = false;
+        m_bSheetResolved = false;
+
+        // Outside a calc cycle (a macro, say) a sheet may have just been renamed
+        unsigned long cycle = CalcCycleNumber();
+        if (!CalcCycleActive() || cycle != m_cycle) {
+            m_sheetNames.clear();
+            m_cycle = cycle;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Could use XlfOper::AsRef() to get the rows and cols, but it embeds an unnecessary
+    // call to Coerce into an xltypeRef; the xltypeSRef that xlfCaller returns already
+    // has them. XLW doesn't expose SRefs, so we go to the XLOPERs directly. An SRef
+    // holds no memory of Excel's, so it needs no xlFree either.
+
+    void
+    CallerContext::ResolveCell()
+    {
+        if (m_bCellResolved) {
+            return;
+        }
+        m_bCellResolved = true;
+        m_bFromCell = false;
+        m_bHaveSheetId = false;
+        m_row = -1;
+        m_col = -1;
+
+        if (XlfExcel::Instance().excel12()) {
+            XLOPER12 xCaller;
+            if (XlfExcel::Instance().Call12(xlfCaller, &xCaller, 0) == xlretSuccess) {
+                if (xCaller.xltype == xltypeSRef) {
+                    m_row = xCaller.val.sref.ref.rwFirst;
+                    m_col = xCaller.val.sref.ref.colFirst;
+                    m_bFromCell = true;
+                    return;
+                }
+                if (xCaller.xltype == xltypeRef && xCaller.val.mref.lpmref && xCaller.val.mref.lpmref->count > 0) {
+                    m_row = xCaller.val.mref.lpmref->reftbl[0].rwFirst;
+                    m_col = xCaller.val.mref.lpmref->reftbl[0].colFirst;
+                    m_idSheet = xCaller.val.mref.idSheet;
+                    m_bHaveSheetId = true;
+                    m_bFromCell = true;
+                }
+                XlfExcel::Instance().Call12(xlFree, NULL, 1, &xCaller);
             }
+        } else {
+            XLOPER xCaller;
+            if (XlfExcel::Instance().Call4(xlfCaller, &xCaller, 0) == xlretSuccess) {
+                if (xCaller.xltype == xltypeSRef) {
+                    m_row = xCaller.val.sref.ref.rwFirst;
+                    m_col = xCaller.val.sref.ref.colFirst;
+                    m_bFromCell = true;
+                    return;
+                }
+                if (xCaller.xltype == xltypeRef && xCaller.val.mref.lpmref && xCaller.val.mref.lpmref->count > 0) {
+                    m_row = xCaller.val.mref.lpmref->reftbl[0].rwFirst;
+                    m_col = xCaller.val.mref.lpmref->reftbl[0].colFirst;
+                    m_idSheet = xCaller.val.mref.idSheet;
+                    m_bHaveSheetId = true;
+                    m_bFromCell = true;
+                }
+                XlfExcel::Instance().Call4(xlFree, NULL, 1, &xCaller);
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // An SRef names the sheet being calculated, which is the caller's; a Ref names
+    // its sheet by ID.
+
+    void
+    CallerContext::ResolveSheet()
+    {
+        if (m_bSheetResolved) {
+            return;
+        }
+        m_bSheetResolved = true;
+
+        if (!FromCell()) {
+            m_sheet = L"Function not called from cell; macro or toolbar call?";
             return;
         }
-        
-        // Could use caller.AsRef() to get an XlfRef from which we can extract rows and
-        // cols, but it embeds an unnecessary call to Coerce into an xltypeRef. This is
-        // not needed because we have an xltypeSRef, which already has the rows and cols
-        // available. Unfortunately, XLW doesn't expose SRefs (yet), so we'll have to do
-        // some Excel-case-specific hackery to gain this efficiency.
 
+        if (m_bHaveSheetId) {
+            std::map<DWORD, std::wstring>::const_iterator it = m_sheetNames.find(m_idSheet);
+            if (it != m_sheetNames.end()) {
+                m_sheet = it->second;
+                return;
+            }
+        }
+
+        m_sheet.clear();
         if (XlfExcel::Instance().excel12()) {
-            LPXLOPER12 pX = (LPXLOPER12) caller.GetLPXLFOPER();
-            assert(pX->xltype == xltypeSRef);
-            rRow = pX->val.sref.ref.rwFirst;
-            rCol = pX->val.sref.ref.colFirst;
+            XLOPER12 xRef, xName;
+            XLMREF12 mref;
+            if (m_bHaveSheetId) {
+                mref.count = 1;
+                mref.reftbl[0].rwFirst = mref.reftbl[0].rwLast = m_row;
+                mref.reftbl[0].colFirst = mref.reftbl[0].colLast = m_col;
+                xRef.xltype = xltypeRef;
+                xRef.val.mref.idSheet = m_idSheet;
+                xRef.val.mref.lpmref = &mref;
+            } else {
+                xRef.xltype = xltypeSRef;
+                xRef.val.sref.count = 1;
+                xRef.val.sref.ref.rwFirst = xRef.val.sref.ref.rwLast = m_row;
+                xRef.val.sref.ref.colFirst = xRef.val.sref.ref.colLast = m_col;
+            }
+            if (XlfExcel::Instance().Call12(xlSheetNm, &xName, 1, &xRef) == xlretSuccess) {
+                if (xName.xltype == xltypeStr && xName.val.str) {
+                    m_sheet.assign(xName.val.str + 1, xName.val.str[0]); // counted string
+                }
+                XlfExcel::Instance().Call12(xlFree, NULL, 1, &xName);
+            }
         } else {
-            LPXLOPER pX = (LPXLOPER) caller.GetLPXLFOPER();
-            assert(pX->xltype == xltypeSRef);
-            rRow = pX->val.sref.ref.rwFirst;
-            rCol = pX->val.sref.ref.colFirst;
+            XLOPER xRef, xName;
+            XLMREF mref;
+            if (m_bHaveSheetId) {
+                mref.count = 1;
+                mref.reftbl[0].rwFirst = mref.reftbl[0].rwLast = (WORD)m_row;
+                mref.reftbl[0].colFirst = mref.reftbl[0].colLast = (BYTE)m_col;
+                xRef.xltype = xltypeRef;
+                xRef.val.mref.idSheet = m_idSheet;
+                xRef.val.mref.lpmref = &mref;
+            } else {
+                xRef.xltype = xltypeSRef;
+                xRef.val.sref.count = 1;
+                xRef.val.sref.ref.rwFirst = xRef.val.sref.ref.rwLast = (WORD)m_row;
+                xRef.val.sref.ref.colFirst = xRef.val.sref.ref.colLast = (BYTE)m_col;
+            }
+            if (XlfExcel::Instance().Call4(xlSheetNm, &xName, 1, &xRef) == xlretSuccess) {
+                if (xName.xltype == xltypeStr && xName.val.str) {
+                    int len = (unsigned char)xName.val.str[0];
+                    int wlen = MultiByteToWideChar(CP_ACP, 0, xName.val.str + 1, len, NULL, 0);
+                    if (wlen > 0) {
+                        m_sheet.resize(wlen);
+                        MultiByteToWideChar(CP_ACP, 0, xName.val.str + 1, len, &m_sheet[0], wlen);
+                    }
+                }
+                XlfExcel::Instance().Call4(xlFree, NULL, 1, &xName);
+            }
         }
 
-        if (pSheet) {
-            XlfOper sheet;
-            XlfExcel::Instance().Call(xlSheetNm, sheet, 1, (LPXLFOPER) caller );
-            *pSheet = sheet.AsString();
+        if (m_bHaveSheetId && !m_sheet.empty()) {
+            m_sheetNames[m_idSheet] = m_sheet;
         }
     }
 
@@ -148,76 +332,223 @@ namespace {
 
     //////////////////////////////////////////////////////////////////////////////
 
+    PyObject*
+    WideToPyString( const std::wstring& w )
+    {
+#if PY_MAJOR_VERSION < 3
+        int len = WideCharToMultiByte(CP_ACP, 0, w.c_str(), (int)w.size(), NULL, 0, NULL, NULL);
+        std::string s(len > 0 ? len : 0, 0);
+        if (len > 0) {
+            WideCharToMultiByte(CP_ACP, 0, w.c_str(), (int)w.size(), &s[0], len, NULL, NULL);
+        }
+        return PyString_FromStringAndSize(s.data(), (Py_ssize_t)s.size());
+#else
+        return PyUnicode_FromWideChar(w.c_str(), (Py_ssize_t)w.size());
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
     void
-    AssembleCallerName( bool R1C1,     // true = R1C1, false = A1
-                        bool full,     //true = sheet name prepended, false == no sheet name
-                        std::string& rCallerName )
+    AssembleCallerName( bool R1C1,      // true = R1C1, false = A1
+                        bool full,      // true = sheet name prepended, false == no sheet name
+                        std::wstring& callerName )
     {
-        std::string sheet;
-        int col, row;
-        GetCallingSheetColRow( full ? &sheet : NULL, col, row );
-        
-        std::ostringstream ostr;
+        CallerContext& rCtx = CallerContext::Factory();
+        if (!rCtx.FromCell()) {
+            callerName = rCtx.Sheet(); // the explanation
+            return;
+        }
+
+        callerName.clear();
         if (full) {
-            ostr << sheet << "!";
+            callerName = rCtx.Sheet();
+            callerName += L"!";
         }
 
+        wchar_t cell[32];
         if (R1C1) {
-            ostr << "R" << (row + 1) << "C" << (col + 1);
+            swprintf(cell, NELEMS(cell), L"R%dC%d", rCtx.Row() + 1, rCtx.Col() + 1);
         } else {
-            std:: string colText;
-            ConvertColnumToText( col, colText );
-            ostr << colText << row + 1;
+            std::string colText;
+            ConvertColnumToText( rCtx.Col(), colText );
+            swprintf(cell, NELEMS(cell), L"%S%d", colText.c_str(), rCtx.Row() + 1);
         }
-
-        rCallerName = ostr.str();
+        callerName += cell;
     }
 
     //////////////////////////////////////////////////////////////////////////////
 
-    PyObject* 
+    PyObject*
     AssembleCallerNamePyObj( bool R1C1,      // true = R1C1, false = A1
                              bool full )     //true = sheet name prepended, false == no sheet name
-    {    
-        std::string callerName;
+    {
+        std::wstring callerName;
         AssembleCallerName(R1C1, full, callerName);
-
-#if PY_MAJOR_VERSION < 3
-        return PyString_FromString(callerName.c_str());
-#else 
-        return PyUnicode_FromString(callerName.c_str());
-#endif
+        return WideToPyString(callerName);
     }
 
     //////////////////////////////////////////////////////////////////////////////
 
 } // namespace
 
-static PyObject* 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Called by PyCall before it calls into Python
+
+void
+ResetCallerContext()
+{
+    CallerContext::Factory().Reset();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// What pyinex.CallerA1Full() returns, for PyCall's own use
+
+void
+CallerA1Full( std::wstring& rName )
+{
+    AssembleCallerName(false, true, rName);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static PyObject*
 pyinex_CallerA1(PyObject *self, PyObject *args)       { return AssembleCallerNamePyObj(false, false); }
 
-static PyObject* 
+static PyObject*
 pyinex_CallerA1Full(PyObject *self, PyObject *args)   { return AssembleCallerNamePyObj(false, true); }
 
-static PyObject* 
+static PyObject*
 pyinex_CallerR1C1(PyObject *self, PyObject *args)     { return AssembleCallerNamePyObj(true, false); }
 
-static PyObject* 
+static PyObject*
 pyinex_CallerR1C1Full(PyObject *self, PyObject *args) { return AssembleCallerNamePyObj(true, true); }
 
-static PyObject* 
-pyinex_CallerSheet(PyObject *self, PyObject *args) 
-{ 
-    std::string sheet;
-    int col, row;
-    GetCallingSheetColRow( &sheet, col, row );
+static PyObject*
+pyinex_CallerSheet(PyObject *self, PyObject *args)    { return WideToPyString(CallerContext::Factory().Sheet()); }
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// pyinex.caller is a single attribute-only object over the same context, so that
+// scripts can write pyinex.caller.row, pyinex.caller.A1Full, and so on. Row and col
+// are 1-based, as in Excel, and None when PyCall wasn't called from a cell.
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+static PyObject*
+caller_row(PyObject *self, void *closure)
+{
+    CallerContext& rCtx = CallerContext::Factory();
+    if (!rCtx.FromCell()) {
+        Py_RETURN_NONE;
+    }
 #if PY_MAJOR_VERSION < 3
-    return PyString_FromString(sheet.c_str());
-#else 
-    return PyUnicode_FromString(sheet.c_str());
+    return PyInt_FromLong(rCtx.Row() + 1);
+#else
+    return PyLong_FromLong(rCtx.Row() + 1);
 #endif
 }
 
+static PyObject*
+caller_col(PyObject *self, void *closure)
+{
+    CallerContext& rCtx = CallerContext::Factory();
+    if (!rCtx.FromCell()) {
+        Py_RETURN_NONE;
+    }
+#if PY_MAJOR_VERSION < 3
+    return PyInt_FromLong(rCtx.Col() + 1);
+#else
+    return PyLong_FromLong(rCtx.Col() + 1);
+#endif
+}
+
+static PyObject*
+caller_fromCell(PyObject *self, void *closure)  { return PyBool_FromLong(CallerContext::Factory().FromCell()); }
+
+static PyObject*
+caller_sheet(PyObject *self, void *closure)     { return WideToPyString(CallerContext::Factory().Sheet()); }
+
+static PyObject*
+caller_A1(PyObject *self, void *closure)        { return AssembleCallerNamePyObj(false, false); }
+
+static PyObject*
+caller_A1Full(PyObject *self, void *closure)    { return AssembleCallerNamePyObj(false, true); }
+
+static PyObject*
+caller_R1C1(PyObject *self, void *closure)      { return AssembleCallerNamePyObj(true, false); }
+
+static PyObject*
+caller_R1C1Full(PyObject *self, void *closure)  { return AssembleCallerNamePyObj(true, true); }
+
+static PyObject*
+caller_repr(PyObject *self)                     { return AssembleCallerNamePyObj(false, true); }
+
+static PyGetSetDef CallerGetSet[] = {
+    {(char*)"row",      caller_row,       NULL, (char*)"Row of the calling cell, from 1", NULL},
+    {(char*)"col",      caller_col,       NULL, (char*)"Column of the calling cell, from 1", NULL},
+    {(char*)"fromCell", caller_fromCell,  NULL, (char*)"False if PyCall was called from a macro or toolbar", NULL},
+    {(char*)"sheet",    caller_sheet,     NULL, (char*)"Sheet name of the calling cell", NULL},
+    {(char*)"A1",       caller_A1,        NULL, (char*)"Calling cell in A1 format", NULL},
+    {(char*)"A1Full",   caller_A1Full,    NULL, (char*)"Calling cell in A1 format with sheet name prepended", NULL},
+    {(char*)"R1C1",     caller_R1C1,      NULL, (char*)"Calling cell in R1C1 format", NULL},
+    {(char*)"R1C1Full", caller_R1C1Full,  NULL, (char*)"Calling cell in R1C1 format with sheet name prepended", NULL},
+    {NULL, NULL, NULL, NULL, NULL} /* Sentinel */
+};
+
+static PyTypeObject CallerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyinex.Caller",            /* tp_name */
+    sizeof(PyObject),           /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    0,                          /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    caller_repr,                /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    "The cell calling the current PyCall", /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    0,                          /* tp_methods */
+    0,                          /* tp_members */
+    CallerGetSet                /* tp_getset */
+};
+
+static void
+AddCallerObject(PyObject* pModule)
+{
+    if (PyType_Ready(&CallerType) < 0) {
+        PyErr_Clear();
+        ERROUT("Couldn't set up the pyinex.caller type");
+        return;
+    }
+
+    PyObject* pCaller = PyObject_New(PyObject, &CallerType);
+    if (!pCaller || PyModule_AddObject(pModule, "caller", pCaller) != 0) {
+        PyErr_Clear();
+        ERROUT("Couldn't add pyinex.caller");
+    }
+}
+
 // This function takes an optional boolean from Python to determine whether or not to clear
 // any observed abort request. True (from Python) = clear the break, and False = don't clear it.
 // This is useful in case one has multiple functions on a sheet that will want to handle a 
@@ -225,6 +556,9 @@ pyinex_CallerSheet(PyObject *self, PyObject *args)
 //
 // The call to Excel has the opposite semantics; the flag is "PreserveBreak," with a true 
 // NOT clearing the break. I find that confusing, so I flipped the meaning for Python users.
+//
+// The no-argument case is the one called in loops, so it skips the argument parsing
+// and reads the cached break flag (see Cancellation.cpp).
 
 static PyObject* 
 pyinex_Break(PyObject *self, PyObject *args) 
@@ -233,7 +567,7 @@ pyinex_Break(PyObject *self, PyObject *args)
     bool bClearBreak = false;
 
     if (PyTuple_Check(args)) {
-        int len = (int)PyObject_Length(args);
+        int len = (int)PyTuple_GET_SIZE(args);
         if (len == 0) {
             // Nothing was passed in; take the default action, which is to NOT clear the break
         } else if (len == 1) {
@@ -254,14 +588,452 @@ pyinex_Break(PyObject *self, PyObject *args)
         }
     }
 
-    XlfOper breakReq;
-    XlfOper preserveBreak(!bClearBreak);   // as noted above, opposite semantics for Excel
-    XlfExcel::Instance().Call(xlAbort, breakReq, 1, (LPXLFOPER) preserveBreak ); 
-    bool bBreak = breakReq.AsBool();
+    bool bBreak = BreakRequested();
+    if (bBreak && bClearBreak) {
+        ClearBreak();
+    }
     
     return PyBool_FromLong( (long)bBreak );
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// pyinex.Timeout(seconds) is a decorator that gives one function its own PyCall 
+// time budget, overriding the global one set with PyTimeout(). It returns a function
+// bound to the budget, which stores it on the decorated function; PyCall looks for it 
+// there.
+
+static PyObject*
+pyinex_ApplyTimeout(PyObject *self, PyObject *args)
+{
+    PyObject* pFunction;
+    if (!PyArg_ParseTuple(args, "O", &pFunction)) {
+        return NULL;
+    }
+
+    if (PyObject_SetAttrString(pFunction, "__pyinex_timeout__", self) != 0) {
+        return NULL;
+    }
+
+    Py_INCREF(pFunction);
+    return pFunction;
+}
+
+static PyMethodDef PyinexApplyTimeoutMethod = 
+    {"Timeout", pyinex_ApplyTimeout, METH_VARARGS, "Sets the PyCall time budget of the decorated function"};
+
+static PyObject*
+pyinex_Timeout(PyObject *self, PyObject *args)
+{
+    double seconds;
+    if (!PyArg_ParseTuple(args, "d", &seconds)) {
+        return NULL;
+    }
+
+    PyObject* pSeconds = PyFloat_FromDouble(seconds);
+    if (!pSeconds) {
+        return NULL;
+    }
+
+    PyObject* pDecorator = PyCFunction_New(&PyinexApplyTimeoutMethod, pSeconds);
+    Py_DECREF(pSeconds);
+    return pDecorator;
+}
+
+// pyinex.Cacheable is a decorator marking a function whose result depends only on
+// its arguments, so PyCall may keep its results in the result cache (see 
+// PyResultCache()). It returns the function itself.
+
+static PyObject*
+pyinex_Cacheable(PyObject *self, PyObject *args)
+{
+    PyObject* pFunction;
+    if (!PyArg_ParseTuple(args, "O", &pFunction)) {
+        return NULL;
+    }
+
+    if (PyObject_SetAttrString(pFunction, "__pyinex_cache__", Py_True) != 0) {
+        return NULL;
+    }
+
+    Py_INCREF(pFunction);
+    return pFunction;
+}
+
+// Returns a dict of "module!function" to the number of times it has run out of time
+static PyObject*
+pyinex_TimeoutCounts(PyObject *self, PyObject *args)
+{
+    std::map<std::string, unsigned long> counts;
+    GetCallTimeoutCounts(counts);
+
+    PyObject* pDict = PyDict_New();
+    std::map<std::string, unsigned long>::const_iterator it;
+    for (it = counts.begin(); pDict && it != counts.end(); ++it) {
+        PyObject* pCount = PyLong_FromUnsignedLong(it->second);
+        if (!pCount || PyDict_SetItemString(pDict, (char*)it->first.c_str(), pCount) != 0) {
+            Py_XDECREF(pCount);
+            Py_DECREF(pDict);
+            return NULL;
+        }
+        Py_DECREF(pCount);
+    }
+    return pDict;
+}
+
+// Returns a dict of garbage collection statistics; see CalcCycle.cpp
+static PyObject*
+pyinex_GCStats(PyObject *self, PyObject *args)
+{
+    GcStatistics stats;
+    GetGcStatistics(stats);
+
+    return Py_BuildValue("{s:O,s:k,s:k,s:k,s:k,s:k,s:k,s:d,s:d,s:d}",
+                         "scheduling",              GcScheduling() ? Py_True : Py_False,
+                         "budget",                  GcAllocationBudget(),
+                         "calculations",            stats.cycles,
+                         "collections",             stats.collections,
+                         "scheduled_collections",   stats.scheduledCollections,
+                         "budget_collections",      stats.budgetCollections,
+                         "mid_calc_collections",    stats.midCalcCollections,
+                         "total_pause_ms",          stats.totalPauseMs,
+                         "max_pause_ms",            stats.maxPauseMs,
+                         "last_pause_ms",           stats.lastPauseMs);
+}
+
+// Returns a dict of the process's memory figures, and the live bytes charged to
+// each module while tracking (see MemoryAccount.cpp)
+static PyObject*
+pyinex_Memory(PyObject *self, PyObject *args)
+{
+    MemoryUsage usage;
+    GetMemoryUsage(usage);
+
+    PyObject* pModules = PyDict_New();
+    std::vector<std::pair<double, std::string> >::const_iterator it;
+    for (it = usage.modules.begin(); pModules && it != usage.modules.end(); ++it) {
+        PyObject* pBytes = PyLong_FromDouble(it->first);
+        if (!pBytes || PyDict_SetItemString(pModules, (char*)it->second.c_str(), pBytes) != 0) {
+            Py_XDECREF(pBytes);
+            Py_DECREF(pModules);
+            return NULL;
+        }
+        Py_DECREF(pBytes);
+    }
+    if (!pModules) {
+        return NULL;
+    }
+
+    double processMB, moduleMB;
+    bool bCollect;
+    GetMemoryLimits(processMB, moduleMB, bCollect);
+
+    return Py_BuildValue("{s:O,s:d,s:d,s:d,s:d,s:N,s:d,s:d,s:O}",
+                         "tracking",                MemoryTrackingActive() ? Py_True : Py_False,
+                         "private_bytes",           usage.privateBytes,
+                         "address_space_bytes",     usage.addressSpaceBytes,
+                         "address_space_free_bytes", usage.addressSpaceFreeBytes,
+                         "tracked_bytes",           usage.trackedBytes,
+                         "modules",                 pModules,
+                         "process_limit_mb",        processMB,
+                         "module_limit_mb",         moduleMB,
+                         "collect",                 bCollect ? Py_True : Py_False);
+}
+
+// on_calc_start(fn) and on_calc_end(fn) register fn to be called as each recalc
+// starts or ends (see CalcCycle.cpp). Both return fn, so they can be used as decorators.
+static PyObject*
+AddCalcHookFromArgs(PyObject *args, bool bStart)
+{
+    PyObject* pFunction;
+    if (!PyArg_ParseTuple(args, "O", &pFunction)) {
+        return NULL;
+    }
+
+    if (!PyCallable_Check(pFunction)) {
+        PyErr_SetString(PyExc_TypeError, "calculation hook must be callable");
+        return NULL;
+    }
+
+    AddCalcHook(bStart, pFunction);
+    Py_INCREF(pFunction);
+    return pFunction;
+}
+
+static PyObject*
+pyinex_OnCalcStart(PyObject *self, PyObject *args)
+{
+    return AddCalcHookFromArgs(args, true);
+}
+
+static PyObject*
+pyinex_OnCalcEnd(PyObject *self, PyObject *args)
+{
+    return AddCalcHookFromArgs(args, false);
+}
+
+// profile_start(hz=100, cells=True) starts the sampling profiler (see Profiler.cpp),
+// throwing away any earlier samples
+static PyObject*
+pyinex_ProfileStart(PyObject *self, PyObject *args)
+{
+    double hz = 100.0;
+    int cells = 1;
+    if (!PyArg_ParseTuple(args, "|di", &hz, &cells)) {
+        return NULL;
+    }
+
+    if (hz <= 0.0) {
+        PyErr_SetString(PyExc_ValueError, "sampling rate must be greater than zero");
+        return NULL;
+    }
+
+    if (!StartProfiler(hz, cells != 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "couldn't start the profiler");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+// profile_stop(path=None) stops it, and returns a dict of collapsed stack to seconds.
+// Given a path, it also writes them there, one "stack microseconds" line each.
+static PyObject*
+pyinex_ProfileStop(PyObject *self, PyObject *args)
+{
+    const char* pPath = NULL;
+    if (!PyArg_ParseTuple(args, "|z", &pPath)) {
+        return NULL;
+    }
+
+    StopProfiler();
+
+    if (pPath && *pPath) {
+#if PY_MAJOR_VERSION < 3
+        UINT codePage = CP_ACP;
+#else
+        UINT codePage = CP_UTF8;
+#endif
+        int len = MultiByteToWideChar(codePage, 0, pPath, -1, NULL, 0);
+        std::wstring path(len > 0 ? len : 0, 0);
+        if (len > 0) {
+            MultiByteToWideChar(codePage, 0, pPath, -1, &path[0], len);
+            path.resize(len - 1);
+        }
+        if (!WriteProfile(path)) {
+            PyErr_Format(PyExc_IOError, "couldn't write the profile to %s", pPath);
+            return NULL;
+        }
+    }
+
+    std::vector<std::pair<std::string, double> > stacks;
+    GetProfileStacks(stacks);
+
+    PyObject* pDict = PyDict_New();
+    std::vector<std::pair<std::string, double> >::const_iterator it;
+    for (it = stacks.begin(); pDict && it != stacks.end(); ++it) {
+        PyObject* pSeconds = PyFloat_FromDouble(it->second / 1.0e6);
+        if (!pSeconds || PyDict_SetItemString(pDict, (char*)it->first.c_str(), pSeconds) != 0) {
+            Py_XDECREF(pSeconds);
+            Py_DECREF(pDict);
+            return NULL;
+        }
+        Py_DECREF(pSeconds);
+    }
+    return pDict;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// restoring(name) is true while the named module is being run to be restored from
+// a snapshot (see ModuleSnapshot.cpp); the module skips its expensive setup then,
+// as __pyinex_restore__ will be handed the result.
+
+static PyObject*
+pyinex_Restoring(PyObject *self, PyObject *args)
+{
+    const char* pName;
+    if (!PyArg_ParseTuple(args, "s", &pName)) {
+        return NULL;
+    }
+
+    return PyBool_FromLong( (long)ModuleRestoring(pName) );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// sys.stdout and sys.stderr are replaced with minimal file-like objects whose write()
+// hands the text to the log queue (see LogSink.cpp), so print doesn't wait on the 
+// console. The self object bound to each method is the severity the text is logged
+// under: stdout as pyxOutput, stderr (tracebacks, warnings) as pyxError.
+
+static pyxErrorSeverity
+OutputSeverity(PyObject *self)
+{
+#if PY_MAJOR_VERSION < 3
+    return (pyxErrorSeverity)PyInt_AsLong(self);
+#else
+    return (pyxErrorSeverity)PyLong_AsLong(self);
+#endif
+}
+
+// Returns false with a Python exception set if pText isn't a string
+static bool
+OutputText(pyxErrorSeverity severity, PyObject *pText)
+{
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(pText)) {
+        LogWrite(severity, PyString_AS_STRING(pText), (size_t)PyString_GET_SIZE(pText));
+        return true;
+    }
+#endif
+
+    if (!PyUnicode_Check(pText)) {
+        PyErr_Format(PyExc_TypeError, "write() argument must be str, not %.100s", Py_TYPE(pText)->tp_name);
+        return false;
+    }
+
+    PyObject* pBytes = PyUnicode_AsUTF8String(pText);
+    if (!pBytes) {
+        return false;
+    }
+
+#if PY_MAJOR_VERSION < 3
+    LogWrite(severity, PyString_AS_STRING(pBytes), (size_t)PyString_GET_SIZE(pBytes));
+#else
+    LogWrite(severity, PyBytes_AS_STRING(pBytes), (size_t)PyBytes_GET_SIZE(pBytes));
+#endif
+    Py_DECREF(pBytes);
+    return true;
+}
+
+static PyObject*
+pyinex_OutputWrite(PyObject *self, PyObject *args)
+{
+    PyObject* pText;
+    if (!PyArg_ParseTuple(args, "O", &pText)) {
+        return NULL;
+    }
+
+    if (!OutputText(OutputSeverity(self), pText)) {
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION < 3
+    Py_RETURN_NONE;
+#else
+    return PyLong_FromSsize_t(PyObject_Length(pText)); // io.TextIOBase returns the char count
+#endif
+}
+
+static PyObject*
+pyinex_OutputWriteLines(PyObject *self, PyObject *args)
+{
+    PyObject* pLines;
+    if (!PyArg_ParseTuple(args, "O", &pLines)) {
+        return NULL;
+    }
+
+    PyObject* pIter = PyObject_GetIter(pLines);
+    if (!pIter) {
+        return NULL;
+    }
+
+    pyxErrorSeverity severity = OutputSeverity(self);
+    PyObject* pLine;
+    while ((pLine = PyIter_Next(pIter)) != NULL) {
+        bool rc = OutputText(severity, pLine);
+        Py_DECREF(pLine);
+        if (!rc) {
+            break;
+        }
+    }
+    Py_DECREF(pIter);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// Deliberately doesn't wait for the writer thread; print(..., flush=True) and the
+// interpreter's own flushes at exit would otherwise put the console wait back
+static PyObject*
+pyinex_OutputFlush(PyObject *self, PyObject *args)
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pyinex_OutputIsATTY(PyObject *self, PyObject *args)
+{
+    Py_RETURN_FALSE;
+}
+
+// There's no descriptor behind the queue. Raise what io.StringIO does, so code
+// that probes for one (faulthandler, subprocess, colour libraries) falls back.
+static PyObject*
+pyinex_OutputFileNo(PyObject *self, PyObject *args)
+{
+    PyObject* pIo = PyImport_ImportModule("io");
+    PyObject* pUnsupported = pIo ? PyObject_GetAttrString(pIo, "UnsupportedOperation") : NULL;
+    Py_XDECREF(pIo);
+    if (!pUnsupported) {
+        // Python 2.5 has no io module
+        PyErr_Clear();
+        pUnsupported = PyExc_IOError;
+        Py_INCREF(pUnsupported);
+    }
+
+    PyErr_SetString(pUnsupported, "fileno");
+    Py_DECREF(pUnsupported);
+    return NULL;
+}
+
+static PyMethodDef PyinexOutputMethods[] = {
+    {"write",          pyinex_OutputWrite,      METH_VARARGS, "Queues text for the Pyinex console"},
+    {"writelines",     pyinex_OutputWriteLines, METH_VARARGS, "Queues each string of an iterable for the Pyinex console"},
+    {"flush",          pyinex_OutputFlush,      METH_VARARGS, "Does nothing; the console is written in the background"},
+    {"isatty",         pyinex_OutputIsATTY,     METH_VARARGS, "Returns False; output goes through a queue, not a terminal"},
+    {"fileno",         pyinex_OutputFileNo,     METH_VARARGS, "Raises io.UnsupportedOperation; there is no file descriptor"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+// A module object is the simplest attribute holder that works unchanged from 2.5 to 3.x
+static void
+RedirectOutputStream(const char* name, pyxErrorSeverity severity)
+{
+    std::string streamName("pyinex.");
+    streamName += name;
+    PyObject* pStream = PyModule_New((char*)streamName.c_str());
+#if PY_MAJOR_VERSION < 3
+    PyObject* pSelf = PyInt_FromLong((long)severity);
+    PyObject* pEncoding = PyString_FromString("utf-8");
+#else
+    PyObject* pSelf = PyLong_FromLong((long)severity);
+    PyObject* pEncoding = PyUnicode_FromString("utf-8");
+#endif
+
+    bool rc = (pStream && pSelf && pEncoding);
+    for (PyMethodDef* pDef = PyinexOutputMethods; rc && pDef->ml_name; ++pDef) {
+        PyObject* pMethod = PyCFunction_New(pDef, pSelf);
+        rc = pMethod && (PyObject_SetAttrString(pStream, (char*)pDef->ml_name, pMethod) == 0);
+        Py_XDECREF(pMethod);
+    }
+    rc = rc && (PyObject_SetAttrString(pStream, "encoding", pEncoding) == 0);
+    rc = rc && (PySys_SetObject((char*)name, pStream) == 0);
+
+    if (!rc) {
+        PyErr_Clear();
+        ERROUT("Couldn't redirect sys.%s; Python output will be written synchronously", name);
+    }
+
+    Py_XDECREF(pEncoding);
+    Py_XDECREF(pSelf);
+    Py_XDECREF(pStream);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 static PyMethodDef PyinexMethods[] = {
@@ -271,6 +1043,16 @@ static PyMethodDef PyinexMethods[] = {
     {"CallerR1C1Full", pyinex_CallerR1C1Full,   METH_VARARGS, "Returns the calling cell in R1C1 format with sheet name prepended"},
     {"CallerSheet",    pyinex_CallerSheet,      METH_VARARGS, "Returns the sheet name of the calling cell"},
     {"Break",          pyinex_Break,            METH_VARARGS, "Returns a boolean indicating whether or not the user has pressed the escape key"},
+    {"Timeout",        pyinex_Timeout,          METH_VARARGS, "Decorator giving a function its own PyCall time budget, in seconds"},
+    {"TimeoutCounts",  pyinex_TimeoutCounts,    METH_VARARGS, "Returns a dict of the number of times each function has exceeded its time budget"},
+    {"Cacheable",      pyinex_Cacheable,        METH_VARARGS, "Decorator letting PyCall keep the function's results in the result cache"},
+    {"GCStats",        pyinex_GCStats,          METH_VARARGS, "Returns a dict of garbage collection counts and pause times"},
+    {"memory",         pyinex_Memory,           METH_VARARGS, "Returns a dict of memory use, by module while tracking is on"},
+    {"on_calc_start",  pyinex_OnCalcStart,      METH_VARARGS, "Registers a function to be called as each recalculation starts"},
+    {"on_calc_end",    pyinex_OnCalcEnd,        METH_VARARGS, "Registers a function to be called as each recalculation ends"},
+    {"profile_start",  pyinex_ProfileStart,     METH_VARARGS, "Starts sampling the Python stack of running PyCalls"},
+    {"profile_stop",   pyinex_ProfileStop,      METH_VARARGS, "Stops sampling, optionally writes collapsed stacks to a file, and returns them"},
+    {"restoring",      pyinex_Restoring,        METH_VARARGS, "Returns True while the named module is being run to be restored from a snapshot"},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
@@ -293,6 +1075,23 @@ PyInit_pyinex(void)
 
     PyObject* pBuiltinDict = PyEval_GetBuiltins();
     int res = PyDict_SetItemString(pBuiltinDict, "pyinex", pModule); 
+
+    // PyModule_AddObject steals a reference; the exception type keeps its own
+    PyObject* pCallTimeout = CallTimeoutException();
+    if (pCallTimeout) {
+        Py_INCREF(pCallTimeout);
+        PyModule_AddObject(pRawModule, "CallTimeout", pCallTimeout);
+    }
+
+    AddCallerObject(pRawModule);
+
+    if (!AddRangeTypes(pRawModule)) {
+        PyErr_Clear();
+        ERROUT("Couldn't add pyinex.Range");
+    }
+
+    RedirectOutputStream("stdout", pyxOutput);
+    RedirectOutputStream("stderr", pyxError);
 }
 
 #else 
@@ -321,6 +1120,28 @@ PyInit_pyinex(void)
 
     PyObject* pBuiltinDict = PyEval_GetBuiltins();
     int res = PyDict_SetItemString(pBuiltinDict, "pyinex", pModule); 
+
+    // PyModule_AddObject steals a reference; the exception type keeps its own
+    PyObject* pCallTimeout = CallTimeoutException();
+    if (pCallTimeout) {
+        Py_INCREF(pCallTimeout);
+        PyModule_AddObject(pModule, "CallTimeout", pCallTimeout);
+    }
+
+    AddCallerObject(pModule);
+
+    if (!AddRangeTypes(pModule)) {
+        PyErr_Clear();
+        ERROUT("Couldn't add pyinex.Range");
+    }
+
+    if (!AddArrowTypes(pModule)) {
+        PyErr_Clear();
+        ERROUT("Couldn't add pyinex.ArrowTable");
+    }
+
+    RedirectOutputStream("stdout", pyxOutput);
+    RedirectOutputStream("stderr", pyxError);
     return pModule;
 }
 
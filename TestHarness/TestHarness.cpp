@@ -44,9 +44,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "stdafx.h"
+#include <process.h>
+#include <algorithm>
+#include <math.h>
+#include <clw/FileConverter.h>
 
 using namespace xlw;
 
+// xlcall.cpp looks up MdCallBack12 in the host executable; MockExcel's XLCALL32.DLL,
+// copied beside us by the post-build step, looks up MdCallBack.
+#pragma comment (linker, "/export:MdCallBack=_MdCallBack@16")
+#pragma comment (linker, "/export:MdCallBack12=_MdCallBack12@16")
+
 // The purpose of this project is to serve as an area for rapid testing of ideas,
 // rather than as a traditional test suite (as the name may imply). Running Excel
 // from the debugger is much slower than testing in a small console application, 
@@ -130,6 +139,538 @@ bool CallPythonFunction( std::wstring& filename, std::string& function )
 
 //////////////////////////////////////////
 
+double ElapsedMs( const LARGE_INTEGER& start, const LARGE_INTEGER& freq )
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return 1000.0 * (double)(now.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
+
+// An XLOPER12 string held in rText, which must outlive it. The XlfOpers PyCall
+// gets are made from these, rather than in XLW's temporary memory, which is freed
+// after every call, as EXCEL_BEGIN frees it.
+void MakeXloper12String( const std::wstring& s, std::vector<wchar_t>& rText, XLOPER12& rX )
+{
+    rText.assign(1, (wchar_t)s.size());
+    rText.insert(rText.end(), s.begin(), s.end());
+    rX.xltype = xltypeStr;
+    rX.val.str = &rText[0];
+}
+
+// xlw only takes its Excel 2007 paths if Excel says it's Excel 2007; see the
+// callbacks below
+bool CheckExcel12()
+{
+    try {
+        if (XlfExcel::Instance().excel12()) {
+            return true;
+        }
+        printf("xlw didn't find Excel 2007 callbacks; is MockExcel's XLCALL32.DLL beside TestHarness.exe?\n");
+    } catch (std::exception& e) {
+        printf("%s\n", e.what());
+    }
+    return false;
+}
+
+//////////////////////////////////////////
+//
+// Times a scalar PyCall - one value in, one out - for a number, a bool and a
+// string: the per-cell conversions, through the CellMatrix path and through the
+// direct XLOPER12 path, and then the whole call, through CallPythonFunction as
+// PyCall makes it. 200,000 iterations is the size of our largest sheets.
+//
+//     TestHarness bench [iterations]
+
+void BenchmarkScalarPath( int iterations )
+{
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    LARGE_INTEGER freq, start;
+    QueryPerformanceFrequency(&freq);
+
+    std::vector<wchar_t> labelText, fileText, functionText;
+    XLOPER12 values[3];
+    values[0].xltype = xltypeNum;
+    values[0].val.num = 42.5;
+    values[1].xltype = xltypeBool;
+    values[1].val.xbool = 1;
+    MakeXloper12String(L"label", labelText, values[2]);
+    CellValue cells[3] = { CellValue(42.5), CellValue(true), CellValue(std::wstring(L"label")) };
+    const char* pNames[3] = { "number", "bool", "string" };
+
+    // PyCall(file, "TestHarnessScalar", value), the other arguments missing
+    XLOPER12 xFile, xFunction, xMissing;
+    MakeXloper12String(L"..\\Examples\\PyinexTest.py", fileText, xFile);
+    MakeXloper12String(L"TestHarnessScalar", functionText, xFunction);
+    xMissing.xltype = xltypeMissing;
+    XlfOper xlFile((LPXLFOPER)&xFile), xlFunction((LPXLFOPER)&xFunction), xlMissing((LPXLFOPER)&xMissing);
+    XlfOper* arrArgs[PYCALL_ARGS];
+    for (int i = 0; i < PYCALL_ARGS; ++i) {
+        arrArgs[i] = &xlMissing;
+    }
+
+    static PyCallResultBuffer buffer;
+    bool bCacheable;
+
+    for (int k = 0; k < 3; ++k) {
+        PyObject* pResult = NULL;
+        if (!ConvertXloper12CellToPyObject(values[k], pResult, NULL)) {
+            PyErr_Print();
+            continue;
+        }
+
+        // Results
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < iterations; ++i) {
+            CellMatrix cm;
+            ConvertPyObjectToCellMatrix(pResult, cm);
+        }
+        double slowResult = ElapsedMs(start, freq);
+
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < iterations; ++i) {
+            ConvertPyScalarToXloper12(pResult, buffer.x, buffer.text, NELEMS(buffer.text));
+        }
+        double fastResult = ElapsedMs(start, freq);
+        Py_DECREF(pResult);
+
+        // Arguments: a 1x1 CellMatrix versus the cell itself
+        PyObject* pValue;
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < iterations; ++i) {
+            CellMatrix cm(1, 1);
+            cm(0, 0) = cells[k];
+            if (ConvertCellMatrixToPyObject(cm, pValue)) {
+                Py_DECREF(pValue);
+            }
+        }
+        double slowArgument = ElapsedMs(start, freq);
+
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < iterations; ++i) {
+            if (ConvertXloper12CellToPyObject(values[k], pValue, NULL)) {
+                Py_DECREF(pValue);
+            }
+        }
+        double fastArgument = ElapsedMs(start, freq);
+
+        // The whole call, once first to import the module
+        XlfOper xlValue((LPXLFOPER)&values[k]);
+        arrArgs[0] = &xlValue;
+        CallPythonFunction(xlFile, xlFunction, arrArgs, false, buffer, bCacheable);
+        XlfExcel::Instance().FreeMemory();
+
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < iterations; ++i) {
+            CallPythonFunction(xlFile, xlFunction, arrArgs, false, buffer, bCacheable);
+            XlfExcel::Instance().FreeMemory();
+        }
+        double call = ElapsedMs(start, freq);
+        arrArgs[0] = &xlMissing;
+
+        printf("%s x %d: result CellMatrix %.1f ms, XLOPER12 %.1f ms; argument CellMatrix %.1f ms, XLOPER12 %.1f ms; "
+               "whole call %.1f ms (%.2f us per call)\n", pNames[k], iterations, slowResult, fastResult,
+               slowArgument, fastArgument, call, 1000.0 * call / iterations);
+    }
+}
+
+//////////////////////////////////////////
+//
+// Checks that a call which overruns its time budget comes back as #NUM!, which
+// nothing else returns, and soon after the budget runs out; and that a call within
+// its budget is unaffected. Returns the number of failed checks.
+//
+//     TestHarness timeout
+
+int TestCallTimeout()
+{
+    LARGE_INTEGER freq, start;
+    QueryPerformanceFrequency(&freq);
+
+    // PyCall(file, "TestHarnessSpin", seconds), the other arguments missing
+    std::vector<wchar_t> fileText, functionText;
+    XLOPER12 xFile, xFunction, xMissing, xSeconds;
+    MakeXloper12String(L"..\\Examples\\PyinexTest.py", fileText, xFile);
+    MakeXloper12String(L"TestHarnessSpin", functionText, xFunction);
+    xMissing.xltype = xltypeMissing;
+    xSeconds.xltype = xltypeNum;
+    XlfOper xlFile((LPXLFOPER)&xFile), xlFunction((LPXLFOPER)&xFunction), xlMissing((LPXLFOPER)&xMissing);
+    XlfOper xlSeconds((LPXLFOPER)&xSeconds);
+    XlfOper* arrArgs[PYCALL_ARGS];
+    arrArgs[0] = &xlSeconds;
+    for (int i = 1; i < PYCALL_ARGS; ++i) {
+        arrArgs[i] = &xlMissing;
+    }
+
+    static PyCallResultBuffer buffer;
+    bool bCacheable;
+    int failures = 0;
+    double budget = CallTimeoutSeconds();
+    SetCallTimeout(0.25);
+
+    // Spins for 10 s under a quarter-second budget
+    xSeconds.val.num = 10.0;
+    QueryPerformanceCounter(&start);
+    XlfOper result = CallPythonFunction(xlFile, xlFunction, arrArgs, false, buffer, bCacheable);
+    double elapsedMs = ElapsedMs(start, freq);
+    const xloper12& x = *(const xloper12*)result.GetLPXLFOPER();
+    if (!(x.xltype & xltypeErr) || x.val.err != xlerrNum) {
+        printf("FAIL: an overrunning call returned type %d, not #NUM!\n", x.xltype);
+        ++failures;
+    } else if (elapsedMs > 2000.0) {
+        printf("FAIL: an overrunning call took %.0f ms to stop under a 250 ms budget\n", elapsedMs);
+        ++failures;
+    } else {
+        printf("ok: an overrunning call returned #NUM! after %.0f ms\n", elapsedMs);
+    }
+    XlfExcel::Instance().FreeMemory();
+
+    // Returns at once, well within it
+    xSeconds.val.num = 0.0;
+    result = CallPythonFunction(xlFile, xlFunction, arrArgs, false, buffer, bCacheable);
+    const xloper12& y = *(const xloper12*)result.GetLPXLFOPER();
+    if (!(y.xltype & xltypeNum) || y.val.num != 0.0) {
+        printf("FAIL: a call within its budget returned type %d, not its value\n", y.xltype);
+        ++failures;
+    } else {
+        printf("ok: a call within its budget returned its value\n");
+    }
+    XlfExcel::Instance().FreeMemory();
+
+    SetCallTimeout(budget);
+    return failures;
+}
+
+//////////////////////////////////////////
+//
+// Checks the behaviour of our modified xlw ArgumentList and clw file parser that
+// differs from XLW 4.0 as supplied: argument names are case insensitive, so two
+// that differ only in case are the same name; input whose blocks overlap is
+// rejected; and in a clw file, negative numbers and exponents are numbers, an
+// empty token is an empty cell, and carriage returns are dropped. Returns the
+// number of failed checks.
+//
+//     TestHarness arglist
+
+int ArgumentListCheck( bool bPassed, const char* pWhat )
+{
+    printf("%s: %s\n", bPassed ? "ok" : "FAIL", pWhat);
+    return bPassed ? 0 : 1;
+}
+
+bool ArgumentListThrows( const CellMatrix& cells )
+{
+    try {
+        ArgumentList args(cells, "TestHarness");
+    } catch (...) {
+        return true;
+    }
+    return false;
+}
+
+int TestArgumentList()
+{
+    int failures = 0;
+
+    // Names added directly
+    {
+        ArgumentList args("s");
+        args.add("Foo", 1.0);
+        bool bFound = false;
+        try {
+            bFound = args.GetDoubleArgumentValue("FOO") == 1.0;
+        } catch (...) {
+        }
+        failures += ArgumentListCheck(bFound, "a name is found whatever its case");
+
+        bool bThrew = false;
+        try {
+            args.add("foo", 2.0);
+        } catch (...) {
+            bThrew = true;
+        }
+        failures += ArgumentListCheck(bThrew, "adding a name that differs only in case throws");
+    }
+
+    // The same, parsed
+    {
+        CellMatrix cells(3, 2);
+        cells(0, 0) = std::string("s");
+        cells(1, 0) = std::string("Foo");
+        cells(1, 1) = std::string("foo");
+        cells(2, 0) = 1.0;
+        cells(2, 1) = 2.0;
+        failures += ArgumentListCheck(ArgumentListThrows(cells), "parsing two names that differ only in case throws");
+    }
+
+    // m is a 1x1 matrix, so its column count sits where x's array size would be
+    {
+        CellMatrix cells(5, 2);
+        cells(0, 0) = std::string("s");
+        cells(1, 0) = std::string("m");
+        cells(1, 1) = std::string("x");
+        cells(2, 0) = std::string("matrix");
+        cells(2, 1) = std::string("array");
+        cells(3, 0) = 1.0;
+        cells(3, 1) = 1.0;
+        cells(4, 0) = 5.0;
+        cells(4, 1) = 7.0;
+        failures += ArgumentListCheck(ArgumentListThrows(cells), "overlapping arguments throw");
+    }
+
+    // a and b are numbers; c is 1x2 cells, an empty one and a word
+    {
+        const char* pFile = "s\r\na,b,c\r\n-1.5,2e3,cells\r\n,,1,2\r\n,,,word\r\n";
+        std::vector<char> file(pFile, pFile + strlen(pFile));
+        bool bParsed = false, bNumbers = false, bEmpty = false, bNoCR = false;
+        try {
+            std::vector<ArgumentList> lists(clw::FileConversion(file, 1));
+            bParsed = lists.size() == 1;
+            if (bParsed) {
+                bNumbers = lists[0].GetDoubleArgumentValue("a") == -1.5 &&
+                           lists[0].GetDoubleArgumentValue("b") == 2000.0;
+                CellMatrix c(lists[0].GetCellsArgumentValue("c"));
+                bEmpty = c.RowsInStructure() == 1 && c.ColumnsInStructure() == 2 && c(0, 0).IsEmpty();
+                bNoCR = c(0, 1).IsAString() && c(0, 1).StringValue() == "word";
+            }
+        } catch (...) {
+        }
+        failures += ArgumentListCheck(bParsed, "a clw file with CRLF line ends parses");
+        failures += ArgumentListCheck(bNumbers, "negative numbers and exponents are numbers");
+        failures += ArgumentListCheck(bEmpty, "an empty token is an empty cell");
+        failures += ArgumentListCheck(bNoCR, "carriage returns are dropped");
+    }
+
+    return failures;
+}
+
+//////////////////////////////////////////
+//
+// Replays a trace recorded by PyTrace() (see Utils/CallTrace.cpp): every call is
+// made again through CallPythonFunction, as PyCall makes it, on this thread or on
+// several. Reports throughput, latency percentiles per function, the time spent
+// converting arguments and results, and results that differ from the recorded
+// ones as Excel would show them.
+//
+//     TestHarness replay tracefile [threads] [passes]
+//
+// PyCall isn't registered thread-safe, and the state a call keeps outside Python -
+// cancellation and time budgets, the profiler's call, the memory tag, PyCallRef's
+// range generation, XLW's temporary memory - is calc-thread-only. The GIL doesn't
+// cover it, since Python hands the GIL over in the middle of a call. So with
+// several threads, each call is made whole under the run's call lock: the threads
+// take turns a call at a time, as Excel's would if it called PyCall from more than
+// one, and what they add to the timings is the cost of handing over the lock and
+// the GIL between threads.
+
+enum ReplayOutcome { replayMatch, replayDiffers, replayFailed };
+
+// A traced call's file and function names, as the XLOPER12 strings PyCall gets
+struct ReplayTarget
+{
+    std::vector<wchar_t>    fileText;
+    std::vector<wchar_t>    functionText;
+    XLOPER12                xFile;
+    XLOPER12                xFunction;
+};
+
+struct ReplayRun
+{
+    const std::vector<TracedCall*>* pCalls;
+    std::vector<ReplayTarget>       targets;    // one per traced call
+    std::vector<double>             latencyMs;  // one per replayed call
+    std::vector<double>             argumentsUs;
+    std::vector<double>             resultUs;
+    std::vector<int>                outcomes;
+    volatile LONG                   next;       // next slot to replay
+    LARGE_INTEGER                   freq;
+    PyCallResultBuffer              buffer;
+    CRITICAL_SECTION                callLock;   // held for a whole call; see above
+};
+
+// Caller holds the GIL, and with several threads, the call lock before it
+int ReplayTracedCall( ReplayRun& run, size_t slot )
+{
+    const TracedCall& call = *(*run.pCalls)[slot % run.pCalls->size()];
+    ReplayTarget& target = run.targets[slot % run.pCalls->size()];
+
+    // Arguments past those recorded are missing, as Excel passes them
+    XLOPER12 xMissing;
+    xMissing.xltype = xltypeMissing;
+    XlfOper xlMissing((LPXLFOPER)&xMissing);
+    std::vector<XlfOper> xlArgs;
+    xlArgs.reserve(call.args.size());
+    XlfOper* arrArgs[PYCALL_ARGS];
+    for (int i = 0; i < PYCALL_ARGS; ++i) {
+        if (i < (int)call.args.size()) {
+            xlArgs.push_back(XlfOper((LPXLFOPER)call.args[i]));
+            arrArgs[i] = &xlArgs.back();
+        } else {
+            arrArgs[i] = &xlMissing;
+        }
+    }
+    XlfOper xlFile((LPXLFOPER)&target.xFile), xlFunction((LPXLFOPER)&target.xFunction);
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    bool bCacheable;
+    PyCallStages stages;
+    XlfOper result = CallPythonFunction(xlFile, xlFunction, arrArgs, call.bRangeArgs, run.buffer, bCacheable, &stages);
+    run.latencyMs[slot] = ElapsedMs(start, run.freq);
+    run.argumentsUs[slot] = stages.argumentsUs;
+    run.resultUs[slot] = stages.resultUs;
+
+    // A call that failed shows as an error, which the recording may also have
+    const xloper12& x = *(const xloper12*)result.GetLPXLFOPER();
+    int outcome = replayMatch;
+    if (!SameTracedResult(x, *call.pResult)) {
+        outcome = (x.xltype & xltypeErr) ? replayFailed : replayDiffers;
+    }
+
+    // XLW's temporary memory - the names' conversions, CellMatrix and table results
+    XlfExcel::Instance().FreeMemory();
+    return outcome;
+}
+
+unsigned __stdcall ReplayThreadMain( void* pArg )
+{
+    ReplayRun& run = *(ReplayRun*)pArg;
+    LONG total = (LONG)run.outcomes.size();
+
+    // The call lock is taken before the GIL, so that a thread waiting for it
+    // never holds the GIL that the calling thread needs back
+    for (LONG slot = InterlockedIncrement(&run.next) - 1; slot < total; slot = InterlockedIncrement(&run.next) - 1) {
+        EnterCriticalSection(&run.callLock);
+        PyGILState_STATE gil = PyGILState_Ensure();
+        run.outcomes[slot] = ReplayTracedCall(run, slot);
+        PyGILState_Release(gil);
+        LeaveCriticalSection(&run.callLock);
+    }
+
+    return 0;
+}
+
+double Percentile( std::vector<double>& sorted, double p )
+{
+    size_t rank = (size_t)ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+int ReplayCallTrace( const std::wstring& filename, int threads, int passes )
+{
+    std::vector<TracedCall*> calls;
+    if (!LoadCallTrace(filename, calls) || calls.empty()) {
+        printf("No calls to replay\n");
+        return 1;
+    }
+
+    if (passes < 1) {
+        passes = 1;
+    }
+
+    ReplayRun run;
+    run.pCalls = &calls;
+    run.targets.resize(calls.size());
+    run.latencyMs.assign(calls.size() * passes, 0.0);
+    run.argumentsUs.assign(calls.size() * passes, 0.0);
+    run.resultUs.assign(calls.size() * passes, 0.0);
+    run.outcomes.assign(calls.size() * passes, replayFailed);
+    run.next = 0;
+    InitializeCriticalSection(&run.callLock);
+    QueryPerformanceFrequency(&run.freq);
+
+    // Load every module once before the clock starts; imports aren't what's being measured
+    for (size_t i = 0; i < calls.size(); ++i) {
+        ReplayTarget& target = run.targets[i];
+        MakeXloper12String(calls[i]->filename, target.fileText, target.xFile);
+        MakeXloper12String(std::wstring(calls[i]->function.begin(), calls[i]->function.end()),
+                           target.functionText, target.xFunction);
+
+        PyObject* pModule = NULL, *pFunction = NULL;
+        if (GetPyModuleAndFunctionObjects(calls[i]->filename, calls[i]->function, pModule, pFunction)) {
+            Py_DECREF(pFunction);
+        }
+    }
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    if (threads <= 1) {
+        threads = 1;
+        for (size_t slot = 0; slot < run.outcomes.size(); ++slot) {
+            run.outcomes[slot] = ReplayTracedCall(run, slot);
+        }
+    } else {
+        PyThreadState* pSave = PyEval_SaveThread();
+        std::vector<HANDLE> handles;
+        for (int i = 0; i < threads; ++i) {
+            HANDLE h = (HANDLE)_beginthreadex(NULL, 0, ReplayThreadMain, &run, 0, NULL);
+            if (h) {
+                handles.push_back(h);
+            }
+        }
+        for (size_t i = 0; i < handles.size(); ++i) {
+            WaitForSingleObject(handles[i], INFINITE);
+            CloseHandle(handles[i]);
+        }
+        PyEval_RestoreThread(pSave);
+    }
+    double wallMs = ElapsedMs(start, run.freq);
+    DeleteCriticalSection(&run.callLock);
+
+    // Per function, in the order functions first appear in the trace
+    std::vector<std::string> order;
+    std::map<std::string, std::vector<double> > latencies, recorded, arguments, results;
+    std::map<std::string, std::vector<unsigned long> > counts;
+    for (size_t slot = 0; slot < run.outcomes.size(); ++slot) {
+        const TracedCall& call = *calls[slot % calls.size()];
+        std::string name = WcharToASCIIRepr(call.filename) + "!" + call.function;
+        if (counts.find(name) == counts.end()) {
+            order.push_back(name);
+            counts[name].assign(3, 0);
+        }
+        latencies[name].push_back(run.latencyMs[slot]);
+        arguments[name].push_back(run.argumentsUs[slot]);
+        results[name].push_back(run.resultUs[slot]);
+        if (slot < calls.size()) {
+            recorded[name].push_back(call.elapsedSeconds * 1000.0);
+        }
+        ++counts[name][run.outcomes[slot]];
+    }
+
+    size_t total = run.outcomes.size();
+    printf("Replayed %lu calls (%lu x %d) on %d thread%s in %.1f ms: %.0f calls/s\n",
+           (unsigned long)total, (unsigned long)calls.size(), passes, threads, threads == 1 ? "" : "s",
+           wallMs, wallMs > 0 ? 1000.0 * total / wallMs : 0.0);
+    printf("%-40s %8s %10s %10s %10s %12s %10s %10s %7s %7s %7s\n", "function", "calls", "p50 us", "p90 us", "p99 us",
+           "recorded us", "args us", "result us", "match", "differ", "failed");
+
+    unsigned long differs = 0, failed = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        std::vector<double>& lat = latencies[order[i]];
+        std::vector<double>& rec = recorded[order[i]];
+        std::vector<double>& arg = arguments[order[i]];
+        std::vector<double>& res = results[order[i]];
+        std::vector<unsigned long>& n = counts[order[i]];
+        std::sort(lat.begin(), lat.end());
+        std::sort(rec.begin(), rec.end());
+        std::sort(arg.begin(), arg.end());
+        std::sort(res.begin(), res.end());
+        printf("%-40s %8lu %10.1f %10.1f %10.1f %12.1f %10.1f %10.1f %7lu %7lu %7lu\n", order[i].c_str(),
+               (unsigned long)lat.size(), 1000.0 * Percentile(lat, 0.50), 1000.0 * Percentile(lat, 0.90),
+               1000.0 * Percentile(lat, 0.99), 1000.0 * Percentile(rec, 0.50), Percentile(arg, 0.50),
+               Percentile(res, 0.50), n[replayMatch], n[replayDiffers], n[replayFailed]);
+        differs += n[replayDiffers];
+        failed += n[replayFailed];
+    }
+
+    FreeCallTrace(calls);
+    return (differs || failed) ? 1 : 0;
+}
+
+//////////////////////////////////////////
+
 static PyObject *
 pyinex_Thousand(PyObject *self, PyObject *args)
 {
@@ -191,6 +732,41 @@ PyInit_pyinex(void)
 
 #endif
 
+//////////////////////////////////////////
+//
+// Just enough of Excel for XlfExcel::InitLibrary to decide it's talking to Excel
+// 2007: the workspace version, and coercing it to an integer. MockExcel.exe
+// answers the full set; see MockExcel.cpp.
+
+extern "C" int __stdcall
+MdCallBack12( int xlfn, int count, LPXLOPER12* args, LPXLOPER12 pRes )
+{
+    return (xlfn == xlFree) ? xlretSuccess : xlretFailed;
+}
+
+extern "C" int __stdcall
+MdCallBack( int xlfn, int count, LPXLOPER* args, LPXLOPER pRes )
+{
+    switch (xlfn) {
+        case xlFree:
+            return xlretSuccess;
+
+        case xlfGetWorkspace:
+            pRes->xltype = xltypeNum;
+            pRes->val.num = 12.0;
+            return xlretSuccess;
+
+        case xlCoerce:
+            if (count == 2 && args[0]->xltype == xltypeNum) {
+                pRes->xltype = xltypeInt;
+                pRes->val.w = (short) args[0]->val.num;
+                return xlretSuccess;
+            }
+            break;
+    }
+    return xlretFailed;
+}
+
 //////////////////////////////////////////
 
 int _tmain(int argc, _TCHAR* argv[])
@@ -209,6 +785,41 @@ int _tmain(int argc, _TCHAR* argv[])
 
     PyImport_ImportModule("pyinex");
 
+    if (argc > 2 && _tcsicmp(argv[1], _T("replay")) == 0) {
+#ifdef _UNICODE
+        std::wstring traceFile(argv[2]);
+#else
+        wchar_t wideFile[MAX_PATH];
+        MultiByteToWideChar(CP_ACP, 0, argv[2], -1, wideFile, MAX_PATH);
+        std::wstring traceFile(wideFile);
+#endif
+        PyEval_InitThreads();
+        int rcReplay = CheckExcel12() ? ReplayCallTrace(traceFile, argc > 3 ? _ttoi(argv[3]) : 1, argc > 4 ? _ttoi(argv[4]) : 1) : 1;
+        Py_Finalize();
+        return rcReplay;
+    }
+
+    if (argc > 1 && _tcsicmp(argv[1], _T("arglist")) == 0) {
+        int rcArgs = TestArgumentList();
+        Py_Finalize();
+        return rcArgs ? 1 : 0;
+    }
+
+    if (argc > 1 && _tcsicmp(argv[1], _T("timeout")) == 0) {
+        int rcTimeout = CheckExcel12() ? TestCallTimeout() : 1;
+        Py_Finalize();
+        return rcTimeout ? 1 : 0;
+    }
+
+    if (argc > 1 && _tcsicmp(argv[1], _T("bench")) == 0) {
+        int rcBench = CheckExcel12() ? 0 : 1;
+        if (rcBench == 0) {
+            BenchmarkScalarPath(argc > 2 ? _ttoi(argv[2]) : 200000);
+        }
+        Py_Finalize();
+        return rcBench;
+    }
+
     int n;
     while(true) {
         rc = CallPythonFunction( std::wstring(L"..\\Examples\\PyinexTest.py"), std::string("TestHarnessFunc") );
@@ -0,0 +1,888 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <float.h>
+
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Arrow C Data Interface bridge.
+//
+// The Arrow C Data Interface (https://arrow.apache.org/docs/format/CDataInterface.html)
+// is a pair of plain C structs - ArrowSchema and ArrowArray - describing columns of
+// typed buffers. Any Arrow implementation can take them over without copying, and
+// none needs to be linked in here: the structs are declared below, and Python
+// libraries find them through the PyCapsule protocol (__arrow_c_array__ and
+// __arrow_c_stream__), which pyarrow 14+, polars, and pandas 2.2+ all understand.
+//
+// Arguments: a PyCall argument annotated as pyinex.ArrowTable (or pyarrow.Table;
+// see MarshalPlan.cpp) is exported straight from Excel's cells into Arrow buffers.
+// The first row is the column names. Each column's type follows its contents:
+// float64 for numbers, bool for TRUE/FALSE, utf8 if any cell is text (other cells
+// written as text), with empty cells and errors as nulls in a validity bitmap.
+// A pyinex.ArrowTable hands its buffers over once, to whatever asks first:
+//
+//     def stats(t: pyinex.ArrowTable):
+//         df = polars.from_arrow(pyarrow.record_batch(t))
+//
+// Results: anything with __arrow_c_array__ or __arrow_c_stream__ and no to_dict()
+// (pyarrow tables, record batches and arrays) is read column by column from its
+// Arrow buffers into a header row and body, without building Python objects.
+// Dates and timestamps become Excel date serial numbers, and a null row of a
+// struct - a whole row of a table - is empty in every column. Polars and pandas
+// frames have to_dict(), so they take the table path (TableResult.cpp) instead,
+// which keeps pandas' index handling predictable.
+//
+// Capsules need Python 3.1 or later (and annotations Python 3), so under Python 2
+// none of this is available. Excel 2007 and later only.
+
+#if PY_MAJOR_VERSION >= 3
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char* format;
+    const char* name;
+    const char* metadata;
+    __int64 flags;
+    __int64 n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+};
+
+struct ArrowArray {
+    __int64 length;
+    __int64 null_count;
+    __int64 offset;
+    __int64 n_buffers;
+    __int64 n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+    int (*get_schema)(struct ArrowArrayStream*, struct ArrowSchema* out);
+    int (*get_next)(struct ArrowArrayStream*, struct ArrowArray* out);
+    const char* (*get_last_error)(struct ArrowArrayStream*);
+    void (*release)(struct ArrowArrayStream*);
+    void* private_data;
+};
+
+#endif  // ARROW_C_STREAM_INTERFACE
+
+namespace {
+
+    const double EXCEL_EPOCH_DAYS = 25569.0;   // 1970-01-01 as an Excel date serial
+    const long MAX_ROWS = 1048576;
+    const long MAX_COLS = 16384;
+
+    XCHAR g_emptyText[1] = { 0 };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Export: each schema and array node owns its own memory, as the interface
+    // requires, since a consumer may move a child out and release it separately.
+
+    struct SchemaNode
+    {
+        std::string                 name;
+        std::vector<ArrowSchema*>   children;
+    };
+
+    void
+    ReleaseSchema( ArrowSchema* pSchema )
+    {
+        SchemaNode* pNode = (SchemaNode*)pSchema->private_data;
+        for (size_t i = 0; i < pNode->children.size(); ++i) {
+            ArrowSchema* pChild = pNode->children[i];
+            if (pChild->release) {
+                pChild->release(pChild);
+            }
+            delete pChild;
+        }
+        delete pNode;
+        pSchema->release = NULL;
+    }
+
+    struct ArrayNode
+    {
+        std::vector<unsigned char>  validity;
+        std::vector<double>         numbers;
+        std::vector<unsigned char>  bits;       // bool values
+        std::vector<int>            offsets;    // utf8
+        std::string                 text;
+        const void*                 buffers[3];
+        std::vector<ArrowArray*>    children;
+    };
+
+    void
+    ReleaseArray( ArrowArray* pArray )
+    {
+        ArrayNode* pNode = (ArrayNode*)pArray->private_data;
+        for (size_t i = 0; i < pNode->children.size(); ++i) {
+            ArrowArray* pChild = pNode->children[i];
+            if (pChild->release) {
+                pChild->release(pChild);
+            }
+            delete pChild;
+        }
+        delete pNode;
+        pArray->release = NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    AppendUtf8( const wchar_t* pText, size_t len, std::string& rOut )
+    {
+        if (len == 0) {
+            return;
+        }
+        int n = WideCharToMultiByte(CP_UTF8, 0, pText, (int)len, NULL, 0, NULL, NULL);
+        if (n > 0) {
+            size_t at = rOut.size();
+            rOut.resize(at + n);
+            WideCharToMultiByte(CP_UTF8, 0, pText, (int)len, &rOut[at], n, NULL, NULL);
+        }
+    }
+
+    void
+    AppendCellText( const XLOPER12& x, std::string& rOut )
+    {
+        char buf[32];
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeStr:
+                AppendUtf8(x.val.str + 1, (size_t)x.val.str[0], rOut);
+                break;
+            case xltypeNum:
+                _snprintf(buf, NELEMS(buf), "%.15g", x.val.num);
+                buf[NELEMS(buf) - 1] = 0;
+                rOut += buf;
+                break;
+            case xltypeBool:
+                rOut += x.val.xbool ? "TRUE" : "FALSE";
+                break;
+        }
+    }
+
+    inline void
+    SetBit( std::vector<unsigned char>& rBits, long i )
+    {
+        rBits[i >> 3] |= (unsigned char)(1 << (i & 7));
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // One column of the body; rows are counted without the header
+
+    void
+    ExportColumn( const XLOPER12* pCells, long rows, long cols, long col,
+                  ArrowSchema& rSchema, ArrowArray& rArray )
+    {
+        // The type follows the contents
+        long nNum = 0, nBool = 0, nStr = 0;
+        for (long i = 0; i < rows; ++i) {
+            switch (pCells[(i + 1) * cols + col].xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+                case xltypeNum:     ++nNum;     break;
+                case xltypeBool:    ++nBool;    break;
+                case xltypeStr:     ++nStr;     break;
+            }
+        }
+
+        const char* pFormat = "g";      // float64
+        if (nStr > 0) {
+            pFormat = "u";              // utf8
+        } else if (nBool > 0 && nNum == 0) {
+            pFormat = "b";              // bool
+        }
+
+        ArrayNode* pNode = new ArrayNode;
+        // Buffers are never empty, so a zero-row column still has valid pointers
+        pNode->validity.assign(rows / 8 + 1, 0);
+        if (*pFormat == 'g') {
+            pNode->numbers.assign(rows + 1, 0.0);
+        } else if (*pFormat == 'b') {
+            pNode->bits.assign(rows / 8 + 1, 0);
+        } else {
+            pNode->offsets.reserve(rows + 1);
+            pNode->offsets.push_back(0);
+        }
+
+        long nulls = 0;
+        for (long i = 0; i < rows; ++i) {
+            const XLOPER12& x = pCells[(i + 1) * cols + col];
+            int type = x.xltype & ~(xlbitXLFree | xlbitDLLFree);
+            bool bValid = (type == xltypeNum || type == xltypeBool || type == xltypeStr);
+            if (bValid) {
+                SetBit(pNode->validity, i);
+            } else {
+                ++nulls;
+            }
+
+            if (*pFormat == 'g') {
+                if (type == xltypeNum) {
+                    pNode->numbers[i] = x.val.num;
+                } else if (type == xltypeBool) {
+                    pNode->numbers[i] = x.val.xbool ? 1.0 : 0.0;
+                }
+            } else if (*pFormat == 'b') {
+                if (type == xltypeBool && x.val.xbool) {
+                    SetBit(pNode->bits, i);
+                }
+            } else {
+                if (bValid) {
+                    AppendCellText(x, pNode->text);
+                }
+                pNode->offsets.push_back((int)pNode->text.size());
+            }
+        }
+
+        pNode->buffers[0] = nulls ? &pNode->validity[0] : NULL;
+        pNode->buffers[2] = NULL;
+        if (*pFormat == 'g') {
+            pNode->buffers[1] = &pNode->numbers[0];
+        } else if (*pFormat == 'b') {
+            pNode->buffers[1] = &pNode->bits[0];
+        } else {
+            pNode->buffers[1] = &pNode->offsets[0];
+            pNode->buffers[2] = pNode->text.empty() ? "" : pNode->text.data();
+        }
+
+        rArray.length = rows;
+        rArray.null_count = nulls;
+        rArray.offset = 0;
+        rArray.n_buffers = (*pFormat == 'u') ? 3 : 2;
+        rArray.n_children = 0;
+        rArray.buffers = pNode->buffers;
+        rArray.children = NULL;
+        rArray.dictionary = NULL;
+        rArray.release = ReleaseArray;
+        rArray.private_data = pNode;
+
+        // Header cell, or a made-up name
+        SchemaNode* pSchemaNode = new SchemaNode;
+        const XLOPER12& head = pCells[col];
+        if ((head.xltype & ~(xlbitXLFree | xlbitDLLFree)) == xltypeStr && head.val.str[0] > 0) {
+            AppendCellText(head, pSchemaNode->name);
+        } else {
+            char buf[32];
+            _snprintf(buf, NELEMS(buf), "column%ld", col + 1);
+            buf[NELEMS(buf) - 1] = 0;
+            pSchemaNode->name = buf;
+        }
+
+        rSchema.format = pFormat;
+        rSchema.name = pSchemaNode->name.c_str();
+        rSchema.metadata = NULL;
+        rSchema.flags = ARROW_FLAG_NULLABLE;
+        rSchema.n_children = 0;
+        rSchema.children = NULL;
+        rSchema.dictionary = NULL;
+        rSchema.release = ReleaseSchema;
+        rSchema.private_data = pSchemaNode;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The table is a struct array - one child per column - as a record batch is
+
+    void
+    ExportTable( const XLOPER12* pCells, long rows, long cols, ArrowSchema& rSchema, ArrowArray& rArray )
+    {
+        long bodyRows = rows - 1;
+
+        SchemaNode* pSchemaNode = new SchemaNode;
+        ArrayNode* pArrayNode = new ArrayNode;
+        for (long j = 0; j < cols; ++j) {
+            ArrowSchema* pChildSchema = new ArrowSchema;
+            ArrowArray* pChildArray = new ArrowArray;
+            ExportColumn(pCells, bodyRows, cols, j, *pChildSchema, *pChildArray);
+            pSchemaNode->children.push_back(pChildSchema);
+            pArrayNode->children.push_back(pChildArray);
+        }
+
+        rSchema.format = "+s";
+        rSchema.name = "";
+        rSchema.metadata = NULL;
+        rSchema.flags = 0;
+        rSchema.n_children = cols;
+        rSchema.children = &pSchemaNode->children[0];
+        rSchema.dictionary = NULL;
+        rSchema.release = ReleaseSchema;
+        rSchema.private_data = pSchemaNode;
+
+        pArrayNode->buffers[0] = NULL;  // no nulls at the top level
+        rArray.length = bodyRows;
+        rArray.null_count = 0;
+        rArray.offset = 0;
+        rArray.n_buffers = 1;
+        rArray.n_children = cols;
+        rArray.buffers = pArrayNode->buffers;
+        rArray.children = &pArrayNode->children[0];
+        rArray.dictionary = NULL;
+        rArray.release = ReleaseArray;
+        rArray.private_data = pArrayNode;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // pyinex.ArrowTable: holds an exported table until something takes it
+
+    struct ArrowTableObject
+    {
+        PyObject_HEAD
+        ArrowSchema*    pSchema;    // NULL once handed over
+        ArrowArray*     pArray;
+        long            rows;
+        PyObject*       pNames;     // tuple of str
+    };
+
+    void
+    SchemaCapsuleDestructor( PyObject* pCapsule )
+    {
+        ArrowSchema* pSchema = (ArrowSchema*)PyCapsule_GetPointer(pCapsule, "arrow_schema");
+        if (pSchema) {
+            if (pSchema->release) {
+                pSchema->release(pSchema);
+            }
+            delete pSchema;
+        }
+    }
+
+    void
+    ArrayCapsuleDestructor( PyObject* pCapsule )
+    {
+        ArrowArray* pArray = (ArrowArray*)PyCapsule_GetPointer(pCapsule, "arrow_array");
+        if (pArray) {
+            if (pArray->release) {
+                pArray->release(pArray);
+            }
+            delete pArray;
+        }
+    }
+
+    PyObject*
+    arrowtable_c_array( PyObject* pSelfObj, PyObject* args, PyObject* kwargs )
+    {
+        ArrowTableObject* pSelf = (ArrowTableObject*)pSelfObj;
+        static char* kwlist[] = { (char*)"requested_schema", NULL };
+        PyObject* pRequested = Py_None;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &pRequested)) {
+            return NULL;
+        }
+
+        if (!pSelf->pSchema) {
+            PyErr_SetString(PyExc_RuntimeError, "This pyinex.ArrowTable has already been handed over");
+            return NULL;
+        }
+
+        PyObject* pSchemaCap = PyCapsule_New(pSelf->pSchema, "arrow_schema", SchemaCapsuleDestructor);
+        if (!pSchemaCap) {
+            return NULL;
+        }
+        pSelf->pSchema = NULL; // the capsule owns it now
+
+        PyObject* pArrayCap = PyCapsule_New(pSelf->pArray, "arrow_array", ArrayCapsuleDestructor);
+        if (!pArrayCap) {
+            Py_DECREF(pSchemaCap);
+            return NULL;
+        }
+        pSelf->pArray = NULL;
+
+        PyObject* pResult = PyTuple_Pack(2, pSchemaCap, pArrayCap);
+        Py_DECREF(pSchemaCap);
+        Py_DECREF(pArrayCap);
+        return pResult;
+    }
+
+    PyObject*
+    arrowtable_num_rows( PyObject* pSelf, void* closure )
+    {
+        return PyLong_FromLong(((ArrowTableObject*)pSelf)->rows);
+    }
+
+    PyObject*
+    arrowtable_column_names( PyObject* pSelf, void* closure )
+    {
+        PyObject* pNames = ((ArrowTableObject*)pSelf)->pNames;
+        Py_INCREF(pNames);
+        return pNames;
+    }
+
+    PyObject*
+    arrowtable_repr( PyObject* pSelf )
+    {
+        ArrowTableObject* pTable = (ArrowTableObject*)pSelf;
+        return PyUnicode_FromFormat("<pyinex.ArrowTable %ld rows x %zd columns%s>", pTable->rows,
+            PyTuple_GET_SIZE(pTable->pNames), pTable->pSchema ? "" : ", handed over");
+    }
+
+    void
+    arrowtable_dealloc( PyObject* pSelfObj )
+    {
+        ArrowTableObject* pSelf = (ArrowTableObject*)pSelfObj;
+        if (pSelf->pSchema) {
+            pSelf->pSchema->release(pSelf->pSchema);
+            delete pSelf->pSchema;
+        }
+        if (pSelf->pArray) {
+            pSelf->pArray->release(pSelf->pArray);
+            delete pSelf->pArray;
+        }
+        Py_XDECREF(pSelf->pNames);
+        PyObject_Del(pSelfObj);
+    }
+
+    PyMethodDef ArrowTableMethods[] = {
+        {"__arrow_c_array__", (PyCFunction)arrowtable_c_array, METH_VARARGS | METH_KEYWORDS,
+            "Hands the table over as Arrow C Data Interface capsules; can only be done once"},
+        {NULL, NULL, 0, NULL} /* Sentinel */
+    };
+
+    PyGetSetDef ArrowTableGetSet[] = {
+        {(char*)"num_rows", arrowtable_num_rows, NULL, (char*)"Rows, not counting the header", NULL},
+        {(char*)"column_names", arrowtable_column_names, NULL, (char*)"Names from the header row", NULL},
+        {NULL, NULL, NULL, NULL, NULL} /* Sentinel */
+    };
+
+    PyTypeObject ArrowTableType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        "pyinex.ArrowTable",        /* tp_name */
+        sizeof(ArrowTableObject),   /* tp_basicsize */
+        0,                          /* tp_itemsize */
+        arrowtable_dealloc,         /* tp_dealloc */
+        0,                          /* tp_print */
+        0,                          /* tp_getattr */
+        0,                          /* tp_setattr */
+        0,                          /* tp_compare */
+        arrowtable_repr,            /* tp_repr */
+        0,                          /* tp_as_number */
+        0,                          /* tp_as_sequence */
+        0,                          /* tp_as_mapping */
+        0,                          /* tp_hash */
+        0,                          /* tp_call */
+        0,                          /* tp_str */
+        0,                          /* tp_getattro */
+        0,                          /* tp_setattro */
+        0,                          /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT,         /* tp_flags */
+        "An Excel range exported through the Arrow C Data Interface", /* tp_doc */
+        0,                          /* tp_traverse */
+        0,                          /* tp_clear */
+        0,                          /* tp_richcompare */
+        0,                          /* tp_weaklistoffset */
+        0,                          /* tp_iter */
+        0,                          /* tp_iternext */
+        ArrowTableMethods,          /* tp_methods */
+        0,                          /* tp_members */
+        ArrowTableGetSet            /* tp_getset */
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Import: one column of one batch into the body, a row at a time
+
+    void
+    SetText( XLOPER12& x, const char* pUtf8, size_t len )
+    {
+        int n = len ? MultiByteToWideChar(CP_UTF8, 0, pUtf8, (int)len, NULL, 0) : 0;
+        if (n <= 0) {
+            x.xltype = xltypeStr;
+            x.val.str = g_emptyText;
+            return;
+        }
+        XCHAR* pText = (XCHAR*)XlfExcel::Instance().GetMemory((n + 1) * sizeof(XCHAR));
+        MultiByteToWideChar(CP_UTF8, 0, pUtf8, (int)len, pText + 1, n);
+        pText[0] = (XCHAR)(n > 0x7FFF ? 0x7FFF : n);
+        x.xltype = xltypeStr;
+        x.val.str = pText;
+    }
+
+    inline bool
+    GetBit( const void* pBits, __int64 i )
+    {
+        return (((const unsigned char*)pBits)[i >> 3] >> (i & 7)) & 1;
+    }
+
+    // Seconds per unit of an Arrow timestamp ("tss", "tsm", "tsu", "tsn")
+    double
+    TimestampUnit( const char* pFormat )
+    {
+        switch (pFormat[2]) {
+            case 's':   return 1.0;
+            case 'm':   return 1e-3;
+            case 'u':   return 1e-6;
+            case 'n':   return 1e-9;
+        }
+        return 0.0;
+    }
+
+    bool
+    IsSupportedFormat( const char* f )
+    {
+        if (f[0] && !f[1]) {
+            return strchr("nbcCsSiIlLfguU", f[0]) != NULL;
+        }
+        return strcmp(f, "tdD") == 0 || strcmp(f, "tdm") == 0 ||
+               (f[0] == 't' && f[1] == 's' && TimestampUnit(f) != 0.0 && f[3] == ':');
+    }
+
+    void
+    ImportColumn( const ArrowSchema& schema, const ArrowArray& array,
+                  XLOPER12* pOut, long stride )
+    {
+        const char* f = schema.format;
+        const void* const* buf = array.buffers;
+
+        for (__int64 r = 0; r < array.length; ++r) {
+            XLOPER12& x = pOut[r * stride];
+            __int64 i = array.offset + r;
+
+            if (f[0] == 'n' || (array.null_count != 0 && buf[0] && !GetBit(buf[0], i))) {
+                x.xltype = xltypeStr;
+                x.val.str = g_emptyText;
+                continue;
+            }
+
+            x.xltype = xltypeNum;
+            switch (f[0]) {
+                case 'b':
+                    x.xltype = xltypeBool;
+                    x.val.xbool = GetBit(buf[1], i);
+                    break;
+                case 'c':   x.val.num = ((const signed char*)buf[1])[i];       break;
+                case 'C':   x.val.num = ((const unsigned char*)buf[1])[i];     break;
+                case 's':   x.val.num = ((const short*)buf[1])[i];             break;
+                case 'S':   x.val.num = ((const unsigned short*)buf[1])[i];    break;
+                case 'i':   x.val.num = ((const int*)buf[1])[i];               break;
+                case 'I':   x.val.num = ((const unsigned int*)buf[1])[i];      break;
+                case 'l':   x.val.num = (double)((const __int64*)buf[1])[i];   break;
+                case 'L':   x.val.num = (double)((const unsigned __int64*)buf[1])[i]; break;
+                case 'f':   x.val.num = ((const float*)buf[1])[i];             break;
+                case 'g':   x.val.num = ((const double*)buf[1])[i];            break;
+                case 'u': {
+                    const int* pOffsets = (const int*)buf[1];
+                    SetText(x, (const char*)buf[2] + pOffsets[i], (size_t)(pOffsets[i + 1] - pOffsets[i]));
+                    break;
+                }
+                case 'U': {
+                    const __int64* pOffsets = (const __int64*)buf[1];
+                    SetText(x, (const char*)buf[2] + pOffsets[i], (size_t)(pOffsets[i + 1] - pOffsets[i]));
+                    break;
+                }
+                case 't':
+                    if (f[1] == 'd' && f[2] == 'D') {
+                        x.val.num = ((const int*)buf[1])[i] + EXCEL_EPOCH_DAYS;
+                    } else if (f[1] == 'd') {
+                        x.val.num = (double)((const __int64*)buf[1])[i] / 86400000.0 + EXCEL_EPOCH_DAYS;
+                    } else {
+                        x.val.num = (double)((const __int64*)buf[1])[i] * TimestampUnit(f) / 86400.0 + EXCEL_EPOCH_DAYS;
+                    }
+                    break;
+            }
+
+            // Excel can't show NaN or infinities
+            if (x.xltype == xltypeNum && !_finite(x.val.num)) {
+                x.xltype = xltypeErr;
+                x.val.err = xlerrNA;
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Batches share one schema. A struct schema is a table; anything else is a
+    // single column named by the schema.
+
+    bool
+    ImportBatches( const ArrowSchema& schema, std::vector<ArrowArray>& batches, XLOPER12& rResult )
+    {
+        bool bStruct = strcmp(schema.format, "+s") == 0;
+        long cols = bStruct ? (long)schema.n_children : 1;
+
+        for (long j = 0; j < cols; ++j) {
+            const ArrowSchema& col = bStruct ? *schema.children[j] : schema;
+            if (col.dictionary || !IsSupportedFormat(col.format)) {
+                ERROUT("Returned Arrow column %ld has type '%s', which can't be returned to Excel",
+                    j + 1, col.format);
+                return false;
+            }
+        }
+
+        __int64 rows = 0;
+        for (size_t b = 0; b < batches.size(); ++b) {
+            rows += batches[b].length;
+        }
+        if (cols < 1 || cols > MAX_COLS || rows + 1 > MAX_ROWS) {
+            ERROUT("Returned Arrow data of %I64d rows and %ld columns doesn't fit on a sheet", rows + 1, cols);
+            return false;
+        }
+
+        rResult.xltype = xltypeMulti;
+        rResult.val.array.rows = (RW)(rows + 1);
+        rResult.val.array.columns = (COL)cols;
+        rResult.val.array.lparray = (LPXLOPER12)XlfExcel::Instance().GetMemory((size_t)(rows + 1) * cols * sizeof(XLOPER12));
+        XLOPER12* pCells = rResult.val.array.lparray;
+
+        for (long j = 0; j < cols; ++j) {
+            const ArrowSchema& col = bStruct ? *schema.children[j] : schema;
+            SetText(pCells[j], col.name ? col.name : "", col.name ? strlen(col.name) : 0);
+
+            XLOPER12* pOut = pCells + cols + j;
+            for (size_t b = 0; b < batches.size(); ++b) {
+                const ArrowArray& batch = batches[b];
+                if (bStruct) {
+                    // A struct's children are offset along with it
+                    ArrowArray child = *batch.children[j];
+                    child.offset += batch.offset;
+                    child.length = batch.length;
+                    ImportColumn(col, child, pOut, cols);
+
+                    // A null struct row is null in every column, whatever its children hold
+                    if (batch.null_count != 0 && batch.n_buffers > 0 && batch.buffers[0]) {
+                        for (__int64 r = 0; r < batch.length; ++r) {
+                            if (!GetBit(batch.buffers[0], batch.offset + r)) {
+                                pOut[r * cols].xltype = xltypeStr;
+                                pOut[r * cols].val.str = g_emptyText;
+                            }
+                        }
+                    }
+                } else {
+                    ImportColumn(col, batch, pOut, cols);
+                }
+                pOut += batch.length * cols;
+            }
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ImportArrayCapsules( PyObject* pObj, XLOPER12& rResult )
+    {
+        PyObject* pPair = PyObject_CallMethod(pObj, (char*)"__arrow_c_array__", NULL);
+        if (!pPair) {
+            PyErr_Print();
+            return false;
+        }
+
+        bool rc = false;
+        ArrowSchema* pSchema = NULL;
+        ArrowArray* pArray = NULL;
+        if (PyTuple_Check(pPair) && PyTuple_GET_SIZE(pPair) == 2) {
+            pSchema = (ArrowSchema*)PyCapsule_GetPointer(PyTuple_GET_ITEM(pPair, 0), "arrow_schema");
+            pArray = (ArrowArray*)PyCapsule_GetPointer(PyTuple_GET_ITEM(pPair, 1), "arrow_array");
+        }
+        if (pSchema && pArray) {
+            std::vector<ArrowArray> batches(1, *pArray);
+            rc = ImportBatches(*pSchema, batches, rResult);
+        } else {
+            PyErr_Clear();
+            ERROUT("__arrow_c_array__ of the returned %s didn't return Arrow capsules", Py_TYPE(pObj)->tp_name);
+        }
+
+        Py_DECREF(pPair); // the capsules release the Arrow data
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ImportStreamCapsule( PyObject* pObj, XLOPER12& rResult )
+    {
+        PyObject* pCapsule = PyObject_CallMethod(pObj, (char*)"__arrow_c_stream__", NULL);
+        if (!pCapsule) {
+            PyErr_Print();
+            return false;
+        }
+        ArrowArrayStream* pStream = (ArrowArrayStream*)PyCapsule_GetPointer(pCapsule, "arrow_array_stream");
+        if (!pStream) {
+            PyErr_Clear();
+            ERROUT("__arrow_c_stream__ of the returned %s didn't return an Arrow stream", Py_TYPE(pObj)->tp_name);
+            Py_DECREF(pCapsule);
+            return false;
+        }
+
+        bool rc = true;
+        ArrowSchema schema;
+        schema.release = NULL;
+        if (pStream->get_schema(pStream, &schema) != 0) {
+            const char* pErr = pStream->get_last_error(pStream);
+            ERROUT("Couldn't read the schema of the returned Arrow stream: %s", pErr ? pErr : "unknown error");
+            rc = false;
+        }
+
+        std::vector<ArrowArray> batches;
+        while (rc) {
+            ArrowArray batch;
+            batch.release = NULL;
+            if (pStream->get_next(pStream, &batch) != 0) {
+                const char* pErr = pStream->get_last_error(pStream);
+                ERROUT("Couldn't read the returned Arrow stream: %s", pErr ? pErr : "unknown error");
+                rc = false;
+                break;
+            }
+            if (!batch.release) {
+                break; // end of stream
+            }
+            batches.push_back(batch);
+        }
+
+        rc = rc && ImportBatches(schema, batches, rResult);
+
+        for (size_t b = 0; b < batches.size(); ++b) {
+            batches[b].release(&batches[b]);
+        }
+        if (schema.release) {
+            schema.release(&schema);
+        }
+        Py_DECREF(pCapsule); // releases the stream
+        return rc;
+    }
+
+} // end anonymous namespace
+
+#endif  // PY_MAJOR_VERSION >= 3
+
+//////////////////////////////////////////////////////////////////////////////
+
+PyObject*
+NewArrowTable( const xloper12* pCells, long rows, long cols )
+{
+#if PY_MAJOR_VERSION < 3
+    PyErr_SetString(PyExc_NotImplementedError, "Arrow export needs Python 3");
+    return NULL;
+#else
+    if (rows < 1 || cols < 1) {
+        PyErr_SetString(PyExc_ValueError, "An Arrow table needs at least a header row");
+        return NULL;
+    }
+
+    ArrowTableObject* pTable = PyObject_New(ArrowTableObject, &ArrowTableType);
+    if (!pTable) {
+        return NULL;
+    }
+    pTable->pSchema = new ArrowSchema;
+    pTable->pArray = new ArrowArray;
+    pTable->rows = rows - 1;
+    ExportTable(pCells, rows, cols, *pTable->pSchema, *pTable->pArray);
+
+    pTable->pNames = PyTuple_New(cols);
+    for (long j = 0; pTable->pNames && j < cols; ++j) {
+        const char* pName = pTable->pSchema->children[j]->name;
+        PyObject* pStr = PyUnicode_DecodeUTF8(pName, (Py_ssize_t)strlen(pName), "replace");
+        if (!pStr) {
+            Py_DECREF((PyObject*)pTable);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pTable->pNames, j, pStr);
+    }
+    if (!pTable->pNames) {
+        Py_DECREF((PyObject*)pTable);
+        return NULL;
+    }
+    return (PyObject*)pTable;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+AddArrowTypes( PyObject* pModule )
+{
+#if PY_MAJOR_VERSION < 3
+    return true;
+#else
+    if (PyType_Ready(&ArrowTableType) < 0) {
+        return false;
+    }
+    Py_INCREF(&ArrowTableType);
+    return PyModule_AddObject(pModule, "ArrowTable", (PyObject*)&ArrowTableType) == 0;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertPyArrowToXloper12( PyObject* pObj, XLOPER12& rResult, bool& rbOk )
+{
+    rbOk = false;
+#if PY_MAJOR_VERSION < 3
+    return false;
+#else
+    if (PyObject_HasAttrString(pObj, "to_dict")) {
+        return false;
+    }
+    if (PyObject_HasAttrString(pObj, "__arrow_c_array__")) {
+        rbOk = ImportArrayCapsules(pObj, rResult);
+        return true;
+    }
+    if (PyObject_HasAttrString(pObj, "__arrow_c_stream__")) {
+        rbOk = ImportStreamCapsule(pObj, rResult);
+        return true;
+    }
+    return false;
+#endif
+}
@@ -0,0 +1,592 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Calculation cycles. Excel gives a worksheet function no notice that a recalc
+// is starting or has finished, so Pyinex infers it: a cycle starts with the first
+// PyCall after the previous one ended, and ends when Excel says calculation has
+// ended or was cancelled (the PyCalcEnded command, run on xlEventCalculationEnded
+// and xlEventCalculationCanceled - Excel 2010 on), or, where those events never
+// arrive (Excel 2007, MockExcel), when no PyCall has run for CALC_IDLE_MS. The
+// idle check is a thread timer, so it fires only when the calc thread pumps
+// messages: between recalcs in Excel, and between script commands in MockExcel.
+//
+// The cycle brackets Python's cyclic garbage collector. With scheduling on
+// (PyGC), automatic collection is disabled at the start of a cycle, so that a
+// generation-2 collection can't land in the middle of a recalc, and a full
+// collection is run at its end instead. A cycle that allocates more than the
+// budget (gen-0 count, checked as each PyCall starts) gets a young collection
+// on the spot, so memory can't grow without bound in a long recalc.
+//
+// Every collection is timed. From Python 3.3 on, gc.callbacks reports automatic
+// collections as well as ours; before that, only the scheduled ones are seen.
+//
+// Scripts can hook the cycle too (pyinex.on_calc_start, pyinex.on_calc_end), to
+// fetch data once per recalc rather than from every cell, or to flush work the
+// cells have batched up. Start hooks run as the first PyCall of the cycle begins,
+// before its own function; end hooks run from the command or the timer, before
+// the scheduled collection. Either way the GIL is held, and no cell's function
+// is running. A hook that raises has its traceback printed; the rest still run.
+
+namespace {
+
+    const DWORD CALC_IDLE_MS = 200;             // PyCall-free gap that ends a cycle
+    const unsigned long DEFAULT_GC_BUDGET = 100000;
+
+    class CalcCycle
+    {
+    public:
+        static CalcCycle& Factory();
+
+        void BeginCall();
+        void EndCall();
+        void End( bool bFromEvent );
+        bool Active() const { return m_bActive; }
+        unsigned long Number() const { return m_stats.cycles; }
+
+        bool GcScheduling() const { return m_bGcScheduling; }
+        void SetGcScheduling( bool bSchedule ) { m_bGcScheduling = bSchedule; }
+        unsigned long GcBudget() const { return m_gcBudget; }
+        void SetGcBudget( unsigned long budget ) { m_gcBudget = budget; }
+
+        void Statistics( GcStatistics& rStats ) const;
+
+        void AddHook( bool bStart, PyObject* pFunction );
+
+    private:
+        CalcCycle();
+        ~CalcCycle();
+
+        void Begin();
+        bool Collect( int generation );
+        void RecordPause( double pauseSeconds );
+        PyObject* GcModule();
+        void InstallGcCallback();
+        void RunHooks( std::vector<PyObject*>& hooks, const char* pWhen );
+
+        static VOID CALLBACK IdleTimerProc( HWND hwnd, UINT msg, UINT_PTR id, DWORD time );
+        static PyObject* GcCallback( PyObject* self, PyObject* args );
+
+    private:
+        // Calc thread only
+        bool            m_bActive;
+        bool            m_bEventsSeen;      // PyCalcEnded has run; no need for the timer
+        int             m_callDepth;
+        DWORD           m_lastCall;         // tick count at the end of the last PyCall
+        UINT_PTR        m_timer;
+        double          m_timelineStartUs;  // the cycle's span on the timeline; negative if none
+        double          m_timelineLastCallUs;
+
+        bool            m_bGcScheduling;
+        unsigned long   m_gcBudget;         // zero = no young collections mid-cycle
+        bool            m_bGcDisabled;      // we turned automatic collection off this cycle
+        bool            m_bGcWasEnabled;
+        PyObject*       m_pGc;              // the gc module
+        bool            m_bGcCallback;      // gc.callbacks times every collection
+        double          m_collectStart;
+
+        GcStatistics    m_stats;
+
+        // Owned references to the script hooks, in registration order
+        std::vector<PyObject*> m_startHooks;
+        std::vector<PyObject*> m_endHooks;
+
+        CalcCycle( const CalcCycle& );
+        CalcCycle& operator=( const CalcCycle& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    CalcCycle&
+    CalcCycle::Factory()
+    {
+        static CalcCycle g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    CalcCycle::CalcCycle() :
+        m_bActive(false),
+        m_bEventsSeen(false),
+        m_callDepth(0),
+        m_lastCall(0),
+        m_timer(0),
+        m_timelineStartUs(-1.0),
+        m_timelineLastCallUs(0.0),
+        m_bGcScheduling(false),
+        m_gcBudget(DEFAULT_GC_BUDGET),
+        m_bGcDisabled(false),
+        m_bGcWasEnabled(true),
+        m_pGc(NULL),
+        m_bGcCallback(false),
+        m_collectStart(0.0)
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Runs after Py_Finalize, so the gc module and hook references are simply abandoned
+
+    CalcCycle::~CalcCycle()
+    {
+        if (m_timer) {
+            KillTimer(NULL, m_timer);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread, with the GIL, as each PyCall starts
+
+    void
+    CalcCycle::BeginCall()
+    {
+        if (++m_callDepth != 1) {
+            return;
+        }
+
+        if (!m_bActive) {
+            Begin();
+        } else if (m_bGcDisabled && m_gcBudget > 0) {
+            PyObject* pCount = PyObject_CallMethod(GcModule(), (char*)"get_count", NULL);
+            if (pCount && PyTuple_Check(pCount) && PyTuple_GET_SIZE(pCount) > 0) {
+                long young = PyLong_AsLong(PyTuple_GET_ITEM(pCount, 0));
+                if (young > 0 && (unsigned long)young > m_gcBudget && Collect(0)) {
+                    ++m_stats.budgetCollections;
+                }
+            }
+            Py_XDECREF(pCount);
+            PyErr_Clear();
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CalcCycle::EndCall()
+    {
+        if (m_callDepth > 0 && --m_callDepth == 0) {
+            m_lastCall = GetTickCount();
+            if (m_timelineStartUs >= 0.0) {
+                m_timelineLastCallUs = TimelineClock();
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CalcCycle::Begin()
+    {
+        m_bActive = true;
+        ++m_stats.cycles;
+        m_timelineStartUs = TimelineActive() ? TimelineClock() : -1.0;
+        m_timelineLastCallUs = m_timelineStartUs;
+
+        if (!m_bGcCallback) {
+            InstallGcCallback();
+        }
+
+        if (m_bGcScheduling && GcModule()) {
+            PyObject* pEnabled = PyObject_CallMethod(m_pGc, (char*)"isenabled", NULL);
+            m_bGcWasEnabled = pEnabled ? PyObject_IsTrue(pEnabled) == 1 : true;
+            Py_XDECREF(pEnabled);
+
+            PyObject* pRes = PyObject_CallMethod(m_pGc, (char*)"disable", NULL);
+            m_bGcDisabled = pRes != NULL;
+            Py_XDECREF(pRes);
+            if (!m_bGcDisabled) {
+                ERROUT("Couldn't disable the garbage collector; it runs as usual this calculation");
+            }
+            PyErr_Clear();
+        }
+
+        if (!m_bEventsSeen && !m_timer) {
+            m_timer = SetTimer(NULL, 0, CALC_IDLE_MS, IdleTimerProc);
+        }
+
+        RunHooks(m_startHooks, "start");
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread. Called from the PyCalcEnded command even when Python hasn't been
+    // started, so touches nothing of Python's unless a cycle is in progress.
+
+    void
+    CalcCycle::End( bool bFromEvent )
+    {
+        if (bFromEvent) {
+            m_bEventsSeen = true;
+        }
+        if (m_timer) {
+            KillTimer(NULL, m_timer);
+            m_timer = 0;
+        }
+        if (!m_bActive || m_callDepth > 0) {
+            return;
+        }
+        m_bActive = false;
+
+        // Ended by the idle timer, the calculation is taken to have finished with its last PyCall
+        if (m_timelineStartUs >= 0.0) {
+            double endUs = bFromEvent ? TimelineClock() : m_timelineLastCallUs;
+            RecordTimelineSpan("calc", "calculation", m_timelineStartUs, endUs - m_timelineStartUs, NULL, std::wstring());
+            m_timelineStartUs = -1.0;
+        }
+
+        RunHooks(m_endHooks, "end");
+
+        if (m_bGcDisabled) {
+            m_bGcDisabled = false;
+            if (Collect(2)) {
+                ++m_stats.scheduledCollections;
+            }
+            if (m_bGcWasEnabled) {
+                PyObject* pRes = PyObject_CallMethod(m_pGc, (char*)"enable", NULL);
+                Py_XDECREF(pRes);
+                PyErr_Clear();
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Runs the given generation; without gc.callbacks, times it here
+
+    bool
+    CalcCycle::Collect( int generation )
+    {
+        double start = CallTraceClock();
+        PyObject* pRes = PyObject_CallMethod(GcModule(), (char*)"collect", (char*)"i", generation);
+        double pause = CallTraceClock() - start;
+
+        if (!pRes) {
+            PyErr_Clear();
+            ERROUT("gc.collect(%d) failed", generation);
+            return false;
+        }
+        Py_DECREF(pRes);
+
+        if (!m_bGcCallback) {
+            ++m_stats.collections;
+            RecordPause(pause);
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CalcCycle::RecordPause( double pauseSeconds )
+    {
+        double ms = pauseSeconds * 1000.0;
+        m_stats.totalPauseMs += ms;
+        m_stats.lastPauseMs = ms;
+        if (ms > m_stats.maxPauseMs) {
+            m_stats.maxPauseMs = ms;
+        }
+        if (m_bActive) {
+            ++m_stats.midCalcCollections;
+        }
+
+        if (TimelineActive()) {
+            std::wostringstream ostr;
+            ostr << ms;
+            RecordTimelineInstant("gc", "collection", "pause_ms", ostr.str());
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    CalcCycle::GcModule()
+    {
+        if (!m_pGc) {
+            m_pGc = PyImport_ImportModule("gc");
+            if (!m_pGc) {
+                PyErr_Clear();
+                ERROUT("Couldn't import the gc module");
+            }
+        }
+        return m_pGc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Once only; a failure leaves collections timed by Collect() alone
+
+    void
+    CalcCycle::InstallGcCallback()
+    {
+#if PY_VERSION_HEX >= 0x03030000
+        static PyMethodDef g_callbackDef =
+            { "pyinex_gc_callback", GcCallback, METH_VARARGS, "Times garbage collections for PyGC" };
+
+        m_bGcCallback = true;
+        if (!GcModule()) {
+            return;
+        }
+
+        PyObject* pCallbacks = PyObject_GetAttrString(m_pGc, "callbacks");
+        PyObject* pCallback = PyCFunction_New(&g_callbackDef, NULL);
+        if (!pCallbacks || !pCallback || PyList_Append(pCallbacks, pCallback) != 0) {
+            PyErr_Clear();
+            ERROUT("Couldn't add to gc.callbacks; only scheduled collections are timed");
+            m_bGcCallback = false;
+        }
+        Py_XDECREF(pCallback);
+        Py_XDECREF(pCallbacks);
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Excel has gone quiet, or a PyCall is still running in a message loop of its own
+
+    VOID CALLBACK
+    CalcCycle::IdleTimerProc( HWND, UINT, UINT_PTR, DWORD )
+    {
+        CalcCycle& rThis = Factory();
+        if (rThis.m_callDepth == 0 && GetTickCount() - rThis.m_lastCall >= CALC_IDLE_MS) {
+            rThis.End(false);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // gc.callbacks entry: callback(phase, info), phase "start" or "stop"
+
+    PyObject*
+    CalcCycle::GcCallback( PyObject* self, PyObject* args )
+    {
+        const char* phase = NULL;
+        PyObject* pInfo = NULL;
+        if (!PyArg_ParseTuple(args, "sO", &phase, &pInfo)) {
+            return NULL;
+        }
+
+        CalcCycle& rThis = Factory();
+        if (strcmp(phase, "start") == 0) {
+            rThis.m_collectStart = CallTraceClock();
+        } else {
+            ++rThis.m_stats.collections;
+            rThis.RecordPause(CallTraceClock() - rThis.m_collectStart);
+        }
+        Py_RETURN_NONE;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CalcCycle::Statistics( GcStatistics& rStats ) const
+    {
+        rStats = m_stats;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A function with the same module and name as one already registered replaces
+    // it, so that reloading a module doesn't register its hooks a second time.
+    // Needs the GIL.
+
+    void
+    CalcCycle::AddHook( bool bStart, PyObject* pFunction )
+    {
+        std::vector<PyObject*>& hooks = bStart ? m_startHooks : m_endHooks;
+
+        PyObject* pModule = PyObject_GetAttrString(pFunction, "__module__");
+        PyObject* pName = PyObject_GetAttrString(pFunction, "__name__");
+        PyErr_Clear();
+
+        std::vector<PyObject*>::iterator it;
+        for (it = hooks.begin(); pModule && pName && it != hooks.end(); ++it) {
+            PyObject* pOtherModule = PyObject_GetAttrString(*it, "__module__");
+            PyObject* pOtherName = PyObject_GetAttrString(*it, "__name__");
+            PyErr_Clear();
+            bool bSame = pOtherModule && pOtherName &&
+                         PyObject_RichCompareBool(pModule, pOtherModule, Py_EQ) == 1 &&
+                         PyObject_RichCompareBool(pName, pOtherName, Py_EQ) == 1;
+            Py_XDECREF(pOtherModule);
+            Py_XDECREF(pOtherName);
+            if (bSame) {
+                break;
+            }
+        }
+        PyErr_Clear();
+        Py_XDECREF(pModule);
+        Py_XDECREF(pName);
+
+        Py_INCREF(pFunction);
+        if (pModule && pName && it != hooks.end()) {
+            PyObject* pOld = *it;
+            *it = pFunction;
+            Py_DECREF(pOld);
+        } else {
+            hooks.push_back(pFunction);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A hook may register others as it runs, so the list is indexed afresh each
+    // time, and each hook is held while it runs in case it's replaced
+
+    void
+    CalcCycle::RunHooks( std::vector<PyObject*>& hooks, const char* pWhen )
+    {
+        for (size_t i = 0; i < hooks.size(); ++i) {
+            PyObject* pHook = hooks[i];
+            Py_INCREF(pHook);
+            PyObject* pRes = PyObject_CallObject(pHook, NULL);
+            if (pRes) {
+                Py_DECREF(pRes);
+            } else {
+                ERROUT("Calculation %s hook failed", pWhen);
+                if (PyErr_Occurred()) {
+                    PyErr_Print();
+                }
+            }
+            Py_DECREF(pHook);
+        }
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+BeginCalcCall()
+{
+    CalcCycle::Factory().BeginCall();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+EndCalcCall()
+{
+    CalcCycle::Factory().EndCall();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+EndCalcCycle( bool bFromEvent )
+{
+    CalcCycle::Factory().End(bFromEvent);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+CalcCycleActive()
+{
+    return CalcCycle::Factory().Active();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+CalcCycleNumber()
+{
+    return CalcCycle::Factory().Number();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+GcScheduling()
+{
+    return CalcCycle::Factory().GcScheduling();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetGcScheduling( bool bSchedule )
+{
+    CalcCycle::Factory().SetGcScheduling(bSchedule);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+GcAllocationBudget()
+{
+    return CalcCycle::Factory().GcBudget();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetGcAllocationBudget( unsigned long budget )
+{
+    CalcCycle::Factory().SetGcBudget(budget);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetGcStatistics( GcStatistics& rStats )
+{
+    CalcCycle::Factory().Statistics(rStats);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+AddCalcHook( bool bStart, PyObject* pFunction )
+{
+    CalcCycle::Factory().AddHook(bStart, pFunction);
+}
@@ -0,0 +1,816 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <float.h>
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Call tracing. While PyTrace() has a trace open, every PyCall and PyCallRef is
+// appended to it as one record: the module file, the function, the calling cell,
+// the argument values, the value handed back to Excel, and how long the call
+// took. TestHarness replays a trace against the interpreter, without Excel,
+// through the same call path, and compares its results with the recorded ones.
+//
+// The file is a stream of records, each a kind byte, a 32-bit payload length and
+// the payload, after an 8-byte magic, a format version and the PY_VERSION_HEX of
+// the recording interpreter. Names (files, functions, sheets) are written once,
+// in an 'S' record giving the id that the 'C' (call) records use:
+//
+//      'S'   u32 id, u32 count, count wchar_ts
+//      'C'   f64 start (seconds since the trace began), f64 elapsed seconds,
+//            u8 flags, u32 sheet id (0 = not called from a cell), i32 row, i32 col,
+//            u32 file id, u32 function id, u8 argument count, the arguments, the result
+//
+// Values are a tag byte and a payload: 'n' f64, 's' u16 count and wchar_ts,
+// 'b' u8, 'e' u16 error code, '-' empty, '.' missing, '?' anything else, and
+// 'm' u32 rows, u32 cols and that many cell values. Trailing missing arguments
+// aren't written. References (PyCallRef's arguments) are written as their values,
+// so tracing PyCallRef reads every cell of its ranges; a call whose ranges aren't
+// all calculated yet isn't recorded, as Excel will make it again.
+//
+// PyCall isn't registered as thread-safe, so records are only ever written from
+// the calc thread, and need no lock. The file is buffered and flushed when the
+// trace is stopped.
+
+namespace {
+
+    const char          TRACE_MAGIC[8] = { 'P', 'Y', 'X', 'T', 'R', 'A', 'C', 'E' };
+    const unsigned long TRACE_VERSION = 1;
+    const size_t        TRACE_BUFFER_BYTES = 65536;
+
+    enum TracedCallFlags { traceRangeArgs = 0x1, traceFromCell = 0x2 };
+
+    class CallTraceWriter
+    {
+    public:
+        static CallTraceWriter& Factory();
+
+        bool Start( const std::wstring& filename );
+        void Stop();
+        bool Active() const { return m_pFile != NULL; }
+        const std::wstring& Filename() const { return m_filename; }
+        unsigned long Count() const { return m_count; }
+        double Clock() const;
+
+        void Record( const std::wstring& filename,
+                     const std::string& function,
+                     const xloper12* pArgs[],
+                     int count,
+                     bool bRangeArgs,
+                     const xloper12* pResult,
+                     double startSeconds,
+                     double elapsedSeconds );
+
+    private:
+        CallTraceWriter();
+        ~CallTraceWriter();
+
+        unsigned long NameId( const std::wstring& name );
+        bool PutValue( const xloper12& x, bool bTop );
+
+        void PutBytes( const void* pData, size_t n )
+        {
+            const unsigned char* p = (const unsigned char*) pData;
+            m_record.insert(m_record.end(), p, p + n);
+        }
+        template <typename T> void Put( T value ) { PutBytes(&value, sizeof(T)); }
+
+        void WriteRecord( char kind );
+
+    private:
+        FILE*                                   m_pFile;
+        std::wstring                            m_filename;
+        unsigned long                           m_count;
+        LARGE_INTEGER                           m_frequency;
+        LARGE_INTEGER                           m_origin;
+        std::map<std::wstring, unsigned long>   m_names;
+        std::vector<unsigned char>              m_record;   // reused for every record
+        std::vector<char>                       m_buffer;   // the FILE's buffer
+
+        CallTraceWriter( const CallTraceWriter& );
+        CallTraceWriter& operator=( const CallTraceWriter& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    CallTraceWriter&
+    CallTraceWriter::Factory()
+    {
+        static CallTraceWriter writer;
+        return writer;
+    }
+
+    CallTraceWriter::CallTraceWriter()
+        : m_pFile(NULL),
+          m_count(0)
+    {
+        QueryPerformanceFrequency(&m_frequency);
+        m_origin.QuadPart = 0;
+    }
+
+    CallTraceWriter::~CallTraceWriter()
+    {
+        Stop();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    CallTraceWriter::Start( const std::wstring& filename )
+    {
+        Stop();
+
+        m_pFile = _wfopen(filename.c_str(), L"wb");
+        if (!m_pFile) {
+            ERROUT("Couldn't open trace file %s", ASCII_REPR(filename));
+            return false;
+        }
+        m_buffer.resize(TRACE_BUFFER_BYTES);
+        setvbuf(m_pFile, &m_buffer[0], _IOFBF, m_buffer.size());
+
+        unsigned long header[2] = { TRACE_VERSION, (unsigned long) PY_VERSION_HEX };
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), m_pFile);
+        fwrite(header, 1, sizeof(header), m_pFile);
+
+        m_filename = filename;
+        m_count = 0;
+        m_names.clear();
+        QueryPerformanceCounter(&m_origin);
+        return true;
+    }
+
+    void
+    CallTraceWriter::Stop()
+    {
+        if (m_pFile) {
+            if (fclose(m_pFile) != 0) {
+                ERROUT("Error writing trace file %s; the trace is incomplete", ASCII_REPR(m_filename));
+            }
+            m_pFile = NULL;
+        }
+        m_filename.clear();
+    }
+
+    double
+    CallTraceWriter::Clock() const
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return (double)(now.QuadPart - m_origin.QuadPart) / (double)m_frequency.QuadPart;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CallTraceWriter::WriteRecord( char kind )
+    {
+        unsigned long len = (unsigned long) m_record.size();
+        fputc(kind, m_pFile);
+        fwrite(&len, 1, sizeof(len), m_pFile);
+        if (len) {
+            fwrite(&m_record[0], 1, len, m_pFile);
+        }
+    }
+
+    // Each name is written once, the first time it's used
+    unsigned long
+    CallTraceWriter::NameId( const std::wstring& name )
+    {
+        std::map<std::wstring, unsigned long>::const_iterator it = m_names.find(name);
+        if (it != m_names.end()) {
+            return it->second;
+        }
+
+        unsigned long id = (unsigned long) m_names.size() + 1; // 0 = none
+        m_names[name] = id;
+
+        m_record.clear();
+        Put(id);
+        Put((unsigned long) name.size());
+        if (!name.empty()) {
+            PutBytes(name.data(), name.size() * sizeof(wchar_t));
+        }
+        WriteRecord('S');
+        return id;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Returns false only for a reference to cells that aren't calculated yet
+
+    bool
+    CallTraceWriter::PutValue( const xloper12& x, bool bTop )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:
+                Put('n');
+                Put(x.val.num);
+                break;
+
+            case xltypeInt:
+                Put('n');
+                Put((double) x.val.w);
+                break;
+
+            case xltypeStr:
+                Put('s');
+                Put((unsigned short) x.val.str[0]);
+                PutBytes(x.val.str + 1, x.val.str[0] * sizeof(wchar_t));
+                break;
+
+            case xltypeBool:
+                Put('b');
+                Put((unsigned char) (x.val.xbool ? 1 : 0));
+                break;
+
+            case xltypeErr:
+                Put('e');
+                Put((unsigned short) x.val.err);
+                break;
+
+            case xltypeNil:
+                Put('-');
+                break;
+
+            case xltypeMissing:
+                Put('.');
+                break;
+
+            case xltypeMulti: {
+                if (!bTop) {
+                    Put('?');
+                    break;
+                }
+                long cells = x.val.array.rows * x.val.array.columns;
+                Put('m');
+                Put((unsigned long) x.val.array.rows);
+                Put((unsigned long) x.val.array.columns);
+                for (long i = 0; i < cells; ++i) {
+                    PutValue(x.val.array.lparray[i], false);
+                }
+                break;
+            }
+
+            case xltypeRef:
+            case xltypeSRef: {
+                if (!bTop) {
+                    Put('?');
+                    break;
+                }
+                XLOPER12 xMulti, xType;
+                xType.xltype = xltypeInt;
+                xType.val.w = xltypeMulti;
+                int ret = XlfExcel::Instance().Call12(xlCoerce, &xMulti, 2, (LPXLOPER12)&x, &xType);
+                if (ret == xlretUncalced) {
+                    return false;
+                }
+                if (ret != xlretSuccess) {
+                    Put('?');
+                    break;
+                }
+                PutValue(xMulti, true);
+                XlfExcel::Instance().Call12(xlFree, NULL, 1, &xMulti);
+                break;
+            }
+
+            default:
+                Put('?');
+                break;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    CallTraceWriter::Record( const std::wstring& filename,
+                             const std::string& function,
+                             const xloper12* pArgs[],
+                             int count,
+                             bool bRangeArgs,
+                             const xloper12* pResult,
+                             double startSeconds,
+                             double elapsedSeconds )
+    {
+        if (!m_pFile) {
+            return;
+        }
+
+        // Where the call came from; the same call PyCall's own caller lookup makes
+        unsigned char flags = bRangeArgs ? traceRangeArgs : 0;
+        long row = -1, col = -1;
+        std::wstring sheet;
+        XLOPER12 xCaller;
+        if (XlfExcel::Instance().Call12(xlfCaller, &xCaller, 0) == xlretSuccess) {
+            if (xCaller.xltype == xltypeSRef) {
+                flags |= traceFromCell;
+                row = xCaller.val.sref.ref.rwFirst;
+                col = xCaller.val.sref.ref.colFirst;
+                XLOPER12 xSheet;
+                if (XlfExcel::Instance().Call12(xlSheetNm, &xSheet, 1, &xCaller) == xlretSuccess) {
+                    if (xSheet.xltype == xltypeStr) {
+                        sheet.assign(xSheet.val.str + 1, xSheet.val.str[0]);
+                    }
+                    XlfExcel::Instance().Call12(xlFree, NULL, 1, &xSheet);
+                }
+            }
+            XlfExcel::Instance().Call12(xlFree, NULL, 1, &xCaller);
+        }
+
+        // Names go out ahead of the record that first uses them
+        std::wstring wideFunction;
+        for (size_t i = 0; i < function.size(); ++i) {
+            wideFunction += (wchar_t)(unsigned char) function[i];
+        }
+        unsigned long sheetId = sheet.empty() ? 0 : NameId(sheet);
+        unsigned long fileId = NameId(filename);
+        unsigned long functionId = NameId(wideFunction);
+
+        while (count > 0 && (pArgs[count - 1]->xltype & ~(xlbitXLFree | xlbitDLLFree)) == xltypeMissing) {
+            --count;
+        }
+
+        m_record.clear();
+        Put(startSeconds);
+        Put(elapsedSeconds);
+        Put(flags);
+        Put(sheetId);
+        Put(row);
+        Put(col);
+        Put(fileId);
+        Put(functionId);
+        Put((unsigned char) count);
+        for (int i = 0; i < count; ++i) {
+            if (!PutValue(*pArgs[i], true)) {
+                return; // Excel calls it again once the cells are calculated
+            }
+        }
+        PutValue(*pResult, true);
+
+        WriteRecord('C');
+        ++m_count;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Reading a trace back: the whole file is read into memory and parsed from there
+
+    class TraceReader
+    {
+    public:
+        TraceReader( const unsigned char* pData, size_t len )
+            : m_p(pData), m_pEnd(pData + len), m_bOk(true) {}
+
+        bool Ok() const { return m_bOk; }
+        bool AtEnd() const { return m_p == m_pEnd; }
+        const unsigned char* Position() const { return m_p; }
+        void Seek( const unsigned char* p ) { m_p = p; }
+
+        bool GetBytes( void* pDest, size_t n )
+        {
+            if (!m_bOk || (size_t)(m_pEnd - m_p) < n) {
+                m_bOk = false;
+                return false;
+            }
+            memcpy(pDest, m_p, n);
+            m_p += n;
+            return true;
+        }
+
+        bool Skip( size_t n )
+        {
+            if (!m_bOk || (size_t)(m_pEnd - m_p) < n) {
+                m_bOk = false;
+                return false;
+            }
+            m_p += n;
+            return true;
+        }
+
+        template <typename T> T Get()
+        {
+            T value = T();
+            GetBytes(&value, sizeof(T));
+            return value;
+        }
+
+    private:
+        const unsigned char*    m_p;
+        const unsigned char*    m_pEnd;
+        bool                    m_bOk;
+    };
+
+    // Counts the cells and string characters that a value needs, reading past it
+    bool
+    MeasureTracedValue( TraceReader& r, size_t& rCells, size_t& rChars, bool bTop )
+    {
+        switch (r.Get<char>()) {
+            case 'n': r.Get<double>(); break;
+            case 'b': r.Get<unsigned char>(); break;
+            case 'e': r.Get<unsigned short>(); break;
+            case '-': case '.': case '?': break;
+
+            case 's': {
+                unsigned short len = r.Get<unsigned short>();
+                r.Skip(len * sizeof(wchar_t));
+                rChars += len + 1;
+                break;
+            }
+
+            case 'm': {
+                if (!bTop) {
+                    return false;
+                }
+                unsigned long rows = r.Get<unsigned long>();
+                unsigned long cols = r.Get<unsigned long>();
+                size_t cells = (size_t) rows * cols;
+                rCells += cells;
+                for (size_t i = 0; r.Ok() && i < cells; ++i) {
+                    if (!MeasureTracedValue(r, rCells, rChars, false)) {
+                        return false;
+                    }
+                }
+                break;
+            }
+
+            default:
+                return false;
+        }
+        return r.Ok();
+    }
+
+    // Second pass over a measured value; cells and text come from the record's storage
+    void
+    DecodeTracedValue( TraceReader& r, xloper12& x, xloper12*& rpCells, wchar_t*& rpText )
+    {
+        switch (r.Get<char>()) {
+            case 'n':
+                x.xltype = xltypeNum;
+                x.val.num = r.Get<double>();
+                break;
+
+            case 's': {
+                unsigned short len = r.Get<unsigned short>();
+                rpText[0] = (wchar_t) len;
+                r.GetBytes(rpText + 1, len * sizeof(wchar_t));
+                x.xltype = xltypeStr;
+                x.val.str = rpText;
+                rpText += len + 1;
+                break;
+            }
+
+            case 'b':
+                x.xltype = xltypeBool;
+                x.val.xbool = r.Get<unsigned char>();
+                break;
+
+            case 'e':
+                x.xltype = xltypeErr;
+                x.val.err = r.Get<unsigned short>();
+                break;
+
+            case '-':
+                x.xltype = xltypeNil;
+                break;
+
+            case 'm': {
+                unsigned long rows = r.Get<unsigned long>();
+                unsigned long cols = r.Get<unsigned long>();
+                size_t cells = (size_t) rows * cols;
+                x.xltype = xltypeMulti;
+                x.val.array.rows = (RW) rows;
+                x.val.array.columns = (COL) cols;
+                x.val.array.lparray = rpCells;
+                rpCells += cells;
+                for (size_t i = 0; i < cells; ++i) {
+                    DecodeTracedValue(r, x.val.array.lparray[i], rpCells, rpText);
+                }
+                break;
+            }
+
+            default: // '.' and '?'
+                x.xltype = xltypeMissing;
+                break;
+        }
+    }
+
+    bool
+    DecodeTracedCall( TraceReader& r,
+                      const std::map<unsigned long, std::wstring>& names,
+                      TracedCall& rCall )
+    {
+        rCall.startSeconds = r.Get<double>();
+        rCall.elapsedSeconds = r.Get<double>();
+        unsigned char flags = r.Get<unsigned char>();
+        unsigned long sheetId = r.Get<unsigned long>();
+        long row = r.Get<long>();
+        long col = r.Get<long>();
+        unsigned long fileId = r.Get<unsigned long>();
+        unsigned long functionId = r.Get<unsigned long>();
+        int count = r.Get<unsigned char>();
+        if (!r.Ok()) {
+            return false;
+        }
+
+        std::map<unsigned long, std::wstring>::const_iterator itFile = names.find(fileId);
+        std::map<unsigned long, std::wstring>::const_iterator itFunction = names.find(functionId);
+        if (itFile == names.end() || itFunction == names.end()) {
+            return false;
+        }
+        rCall.filename = itFile->second;
+        rCall.function.clear();
+        for (size_t i = 0; i < itFunction->second.size(); ++i) {
+            rCall.function += (char) itFunction->second[i];
+        }
+
+        rCall.bRangeArgs = (flags & traceRangeArgs) != 0;
+        rCall.caller.clear();
+        if (flags & traceFromCell) {
+            std::map<unsigned long, std::wstring>::const_iterator itSheet = names.find(sheetId);
+            if (itSheet != names.end()) {
+                rCall.caller = itSheet->second + L"!";
+            }
+            wchar_t cell[32];
+            swprintf(cell, NELEMS(cell), L"R%ldC%ld", row + 1, col + 1);
+            rCall.caller += cell;
+        }
+
+        // Size the storage first, so that nothing in it moves while it's filled
+        const unsigned char* pValues = r.Position();
+        size_t cells = 0, chars = 0;
+        for (int i = 0; i <= count; ++i) {
+            if (!MeasureTracedValue(r, cells, chars, true)) {
+                return false;
+            }
+        }
+
+        size_t bytes = (count + 1 + cells) * sizeof(xloper12) + chars * sizeof(wchar_t);
+        rCall.storage.assign(bytes / sizeof(double) + 1, 0.0);
+        xloper12* pTop = (xloper12*) &rCall.storage[0];
+        xloper12* pCells = pTop + count + 1;
+        wchar_t* pText = (wchar_t*)(pCells + cells);
+
+        r.Seek(pValues);
+        rCall.args.resize(count);
+        for (int i = 0; i < count; ++i) {
+            DecodeTracedValue(r, pTop[i], pCells, pText);
+            rCall.args[i] = &pTop[i];
+        }
+        DecodeTracedValue(r, pTop[count], pCells, pText);
+        rCall.pResult = &pTop[count];
+        return r.Ok();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Comparison of a replayed result with the recorded one, both as PyCall handed
+    // them back to Excel. An empty cell, a missing value and an empty string all
+    // show as an empty cell, so they match one another; NaNs match too.
+
+    bool
+    IsEmptyTracedCell( const xloper12& x )
+    {
+        int type = x.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        return type == xltypeNil || type == xltypeMissing || (type == xltypeStr && x.val.str[0] == 0);
+    }
+
+    bool
+    SameTracedCell( const xloper12& x, const xloper12& expected )
+    {
+        if (IsEmptyTracedCell(x) || IsEmptyTracedCell(expected)) {
+            return IsEmptyTracedCell(x) && IsEmptyTracedCell(expected);
+        }
+
+        int type = x.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        if ((int)(expected.xltype & ~(xlbitXLFree | xlbitDLLFree)) != type) {
+            return false;
+        }
+        switch (type) {
+            case xltypeNum:
+                return x.val.num == expected.val.num || (_isnan(x.val.num) && _isnan(expected.val.num));
+            case xltypeStr:
+                return x.val.str[0] == expected.val.str[0] &&
+                       memcmp(x.val.str + 1, expected.val.str + 1, x.val.str[0] * sizeof(wchar_t)) == 0;
+            case xltypeBool:
+                return (x.val.xbool != 0) == (expected.val.xbool != 0);
+            case xltypeErr:
+                return x.val.err == expected.val.err;
+            case xltypeInt:
+                return x.val.w == expected.val.w;
+        }
+        return false;
+    }
+
+    // A one-cell array shows as its cell
+    const xloper12&
+    TracedCell( const xloper12& x )
+    {
+        if ((x.xltype & xltypeMulti) && x.val.array.rows * x.val.array.columns == 1) {
+            return x.val.array.lparray[0];
+        }
+        return x;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StartCallTrace( const std::wstring& filename )
+{
+    return CallTraceWriter::Factory().Start(filename);
+}
+
+void
+StopCallTrace()
+{
+    CallTraceWriter::Factory().Stop();
+}
+
+bool
+CallTraceActive()
+{
+    return CallTraceWriter::Factory().Active();
+}
+
+void
+GetCallTraceFile( std::wstring& filename )
+{
+    filename = CallTraceWriter::Factory().Filename();
+}
+
+unsigned long
+TracedCallCount()
+{
+    return CallTraceWriter::Factory().Count();
+}
+
+double
+CallTraceClock()
+{
+    return CallTraceWriter::Factory().Clock();
+}
+
+void
+RecordTracedCall( const std::wstring& filename,
+                  const std::string& function,
+                  const xloper12* pArgs[],
+                  int count,
+                  bool bRangeArgs,
+                  const xloper12* pResult,
+                  double startSeconds,
+                  double elapsedSeconds )
+{
+    CallTraceWriter::Factory().Record(filename, function, pArgs, count, bRangeArgs, 
+                                      pResult, startSeconds, elapsedSeconds);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+LoadCallTrace( const std::wstring& filename, std::vector<TracedCall*>& rCalls )
+{
+    FILE* pFile = _wfopen(filename.c_str(), L"rb");
+    if (!pFile) {
+        ERROUT("Couldn't open trace file %s", ASCII_REPR(filename));
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), pFile)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(pFile);
+
+    char magic[8];
+    TraceReader r(data.empty() ? NULL : &data[0], data.size());
+    r.GetBytes(magic, sizeof(magic));
+    unsigned long version = r.Get<unsigned long>();
+    unsigned long pyVersion = r.Get<unsigned long>();
+    if (!r.Ok() || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        ERROUT("%s is not a Pyinex trace file", ASCII_REPR(filename));
+        return false;
+    }
+    if (version != TRACE_VERSION) {
+        ERROUT("%s is trace format version %lu; this build reads version %lu", 
+               ASCII_REPR(filename), version, TRACE_VERSION);
+        return false;
+    }
+    if ((pyVersion >> 16) != ((unsigned long) PY_VERSION_HEX >> 16)) {
+        WARNOUT("%s was recorded under Python %lu.%lu", ASCII_REPR(filename), pyVersion >> 24, (pyVersion >> 16) & 0xff);
+    }
+
+    std::map<unsigned long, std::wstring> names;
+    while (r.Ok() && !r.AtEnd()) {
+        char kind = r.Get<char>();
+        unsigned long len = r.Get<unsigned long>();
+        const unsigned char* pRecord = r.Position();
+        if (!r.Ok()) {
+            break;
+        }
+
+        TraceReader rec(pRecord, len);
+        if (kind == 'S') {
+            unsigned long id = rec.Get<unsigned long>();
+            unsigned long count = rec.Get<unsigned long>();
+            std::wstring& name = names[id];
+            name.resize(count);
+            if (count) {
+                rec.GetBytes(&name[0], count * sizeof(wchar_t));
+            }
+        } else if (kind == 'C') {
+            TracedCall* pCall = new TracedCall;
+            if (DecodeTracedCall(rec, names, *pCall)) {
+                rCalls.push_back(pCall);
+            } else {
+                delete pCall;
+                WARNOUT("Skipped unreadable call record %lu in %s", (unsigned long) rCalls.size(), ASCII_REPR(filename));
+            }
+        } // other kinds are for later versions; skip them
+
+        r.Skip(len);
+    }
+
+    if (!r.Ok()) {
+        WARNOUT("%s ends part-way through a record; it was probably still being written", ASCII_REPR(filename));
+    }
+    return true;
+}
+
+void
+FreeCallTrace( std::vector<TracedCall*>& rCalls )
+{
+    for (size_t i = 0; i < rCalls.size(); ++i) {
+        delete rCalls[i];
+    }
+    rCalls.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+SameTracedResult( const xloper12& result, const xloper12& expected )
+{
+    const xloper12& x = TracedCell(result);
+    const xloper12& y = TracedCell(expected);
+    if (!(x.xltype & xltypeMulti) || !(y.xltype & xltypeMulti)) {
+        return SameTracedCell(x, y);
+    }
+
+    if (x.val.array.rows != y.val.array.rows || x.val.array.columns != y.val.array.columns) {
+        return false;
+    }
+    long cells = (long)x.val.array.rows * x.val.array.columns;
+    for (long i = 0; i < cells; ++i) {
+        if (!SameTracedCell(x.val.array.lparray[i], y.val.array.lparray[i])) {
+            return false;
+        }
+    }
+    return true;
+}
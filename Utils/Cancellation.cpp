@@ -0,0 +1,557 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <process.h>
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// pyinex.Break() used to call back into Excel (xlAbort) on every invocation,
+// which is far too slow to do inside a tight loop. The break state now lives in
+// a flag here. Break() reads the flag, and only asks Excel again once the cached
+// answer is more than BREAK_POLL_MS old, so polling it costs next to nothing.
+//
+// xlAbort can only be called on Excel's calc thread. For scripts that never poll
+// at all, there's an opt-in mode (PyBreakInterrupt) in which a watchdog thread
+// watches for Esc while a PyCall is running, sets the flag, and raises
+// KeyboardInterrupt in the running script via Py_AddPendingCall. Pending calls run
+// on the interpreter's main thread - the calc thread, which is where PyCall runs -
+// the next time the eval loop checks for them, so code inside a long-running C
+// extension call is interrupted when it returns to Python.
+//
+// The same watchdog enforces time budgets. A PyCall given a budget (globally via
+// PyTimeout, or per function via the pyinex.Timeout decorator) that overruns it
+// gets pyinex.CallTimeout raised in it, and the cell returns #NUM! rather than
+// the usual #NULL!, so a pathological input costs one budget, not the whole recalc.
+// #NUM! is the timeout's alone; #N/A already means a missing value, a NaN or a
+// reference that isn't calculated yet.
+
+namespace {
+
+    const DWORD BREAK_POLL_MS = 100;    // max age of the cached xlAbort answer
+    const DWORD KEY_POLL_MS = 50;       // watchdog's polling interval; also the deadline granularity
+
+    enum InterruptKind { interruptBreak, interruptTimeout };
+
+    class Cancellation
+    {
+    public:
+        static Cancellation& Factory();
+
+        void BeginCall( double timeoutSeconds );
+        bool EndCall();
+
+        bool BreakRequested();
+        void ClearBreak();
+        bool Interrupt() { return Interrupt(interruptBreak, m_callGeneration); }
+
+        bool InterruptEnabled() const { return m_interruptEnabled != 0; }
+        void SetInterruptEnabled( bool bEnable );
+
+        double TimeoutSeconds() const { return m_timeoutSeconds; }
+        void SetTimeoutSeconds( double seconds ) { m_timeoutSeconds = seconds; }
+
+        void RecordTimeout( const std::string& function );
+        void TimeoutCounts( std::map<std::string, unsigned long>& rCounts ) const;
+        unsigned long TotalTimeouts() const { return m_totalTimeouts; }
+
+    private:
+        Cancellation();
+        ~Cancellation();
+
+        bool Interrupt( InterruptKind kind, LONG generation );
+        bool StartWatchdog();
+        bool EscapePressed() const;
+        void Poll();
+
+        static int RaiseInterrupt( void* pGeneration );
+        static unsigned __stdcall WatchdogMain( void* pCancellation );
+
+    private:
+        volatile LONG   m_break;            // cached break state; any thread may set it
+        volatile LONG   m_callDepth;        // PyCalls in progress (calc thread only changes it)
+        volatile LONG   m_callGeneration;   // identifies the outermost call in progress
+        volatile LONG   m_interruptPending; // a RaiseInterrupt is queued with Python
+        volatile LONG   m_interruptKind;    // what the queued RaiseInterrupt raises
+        volatile LONG   m_interruptEnabled;
+        DWORD           m_lastPoll;         // calc thread only
+
+        // Deadline of the current call; m_deadlineGeneration is zero if it has none
+        volatile LONG   m_deadlineGeneration;
+        volatile DWORD  m_deadline;
+        volatile LONG   m_timedOutGeneration;
+
+        // Calc thread only
+        double          m_timeoutSeconds;   // global budget; zero = none
+        std::map<std::string, unsigned long> m_timeoutCounts;
+        unsigned long   m_totalTimeouts;
+
+        HANDLE          m_hWatchdog;
+        HANDLE          m_hActive;          // manual reset; set while a call is in progress
+        HANDLE          m_hQuit;
+
+        Cancellation( const Cancellation& );
+        Cancellation& operator=( const Cancellation& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Cancellation&
+    Cancellation::Factory()
+    {
+        static Cancellation g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Cancellation::Cancellation() :
+        m_break(0),
+        m_callDepth(0),
+        m_callGeneration(0),
+        m_interruptPending(0),
+        m_interruptKind(interruptBreak),
+        m_interruptEnabled(0),
+        m_lastPoll(GetTickCount() - BREAK_POLL_MS),
+        m_deadlineGeneration(0),
+        m_deadline(0),
+        m_timedOutGeneration(0),
+        m_timeoutSeconds(0.0),
+        m_totalTimeouts(0),
+        m_hWatchdog(NULL),
+        m_hActive(NULL),
+        m_hQuit(NULL)
+    {
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Runs inside DllMain at unload; signal the watchdog but don't wait for it,
+    // as it can't exit while we hold the loader lock. It touches nothing but the
+    // two events after waking, and those are deliberately not closed.
+
+    Cancellation::~Cancellation()
+    {
+        if (m_hWatchdog) {
+            SetEvent(m_hQuit);
+            CloseHandle(m_hWatchdog);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    //
+    // Calc thread only. A budget of zero or less means none.
+
+    void
+    Cancellation::BeginCall( double timeoutSeconds )
+    {
+        if (InterlockedIncrement(&m_callDepth) != 1) {
+            return; // nested; the outermost call's deadline stands
+        }
+
+        LONG generation = InterlockedIncrement(&m_callGeneration);
+        if (generation == 0) {
+            generation = InterlockedIncrement(&m_callGeneration); // zero means "no call"
+        }
+
+        if (timeoutSeconds > 0.0) {
+            if (StartWatchdog()) {
+                m_deadline = GetTickCount() + (DWORD)(timeoutSeconds * 1000.0);
+                InterlockedExchange(&m_deadlineGeneration, generation);
+            } else {
+                ERROUT("Couldn't start the watchdog; the call runs without its %g second budget", timeoutSeconds);
+            }
+        }
+
+        if (m_hActive) {
+            SetEvent(m_hActive);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Returns true if the (outermost) call ran out of time.
+
+    bool
+    Cancellation::EndCall()
+    {
+        if (InterlockedDecrement(&m_callDepth) != 0) {
+            return false;
+        }
+
+        InterlockedExchange(&m_deadlineGeneration, 0);
+        if (m_hActive) {
+            ResetEvent(m_hActive);
+        }
+
+        return m_timedOutGeneration == m_callGeneration;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, as it may call into Excel
+
+    bool
+    Cancellation::BreakRequested()
+    {
+        DWORD now = GetTickCount();
+        if (now - m_lastPoll >= BREAK_POLL_MS) {
+            m_lastPoll = now;
+
+            XlfOper breakReq;
+            XlfOper preserveBreak(true);
+            XlfExcel::Instance().Call(xlAbort, breakReq, 1, (LPXLFOPER) preserveBreak );
+            InterlockedExchange(&m_break, breakReq.AsBool() ? 1 : 0);
+        }
+
+        return m_break != 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Excel's "PreserveBreak" argument has the opposite sense.
+
+    void
+    Cancellation::ClearBreak()
+    {
+        XlfOper breakReq;
+        XlfOper preserveBreak(false);
+        XlfExcel::Instance().Call(xlAbort, breakReq, 1, (LPXLFOPER) preserveBreak );
+
+        InterlockedExchange(&m_break, 0);
+        m_lastPoll = GetTickCount();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Any thread. For a break, sets the break flag; then, if the given call is still
+    // running, queues an exception for it. Returns false if there was nothing to interrupt.
+
+    bool
+    Cancellation::Interrupt( InterruptKind kind, LONG generation )
+    {
+        if (kind == interruptBreak) {
+            InterlockedExchange(&m_break, 1);
+        }
+
+        if (m_callDepth == 0 || generation != m_callGeneration) {
+            return false;
+        }
+
+        if (InterlockedExchange(&m_interruptPending, 1)) {
+            return true; // one is already on its way
+        }
+
+        InterlockedExchange(&m_interruptKind, kind);
+        if (Py_AddPendingCall(RaiseInterrupt, (void*)(LONG_PTR)generation) != 0) {
+            // Python's pending-call queue is full; try again on the next poll
+            InterlockedExchange(&m_interruptPending, 0);
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Called by Python on the calc thread, with the GIL held. The call that was
+    // meant to be interrupted may already have returned; don't raise into whatever
+    // Python code happens to run next.
+
+    int
+    Cancellation::RaiseInterrupt( void* pGeneration )
+    {
+        Cancellation& rThis = Factory();
+        InterlockedExchange(&rThis.m_interruptPending, 0);
+
+        if (rThis.m_callDepth == 0 || rThis.m_callGeneration != (LONG)(LONG_PTR)pGeneration) {
+            return 0;
+        }
+
+        if (rThis.m_interruptKind == interruptTimeout) {
+            PyErr_SetString(CallTimeoutException(), "PyCall exceeded its time budget");
+        } else {
+            PyErr_SetNone(PyExc_KeyboardInterrupt);
+        }
+        return -1;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    Cancellation::SetInterruptEnabled( bool bEnable )
+    {
+        if (bEnable && !StartWatchdog()) {
+            ERROUT("Couldn't start the break watchdog; Esc won't interrupt running scripts");
+            return;
+        }
+        InterlockedExchange(&m_interruptEnabled, bEnable ? 1 : 0);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Keyed by "module!function".
+
+    void
+    Cancellation::RecordTimeout( const std::string& function )
+    {
+        ++m_timeoutCounts[function];
+        ++m_totalTimeouts;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    Cancellation::TimeoutCounts( std::map<std::string, unsigned long>& rCounts ) const
+    {
+        rCounts = m_timeoutCounts;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Started on first use, and left running (idle, waiting on
+    // m_hActive) for the life of the process.
+
+    bool
+    Cancellation::StartWatchdog()
+    {
+        if (m_hWatchdog) {
+            return true;
+        }
+
+        m_hActive = CreateEvent(NULL, TRUE, m_callDepth > 0, NULL);
+        m_hQuit = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!m_hActive || !m_hQuit) {
+            std::string errTxt;
+            GetWindowsErrorText(errTxt);
+            ERROUT("CreateEvent failed: %s", errTxt.c_str());
+            return false;
+        }
+
+        m_hWatchdog = (HANDLE)_beginthreadex(NULL, 0, WatchdogMain, this, 0, NULL);
+        return m_hWatchdog != NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Only counts if Excel has the focus; Esc in another application is none of our business
+
+    bool
+    Cancellation::EscapePressed() const
+    {
+        if (!(GetAsyncKeyState(VK_ESCAPE) & 0x8001)) {
+            return false;
+        }
+
+        DWORD pid = 0;
+        HWND hForeground = GetForegroundWindow();
+        if (hForeground) {
+            GetWindowThreadProcessId(hForeground, &pid);
+        }
+        return pid == GetCurrentProcessId();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    unsigned __stdcall
+    Cancellation::WatchdogMain( void* pCancellation )
+    {
+        Cancellation* pThis = (Cancellation*)pCancellation;
+        HANDLE quit = pThis->m_hQuit, active = pThis->m_hActive;
+        HANDLE handles[2] = { quit, active };
+
+        for (;;) {
+            // Sleep until a call is running, then poll the keyboard while it does
+            if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+                break;
+            }
+            if (WaitForSingleObject(quit, KEY_POLL_MS) == WAIT_OBJECT_0) {
+                break;
+            }
+
+            pThis->Poll();
+        }
+
+        return 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Watchdog thread. The deadline and its generation are read without a lock;
+    // a torn pair at worst yields an interrupt that RaiseInterrupt discards.
+
+    void
+    Cancellation::Poll()
+    {
+        if (m_callDepth == 0) {
+            return;
+        }
+
+        LONG generation = m_deadlineGeneration;
+        if (generation != 0 && (LONG)(GetTickCount() - m_deadline) >= 0) {
+            InterlockedExchange(&m_timedOutGeneration, generation);
+            Interrupt(interruptTimeout, generation);
+            return;
+        }
+
+        if (m_interruptEnabled && EscapePressed()) {
+            Interrupt(interruptBreak, m_callGeneration);
+        }
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+BeginCancellableCall( double timeoutSeconds )
+{
+    Cancellation::Factory().BeginCall(timeoutSeconds);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+EndCancellableCall()
+{
+    return Cancellation::Factory().EndCall();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+BreakRequested()
+{
+    return Cancellation::Factory().BreakRequested();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+ClearBreak()
+{
+    Cancellation::Factory().ClearBreak();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+InterruptRunningCall()
+{
+    return Cancellation::Factory().Interrupt();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+BreakInterruptEnabled()
+{
+    return Cancellation::Factory().InterruptEnabled();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetBreakInterrupt( bool bInterrupt )
+{
+    Cancellation::Factory().SetInterruptEnabled(bInterrupt);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+double
+CallTimeoutSeconds()
+{
+    return Cancellation::Factory().TimeoutSeconds();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetCallTimeout( double seconds )
+{
+    Cancellation::Factory().SetTimeoutSeconds(seconds);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+RecordCallTimeout( const std::string& function )
+{
+    Cancellation::Factory().RecordTimeout(function);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetCallTimeoutCounts( std::map<std::string, unsigned long>& rCounts )
+{
+    Cancellation::Factory().TimeoutCounts(rCounts);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+TotalCallTimeouts()
+{
+    return Cancellation::Factory().TotalTimeouts();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Derives from KeyboardInterrupt, not Exception, so that a bare "except Exception"
+// in the script doesn't swallow it. Created on first use; needs the GIL.
+
+PyObject*
+CallTimeoutException()
+{
+    static PyObject* g_pCallTimeout = NULL;
+    if (!g_pCallTimeout) {
+        g_pCallTimeout = PyErr_NewException((char*)"pyinex.CallTimeout", PyExc_KeyboardInterrupt, NULL);
+    }
+    return g_pCallTimeout;
+}
@@ -362,7 +362,10 @@ namespace
 
         *pGlobalStream = *hf;
 
-        // Turn off buffering
+        // Turn off buffering. Python's sys.stdout and sys.stderr, and PrintError, no longer
+        // come through here (they go to the log writer thread; see LogSink.cpp), so what's
+        // left is printf from C extensions and the interpreter's fatal-error output - the
+        // latter is exactly what must not be sitting in a buffer when the process dies.
         p_setvbuf( pGlobalStream, NULL, _IONBF, 0 );
         return true;
     }
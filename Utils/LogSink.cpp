@@ -0,0 +1,763 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <process.h>
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Console output used to be a synchronous, unbuffered write on the calc thread
+// for every Python print and every ERROUT. A script printing once per cell could
+// spend most of its recalc time waiting on the console.
+//
+// Now all of that text goes into a bounded multi-producer, single-consumer queue
+// (Dmitry Vyukov's design: each slot carries a sequence number that tells producers
+// and the consumer whose turn it is, so the only contended operation is a single
+// compare-exchange on the enqueue position). A background thread drains the queue
+// in batches to the console and, optionally, to a size-rotated log file.
+//
+// Producers never block. If the queue is full the message is dropped and counted;
+// the writer reports the count the next time it gets to write. Producers only wake
+// the writer for errors or when the queue is half full - otherwise it picks up
+// pending text on its own timer - so a print costs a memcpy, not a system call.
+//
+// Until the writer thread is started (and after it's stopped) text is written
+// synchronously, so nothing logged during startup or shutdown is lost. Producers
+// count themselves in and out around each use of the queue and the wake event;
+// Stop clears m_running, which turns new producers synchronous, and waits for the
+// count to reach zero before the final drain and before it closes the event.
+
+namespace {
+
+    const LONG   SLOT_COUNT = 4096;             // must be a power of two
+    const LONG   SLOT_MASK = SLOT_COUNT - 1;
+    const size_t SLOT_TEXT = 244;               // a typical ERROUT line fits in one slot
+    const DWORD  WRITER_PERIOD_MS = 50;         // upper bound on console latency for non-errors
+    const size_t BATCH_BYTES = 64 * 1024;
+    const DWORD  FLUSH_TIMEOUT_MS = 2000;
+    const DWORD  STOP_TIMEOUT_MS = 5000;
+
+    const unsigned long ALL_SEVERITIES = pyxError | pyxWarning | pyxInfo | pyxOutput;
+
+    struct Slot
+    {
+        volatile LONG   seq;
+        unsigned short  len;
+        unsigned short  severity;
+        char            text[SLOT_TEXT];
+    };
+
+    // Positions wrap; compare them by signed distance
+    inline LONG Distance( LONG to, LONG from )
+    {
+        return (LONG)((ULONG)to - (ULONG)from);
+    }
+
+    inline LONG Next( LONG pos )
+    {
+        return (LONG)((ULONG)pos + 1);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    class LogSink
+    {
+    public:
+        static LogSink& Factory();
+
+        bool Start();
+        void Stop();
+        void Flush();
+        void Write( pyxErrorSeverity severity, const char* pText, size_t len );
+
+        unsigned long SeverityMask() const { return (unsigned long)m_mask; }
+        void SetSeverityMask( unsigned long mask ) { InterlockedExchange(&m_mask, (LONG)(mask & ALL_SEVERITIES)); }
+        unsigned long Dropped() const { return (unsigned long)m_dropped; }
+
+        void SetFile( const std::wstring& filename, unsigned long maxBytes, unsigned long keep );
+
+    private:
+        LogSink();
+        ~LogSink();
+
+        bool EnterProducer();
+        void LeaveProducer() { InterlockedDecrement(&m_producers); }
+        bool Push( pyxErrorSeverity severity, const char* pText, size_t len );
+        void Drain();
+        void ApplyFileSettings();
+        void OpenFile();
+        void CloseFile();
+        void RotateFile();
+        void WriteConsoleText( const char* pText, size_t len );
+        void WriteFileText( const char* pText, size_t len );
+        void WriteBatch();
+
+        static unsigned __stdcall WriterMain( void* pSink );
+
+    private:
+        Slot*           m_slots;
+        volatile LONG   m_enqueuePos;
+        volatile LONG   m_dequeuePos;   // advanced by the writer thread only
+        volatile LONG   m_writtenPos;   // queue position the writer has fully written out
+        volatile LONG   m_dropped;
+        volatile LONG   m_mask;
+        volatile LONG   m_running;      // cleared first thing in Stop; producers check it
+        volatile LONG   m_producers;    // threads between checking m_running and finishing
+        volatile LONG   m_stop;
+
+        HANDLE          m_hThread;
+        HANDLE          m_hWake;
+        HANDLE          m_hDone;        // set by the writer after its final drain
+        bool            m_bAbandoned;   // writer didn't finish in time; its state is leaked
+        HANDLE          m_hConsole;
+        bool            m_bRealConsole; // false if stdout is a pipe or file
+
+        // Serializes synchronous writes, and guards the requested file settings below
+        mutable CRITICAL_SECTION m_cs;
+
+        std::wstring    m_filename;
+        unsigned long   m_maxBytes;
+        unsigned long   m_keep;
+        bool            m_bFileChanged;
+        bool            m_bLimitsChanged;
+
+        // Owned by the writer thread
+        HANDLE          m_hFile;
+        std::wstring    m_openFilename;
+        unsigned long   m_openMaxBytes;
+        unsigned long   m_openKeep;
+        ULONGLONG       m_fileSize;
+        unsigned long   m_droppedReported;
+        std::vector<char>    m_batch;
+        std::vector<wchar_t> m_wide;
+
+        LogSink( const LogSink& );
+        LogSink& operator=( const LogSink& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    LogSink&
+    LogSink::Factory()
+    {
+        static LogSink g_sink;
+        return g_sink;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    LogSink::LogSink() :
+        m_slots(new Slot[SLOT_COUNT]),
+        m_enqueuePos(0),
+        m_dequeuePos(0),
+        m_writtenPos(0),
+        m_dropped(0),
+        m_mask((LONG)ALL_SEVERITIES),
+        m_running(0),
+        m_producers(0),
+        m_stop(0),
+        m_hThread(NULL),
+        m_hWake(NULL),
+        m_hDone(NULL),
+        m_bAbandoned(false),
+        m_hConsole(INVALID_HANDLE_VALUE),
+        m_bRealConsole(false),
+        m_maxBytes(0),
+        m_keep(0),
+        m_bFileChanged(false),
+        m_bLimitsChanged(false),
+        m_hFile(INVALID_HANDLE_VALUE),
+        m_openMaxBytes(0),
+        m_openKeep(0),
+        m_fileSize(0),
+        m_droppedReported(0)
+    {
+        for (LONG i = 0; i < SLOT_COUNT; ++i) {
+            m_slots[i].seq = i;
+        }
+        InitializeCriticalSection(&m_cs);
+        m_batch.reserve(BATCH_BYTES + SLOT_TEXT);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    LogSink::~LogSink()
+    {
+        Stop();
+        if (m_bAbandoned) {
+            return;
+        }
+        DeleteCriticalSection(&m_cs);
+        delete [] m_slots;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Call after the console has been allocated; the console handle is picked up here.
+
+    bool
+    LogSink::Start()
+    {
+        if (m_running) {
+            return true;
+        }
+
+        m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode;
+        m_bRealConsole = (m_hConsole != INVALID_HANDLE_VALUE && m_hConsole != NULL &&
+                          GetConsoleMode(m_hConsole, &mode) != FALSE);
+
+        m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!m_hWake || !m_hDone) {
+            std::string errTxt;
+            GetWindowsErrorText(errTxt);
+            ERROUT("CreateEvent failed; console output stays synchronous: %s", errTxt.c_str());
+            if (m_hWake) {
+                CloseHandle(m_hWake);
+                m_hWake = NULL;
+            }
+            if (m_hDone) {
+                CloseHandle(m_hDone);
+                m_hDone = NULL;
+            }
+            return false;
+        }
+
+        m_stop = 0;
+        m_hThread = (HANDLE)_beginthreadex(NULL, 0, WriterMain, this, 0, NULL);
+        if (!m_hThread) {
+            CloseHandle(m_hWake);
+            CloseHandle(m_hDone);
+            m_hWake = NULL;
+            m_hDone = NULL;
+            ERROUT("Couldn't start the log writer thread; console output stays synchronous");
+            return false;
+        }
+
+        InterlockedExchange(&m_running, 1);
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::Stop()
+    {
+        if (!m_running) {
+            return;
+        }
+
+        // New writes go synchronous from here on. Ones already past the check may
+        // still push or set the wake event, so let them finish before the writer's
+        // final drain; after that nobody touches the queue or the event.
+        InterlockedExchange(&m_running, 0);
+        DWORD start = GetTickCount();
+        while (m_producers > 0) {
+            if (GetTickCount() - start > STOP_TIMEOUT_MS) {
+                m_bAbandoned = true;
+                return;
+            }
+            Sleep(1);
+        }
+
+        InterlockedExchange(&m_stop, 1);
+        SetEvent(m_hWake);
+
+        // Wait for the writer's own signal rather than the thread handle. This runs from
+        // a static destructor, i.e. inside DllMain when the XLL is unloaded, and the thread
+        // can't exit until the loader lock is released.
+        if (WaitForSingleObject(m_hDone, STOP_TIMEOUT_MS) != WAIT_OBJECT_0) {
+            // Still writing (console blocked?); don't free anything it's using
+            m_bAbandoned = true;
+            return;
+        }
+
+        CloseHandle(m_hThread);
+        CloseHandle(m_hWake);
+        CloseHandle(m_hDone);
+        m_hThread = NULL;
+        m_hWake = NULL;
+        m_hDone = NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Waits (briefly) for everything queued so far to reach the console. Only
+    // needed where ordering against something else matters, e.g. clearing the screen.
+
+    void
+    LogSink::Flush()
+    {
+        if (!EnterProducer()) {
+            return;
+        }
+
+        LONG target = m_enqueuePos;
+        SetEvent(m_hWake);
+        LeaveProducer();
+
+        DWORD start = GetTickCount();
+        while (Distance(target, m_writtenPos) > 0 && m_running) {
+            if (GetTickCount() - start > FLUSH_TIMEOUT_MS) {
+                break;
+            }
+            Sleep(1);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Counts the caller in if the writer is running; the caller may then push and
+    // set the wake event until LeaveProducer(). Counting in before the check means
+    // Stop either sees the caller or the caller sees Stop's cleared m_running.
+
+    bool
+    LogSink::EnterProducer()
+    {
+        InterlockedIncrement(&m_producers);
+        if (!m_running) {
+            LeaveProducer();
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::Write( pyxErrorSeverity severity, const char* pText, size_t len )
+    {
+        if (!(m_mask & severity) || len == 0) {
+            return;
+        }
+
+        if (!EnterProducer()) {
+            EnterCriticalSection(&m_cs);
+            WriteConsoleText(pText, len);
+            LeaveCriticalSection(&m_cs);
+            return;
+        }
+
+        // Long messages take several slots. Chunks of concurrent writers may
+        // interleave; each chunk itself is intact, and ends on a whole UTF-8
+        // character so that the console never gets half of one.
+        while (len > 0) {
+            size_t chunk = len < SLOT_TEXT ? len : SLOT_TEXT;
+            if (chunk < len) {
+                size_t whole = chunk;
+                while (whole > 0 && ((unsigned char)pText[whole] & 0xC0) == 0x80) {
+                    --whole;
+                }
+                if (whole > 0) {
+                    chunk = whole;
+                }
+            }
+            if (!Push(severity, pText, chunk)) {
+                InterlockedIncrement(&m_dropped);
+                break;
+            }
+            pText += chunk;
+            len -= chunk;
+        }
+        LeaveProducer();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    LogSink::Push( pyxErrorSeverity severity, const char* pText, size_t len )
+    {
+        LONG pos = m_enqueuePos;
+        Slot* pSlot;
+        for (;;) {
+            pSlot = &m_slots[pos & SLOT_MASK];
+            LONG dif = Distance(pSlot->seq, pos);
+            if (dif == 0) {
+                // Slot is free for this position; claim the position
+                if (InterlockedCompareExchange(&m_enqueuePos, Next(pos), pos) == pos) {
+                    break;
+                }
+            } else if (dif < 0) {
+                // Writer hasn't consumed this slot from the previous lap; queue is full
+                return false;
+            }
+            pos = m_enqueuePos;
+        }
+
+        memcpy(pSlot->text, pText, len);
+        pSlot->len = (unsigned short)len;
+        pSlot->severity = (unsigned short)severity;
+
+        // Publish; the interlocked store is a full barrier, so the text is visible first
+        InterlockedExchange(&pSlot->seq, Next(pos));
+
+        if (severity == pyxError || Distance(pos, m_dequeuePos) >= SLOT_COUNT / 2) {
+            SetEvent(m_hWake);
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::Drain()
+    {
+        m_batch.clear();
+        for (;;) {
+            LONG pos = m_dequeuePos;
+            Slot& rSlot = m_slots[pos & SLOT_MASK];
+            if (Distance(rSlot.seq, Next(pos)) != 0) {
+                break; // not yet published
+            }
+
+            m_batch.insert(m_batch.end(), rSlot.text, rSlot.text + rSlot.len);
+
+            // Hand the slot back to producers for the next lap
+            InterlockedExchange(&rSlot.seq, (LONG)((ULONG)pos + SLOT_COUNT));
+            InterlockedExchange(&m_dequeuePos, Next(pos));
+
+            if (m_batch.size() >= BATCH_BYTES) {
+                WriteBatch();
+                InterlockedExchange(&m_writtenPos, m_dequeuePos);
+            }
+        }
+
+        unsigned long dropped = (unsigned long)m_dropped;
+        if (dropped != m_droppedReported) {
+            char note[128];
+            int n = _snprintf_s(note, NELEMS(note), _TRUNCATE,
+                "\n[pyinex] %lu log messages dropped; output was faster than the console\n\n",
+                dropped - m_droppedReported);
+            if (n > 0) {
+                m_batch.insert(m_batch.end(), note, note + n);
+            }
+            m_droppedReported = dropped;
+        }
+
+        WriteBatch();
+        InterlockedExchange(&m_writtenPos, m_dequeuePos);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::WriteBatch()
+    {
+        if (m_batch.empty()) {
+            return;
+        }
+
+        WriteConsoleText(&m_batch[0], m_batch.size());
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            WriteFileText(&m_batch[0], m_batch.size());
+        }
+        m_batch.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Text in the queue is UTF-8 (ASCII for everything Pyinex itself logs). A real
+    // console gets it as UTF-16 through WriteConsoleW, so non-ASCII output from
+    // Python shows up regardless of the console code page.
+
+    void
+    LogSink::WriteConsoleText( const char* pText, size_t len )
+    {
+        if (m_hConsole == INVALID_HANDLE_VALUE || m_hConsole == NULL) {
+            m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+            if (m_hConsole == INVALID_HANDLE_VALUE || m_hConsole == NULL) {
+                return;
+            }
+            DWORD mode;
+            m_bRealConsole = (GetConsoleMode(m_hConsole, &mode) != FALSE);
+        }
+
+        DWORD written;
+        if (!m_bRealConsole) {
+            WriteFile(m_hConsole, pText, (DWORD)len, &written, NULL);
+            return;
+        }
+
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, pText, (int)len, NULL, 0);
+        if (wlen <= 0) {
+            WriteFile(m_hConsole, pText, (DWORD)len, &written, NULL);
+            return;
+        }
+
+        if (m_wide.size() < (size_t)wlen) {
+            m_wide.resize(wlen);
+        }
+        MultiByteToWideChar(CP_UTF8, 0, pText, (int)len, &m_wide[0], wlen);
+        WriteConsoleW(m_hConsole, &m_wide[0], (DWORD)wlen, &written, NULL);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::WriteFileText( const char* pText, size_t len )
+    {
+        if (m_openMaxBytes && m_fileSize > 0 && m_fileSize + len > m_openMaxBytes) {
+            RotateFile();
+            if (m_hFile == INVALID_HANDLE_VALUE) {
+                return;
+            }
+        }
+
+        DWORD written = 0;
+        WriteFile(m_hFile, pText, (DWORD)len, &written, NULL);
+        m_fileSize += written;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Called on every recalc of PyLog(), so the file is only reopened (and its
+    // size re-read) when the name changes. New limits for the same file are
+    // picked up without reopening it.
+
+    void
+    LogSink::SetFile( const std::wstring& filename, unsigned long maxBytes, unsigned long keep )
+    {
+        EnterCriticalSection(&m_cs);
+        bool bSameFile = (_wcsicmp(m_filename.c_str(), filename.c_str()) == 0);
+        bool bChanged = !bSameFile || maxBytes != m_maxBytes || keep != m_keep;
+        if (!bSameFile) {
+            m_filename = filename;
+            m_bFileChanged = true;
+        }
+        if (bChanged) {
+            m_maxBytes = maxBytes;
+            m_keep = keep;
+            m_bLimitsChanged = true;
+        }
+        LeaveCriticalSection(&m_cs);
+
+        if (bChanged && EnterProducer()) {
+            SetEvent(m_hWake);
+            LeaveProducer();
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Writer thread only. Picks up a new file or new limits set through SetFile().
+
+    void
+    LogSink::ApplyFileSettings()
+    {
+        EnterCriticalSection(&m_cs);
+        bool bChanged = m_bFileChanged;
+        if (bChanged) {
+            m_openFilename = m_filename;
+            m_bFileChanged = false;
+        }
+        if (m_bLimitsChanged) {
+            // The next write rotates if the file is already over a lower limit
+            m_openMaxBytes = m_maxBytes;
+            m_openKeep = m_keep;
+            m_bLimitsChanged = false;
+        }
+        LeaveCriticalSection(&m_cs);
+
+        if (bChanged) {
+            CloseFile();
+            if (!m_openFilename.empty()) {
+                OpenFile();
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::OpenFile()
+    {
+        m_hFile = CreateFileW( m_openFilename.c_str(),
+                               FILE_APPEND_DATA,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL );
+
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            std::string errTxt;
+            GetWindowsErrorText(errTxt);
+            ERROUT("Couldn't open log file %s: %s", ASCII_REPR(m_openFilename), errTxt.c_str());
+            return;
+        }
+
+        LARGE_INTEGER size;
+        m_fileSize = GetFileSizeEx(m_hFile, &size) ? (ULONGLONG)size.QuadPart : 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    LogSink::CloseFile()
+    {
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+        m_fileSize = 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // log.txt -> log.txt.1 -> log.txt.2 ... -> log.txt.<keep>, which is overwritten
+
+    void
+    LogSink::RotateFile()
+    {
+        CloseFile();
+
+        if (m_openKeep == 0) {
+            DeleteFileW(m_openFilename.c_str());
+        }
+
+        wchar_t suffix[16];
+        for (unsigned long i = m_openKeep; i > 0; --i) {
+            std::wstring src(m_openFilename);
+            if (i > 1) {
+                swprintf(suffix, NELEMS(suffix), L".%lu", i - 1);
+                src += suffix;
+            }
+            swprintf(suffix, NELEMS(suffix), L".%lu", i);
+            std::wstring dst(m_openFilename + suffix);
+            MoveFileExW(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+
+        OpenFile();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    unsigned __stdcall
+    LogSink::WriterMain( void* pSink )
+    {
+        LogSink* pThis = (LogSink*)pSink;
+
+        for (;;) {
+            WaitForSingleObject(pThis->m_hWake, WRITER_PERIOD_MS);
+            pThis->ApplyFileSettings();
+            pThis->Drain();
+            if (pThis->m_stop) {
+                // Stop waited for the last producer, so this drain gets everything
+                pThis->Drain();
+                break;
+            }
+        }
+
+        pThis->CloseFile();
+        SetEvent(pThis->m_hDone);
+        return 0;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StartLogWriter()
+{
+    return LogSink::Factory().Start();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+StopLogWriter()
+{
+    LogSink::Factory().Stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+FlushLog()
+{
+    LogSink::Factory().Flush();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+LogWrite( pyxErrorSeverity severity, const char* pText, size_t len )
+{
+    LogSink::Factory().Write(severity, pText, len);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+LogSeverityMask()
+{
+    return LogSink::Factory().SeverityMask();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetLogSeverityMask( unsigned long mask )
+{
+    LogSink::Factory().SetSeverityMask(mask);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+LogDroppedCount()
+{
+    return LogSink::Factory().Dropped();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetLogFile( const std::wstring& filename, unsigned long maxBytes, unsigned long keep )
+{
+    LogSink::Factory().SetFile(filename, maxBytes, keep);
+}
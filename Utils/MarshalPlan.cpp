@@ -0,0 +1,695 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <limits>
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Argument conversions driven by a function's annotations.
+//
+// Without annotations, every number reaches Python as a float and every range as
+// tuples of whatever the cells hold, so scripts are full of int() calls and loops
+// that rebuild the data in the type they wanted. A function can instead say what
+// it wants:
+//
+//     def price(notional: float, days: int, ccy: str, curve: numpy.ndarray,
+//               flags: list[bool]):
+//
+// The first PyCall of a function compiles its annotations into a "plan" - one
+// small integer per argument, saying what shape and element type to build - and
+// keeps it in the function's __dict__ as __pyinex_plan__. Reloading a module
+// makes new function objects, so stale plans go with the old ones. After that,
+// each annotated argument is built straight from Excel's cells in the annotated
+// type: numpy arrays from one contiguous float64/int64/bool buffer, lists without
+// intermediate tuples. Unannotated arguments, and annotations we don't recognize,
+// are converted as usual.
+//
+// Recognized annotations (as objects, or as strings under
+// "from __future__ import annotations"):
+//
+//     float, int, bool, str         a single value
+//     list                          a flat list of all the cells, row by row
+//     list[T], [T]                  the same, converted to T
+//     numpy.ndarray                 float64; 1-D for a single row or column
+//     NDArray[numpy.int64], NDArray[numpy.bool_]   the same, as int64 or bool
+//     pyinex.ArrowTable             Arrow C Data Interface export (ArrowBridge.cpp)
+//     pyarrow.Table                 the same, taken over by pyarrow.table()
+//
+// Annotations are Python 3 only, so under Python 2 no function has a plan.
+// Under Excel 2002/2003 plans are ignored.
+
+namespace {
+
+    // A plan entry is a shape and an element type. Zero means "as usual".
+    enum {
+        elemAny         = 0x00,
+        elemFloat       = 0x01,
+        elemInt         = 0x02,
+        elemBool        = 0x03,
+        elemStr         = 0x04,
+        elemMask        = 0x0F,
+
+        shapeScalar     = 0x10,
+        shapeList       = 0x20,
+        shapeArray      = 0x30,
+        shapeArrow      = 0x40,     // element 0 for pyinex.ArrowTable, 1 for pyarrow.Table
+        shapeMask       = 0xF0
+    };
+
+    const char* g_elemNames[] = { "value", "float", "int", "bool", "str" };
+
+    PyObject*
+    NewPyInt( long n )
+    {
+#if PY_MAJOR_VERSION < 3
+        return PyInt_FromLong(n);
+#else
+        return PyLong_FromLong(n);
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Compiling
+
+#if PY_MAJOR_VERSION >= 3
+
+    int
+    ElementFromName( const std::string& name )
+    {
+        if (name == "float")    return elemFloat;
+        if (name == "int")      return elemInt;
+        if (name == "bool")     return elemBool;
+        if (name == "str")      return elemStr;
+        return -1;
+    }
+
+    // "from __future__ import annotations" leaves them as source text
+    int
+    CompileAnnotationString( PyObject* pText )
+    {
+        PyObject* pUTF8 = PyUnicode_AsUTF8String(pText);
+        if (!pUTF8) {
+            PyErr_Clear();
+            return -1;
+        }
+        std::string text(PyBytes_AS_STRING(pUTF8), PyBytes_GET_SIZE(pUTF8));
+        Py_DECREF(pUTF8);
+
+        text.erase(std::remove(text.begin(), text.end(), ' '), text.end());
+
+        int elem = ElementFromName(text);
+        if (elem >= 0) {
+            return shapeScalar | elem;
+        }
+        if (text == "list" || text == "List") {
+            return shapeList | elemAny;
+        }
+        if (text == "ndarray" || text == "np.ndarray" || text == "numpy.ndarray") {
+            return shapeArray | elemFloat;
+        }
+        if (text == "ArrowTable" || text == "pyinex.ArrowTable") {
+            return shapeArrow;
+        }
+        if (text == "pyarrow.Table" || text == "pa.Table") {
+            return shapeArrow | 1;
+        }
+
+        std::string::size_type open = text.find('[');
+        if (open != std::string::npos && text[text.size() - 1] == ']') {
+            std::string outer = text.substr(0, open);
+            std::string inner = text.substr(open + 1, text.size() - open - 2);
+            if (outer == "list" || outer == "List" || outer == "typing.List") {
+                elem = ElementFromName(inner);
+                return elem >= 0 ? (shapeList | elem) : -1;
+            }
+        }
+        return -1;
+    }
+
+#endif
+
+    int
+    CompileElement( PyObject* pType )
+    {
+        if (pType == (PyObject*)&PyFloat_Type)      return elemFloat;
+        if (pType == (PyObject*)&PyBool_Type)       return elemBool;
+        if (pType == (PyObject*)&PyLong_Type)       return elemInt;
+        if (pType == (PyObject*)&PyUnicode_Type)    return elemStr;
+#if PY_MAJOR_VERSION < 3
+        if (pType == (PyObject*)&PyInt_Type)        return elemInt;
+        if (pType == (PyObject*)&PyString_Type)     return elemStr;
+#endif
+        return -1;
+    }
+
+    bool
+    IsNdarrayType( PyObject* pType )
+    {
+        return pType && PyType_Check(pType) &&
+               strcmp(((PyTypeObject*)pType)->tp_name, "numpy.ndarray") == 0;
+    }
+
+    // Types are matched by name, so neither pyarrow nor the type itself has to be
+    // imported here
+    int
+    CompileArrowType( PyObject* pType )
+    {
+        if (!pType || !PyType_Check(pType)) {
+            return -1;
+        }
+        const char* pName = ((PyTypeObject*)pType)->tp_name;
+        if (strcmp(pName, "pyinex.ArrowTable") == 0) {
+            return shapeArrow;
+        }
+        if (strcmp(pName, "pyarrow.lib.Table") == 0) {
+            return shapeArrow | 1;
+        }
+        return -1;
+    }
+
+    // numpy.typing.NDArray[numpy.int64] is ndarray[Any, dtype[int64]]; float64
+    // unless it says int64 or bool
+    int
+    CompileArrayElement( PyObject* pAnn )
+    {
+        int elem = elemFloat;
+        PyObject* pArgs = PyObject_GetAttrString(pAnn, "__args__");
+        if (pArgs && PyTuple_Check(pArgs) && PyTuple_GET_SIZE(pArgs) == 2) {
+            PyObject* pDtypeArgs = PyObject_GetAttrString(PyTuple_GET_ITEM(pArgs, 1), "__args__");
+            if (pDtypeArgs && PyTuple_Check(pDtypeArgs) && PyTuple_GET_SIZE(pDtypeArgs) == 1 &&
+                PyType_Check(PyTuple_GET_ITEM(pDtypeArgs, 0))) {
+                const char* pName = ((PyTypeObject*)PyTuple_GET_ITEM(pDtypeArgs, 0))->tp_name;
+                if (strcmp(pName, "numpy.int64") == 0) {
+                    elem = elemInt;
+                } else if (strcmp(pName, "numpy.bool_") == 0 || strcmp(pName, "numpy.bool") == 0) {
+                    elem = elemBool;
+                }
+            }
+            Py_XDECREF(pDtypeArgs);
+        }
+        Py_XDECREF(pArgs);
+        PyErr_Clear();
+        return elem;
+    }
+
+    // Returns a plan entry, or -1 if we don't handle the annotation
+    int
+    CompileAnnotation( PyObject* pAnn )
+    {
+        int elem = CompileElement(pAnn);
+        if (elem >= 0) {
+            return shapeScalar | elem;
+        }
+
+        if (pAnn == (PyObject*)&PyList_Type) {
+            return shapeList | elemAny;
+        }
+
+        if (IsNdarrayType(pAnn)) {
+            return shapeArray | elemFloat;
+        }
+
+        int entry = CompileArrowType(pAnn);
+        if (entry >= 0) {
+            return entry;
+        }
+
+        // [float]
+        if (PyList_Check(pAnn) && PyList_GET_SIZE(pAnn) == 1) {
+            elem = CompileElement(PyList_GET_ITEM(pAnn, 0));
+            return elem >= 0 ? (shapeList | elem) : -1;
+        }
+
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_Check(pAnn)) {
+            return CompileAnnotationString(pAnn);
+        }
+#endif
+
+        // list[float], typing.List[float], numpy.typing.NDArray[...]
+        PyObject* pOrigin = PyObject_GetAttrString(pAnn, "__origin__");
+        if (!pOrigin) {
+            PyErr_Clear();
+            return -1;
+        }
+        if (pOrigin == (PyObject*)&PyList_Type) {
+            PyObject* pArgs = PyObject_GetAttrString(pAnn, "__args__");
+            if (pArgs && PyTuple_Check(pArgs) && PyTuple_GET_SIZE(pArgs) == 1) {
+                elem = CompileElement(PyTuple_GET_ITEM(pArgs, 0));
+                entry = elem >= 0 ? (shapeList | elem) : -1;
+            }
+            Py_XDECREF(pArgs);
+            PyErr_Clear();
+        } else if (IsNdarrayType(pOrigin)) {
+            entry = shapeArray | CompileArrayElement(pAnn);
+        }
+        Py_DECREF(pOrigin);
+        return entry;
+    }
+
+    // New reference to a tuple of plan entries, or to None if nothing's annotated
+    PyObject*
+    CompilePlan( PyObject* pFunction, const char* pFunctionName )
+    {
+        PyObject* pAnnotations = PyObject_GetAttrString(pFunction, "__annotations__");
+        if (!pAnnotations) {
+            PyErr_Clear();  // Python 2
+            Py_RETURN_NONE;
+        }
+        if (!PyDict_Check(pAnnotations) || PyDict_Size(pAnnotations) == 0) {
+            Py_DECREF(pAnnotations);
+            Py_RETURN_NONE;
+        }
+
+        PyCodeObject* pCO = (PyCodeObject*)PyFunction_GET_CODE(pFunction);
+        int argcount = pCO->co_argcount;
+        PyObject* pPlan = PyTuple_New(argcount);
+        bool bAny = false;
+
+        for (int i = 0; pPlan && i < argcount; ++i) {
+            PyObject* pName = PyTuple_GetItem(pCO->co_varnames, i);         // borrowed
+            PyObject* pAnn = pName ? PyDict_GetItem(pAnnotations, pName) : NULL; // borrowed
+            int entry = pAnn ? CompileAnnotation(pAnn) : 0;
+            if (entry < 0) {
+                WARNOUT("Argument %d of %s has an annotation PyCall doesn't convert to; it's passed as usual",
+                    i + 1, pFunctionName);
+                entry = 0;
+            }
+            bAny = bAny || entry != 0;
+            PyTuple_SET_ITEM(pPlan, i, NewPyInt(entry));
+        }
+        Py_DECREF(pAnnotations);
+
+        if (!pPlan || !bAny) {
+            PyErr_Clear();
+            Py_XDECREF(pPlan);
+            Py_RETURN_NONE;
+        }
+        return pPlan;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Converting
+
+    const char*
+    DescribeCell( const XLOPER12& x )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:     return "a number";
+            case xltypeStr:     return "text";
+            case xltypeBool:    return "TRUE/FALSE";
+            case xltypeErr:     return "an error";
+            case xltypeMissing:
+            case xltypeNil:     return "empty";
+            default:            return "an unexpected type";
+        }
+    }
+
+    // Numeric view of a cell, for the float, int and bool element types. Empty cells
+    // and errors are NaN for floats; anything else that isn't a number or a bool fails.
+    bool
+    CellAsDouble( const XLOPER12& x, int elem, double& rD )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:
+                rD = x.val.num;
+                return true;
+            case xltypeBool:
+                rD = x.val.xbool ? 1.0 : 0.0;
+                return true;
+            case xltypeErr:
+            case xltypeMissing:
+            case xltypeNil:
+                if (elem == elemFloat) {
+                    rD = std::numeric_limits<double>::quiet_NaN();
+                    return true;
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    bool
+    ConvertCell( const XLOPER12& x, int elem, PyObject*& rpObj )
+    {
+        rpObj = NULL;
+        int type = x.xltype & ~(xlbitXLFree | xlbitDLLFree);
+        double d;
+
+        switch (elem) {
+            case elemFloat:
+                if (!CellAsDouble(x, elem, d)) {
+                    return false;
+                }
+                rpObj = PyFloat_FromDouble(d);
+                break;
+
+            case elemInt:
+                if (!CellAsDouble(x, elem, d)) {
+                    return false;
+                }
+                rpObj = PyLong_FromDouble(d); // truncates, as int() would
+                break;
+
+            case elemBool:
+                if (!CellAsDouble(x, elem, d)) {
+                    return false;
+                }
+                rpObj = PyBool_FromLong(d != 0.0);
+                break;
+
+            case elemStr:
+                if (type == xltypeNum) {
+                    char buf[32];
+                    _snprintf(buf, NELEMS(buf), "%.15g", x.val.num);
+                    buf[NELEMS(buf) - 1] = 0;
+#if PY_MAJOR_VERSION < 3
+                    rpObj = PyString_FromString(buf);
+#else
+                    rpObj = PyUnicode_FromString(buf);
+#endif
+                } else if (type == xltypeBool) {
+#if PY_MAJOR_VERSION < 3
+                    rpObj = PyString_FromString(x.val.xbool ? "TRUE" : "FALSE");
+#else
+                    rpObj = PyUnicode_FromString(x.val.xbool ? "TRUE" : "FALSE");
+#endif
+                } else if (type == xltypeNil || type == xltypeMissing) {
+#if PY_MAJOR_VERSION < 3
+                    rpObj = PyString_FromString("");
+#else
+                    rpObj = PyUnicode_FromString("");
+#endif
+                } else {
+                    return ConvertXloper12CellToPyObject(x, rpObj, NULL); // text and error text
+                }
+                break;
+
+            default:
+                return ConvertXloper12CellToPyObject(x, rpObj, NULL);
+        }
+        return rpObj != NULL;
+    }
+
+    void
+    ReportCellFailure( const XLOPER12& x, int elem, long row, long col )
+    {
+        if (PyErr_Occurred()) {
+            PyErr_Print();
+        }
+        ERROUT("Cell %ld, %ld of the argument is %s, which can't be converted to %s",
+            row + 1, col + 1, DescribeCell(x), g_elemNames[elem]);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    BuildList( const XLOPER12* pCells, long n, long cols, int elem )
+    {
+        PyObject* pList = PyList_New(n);
+        PyObject* pValue;
+        for (long k = 0; pList && k < n; ++k) {
+            if (!ConvertCell(pCells[k], elem, pValue)) {
+                ReportCellFailure(pCells[k], elem, k / cols, k % cols);
+                Py_DECREF(pList);
+                return NULL;
+            }
+            PyList_SET_ITEM(pList, k, pValue); // pValue reference stolen here
+        }
+        return pList;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Arrays are packed into one buffer and handed to numpy.frombuffer, so numpy
+    // never sees a Python object per cell. The buffer is a bytearray, which keeps
+    // the array writable.
+
+    template <class T>
+    bool
+    PackCells( const XLOPER12* pCells, long n, long cols, int elem, T* pOut )
+    {
+        double d;
+        for (long k = 0; k < n; ++k) {
+            if (!CellAsDouble(pCells[k], elem, d)) {
+                ReportCellFailure(pCells[k], elem, k / cols, k % cols);
+                return false;
+            }
+            pOut[k] = (elem == elemBool) ? (T)(d != 0.0) : (T)d;
+        }
+        return true;
+    }
+
+    PyObject*
+    BuildArray( const XLOPER12* pCells, long rows, long cols, int elem )
+    {
+#if PY_MAJOR_VERSION < 3
+        return NULL; // never called; Python 2 has no annotations, and 2.5 no bytearray
+#else
+        const char* pDtype;
+        size_t width;
+        switch (elem) {
+            case elemInt:   pDtype = "int64";   width = sizeof(__int64);  break;
+            case elemBool:  pDtype = "bool";    width = sizeof(char);     break;
+            default:        pDtype = "float64"; width = sizeof(double);   break;
+        }
+
+        PyObject* pNumpy = PyImport_ImportModule("numpy");
+        if (!pNumpy) {
+            PyErr_Print();
+            ERROUT("An argument is annotated as numpy.ndarray, but numpy can't be imported");
+            return NULL;
+        }
+
+        long n = rows * cols;
+        PyObject* pBuffer = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(n * width));
+        bool rc = (pBuffer != NULL);
+        if (rc) {
+            char* pOut = PyByteArray_AS_STRING(pBuffer);
+            switch (elem) {
+                case elemInt:   rc = PackCells(pCells, n, cols, elem, (__int64*)pOut);  break;
+                case elemBool:  rc = PackCells(pCells, n, cols, elem, pOut);            break;
+                default:        rc = PackCells(pCells, n, cols, elem, (double*)pOut);   break;
+            }
+        }
+
+        PyObject* pArray = rc ? PyObject_CallMethod(pNumpy, (char*)"frombuffer", (char*)"Os", pBuffer, pDtype) : NULL;
+        Py_XDECREF(pBuffer); // the array keeps its own reference
+        Py_DECREF(pNumpy);
+
+        if (pArray && rows > 1 && cols > 1) {
+            PyObject* pShaped = PyObject_CallMethod(pArray, (char*)"reshape", (char*)"ll", rows, cols);
+            Py_DECREF(pArray);
+            pArray = pShaped;
+        }
+
+        if (!pArray && PyErr_Occurred()) {
+            PyErr_Print();
+        }
+        return pArray;
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    BuildArrowTable( const XLOPER12* pCells, long rows, long cols, int elem )
+    {
+        PyObject* pTable = NewArrowTable(pCells, rows, cols);
+        if (pTable && elem == 1) {
+            PyObject* pPyarrow = PyImport_ImportModule("pyarrow");
+            if (!pPyarrow) {
+                PyErr_Clear();
+                ERROUT("An argument is annotated as pyarrow.Table, but pyarrow can't be imported");
+                Py_DECREF(pTable);
+                return NULL;
+            }
+            PyObject* pConverted = PyObject_CallMethod(pPyarrow, (char*)"table", (char*)"O", pTable);
+            Py_DECREF(pPyarrow);
+            Py_DECREF(pTable);
+            pTable = pConverted;
+        }
+
+        if (!pTable && PyErr_Occurred()) {
+            PyErr_Print();
+        }
+        return pTable;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+PyObject*
+GetMarshalPlan( PyObject* pFunction, const char* pFunctionName )
+{
+#if PY_MAJOR_VERSION < 3
+    return NULL;
+#else
+    PyObject* pDict = ((PyFunctionObject*)pFunction)->func_dict;
+    PyObject* pPlan = pDict ? PyDict_GetItemString(pDict, "__pyinex_plan__") : NULL; // borrowed
+    if (pPlan) {
+        return (pPlan == Py_None) ? NULL : pPlan;
+    }
+
+    pPlan = CompilePlan(pFunction, pFunctionName);
+    if (PyObject_SetAttrString(pFunction, "__pyinex_plan__", pPlan) != 0) {
+        PyErr_Clear(); // compiled again next time
+        Py_DECREF(pPlan);
+        return NULL;
+    }
+    Py_DECREF(pPlan); // the function's dict holds it now
+    return (pPlan == Py_None) ? NULL : pPlan;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int
+MarshalPlanEntry( PyObject* pPlan, int argIndex )
+{
+    if (!pPlan || argIndex >= PyTuple_GET_SIZE(pPlan)) {
+        return 0;
+    }
+#if PY_MAJOR_VERSION < 3
+    return (int)PyInt_AsLong(PyTuple_GET_ITEM(pPlan, argIndex));
+#else
+    return (int)PyLong_AsLong(PyTuple_GET_ITEM(pPlan, argIndex));
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertXlfOperByPlan( XlfOper& rOper, int entry, PyObject*& rpObj, PyStringInterner* pInterner )
+{
+    rpObj = NULL;
+
+    if (entry == 0 || !XlfExcel::Instance().excel12()) {
+        return ConvertXlfOperToPyObject(rOper, rpObj, pInterner);
+    }
+
+    // Get at the cells: arrays as they are, references flattened by Excel, single
+    // values as a one-cell array
+    LPXLOPER12 pX = (LPXLOPER12) rOper.GetLPXLFOPER();
+    int type = pX->xltype & ~(xlbitXLFree | xlbitDLLFree);
+    XLOPER12 xMulti;
+    bool bFree = false;
+
+    if (type == xltypeRef || type == xltypeSRef) {
+        XLOPER12 xType;
+        xType.xltype = xltypeInt;
+        xType.val.w = xltypeMulti;
+        int ret = XlfExcel::Instance().Call12(xlCoerce, &xMulti, 2, pX, &xType);
+        if (ret == xlretUncalced) {
+            // Only PyCallRef passes references; as for a Range, Excel calls it
+            // again once the cells are calculated
+            NoteUncalculatedCells();
+            return false;
+        }
+        if (ret != xlretSuccess) {
+            ERROUT("Couldn't read the referenced cells");
+            return false;
+        }
+        pX = &xMulti;
+        type = pX->xltype & ~(xlbitXLFree | xlbitDLLFree);
+        bFree = true;
+    }
+
+    const XLOPER12* pCells = pX;
+    long rows = 1, cols = 1;
+    if (type == xltypeMulti) {
+        pCells = pX->val.array.lparray;
+        rows = pX->val.array.rows;
+        cols = pX->val.array.columns;
+    }
+
+    int elem = entry & elemMask;
+    switch (entry & shapeMask) {
+        case shapeScalar:
+            if (rows != 1 || cols != 1) {
+                ERROUT("Argument is annotated as a single %s, but is %ld x %ld cells", g_elemNames[elem], rows, cols);
+            } else if (type == xltypeMissing) {
+                rpObj = Py_None; // an omitted argument, as usual
+                Py_INCREF(rpObj);
+            } else if (!ConvertCell(pCells[0], elem, rpObj)) {
+                ReportCellFailure(pCells[0], elem, 0, 0);
+            }
+            break;
+
+        case shapeList:
+            rpObj = BuildList(pCells, rows * cols, cols, elem);
+            break;
+
+        case shapeArray:
+            rpObj = BuildArray(pCells, rows, cols, elem);
+            break;
+
+        case shapeArrow:
+            if (type == xltypeMissing) {
+                rpObj = Py_None;
+                Py_INCREF(rpObj);
+            } else {
+                rpObj = BuildArrowTable(pCells, rows, cols, elem);
+            }
+            break;
+
+        default:
+            ERROUT("Bad marshaling plan entry 0x%x", entry);
+            break;
+    }
+
+    if (bFree) {
+        XlfExcel::Instance().Call12(xlFree, NULL, 1, &xMulti);
+    }
+    return rpObj != NULL;
+}
@@ -0,0 +1,663 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <math.h>
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Memory accounting. Pyinex can't stop a script from exhausting Excel's address
+// space, but it can say which script is responsible. While tracking is on, the
+// Python allocators (the PyMem and PyObject domains, which hold every Python
+// object) are wrapped, and allocations are charged to the module that was
+// running when they were made: the module whose PyCall was in progress, or the
+// one ModuleCache was importing. Anything else - hooks, the console, Python's own
+// housekeeping - is charged to "(other)".
+//
+// Recording every allocation would cost too much, so allocations are sampled,
+// as tcmalloc does: on average one sample per SAMPLE_INTERVAL bytes, with
+// exponentially distributed gaps, each sample weighted by the bytes it stands
+// for. Only sampled blocks go into the table, so freeing an unsampled block costs
+// one probe. The figures are estimates of live bytes, good to within a few
+// percent for a module holding more than a few megabytes. Memory that extension
+// modules take straight from the C runtime (NumPy array data, for one) isn't seen;
+// the process figures, reported alongside, are.
+//
+// The wrappers are installed on first use and never removed, as something else
+// (tracemalloc) may have wrapped them in turn; stopping just turns sampling off.
+// They're only ever called with the GIL held, which is what serializes them.
+// Python 3.5 and later; earlier versions have no allocator API.
+//
+// Soft limits, on the process's address space and on any one module's live
+// bytes, are checked after each PyCall (at most every LIMIT_CHECK_MS). Crossing
+// one writes a warning, once until it's back under, and optionally forces a
+// full collection first.
+
+#if PY_VERSION_HEX >= 0x03050000
+#define PYINEX_MEMORY_TRACKING
+#endif
+
+namespace {
+
+    const double SAMPLE_INTERVAL = 64.0 * 1024.0;  // mean bytes between samples
+    const DWORD LIMIT_CHECK_MS = 250;
+    const double BYTES_PER_MB = 1024.0 * 1024.0;
+
+    struct Sample
+    {
+        void*   p;          // NULL marks an empty slot
+        int     tag;
+        double  bytes;      // what the sample stands for
+    };
+
+    class MemoryAccount
+    {
+    public:
+        static MemoryAccount& Factory();
+
+        int SetTag( const char* pModuleName );
+        void RestoreTag( int tag ) { m_tag = tag; }
+
+        bool Start();
+        void Stop();
+        bool Tracking() const { return m_bTracking; }
+
+        void SetLimits( double processMB, double moduleMB, bool bCollect );
+        void Limits( double& rProcessMB, double& rModuleMB, bool& rbCollect ) const;
+        void CheckLimits();
+
+        void Usage( MemoryUsage& rUsage ) const;
+
+    private:
+        MemoryAccount();
+        ~MemoryAccount();
+
+        static void ProcessUsage( MemoryUsage& rUsage );
+
+        void Allocated( void* p, size_t size );
+        void Freed( void* p );
+        double NextGap();
+
+        size_t Slot( void* p ) const;
+        void Insert( const Sample& sample );
+        void Remove( size_t slot );
+        void Grow();
+
+#ifdef PYINEX_MEMORY_TRACKING
+        static void* Malloc( void* ctx, size_t size );
+        static void* Calloc( void* ctx, size_t nelem, size_t elsize );
+        static void* Realloc( void* ctx, void* ptr, size_t size );
+        static void Free( void* ctx, void* ptr );
+#endif
+
+    private:
+        bool                    m_bTracking;
+        bool                    m_bInstalled;
+        int                     m_tag;          // index into m_names; 0 = "(other)"
+        double                  m_gap;          // bytes still to allocate before the next sample
+        unsigned long           m_random;       // xorshift state
+
+        std::vector<Sample>     m_samples;      // open addressing, power-of-two size
+        size_t                  m_sampleCount;
+
+        std::vector<std::string>    m_names;
+        std::map<std::string, int>  m_tags;
+        std::vector<double>         m_live;     // estimated live bytes, by tag
+        std::vector<bool>           m_warned;   // over the module limit, by tag
+
+        double                  m_processLimitMB;   // zero = none
+        double                  m_moduleLimitMB;
+        bool                    m_bCollect;
+        bool                    m_bProcessWarned;
+        DWORD                   m_lastCheck;
+
+#ifdef PYINEX_MEMORY_TRACKING
+        PyMemAllocatorEx        m_memAllocator; // the allocators we wrap
+        PyMemAllocatorEx        m_objAllocator;
+#endif
+
+        MemoryAccount( const MemoryAccount& );
+        MemoryAccount& operator=( const MemoryAccount& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    MemoryAccount&
+    MemoryAccount::Factory()
+    {
+        static MemoryAccount g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    MemoryAccount::MemoryAccount() :
+        m_bTracking(false),
+        m_bInstalled(false),
+        m_tag(0),
+        m_gap(0.0),
+        m_random(2463534242UL),
+        m_sampleCount(0),
+        m_processLimitMB(0.0),
+        m_moduleLimitMB(0.0),
+        m_bCollect(false),
+        m_bProcessWarned(false),
+        m_lastCheck(0)
+    {
+        m_names.push_back("(other)");
+        m_live.push_back(0.0);
+        m_warned.push_back(false);
+        m_gap = NextGap();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Python may still free through the wrappers after this runs; with the table
+    // gone, they find nothing, and pass the call on.
+
+    MemoryAccount::~MemoryAccount()
+    {
+        m_bTracking = false;
+        m_sampleCount = 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Returns the previous tag, for RestoreTag. Tags aren't kept while tracking is off.
+
+    int
+    MemoryAccount::SetTag( const char* pModuleName )
+    {
+        int previous = m_tag;
+        if (!m_bTracking) {
+            return previous;
+        }
+
+        if (!pModuleName) {
+            m_tag = 0;
+            return previous;
+        }
+
+        std::map<std::string, int>::const_iterator it = m_tags.find(pModuleName);
+        if (it != m_tags.end()) {
+            m_tag = it->second;
+        } else {
+            m_tag = (int)m_names.size();
+            m_names.push_back(pModuleName);
+            m_live.push_back(0.0);
+            m_warned.push_back(false);
+            m_tags[pModuleName] = m_tag;
+        }
+        return previous;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Needs the GIL. Only allocations made from here on are counted.
+
+    bool
+    MemoryAccount::Start()
+    {
+#ifdef PYINEX_MEMORY_TRACKING
+        if (!m_bInstalled) {
+            PyMemAllocatorEx hook;
+            hook.malloc = Malloc;
+            hook.calloc = Calloc;
+            hook.realloc = Realloc;
+            hook.free = Free;
+
+            PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &m_memAllocator);
+            hook.ctx = &m_memAllocator;
+            PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &hook);
+
+            PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &m_objAllocator);
+            hook.ctx = &m_objAllocator;
+            PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &hook);
+
+            m_bInstalled = true;
+        }
+        m_bTracking = true;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Needs the GIL. Forgets everything; a restart counts from zero.
+
+    void
+    MemoryAccount::Stop()
+    {
+        m_bTracking = false;
+        m_tag = 0;
+        m_samples.clear();
+        m_sampleCount = 0;
+        for (size_t i = 0; i < m_live.size(); ++i) {
+            m_live[i] = 0.0;
+            m_warned[i] = false;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    MemoryAccount::SetLimits( double processMB, double moduleMB, bool bCollect )
+    {
+        m_processLimitMB = processMB;
+        m_moduleLimitMB = moduleMB;
+        m_bCollect = bCollect;
+        m_bProcessWarned = false;
+        m_warned.assign(m_warned.size(), false);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    MemoryAccount::Limits( double& rProcessMB, double& rModuleMB, bool& rbCollect ) const
+    {
+        rProcessMB = m_processLimitMB;
+        rModuleMB = m_moduleLimitMB;
+        rbCollect = m_bCollect;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread, with the GIL, after each PyCall
+
+    void
+    MemoryAccount::CheckLimits()
+    {
+        if (m_processLimitMB <= 0.0 && (m_moduleLimitMB <= 0.0 || !m_bTracking)) {
+            return;
+        }
+
+        DWORD now = GetTickCount();
+        if (now - m_lastCheck < LIMIT_CHECK_MS) {
+            return;
+        }
+        m_lastCheck = now;
+
+        // Collect at most once per check, and only if a limit is newly crossed
+        bool bCollected = false;
+
+        if (m_processLimitMB > 0.0) {
+            MemoryUsage usage;
+            ProcessUsage(usage);
+            bool bOver = usage.addressSpaceBytes > m_processLimitMB * BYTES_PER_MB;
+            if (bOver && !m_bProcessWarned && m_bCollect) {
+                PyGC_Collect();
+                bCollected = true;
+                ProcessUsage(usage);
+                bOver = usage.addressSpaceBytes > m_processLimitMB * BYTES_PER_MB;
+            }
+            if (bOver && !m_bProcessWarned) {
+                WARNOUT("Excel is using %.0f MB of address space, over the %g MB limit; %.0f MB is free",
+                    usage.addressSpaceBytes / BYTES_PER_MB, m_processLimitMB, usage.addressSpaceFreeBytes / BYTES_PER_MB);
+            }
+            m_bProcessWarned = bOver;
+        }
+
+        if (m_moduleLimitMB > 0.0 && m_bTracking) {
+            double limit = m_moduleLimitMB * BYTES_PER_MB;
+            for (size_t tag = 0; tag < m_live.size(); ++tag) {
+                bool bOver = m_live[tag] > limit;
+                if (bOver && !m_warned[tag] && m_bCollect && !bCollected) {
+                    PyGC_Collect();
+                    bCollected = true;
+                    bOver = m_live[tag] > limit;
+                }
+                if (bOver && !m_warned[tag]) {
+                    WARNOUT("Module %s holds about %.0f MB, over the %g MB limit",
+                        m_names[tag].c_str(), m_live[tag] / BYTES_PER_MB, m_moduleLimitMB);
+                }
+                m_warned[tag] = bOver;
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    MemoryAccount::ProcessUsage( MemoryUsage& rUsage )
+    {
+        PROCESS_MEMORY_COUNTERS_EX counters;
+        memset(&counters, 0, sizeof(counters));
+        counters.cb = sizeof(counters);
+        if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+            rUsage.privateBytes = (double)counters.PrivateUsage;
+        }
+
+        MEMORYSTATUSEX status;
+        status.dwLength = sizeof(status);
+        if (GlobalMemoryStatusEx(&status)) {
+            rUsage.addressSpaceBytes = (double)(status.ullTotalVirtual - status.ullAvailVirtual);
+            rUsage.addressSpaceFreeBytes = (double)status.ullAvailVirtual;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Modules largest first; ones that hold nothing are left out
+
+    void
+    MemoryAccount::Usage( MemoryUsage& rUsage ) const
+    {
+        rUsage.privateBytes = rUsage.addressSpaceBytes = rUsage.addressSpaceFreeBytes = 0.0;
+        rUsage.trackedBytes = 0.0;
+        rUsage.modules.clear();
+        ProcessUsage(rUsage);
+
+        for (size_t tag = 0; tag < m_live.size(); ++tag) {
+            if (m_live[tag] >= 0.5) {
+                rUsage.trackedBytes += m_live[tag];
+                rUsage.modules.push_back(std::make_pair(m_live[tag], m_names[tag]));
+            }
+        }
+        std::sort(rUsage.modules.begin(), rUsage.modules.end());
+        std::reverse(rUsage.modules.begin(), rUsage.modules.end());
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // An allocation of size bytes is sampled if it covers the next sample point.
+    // A sample of s bytes is taken with probability 1 - exp(-s/I), so weighting it
+    // by the inverse keeps the estimate unbiased for small and large blocks alike.
+
+    void
+    MemoryAccount::Allocated( void* p, size_t size )
+    {
+        if (!m_bTracking || !p) {
+            return;
+        }
+
+        double bytes = (double)size;
+        if (bytes < m_gap) {
+            m_gap -= bytes;
+            return;
+        }
+        m_gap = NextGap();
+
+        Sample sample;
+        sample.p = p;
+        sample.tag = m_tag;
+        sample.bytes = bytes > 0.0 ? bytes / (1.0 - exp(-bytes / SAMPLE_INTERVAL)) : SAMPLE_INTERVAL;
+        Insert(sample);
+        m_live[m_tag] += sample.bytes;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    MemoryAccount::Freed( void* p )
+    {
+        if (m_sampleCount == 0 || !p) {
+            return;
+        }
+
+        size_t slot = Slot(p);
+        if (m_samples[slot].p == p) {
+            m_live[m_samples[slot].tag] -= m_samples[slot].bytes;
+            Remove(slot);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Exponentially distributed, with mean SAMPLE_INTERVAL
+
+    double
+    MemoryAccount::NextGap()
+    {
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        double u = ((m_random & 0xFFFFFF) + 0.5) / 16777216.0;   // (0, 1)
+        return -log(u) * SAMPLE_INTERVAL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The slot holding p, or the empty slot where it would go. The table is never full.
+
+    size_t
+    MemoryAccount::Slot( void* p ) const
+    {
+        size_t mask = m_samples.size() - 1;
+        size_t slot = (((size_t)p >> 4) * 2654435761U) & mask;
+        while (m_samples[slot].p && m_samples[slot].p != p) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The table's own memory comes from the C runtime, not Python, so growing it
+    // doesn't come back through the wrappers
+
+    void
+    MemoryAccount::Insert( const Sample& sample )
+    {
+        if ((m_sampleCount + 1) * 2 > m_samples.size()) {
+            Grow();
+        }
+        size_t slot = Slot(sample.p);
+        if (!m_samples[slot].p) {
+            ++m_sampleCount;
+        }
+        m_samples[slot] = sample;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Linear probing; entries after the hole that belong before it are shifted
+    // back, so lookups never need tombstones
+
+    void
+    MemoryAccount::Remove( size_t slot )
+    {
+        size_t mask = m_samples.size() - 1;
+        size_t hole = slot;
+        size_t next = (hole + 1) & mask;
+        while (m_samples[next].p) {
+            size_t home = (((size_t)m_samples[next].p >> 4) * 2654435761U) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                m_samples[hole] = m_samples[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        m_samples[hole].p = NULL;
+        --m_sampleCount;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    MemoryAccount::Grow()
+    {
+        std::vector<Sample> old;
+        old.swap(m_samples);
+
+        Sample empty;
+        empty.p = NULL;
+        empty.tag = 0;
+        empty.bytes = 0.0;
+        m_samples.assign(old.empty() ? 1024 : old.size() * 2, empty);
+        m_sampleCount = 0;
+
+        for (size_t i = 0; i < old.size(); ++i) {
+            if (old[i].p) {
+                m_samples[Slot(old[i].p)] = old[i];
+                ++m_sampleCount;
+            }
+        }
+    }
+
+#ifdef PYINEX_MEMORY_TRACKING
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The wrappers. ctx is the allocator being wrapped.
+
+    void*
+    MemoryAccount::Malloc( void* ctx, size_t size )
+    {
+        PyMemAllocatorEx* pNext = (PyMemAllocatorEx*)ctx;
+        void* p = pNext->malloc(pNext->ctx, size);
+        Factory().Allocated(p, size);
+        return p;
+    }
+
+    void*
+    MemoryAccount::Calloc( void* ctx, size_t nelem, size_t elsize )
+    {
+        PyMemAllocatorEx* pNext = (PyMemAllocatorEx*)ctx;
+        void* p = pNext->calloc(pNext->ctx, nelem, elsize);
+        Factory().Allocated(p, nelem * elsize);
+        return p;
+    }
+
+    void*
+    MemoryAccount::Realloc( void* ctx, void* ptr, size_t size )
+    {
+        PyMemAllocatorEx* pNext = (PyMemAllocatorEx*)ctx;
+        void* p = pNext->realloc(pNext->ctx, ptr, size);
+        if (p) {
+            MemoryAccount& rThis = Factory();
+            rThis.Freed(ptr);
+            rThis.Allocated(p, size);
+        }
+        return p;
+    }
+
+    void
+    MemoryAccount::Free( void* ctx, void* ptr )
+    {
+        PyMemAllocatorEx* pNext = (PyMemAllocatorEx*)ctx;
+        Factory().Freed(ptr);
+        pNext->free(pNext->ctx, ptr);
+    }
+
+#endif
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+int
+SetMemoryTag( const char* pModuleName )
+{
+    return MemoryAccount::Factory().SetTag(pModuleName);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+RestoreMemoryTag( int tag )
+{
+    MemoryAccount::Factory().RestoreTag(tag);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StartMemoryTracking()
+{
+    return MemoryAccount::Factory().Start();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+StopMemoryTracking()
+{
+    MemoryAccount::Factory().Stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+MemoryTrackingActive()
+{
+    return MemoryAccount::Factory().Tracking();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+SetMemoryLimits( double processMB, double moduleMB, bool bCollect )
+{
+    MemoryAccount::Factory().SetLimits(processMB, moduleMB, bCollect);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetMemoryLimits( double& rProcessMB, double& rModuleMB, bool& rbCollect )
+{
+    MemoryAccount::Factory().Limits(rProcessMB, rModuleMB, rbCollect);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+CheckMemoryLimits()
+{
+    MemoryAccount::Factory().CheckLimits();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetMemoryUsage( MemoryUsage& rUsage )
+{
+    MemoryAccount::Factory().Usage(rUsage);
+}
@@ -828,6 +828,16 @@ Doesn't work in Parallels...
             }
         }
 
+        // Whatever the module builds as it's run is charged to it (see MemoryAccount.cpp)
+        std::string moduleName(basename.begin(), basename.end());
+        MemoryTagScope memoryTag(moduleName.c_str());
+
+        // A module that keeps snapshots of its state is restored from one taken after
+        // an earlier run of the same file, if there is one (see ModuleSnapshot.cpp)
+        if (rc) {
+            BeginModuleImport(filename, moduleName);
+        }
+
         if (rc) {
             if (bImport) {
                 assert(rpModule == NULL);
@@ -872,6 +882,25 @@ Doesn't work in Parallels...
                     rc = false;
                 }
             }
+
+            // Restoring failed, and the snapshot is gone; run the module again, in full
+            if (!EndModuleImport(rc ? rpModule : NULL)) {
+                BeginModuleImport(filename, moduleName);
+                rpModule = PyImport_ReloadModule(rpModule);
+                if (!rpModule) {
+                    ERROUT("Couldn't rerun python module %s from path %s", ASCII_REPR(basename), ASCII_REPR(path));
+                    if (PyErr_Occurred()) {
+                        PyErr_Print();
+                    }
+                    rc = false;
+                }
+                EndModuleImport(rpModule);
+            }
+        }
+
+        if (TimelineActive()) {
+            const char* pEvent = bImport ? (rc ? "import" : "import failed") : (rc ? "reload" : "reload failed");
+            RecordTimelineInstant("module", pEvent, "module", basename);
         }
 
         Py_XDECREF(pBasename);
@@ -0,0 +1,535 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module snapshots. A script that does expensive work as it's imported - loading
+// reference data, calibrating models - can have that work kept, so that later
+// imports of the same file, in this Excel or the next, pick up where the first
+// one finished. The module opts in by defining two functions:
+//
+//      __pyinex_snapshot__()       returns the state worth keeping, which must
+//                                  be picklable
+//      __pyinex_restore__(state)   puts that state back
+//
+// and by skipping its expensive work while pyinex.restoring(__name__) is true.
+// After a module has been imported (or reloaded) in full, its snapshot is taken
+// and pickled to a file; before it's next imported, a snapshot taken from a file
+// with the same contents is unpickled, the module is run (with restoring() true),
+// and its restore function is handed the state. If restoring raises, the snapshot
+// is deleted and the module is run again, in full.
+//
+// Snapshots are kept in the directory named by PYINEX_SNAPSHOT_DIR, or else in
+// Pyinex\Snapshots under the local application data directory, one file a
+// script: a header - magic, version, the Python version, a hash of the script
+// file's contents, and the pickle's length and checksum - then the pickle. A
+// snapshot is only used by the same Python (major and minor version), for the
+// same script contents; modules the script imports, and data files it reads,
+// aren't looked at, so delete the snapshot when those change. Snapshots are read
+// through a file mapping, and, from Python 3.3, unpickled straight from it.
+// They're written to a temporary file that's then renamed over the old one, so
+// an Excel reading one never sees it half-written.
+//
+// Imports are made on the calc thread, with the GIL held.
+
+namespace {
+
+    const char          SNAPSHOT_MAGIC[8] = { 'P', 'Y', 'X', 'S', 'N', 'A', 'P', 'S' };
+    const unsigned long SNAPSHOT_VERSION = 1;
+    const DWORD         WRITE_CHUNK_BYTES = 1 << 24;
+
+    struct SnapshotHeader
+    {
+        char            magic[8];
+        unsigned long   version;
+        unsigned long   pythonVersion;  // PY_VERSION_HEX of the Python that pickled it
+        ULONGLONG       moduleHash;     // of the script file's contents
+        ULONGLONG       checksum;       // of the pickle
+        ULONGLONG       length;         // of the pickle, which follows
+    };
+
+    class ModuleSnapshots
+    {
+    public:
+        static ModuleSnapshots& Factory();
+
+        bool BeginImport( const std::wstring& filename, const std::string& moduleName );
+        bool Restoring( const std::string& moduleName ) const;
+        bool EndImport( PyObject* pModule );
+
+    private:
+        ModuleSnapshots();
+        ~ModuleSnapshots();
+
+        // An import in progress. Scripts are imported one at a time, but one may
+        // still import another, so these are stacked.
+        struct PendingImport
+        {
+            std::string     moduleName;
+            std::wstring    snapshotFile;
+            ULONGLONG       moduleHash;
+            PyObject*       pState;         // from the snapshot; NULL if there isn't one
+        };
+
+        bool SnapshotFilename( const std::wstring& filename, const std::string& moduleName, std::wstring& rSnapshotFile );
+        PyObject* LoadState( const PendingImport& pending );
+        PyObject* Unpickle( const unsigned char* pData, size_t n, bool& rbUnmap );
+        bool Restore( PyObject* pModule, const PendingImport& pending );
+        void Save( PyObject* pModule, const PendingImport& pending );
+
+    private:
+        std::wstring                m_dir;          // empty if it couldn't be made
+        bool                        m_bDirChecked;
+        std::vector<PendingImport>  m_pending;
+
+        ModuleSnapshots( const ModuleSnapshots& );
+        ModuleSnapshots& operator=( const ModuleSnapshots& );
+    };
+
+    // Same major and minor version; pickles don't change within those
+    bool
+    SamePython( unsigned long pythonVersion )
+    {
+        return (pythonVersion >> 16) == ((unsigned long) PY_VERSION_HEX >> 16);
+    }
+
+    PyObject*
+    PickleModule()
+    {
+#if PY_MAJOR_VERSION < 3
+        return PyImport_ImportModule("cPickle");
+#else
+        return PyImport_ImportModule("pickle");
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ModuleSnapshots&
+    ModuleSnapshots::Factory()
+    {
+        static ModuleSnapshots g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ModuleSnapshots::ModuleSnapshots() :
+        m_bDirChecked(false)
+    {
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ModuleSnapshots::~ModuleSnapshots()
+    {
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // dir\module-xxxxxxxxxxxxxxxx.snapshot, where the x's hash the script's full
+    // name, so scripts of the same name in different directories don't share one.
+    // The directory is made the first time it's needed.
+
+    bool
+    ModuleSnapshots::SnapshotFilename( const std::wstring& filename,
+                                       const std::string& moduleName,
+                                       std::wstring& rSnapshotFile )
+    {
+        if (!m_bDirChecked) {
+            m_bDirChecked = true;
+
+            wchar_t pDir[MAX_PATH];
+            DWORD len = GetEnvironmentVariableW(L"PYINEX_SNAPSHOT_DIR", pDir, NELEMS(pDir));
+            std::wstring dir;
+            if (len > 0 && len < NELEMS(pDir)) {
+                dir = pDir;
+            } else {
+                len = GetEnvironmentVariableW(L"LOCALAPPDATA", pDir, NELEMS(pDir));
+                if (len == 0 || len >= NELEMS(pDir)) {
+                    // No LOCALAPPDATA before Vista
+                    len = GetTempPathW(NELEMS(pDir), pDir);
+                }
+                if (len > 0 && len < NELEMS(pDir)) {
+                    dir = pDir;
+                    if (dir[dir.size() - 1] != L'\\') {
+                        dir += L"\\";
+                    }
+                    dir += L"Pyinex";
+                    CreateDirectoryW(dir.c_str(), NULL);
+                    dir += L"\\Snapshots";
+                }
+            }
+
+            if (!dir.empty() && (CreateDirectoryW(dir.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS)) {
+                m_dir = dir;
+            } else {
+                ERROUT("Couldn't make a directory for module snapshots; they won't be taken");
+            }
+        }
+
+        if (m_dir.empty()) {
+            return false;
+        }
+
+        std::wstring lower(filename);
+        for (size_t i = 0; i < lower.size(); ++i) {
+            lower[i] = towlower(lower[i]);
+        }
+        std::wostringstream name;
+        name << m_dir << L"\\" << std::wstring(moduleName.begin(), moduleName.end()) << L"-"
+             << std::hex << HashBytes(lower.data(), lower.size() * sizeof(wchar_t), HASH_SEED) << L".snapshot";
+        rSnapshotFile = name.str();
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Returns true if the module is to be restored from a snapshot
+
+    bool
+    ModuleSnapshots::BeginImport( const std::wstring& filename, const std::string& moduleName )
+    {
+        PendingImport pending;
+        pending.moduleName = moduleName;
+        pending.moduleHash = 0;
+        pending.pState = NULL;
+
+        // Hashed before the module runs, so a snapshot is never filed under contents
+        // that weren't the ones run
+        if (HashFileContents(filename, pending.moduleHash) &&
+            SnapshotFilename(filename, moduleName, pending.snapshotFile)) {
+            pending.pState = LoadState(pending);
+        } else {
+            pending.snapshotFile.clear();
+        }
+
+        m_pending.push_back(pending);
+        return pending.pState != NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ModuleSnapshots::Restoring( const std::string& moduleName ) const
+    {
+        for (size_t i = 0; i < m_pending.size(); ++i) {
+            if (m_pending[i].pState && m_pending[i].moduleName == moduleName) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // pModule is NULL if the import failed. Returns false if the module was to be
+    // restored, and couldn't be; the snapshot is gone by then, and the module
+    // needs running again.
+
+    bool
+    ModuleSnapshots::EndImport( PyObject* pModule )
+    {
+        if (m_pending.empty()) {
+            return true;
+        }
+        PendingImport pending = m_pending.back();
+        m_pending.pop_back();
+
+        bool rc = true;
+        if (pending.pState) {
+            if (pModule) {
+                rc = Restore(pModule, pending);
+            }
+            Py_DECREF(pending.pState);
+            if (!rc) {
+                DeleteFileW(pending.snapshotFile.c_str());
+            }
+        } else if (pModule && !pending.snapshotFile.empty()) {
+            Save(pModule, pending);
+        }
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A missing file is the usual case - no snapshot yet - and a snapshot of other
+    // contents is an out-of-date one, to be replaced; neither is worth a message
+
+    PyObject*
+    ModuleSnapshots::LoadState( const PendingImport& pending )
+    {
+        HANDLE hFile = CreateFileW(pending.snapshotFile.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return NULL;
+        }
+
+        LARGE_INTEGER fileBytes;
+        HANDLE hMapping = NULL;
+        const unsigned char* pView = NULL;
+        if (GetFileSizeEx(hFile, &fileBytes) && fileBytes.QuadPart > (LONGLONG) sizeof(SnapshotHeader)) {
+            hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (hMapping) {
+                pView = (const unsigned char*) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+
+        PyObject* pState = NULL;
+        bool bUnmap = true;
+        if (pView) {
+            SnapshotHeader header;
+            memcpy(&header, pView, sizeof(header));
+            const unsigned char* pPickle = pView + sizeof(header);
+            bool bCurrent = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+                            header.version == SNAPSHOT_VERSION &&
+                            SamePython(header.pythonVersion) &&
+                            header.moduleHash == pending.moduleHash;
+            if (bCurrent) {
+                if (header.length != (ULONGLONG) fileBytes.QuadPart - sizeof(header) ||
+                    header.checksum != HashBytes(pPickle, (size_t) header.length, HASH_SEED)) {
+                    WARNOUT("Snapshot of %s is damaged; the module will be run in full", pending.moduleName.c_str());
+                } else {
+                    pState = Unpickle(pPickle, (size_t) header.length, bUnmap);
+                }
+            }
+        }
+
+        if (pView && bUnmap) {
+            UnmapViewOfFile(pView);
+        }
+        if (hMapping) {
+            CloseHandle(hMapping);
+        }
+        CloseHandle(hFile);
+        return pState;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // rbUnmap is cleared if the mapped memory can't be let go of: something still
+    // holds a buffer on it
+
+    PyObject*
+    ModuleSnapshots::Unpickle( const unsigned char* pData, size_t n, bool& rbUnmap )
+    {
+        PyObject* pPickle = PickleModule();
+        if (!pPickle) {
+            PyErr_Print();
+            return NULL;
+        }
+
+#if PY_VERSION_HEX >= 0x03030000
+        PyObject* pBuffer = PyMemoryView_FromMemory((char*) pData, (Py_ssize_t) n, PyBUF_READ);
+#elif PY_MAJOR_VERSION >= 3
+        PyObject* pBuffer = PyBytes_FromStringAndSize((const char*) pData, (Py_ssize_t) n);
+#else
+        PyObject* pBuffer = PyString_FromStringAndSize((const char*) pData, (Py_ssize_t) n);
+#endif
+        PyObject* pState = pBuffer ? PyObject_CallMethod(pPickle, (char*)"loads", (char*)"O", pBuffer) : NULL;
+        if (!pState) {
+            PyErr_Print();
+            ERROUT("Couldn't unpickle the snapshot; the module will be run in full");
+        }
+
+#if PY_VERSION_HEX >= 0x03030000
+        if (pBuffer) {
+            PyObject* pRes = PyObject_CallMethod(pBuffer, (char*)"release", NULL);
+            if (!pRes) {
+                PyErr_Clear();
+                rbUnmap = false;
+            }
+            Py_XDECREF(pRes);
+        }
+#endif
+        Py_XDECREF(pBuffer);
+        Py_DECREF(pPickle);
+        return pState;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ModuleSnapshots::Restore( PyObject* pModule, const PendingImport& pending )
+    {
+        PyObject* pRestore = PyObject_GetAttrString(pModule, "__pyinex_restore__");
+        PyObject* pRes = NULL;
+        if (pRestore && PyCallable_Check(pRestore)) {
+            pRes = PyObject_CallFunctionObjArgs(pRestore, pending.pState, NULL);
+        }
+
+        bool rc = pRes != NULL;
+        if (!rc) {
+            if (PyErr_Occurred()) {
+                PyErr_Print();
+            }
+            ERROUT("Couldn't restore %s from its snapshot; running it in full", pending.moduleName.c_str());
+        } else if (TimelineActive()) {
+            RecordTimelineInstant("module", "snapshot restored", "module",
+                                  std::wstring(pending.moduleName.begin(), pending.moduleName.end()));
+        }
+
+        Py_XDECREF(pRes);
+        Py_XDECREF(pRestore);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Modules without a snapshot function are left alone. A snapshot that can't be
+    // taken is reported, and the module carries on without one.
+
+    void
+    ModuleSnapshots::Save( PyObject* pModule, const PendingImport& pending )
+    {
+        PyObject* pSnapshot = PyObject_GetAttrString(pModule, "__pyinex_snapshot__");
+        if (!pSnapshot) {
+            PyErr_Clear();
+            return;
+        }
+
+        PyObject* pPickle = PickleModule();
+        PyObject* pState = (pPickle && PyCallable_Check(pSnapshot)) ? PyObject_CallObject(pSnapshot, NULL) : NULL;
+        PyObject* pData = pState ? PyObject_CallMethod(pPickle, (char*)"dumps", (char*)"Oi", pState, -1) : NULL;
+
+        char* pBytes = NULL;
+        Py_ssize_t n = 0;
+#if PY_MAJOR_VERSION < 3
+        bool rc = pData && PyString_AsStringAndSize(pData, &pBytes, &n) == 0;
+#else
+        bool rc = pData && PyBytes_AsStringAndSize(pData, &pBytes, &n) == 0;
+#endif
+        if (!rc) {
+            if (PyErr_Occurred()) {
+                PyErr_Print();
+            }
+            ERROUT("Couldn't take a snapshot of %s", pending.moduleName.c_str());
+        }
+
+        // Written under a name of its own, then renamed over any older snapshot
+        std::wostringstream tempName;
+        tempName << pending.snapshotFile << L"." << GetCurrentProcessId() << L".tmp";
+        std::wstring tempFile(tempName.str());
+        std::string errTxt;
+        HANDLE hFile = INVALID_HANDLE_VALUE;
+        if (rc) {
+            hFile = CreateFileW(tempFile.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                GetWindowsErrorText(errTxt);
+                ERROUT("Couldn't write the snapshot of %s: %s", pending.moduleName.c_str(), errTxt.c_str());
+                rc = false;
+            }
+        }
+
+        if (rc) {
+            SnapshotHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+            header.version = SNAPSHOT_VERSION;
+            header.pythonVersion = PY_VERSION_HEX;
+            header.moduleHash = pending.moduleHash;
+            header.checksum = HashBytes(pBytes, (size_t) n, HASH_SEED);
+            header.length = (ULONGLONG) n;
+
+            DWORD nWritten = 0;
+            rc = WriteFile(hFile, &header, sizeof(header), &nWritten, NULL) && nWritten == sizeof(header);
+            for (Py_ssize_t done = 0; rc && done < n; done += nWritten) {
+                DWORD chunk = (n - done < (Py_ssize_t) WRITE_CHUNK_BYTES) ? (DWORD)(n - done) : WRITE_CHUNK_BYTES;
+                rc = WriteFile(hFile, pBytes + done, chunk, &nWritten, NULL) && nWritten == chunk;
+            }
+        }
+        if (hFile != INVALID_HANDLE_VALUE) {
+            rc = CloseHandle(hFile) && rc;
+            if (rc) {
+                rc = MoveFileExW(tempFile.c_str(), pending.snapshotFile.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+            }
+            if (!rc) {
+                GetWindowsErrorText(errTxt);
+                ERROUT("Couldn't write the snapshot of %s: %s", pending.moduleName.c_str(), errTxt.c_str());
+                DeleteFileW(tempFile.c_str());
+            }
+        }
+
+        if (rc && TimelineActive()) {
+            RecordTimelineInstant("module", "snapshot saved", "module",
+                                  std::wstring(pending.moduleName.begin(), pending.moduleName.end()));
+        }
+
+        Py_XDECREF(pData);
+        Py_XDECREF(pState);
+        Py_XDECREF(pPickle);
+        Py_DECREF(pSnapshot);
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+BeginModuleImport( const std::wstring& filename, const std::string& moduleName )
+{
+    return ModuleSnapshots::Factory().BeginImport(filename, moduleName);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ModuleRestoring( const std::string& moduleName )
+{
+    return ModuleSnapshots::Factory().Restoring(moduleName);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+EndModuleImport( PyObject* pModule )
+{
+    return ModuleSnapshots::Factory().EndImport(pModule);
+}
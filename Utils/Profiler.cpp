@@ -0,0 +1,708 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+#include <process.h>
+#include <frameobject.h>
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A sampling profiler for the Python that PyCall runs. While it's on, a sampler
+// thread wakes hz times a second and, if a PyCall is in progress, takes the GIL
+// and walks the calc thread's stack through its PyThreadState, with the ordinary
+// frame API. The calc thread only lets go of the GIL at a checkpoint in the eval
+// loop, or when C code releases it, so the stack is never caught half-built and
+// holds still while it's read. Between samples a PyCall costs the profiler a
+// couple of stores.
+//
+// The sampler can't have the GIL the moment it asks - under Python 3 it waits out
+// the 5 ms switch interval first, and an extension that holds the GIL keeps it
+// out for as long as it runs - so each sample stands for all the time since the
+// one before it. Stacks are weighted by time, not counted, which also keeps the
+// profile honest when the system timer (usually 64 Hz) is coarser than the rate
+// asked for. Weights are in microseconds.
+//
+// Stacks are kept collapsed: one line per distinct stack, its frames separated by
+// semicolons, outermost first, then its weight - what flamegraph.pl and speedscope
+// read. The outermost frame is the PyCall's "module!function"; then, if cells are
+// on and this is Excel 2007, the calling cell; then the Python frames, each as
+// "function (file:line)" with the line the function is defined on. Only the calc
+// thread may call Excel, so a call's samples are held aside until it ends, and
+// labelled then; calls that weren't sampled never ask Excel for their caller.
+
+namespace {
+
+    const double MAX_PROFILE_HZ = 1000.0;
+    const size_t MAX_PROFILE_DEPTH = 256;  // frames kept, from the innermost
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Semicolons separate frames, so they can't appear in one
+
+    void
+    Sanitize( std::string& text )
+    {
+        std::replace(text.begin(), text.end(), ';', '_');
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    std::string
+    CodeText( PyObject* pText )
+    {
+        std::string text("?");
+#if PY_MAJOR_VERSION < 3
+        if (pText && PyString_Check(pText)) {
+            text = PyString_AsString(pText);
+        }
+#else
+        if (pText && PyUnicode_Check(pText)) {
+            PyObject* pUTF8 = PyUnicode_AsUTF8String(pText);
+            if (pUTF8) {
+                text.assign(PyBytes_AS_STRING(pUTF8), PyBytes_GET_SIZE(pUTF8));
+                Py_DECREF(pUTF8);
+            } else {
+                PyErr_Clear();
+            }
+        }
+#endif
+        Sanitize(text);
+        return text;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Takes a zero-indexed col
+
+    std::string
+    ColumnText( int col )
+    {
+        std::string text;
+        for (++col; col > 0; col = (col - 1) / 26) {
+            text.insert(text.begin(), (char)('A' + (col - 1) % 26));
+        }
+        return text;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    class Profiler
+    {
+    public:
+        static Profiler& Factory();
+
+        bool Start( double hz, bool bCells );
+        void Stop();
+        void Shutdown();
+
+        bool Active() const { return m_active != 0; }
+        double Hz() const { return m_hz; }
+        bool Cells() const { return m_bCells; }
+        unsigned long Samples() const { return m_samples; }
+
+        void BeginCall( PyObject* pModule, PyObject* pFunction );
+        void EndCall();
+
+        void GetStacks( std::vector<std::pair<std::string, double> >& rStacks ) const;
+        bool Write( const std::wstring& filename ) const;
+
+    private:
+        Profiler();
+        ~Profiler();
+
+        bool StartSampler();
+        void Sample();
+        void TakeSample();
+        void BuildCallLabel( std::string& rLabel ) const;
+        const std::string& FrameName( PyCodeObject* pCode );
+        void ClearFrameNames();
+        double Clock() const;
+
+        static unsigned __stdcall SamplerMain( void* pProfiler );
+
+    private:
+        volatile LONG   m_active;
+        volatile LONG   m_callDepth;        // PyCalls in progress (calc thread only changes it)
+        volatile DWORD  m_intervalMs;
+
+        // Whoever holds the GIL - the calc thread, or the sampler taking a sample
+        double          m_hz;
+        bool            m_bCells;
+        PyThreadState*  m_pCallState;       // the calc thread's, while a PyCall is in progress
+        PyObject*       m_pModule;          // the PyCall in progress; borrowed
+        PyObject*       m_pFunction;
+        double          m_lastSample;       // seconds
+        unsigned long   m_samples;
+        std::map<std::string, double> m_callStacks;         // the call in progress's, without its label
+        std::map<std::string, double> m_stacks;             // collapsed stack to microseconds
+        std::map<PyCodeObject*, std::string> m_frameNames;  // holds a reference to each code object
+
+        LARGE_INTEGER   m_frequency;
+        HANDLE          m_hSampler;
+        HANDLE          m_hActive;          // manual reset; set while profiling a call
+        HANDLE          m_hQuit;
+        HANDLE          m_hDone;            // set by the sampler as it exits
+
+        Profiler( const Profiler& );
+        Profiler& operator=( const Profiler& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Profiler&
+    Profiler::Factory()
+    {
+        static Profiler g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Profiler::Profiler() :
+        m_active(0),
+        m_callDepth(0),
+        m_intervalMs(10),
+        m_hz(0.0),
+        m_bCells(true),
+        m_pCallState(NULL),
+        m_pModule(NULL),
+        m_pFunction(NULL),
+        m_lastSample(0.0),
+        m_samples(0),
+        m_hSampler(NULL),
+        m_hActive(NULL),
+        m_hQuit(NULL),
+        m_hDone(NULL)
+    {
+        QueryPerformanceFrequency(&m_frequency);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Runs inside DllMain at unload; as with the break watchdog, the sampler is
+    // signalled but not waited for. The code objects in m_frameNames are left
+    // alone, as the interpreter is already gone.
+
+    Profiler::~Profiler()
+    {
+        if (m_hSampler) {
+            SetEvent(m_hQuit);
+            CloseHandle(m_hSampler);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, with the GIL. Throws away the samples of any previous run.
+
+    bool
+    Profiler::Start( double hz, bool bCells )
+    {
+        if (hz <= 0.0) {
+            ERROUT("Sampling rate was %g Hz; it must be greater than zero", hz);
+            return false;
+        }
+        if (hz > MAX_PROFILE_HZ) {
+            WARNOUT("Input sampling rate was %g Hz; max value is %g", hz, MAX_PROFILE_HZ);
+            hz = MAX_PROFILE_HZ;
+        }
+
+        if (!StartSampler()) {
+            ERROUT("Couldn't start the profiler's sampling thread");
+            return false;
+        }
+
+#if PY_VERSION_HEX < 0x03070000
+        // Until this is called there's no GIL for the sampler to take; the calc thread gets it
+        PyEval_InitThreads();
+#endif
+
+        Stop();
+        m_stacks.clear();
+        m_callStacks.clear();
+        m_samples = 0;
+
+        m_hz = hz;
+        m_bCells = bCells;
+        m_intervalMs = (DWORD)(1000.0 / hz + 0.5);
+        if (m_intervalMs == 0) {
+            m_intervalMs = 1;
+        }
+
+        m_lastSample = Clock();
+        InterlockedExchange(&m_active, 1);
+        if (m_callDepth > 0) {
+            m_pCallState = PyThreadState_Get(); // started from inside a PyCall
+            SetEvent(m_hActive);
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, with the GIL. The samples are kept until the next Start; those
+    // of a call in progress are added as it ends.
+
+    void
+    Profiler::Stop()
+    {
+        InterlockedExchange(&m_active, 0);
+        if (m_hActive) {
+            ResetEvent(m_hActive);
+        }
+        ClearFrameNames();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, with the GIL, before Py_Finalize, so that the sampler can't
+    // take a sample of an interpreter that's being torn down. The sampler may be
+    // waiting for the GIL already, so it's let go while the sampler finishes. This
+    // runs inside DllMain, where a thread can't exit, so the sampler signals m_hDone
+    // rather than being waited on; if the process is exiting, the sampler is already
+    // gone and its handle is signalled instead.
+
+    void
+    Profiler::Shutdown()
+    {
+        Stop();
+        if (!m_hSampler) {
+            return;
+        }
+
+        SetEvent(m_hQuit);
+        HANDLE handles[2] = { m_hDone, m_hSampler };
+        PyThreadState* pSave = PyEval_SaveThread();
+        WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+        PyEval_RestoreThread(pSave);
+
+        CloseHandle(m_hSampler);
+        m_hSampler = NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, with the GIL. Both objects are borrowed; PyCall holds them for the call.
+
+    void
+    Profiler::BeginCall( PyObject* pModule, PyObject* pFunction )
+    {
+        if (InterlockedIncrement(&m_callDepth) != 1) {
+            return; // nested; samples go to the outermost call
+        }
+
+        m_pModule = pModule;
+        m_pFunction = pFunction;
+        if (m_active) {
+            m_pCallState = PyThreadState_Get();
+            m_lastSample = Clock();
+            SetEvent(m_hActive);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only, with the GIL, so the sampler can't be partway through a sample
+
+    void
+    Profiler::EndCall()
+    {
+        if (InterlockedDecrement(&m_callDepth) != 0) {
+            return;
+        }
+
+        if (!m_callStacks.empty()) {
+            std::string label;
+            BuildCallLabel(label);
+            std::map<std::string, double>::const_iterator it;
+            for (it = m_callStacks.begin(); it != m_callStacks.end(); ++it) {
+                m_stacks[label + ";" + it->first] += it->second;
+            }
+            m_callStacks.clear();
+        }
+
+        m_pCallState = NULL;
+        m_pModule = m_pFunction = NULL;
+        if (m_active) {
+            ResetEvent(m_hActive);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Heaviest first
+
+    bool
+    HeavierStack( const std::pair<std::string, double>& lhs, const std::pair<std::string, double>& rhs )
+    {
+        return lhs.second > rhs.second;
+    }
+
+    void
+    Profiler::GetStacks( std::vector<std::pair<std::string, double> >& rStacks ) const
+    {
+        rStacks.assign(m_stacks.begin(), m_stacks.end());
+        std::sort(rStacks.begin(), rStacks.end(), HeavierStack);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    Profiler::Write( const std::wstring& filename ) const
+    {
+        FILE* pFile = _wfopen(filename.c_str(), L"w");
+        if (!pFile) {
+            ERROUT("Couldn't open profile file %s", ASCII_REPR(filename));
+            return false;
+        }
+
+        std::map<std::string, double>::const_iterator it;
+        for (it = m_stacks.begin(); it != m_stacks.end(); ++it) {
+            fprintf(pFile, "%s %.0f\n", it->first.c_str(), it->second);
+        }
+
+        if (fclose(pFile) != 0) {
+            ERROUT("Error writing profile file %s; the profile is incomplete", ASCII_REPR(filename));
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Started on first use, and left running (idle, waiting on
+    // m_hActive) for the life of the process.
+
+    bool
+    Profiler::StartSampler()
+    {
+        if (m_hSampler) {
+            return true;
+        }
+
+        m_hActive = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hQuit = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!m_hActive || !m_hQuit || !m_hDone) {
+            std::string errTxt;
+            GetWindowsErrorText(errTxt);
+            ERROUT("CreateEvent failed: %s", errTxt.c_str());
+            return false;
+        }
+
+        m_hSampler = (HANDLE)_beginthreadex(NULL, 0, SamplerMain, this, 0, NULL);
+        return m_hSampler != NULL;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Sampler thread. Waits for the GIL, which the calc thread gives up at its next
+    // checkpoint; the call may have finished, or profiling stopped, by then. If the
+    // call ends while we wait, the calc thread goes back to Excel still holding the
+    // GIL, and we get it when Python next runs.
+
+    void
+    Profiler::Sample()
+    {
+        if (!m_active || m_callDepth == 0) {
+            return;
+        }
+
+        PyGILState_STATE gil = PyGILState_Ensure();
+        if (m_active && m_callDepth > 0 && m_pCallState) {
+            TakeSample();
+        }
+        PyGILState_Release(gil);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Sampler thread, with the GIL. The calc thread's frames are walked from the
+    // innermost out.
+
+    void
+    Profiler::TakeSample()
+    {
+        double now = Clock();
+        double weight = (now - m_lastSample) * 1.0e6;
+        m_lastSample = now;
+
+        std::vector<const std::string*> frames;
+        PyFrameObject* pFrame = m_pCallState->frame; // borrowed
+        for ( ; pFrame && frames.size() < MAX_PROFILE_DEPTH; pFrame = pFrame->f_back) {
+            frames.push_back(&FrameName(pFrame->f_code));
+        }
+        if (frames.empty()) {
+            return; // between Python frames, converting arguments or results
+        }
+
+        std::string stack;
+        std::vector<const std::string*>::reverse_iterator it;
+        for (it = frames.rbegin(); it != frames.rend(); ++it) {
+            if (!stack.empty()) {
+                stack += ';';
+            }
+            stack += **it;
+        }
+
+        m_callStacks[stack] += weight;
+        ++m_samples;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // "module!function", then ";[Book]Sheet!A1" if cells are on. Calc thread only.
+
+    void
+    Profiler::BuildCallLabel( std::string& rLabel ) const
+    {
+        const char* pModuleName = m_pModule ? PyModule_GetName(m_pModule) : NULL;
+        if (!pModuleName) {
+            PyErr_Clear();
+            pModuleName = "?";
+        }
+        rLabel = pModuleName;
+        Sanitize(rLabel);
+        rLabel += "!";
+        rLabel += m_pFunction ? CodeText(((PyFunctionObject*)m_pFunction)->func_name) : std::string("?");
+
+        if (!m_bCells || !XlfExcel::Instance().excel12()) {
+            return;
+        }
+
+        XLOPER12 xCaller;
+        if (XlfExcel::Instance().Call12(xlfCaller, &xCaller, 0) != xlretSuccess) {
+            return;
+        }
+        if (xCaller.xltype == xltypeSRef) {
+            std::string cell;
+            XLOPER12 xSheet;
+            if (XlfExcel::Instance().Call12(xlSheetNm, &xSheet, 1, &xCaller) == xlretSuccess) {
+                if (xSheet.xltype == xltypeStr && xSheet.val.str[0] > 0) {
+                    int len = WideCharToMultiByte(CP_UTF8, 0, xSheet.val.str + 1, xSheet.val.str[0], NULL, 0, NULL, NULL);
+                    if (len > 0) {
+                        cell.resize(len);
+                        WideCharToMultiByte(CP_UTF8, 0, xSheet.val.str + 1, xSheet.val.str[0], &cell[0], len, NULL, NULL);
+                        cell += "!";
+                    }
+                }
+                XlfExcel::Instance().Call12(xlFree, NULL, 1, &xSheet);
+            }
+
+            std::ostringstream ostr;
+            ostr << ColumnText(xCaller.val.sref.ref.colFirst) << xCaller.val.sref.ref.rwFirst + 1;
+            cell += ostr.str();
+            Sanitize(cell);
+
+            rLabel += ";";
+            rLabel += cell;
+        }
+        XlfExcel::Instance().Call12(xlFree, NULL, 1, &xCaller);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // "function (file:line)", made once per code object. The map keeps a reference
+    // to each, so an address can't be reused by another while it's in there.
+
+    const std::string&
+    Profiler::FrameName( PyCodeObject* pCode )
+    {
+        std::map<PyCodeObject*, std::string>::iterator it = m_frameNames.find(pCode);
+        if (it != m_frameNames.end()) {
+            return it->second;
+        }
+
+        std::string file = CodeText(pCode->co_filename);
+        size_t slash = file.find_last_of("\\/");
+        if (slash != std::string::npos) {
+            file.erase(0, slash + 1);
+        }
+
+        std::ostringstream ostr;
+        ostr << CodeText(pCode->co_name) << " (" << file << ":" << pCode->co_firstlineno << ")";
+
+        Py_INCREF(pCode);
+        return m_frameNames[pCode] = ostr.str();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    Profiler::ClearFrameNames()
+    {
+        std::map<PyCodeObject*, std::string>::iterator it;
+        for (it = m_frameNames.begin(); it != m_frameNames.end(); ++it) {
+            Py_DECREF(it->first);
+        }
+        m_frameNames.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    double
+    Profiler::Clock() const
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return (double)now.QuadPart / (double)m_frequency.QuadPart;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    unsigned __stdcall
+    Profiler::SamplerMain( void* pProfiler )
+    {
+        Profiler* pThis = (Profiler*)pProfiler;
+        HANDLE quit = pThis->m_hQuit, active = pThis->m_hActive, done = pThis->m_hDone;
+        HANDLE handles[2] = { quit, active };
+
+        for (;;) {
+            // Sleep until a call is being profiled, then sample it while it runs
+            if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+                break;
+            }
+            if (WaitForSingleObject(quit, pThis->m_intervalMs) == WAIT_OBJECT_0) {
+                break;
+            }
+
+            pThis->Sample();
+        }
+
+        SetEvent(done);
+        return 0;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StartProfiler( double hz, bool bCells )
+{
+    return Profiler::Factory().Start(hz, bCells);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+StopProfiler()
+{
+    Profiler::Factory().Stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+ShutdownProfiler()
+{
+    Profiler::Factory().Shutdown();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ProfilerActive()
+{
+    return Profiler::Factory().Active();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+double
+ProfilerHz()
+{
+    return Profiler::Factory().Hz();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ProfilerCells()
+{
+    return Profiler::Factory().Cells();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+ProfileSampleCount()
+{
+    return Profiler::Factory().Samples();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+BeginProfiledCall( PyObject* pModule, PyObject* pFunction )
+{
+    Profiler::Factory().BeginCall(pModule, pFunction);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+EndProfiledCall()
+{
+    Profiler::Factory().EndCall();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetProfileStacks( std::vector<std::pair<std::string, double> >& rStacks )
+{
+    Profiler::Factory().GetStacks(rStacks);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+WriteProfile( const std::wstring& filename )
+{
+    return Profiler::Factory().Write(filename);
+}
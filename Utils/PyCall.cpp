@@ -0,0 +1,410 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A PyCall's whole path, from the XLOPERs Excel passes in to the XLOPER handed
+// back: finding the function, converting its arguments, the call itself, and
+// converting the result. The add-in's PyCall and PyCallRef make their calls
+// through here, and so does TestHarness, so that what it times and replays is
+// what Excel runs. Nothing here calls back into Excel except to read references.
+// A caller with the result cache open has it consulted here as well, once the
+// function is found to be cacheable, so that other calls never make a key.
+
+namespace {
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Positional arguments for the Python call, in a tuple that owns their references
+
+    class PyCallArguments
+    {
+    public:
+        explicit PyCallArguments( int count ) :
+            m_pTuple(PyTuple_New(count))
+        {
+        }
+
+        ~PyCallArguments() { Py_XDECREF(m_pTuple); }
+
+        bool Ok() const { return m_pTuple != NULL; }
+
+        // Steals the reference to pValue
+        void Set( int i, PyObject* pValue ) { PyTuple_SET_ITEM(m_pTuple, i, pValue); }
+
+        PyObject* Call( PyObject* pFunction ) { return PyObject_CallObject(pFunction, m_pTuple); }
+
+    private:
+        PyObject*   m_pTuple;
+
+        PyCallArguments( const PyCallArguments& );
+        PyCallArguments& operator=( const PyCallArguments& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Times the stages of a PyCall, for the timeline (see Timeline.cpp) if one is
+    // being recorded, and for the caller if it asked. End() ends one stage and
+    // starts the next.
+
+    class PyCallStageClock
+    {
+    public:
+        explicit PyCallStageClock( PyCallStages* pStages ) :
+            m_pStages(pStages),
+            m_bTimeline(TimelineActive()),
+            m_startUs(-1.0)
+        {
+            if (m_pStages) {
+                m_pStages->lookupUs = m_pStages->argumentsUs = m_pStages->pythonUs = m_pStages->resultUs = 0.0;
+            }
+            if (m_pStages || m_bTimeline) {
+                m_startUs = TimelineClock();
+            }
+        }
+
+        void End( const char* pCategory, const char* pStage, double PyCallStages::* pElapsedUs )
+        {
+            if (m_startUs < 0.0) {
+                return;
+            }
+            double nowUs = TimelineClock();
+            if (m_bTimeline) {
+                RecordTimelineSpan(pCategory, pStage, m_startUs, nowUs - m_startUs, NULL, std::wstring());
+            }
+            if (m_pStages) {
+                m_pStages->*pElapsedUs = nowUs - m_startUs;
+            }
+            m_startUs = nowUs;
+        }
+
+    private:
+        PyCallStages*   m_pStages;
+        bool            m_bTimeline;
+        double          m_startUs;
+
+        PyCallStageClock( const PyCallStageClock& );
+        PyCallStageClock& operator=( const PyCallStageClock& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // PyCallRef's references can be read from Excel only while its Range generation
+    // is open (see RangeProxy.cpp). This closes it on every way out of the call.
+    // Close() may be called early; it returns true if any reference was found
+    // uncalculated, in which case Excel calls the function again.
+
+    class RangeProxyScope
+    {
+    public:
+        RangeProxyScope( bool bOpen ) :
+            m_bOpen(bOpen),
+            m_bUncalculated(false)
+        {
+            if (m_bOpen) {
+                OpenRangeProxies();
+            }
+        }
+
+        ~RangeProxyScope() { Close(); }
+
+        bool Close()
+        {
+            if (m_bOpen) {
+                m_bUncalculated = CloseRangeProxies();
+                m_bOpen = false;
+            }
+            return m_bUncalculated;
+        }
+
+    private:
+        bool    m_bOpen;
+        bool    m_bUncalculated;
+
+        RangeProxyScope( const RangeProxyScope& );
+        RangeProxyScope& operator=( const RangeProxyScope& );
+    };
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+XlfOper
+CallPythonFunction( XlfOper& xlFilename,
+                    XlfOper& xlFunction,
+                    XlfOper* arrCM[],
+                    bool bRangeArgs,
+                    PyCallResultBuffer& rBuffer,
+                    bool& rbCacheable,
+                    PyCallStages* pStages,
+                    PyCallCacheEntry* pCache )
+{
+    rbCacheable = false;
+    if (pCache) {
+        pCache->bKeyed = pCache->bFound = false;
+    }
+    PyCallStageClock stages(pStages);
+
+    // DON'T DECREMENT THE MODULE POINTER - its lifetime is managed by a separate cache object.
+    PyObject* pModule = NULL, *pFunction = NULL;
+    bool rc =  GetPyModuleAndFunctionObjects(  xlFilename.AsWstring(), 
+                                               xlFunction.AsString(), 
+                                               pModule, 
+                                               pFunction);
+    stages.End("module", "find module", &PyCallStages::lookupUs);
+    if (!rc) {
+        assert(!pModule);
+        assert(!pFunction);
+        return XlfOper::Error(0);
+    }
+
+    // The function's dict is read directly, so that a missing attribute doesn't cost
+    // an AttributeError per call. Other callables have no decorations to read.
+    PyObject* pFuncDict = PyFunction_Check(pFunction) ? ((PyFunctionObject*)pFunction)->func_dict : NULL;
+    bool bCacheable = pFuncDict && PyDict_GetItemString(pFuncDict, "__pyinex_cache__") != NULL; // borrowed
+
+    // A result stored for the same script, function and arguments - by this Excel
+    // or an earlier one - stands in for the call. PyCallRef's ranges may not be
+    // calculated yet, so its calls aren't cached.
+    if (pCache && bCacheable && !bRangeArgs) {
+        const xloper12* pArgs[PYCALL_ARGS];
+        for (int i = 0; i < PYCALL_ARGS; ++i) {
+            pArgs[i] = (const xloper12*) arrCM[i]->GetLPXLFOPER();
+        }
+        pCache->bKeyed = MakeResultCacheKey(xlFilename.AsWstring(), xlFunction.AsString(), pArgs, PYCALL_ARGS, pCache->key);
+        const xloper12* pCached = NULL;
+        if (pCache->bKeyed && LookUpCachedResult(pCache->key, pCached)) {
+            pCache->bFound = true;
+            Py_XDECREF(pFunction);
+            return XlfOper((LPXLFOPER)pCached);
+        }
+    }
+
+    // What the call allocates is charged to its module (see MemoryAccount.cpp)
+    MemoryTagScope memoryTag(PyModule_GetName(pModule));
+
+    // Examine the function's PyCodeObject to see how many arguments its definition contains.
+    //
+    // If the function is declared with a vararg param (*varname), pass all possible params to Python,
+    // whether they're empty or not. We can't say if those empty params are meaningful to a user function,
+    // so we pass them all on.
+    //
+    // If the function does not have a vararg param, prune out all params past the number defined, and only
+    // pass that defined number. To do otherwise causes Python to throw a TypeError (see err_args() in ceval.c).
+
+    int pyCallArgcount = 0;
+    if (rc) {
+        assert(pFunction);
+        PyCodeObject* pCO = (PyCodeObject*)PyFunction_GET_CODE(pFunction);
+        assert(pCO);
+        pyCallArgcount = pCO->co_argcount;
+
+        // co_argcount refers to the number  of params in the function's opening "define" statement.
+        // If it exceeds the number of params that Excel can pass in, there's no way to call this function here.
+        // Default param values don't provide a loophole, as Excel has no natural way to support named params.
+        if (pyCallArgcount > PYCALL_ARGS) {
+            ERROUT("Function %s has %d arguments; this exceeds the maximum allowable number %d", 
+                xlFunction.AsString(), pyCallArgcount, PYCALL_ARGS);
+            rc = false;
+        }
+
+        // co_flags has the CO_VARARGS bit set if the function has a vararg param in its definition.
+        if (rc && (pCO->co_flags & CO_VARARGS)) {
+            pyCallArgcount = PYCALL_ARGS; // Forces us to pass everything Excel has on to Python
+        }
+    }
+
+    // Assemble the args
+    long cmDx;
+    PyCallArguments args(pyCallArgcount);
+    PyObject *pValue = NULL;
+    rc = rc && args.Ok();
+
+    // Repeated labels within this call share one string object
+    PyStringInterner interner;
+    PyStringInterner* pInterner = StringInterningEnabled() ? &interner : NULL;
+
+    RangeProxyScope rangeProxies(bRangeArgs);
+
+    // Annotated arguments are built directly in the annotated type (see MarshalPlan.cpp);
+    // the plan is compiled on the function's first call
+    PyObject* pPlan = rc ? GetMarshalPlan(pFunction, xlFunction.AsString()) : NULL; // borrowed
+
+    for(cmDx = 0; rc && cmDx < pyCallArgcount; ++cmDx) {
+        int planEntry = MarshalPlanEntry(pPlan, cmDx);
+        if (planEntry) {
+            rc = ConvertXlfOperByPlan( *arrCM[cmDx], planEntry, pValue, pInterner );
+        } else {
+            rc = bRangeArgs ? ConvertXlfOperToRangeProxy( *arrCM[cmDx], pValue, pInterner )
+                            : ConvertXlfOperToPyObject( *arrCM[cmDx], pValue, pInterner );
+        }
+        if (rc) {
+            assert(pValue);
+            args.Set(cmDx, pValue); // pValue reference stolen here
+        } else {
+            // args frees the ones already converted
+            assert(!pValue);
+            if (!rangeProxies.Close()) {
+                ERROUT("Failed to convert argument %d to a PyObject", cmDx);
+            }
+        }
+    }
+
+    // An annotated reference that isn't calculated yet; Excel will call again
+    if (!rc && rangeProxies.Close()) {
+        Py_XDECREF(pFunction);
+        return XlfOper::Error(xlerrNA);
+    }
+
+    // Make the call, within the function's time budget (if it has one - set by the 
+    // pyinex.Timeout decorator), or else the global one.
+    PyObject* pResult = NULL;
+    bool bTimedOut = false;
+    if (rc) {
+        double timeoutSeconds = CallTimeoutSeconds();
+        if (pFuncDict) {
+            PyObject* pBudget = PyDict_GetItemString(pFuncDict, "__pyinex_timeout__"); // borrowed
+            if (pBudget && PyNumber_Check(pBudget)) {
+                timeoutSeconds = PyFloat_AsDouble(pBudget);
+                if (timeoutSeconds == -1.0 && PyErr_Occurred()) {
+                    PyErr_Clear();
+                    timeoutSeconds = CallTimeoutSeconds();
+                }
+            }
+        }
+
+        stages.End("marshal", "convert arguments", &PyCallStages::argumentsUs);
+
+        // The profiler, if it's running, samples the call under the function's name (see Profiler.cpp)
+        BeginProfiledCall(pModule, pFunction);
+        BeginCancellableCall(timeoutSeconds);
+        pResult = args.Call(pFunction);
+        bTimedOut = EndCancellableCall();
+        EndProfiledCall();
+
+        stages.End("python", "python", &PyCallStages::pythonUs);
+
+        // A Range that found uncalculated cells has made Excel schedule this call again,
+        // once they're done; the result of this one is thrown away
+        if (rangeProxies.Close()) {
+            if (!pResult) {
+                PyErr_Clear();
+            }
+            Py_XDECREF(pFunction);
+            Py_XDECREF(pResult);
+            return XlfOper::Error(xlerrNA);
+        }
+
+        if (bTimedOut) {
+            std::string name( PyModule_GetName(pModule) ? PyModule_GetName(pModule) : "?" );
+            name += "!";
+            name += xlFunction.AsString();
+            RecordCallTimeout(name);
+            WARNOUT("%s exceeded its %g second time budget", name.c_str(), timeoutSeconds);
+        }
+
+        if (!pResult) {
+            if (PyErr_Occurred()) {
+                // Already reported above; the traceback adds nothing
+                if (bTimedOut && PyErr_ExceptionMatches(CallTimeoutException())) {
+                    PyErr_Clear();
+                } else {
+                    PyErr_Print();
+                }
+            }
+            rc = false;
+        }
+    }
+
+    // Unpack results. Most PyCalls return a single number, string, or bool; those skip
+    // the CellMatrix and go back to Excel as the value itself, with no allocation.
+    // Tables (dicts of columns, lists of dicts, DataFrames) are also written
+    // directly, as a header row and a body; see TableResult.cpp. Arrow data goes
+    // the same way, read from its buffers (ArrowBridge.cpp), and so do iterators
+    // and generators, a row at a time (StreamResult.cpp).
+    bool bDirect = false;
+    CellMatrix retMatrix;
+    if (rc && pResult != NULL) {
+        bool bExcel12 = XlfExcel::Instance().excel12();
+        if (bExcel12 && ConvertPyScalarToXloper12(pResult, rBuffer.x, rBuffer.text, NELEMS(rBuffer.text))) {
+            bDirect = true;
+        } else if (bExcel12 && ConvertPyArrowToXloper12(pResult, rBuffer.x, rc)) {
+            bDirect = rc;
+        } else if (bExcel12 && ConvertPyTableToXloper12(pResult, rBuffer.x, rc)) {
+            bDirect = rc;
+        } else if (bExcel12 && ConvertPyIterableToXloper12(pResult, rBuffer.x, rc)) {
+            bDirect = rc;
+        } else {
+            rc = ConvertPyObjectToCellMatrix(pResult, retMatrix);
+        }
+        if (!rc) {
+            if (PyErr_Occurred()) {
+                PyErr_Print();
+            }
+        }
+        stages.End("marshal", "convert result", &PyCallStages::resultUs);
+    }
+
+    // Clean up; args releases the arguments on the way out
+    Py_XDECREF(pFunction);
+    Py_XDECREF(pResult);
+
+    rbCacheable = bCacheable && !bTimedOut && (bDirect || rc);
+
+    if (bDirect) {
+        return XlfOper((LPXLFOPER)&rBuffer.x);
+    } else if (rc) {
+        return XlfOper(retMatrix);
+    } else if (bTimedOut) {
+        // Only a timeout gives #NUM!; see Cancellation.cpp
+        return XlfOper::Error(xlerrNum);
+    } else {
+        return XlfOper::Error(0);
+    }
+}
@@ -0,0 +1,691 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Lazy range arguments for PyCallRef.
+//
+// PyCall's arguments are registered as values, so Excel hands over every cell of
+// every range, and all of them are converted to Python up front. PyCallRef's are
+// registered as references (type U). A single-area reference becomes a
+// pyinex.Range object, which only knows its shape until it's indexed. Cells are
+// then fetched from Excel with xlCoerce a block of rows at a time, converted
+// once, and cached, so a lookup that touches three cells of a million-row range
+// pays for one block.
+//
+// Slicing a Range gives another Range over the same cache. rows() and tuples()
+// materialize it (tuples() in the same shapes PyCall uses), and __array__ lets
+// numpy.asarray() do the same.
+//
+// References can only be read while Excel is calling us. Each PyCallRef opens a
+// new "generation"; a Range kept past the end of its call can still serve what's
+// already cached, but anything else raises an error.
+//
+// If a referenced cell hasn't been calculated yet, xlCoerce says so; we raise
+// pyinex.Uncalculated to unwind the script, and PyCallRef returns straight away.
+// Excel then calls it again once the precedents are done.
+
+namespace {
+
+    const long BLOCK_CELLS = 16384;     // cells fetched per xlCoerce, give or take a row
+
+    long g_generation = 0;              // current PyCallRef; bumped on open and on close
+    bool g_bUncalculated = false;
+
+    PyObject* g_pUncalculated = NULL;
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Shared by a Range and every slice of it; owned by the root Range
+
+    struct RangeSource
+    {
+        bool        bSRef;          // SRefs refer to the calling sheet, so carry no ID
+        DWORD       idSheet;
+        long        rwFirst;
+        long        colFirst;
+        long        rows;
+        long        cols;
+        long        blockRows;
+        long        generation;
+
+        std::map<long, PyObject*>   blocks; // block number -> tuple of row tuples
+        PyStringInterner            interner;
+    };
+
+    struct RangeObject
+    {
+        PyObject_HEAD
+        RangeObject*    pRoot;      // owned reference, or NULL if this is the root
+        RangeSource*    pSource;    // the root's
+        long            top;        // position and size within the source
+        long            left;
+        long            rows;
+        long            cols;
+    };
+
+    extern PyTypeObject RangeType;
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    FetchBlock( RangeSource& rSrc, long block, PyObject*& rpRows )
+    {
+        rpRows = NULL;
+
+        if (rSrc.generation != g_generation) {
+            PyErr_SetString(PyExc_RuntimeError,
+                "pyinex.Range used after the PyCallRef that created it returned; "
+                "call its rows() method during the call to keep the data");
+            return false;
+        }
+
+        long first = block * rSrc.blockRows;
+        long count = rSrc.rows - first;
+        if (count > rSrc.blockRows) {
+            count = rSrc.blockRows;
+        }
+
+        XLOPER12 xRef, xType, xMulti;
+        XLMREF12 mref;
+        XLREF12* pRef;
+        if (rSrc.bSRef) {
+            xRef.xltype = xltypeSRef;
+            xRef.val.sref.count = 1;
+            pRef = &xRef.val.sref.ref;
+        } else {
+            xRef.xltype = xltypeRef;
+            xRef.val.mref.idSheet = rSrc.idSheet;
+            xRef.val.mref.lpmref = &mref;
+            mref.count = 1;
+            pRef = &mref.reftbl[0];
+        }
+        pRef->rwFirst = rSrc.rwFirst + first;
+        pRef->rwLast = rSrc.rwFirst + first + count - 1;
+        pRef->colFirst = rSrc.colFirst;
+        pRef->colLast = rSrc.colFirst + rSrc.cols - 1;
+
+        xType.xltype = xltypeInt;
+        xType.val.w = xltypeMulti;
+
+        int ret = XlfExcel::Instance().Call12(xlCoerce, &xMulti, 2, &xRef, &xType);
+        if (ret == xlretUncalced) {
+            g_bUncalculated = true;
+            PyErr_SetString(g_pUncalculated, "Referenced cells haven't been calculated yet");
+            return false;
+        }
+        if (ret != xlretSuccess) {
+            PyErr_Format(PyExc_RuntimeError, "Excel couldn't read the referenced cells (xlCoerce returned %d)", ret);
+            return false;
+        }
+
+        // A single cell may come back as a bare value
+        const XLOPER12* pCells = &xMulti;
+        long rows = 1, cols = 1;
+        if (xMulti.xltype == xltypeMulti) {
+            pCells = xMulti.val.array.lparray;
+            rows = xMulti.val.array.rows;
+            cols = xMulti.val.array.columns;
+        }
+
+        bool rc = (rows == count && cols == rSrc.cols);
+        if (!rc) {
+            PyErr_Format(PyExc_RuntimeError, "Excel returned %ld x %ld cells for a %ld x %ld block",
+                rows, cols, count, rSrc.cols);
+        }
+
+        PyObject* pValue;
+        rpRows = rc ? PyTuple_New(rows) : NULL;
+        for (long i = 0; rc && rpRows && i < rows; ++i) {
+            PyObject* pRow = PyTuple_New(cols);
+            if (!pRow) {
+                rc = false;
+                break;
+            }
+            PyTuple_SET_ITEM(rpRows, i, pRow); // pRow reference stolen here
+            for (long j = 0; rc && j < cols; ++j) {
+                rc = ConvertXloper12CellToPyObject(pCells[i*cols + j], pValue, &rSrc.interner);
+                if (rc) {
+                    PyTuple_SET_ITEM(pRow, j, pValue); // pValue reference stolen here
+                }
+            }
+        }
+        rc = rc && rpRows;
+
+        XlfExcel::Instance().Call12(xlFree, NULL, 1, &xMulti);
+
+        if (!rc) {
+            Py_XDECREF(rpRows);
+            rpRows = NULL;
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_RuntimeError, "Couldn't convert the referenced cells");
+            }
+        }
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Borrowed reference to a row of the source, as a tuple of all its columns
+
+    PyObject*
+    SourceRow( RangeSource& rSrc, long row )
+    {
+        long block = row / rSrc.blockRows;
+        std::map<long, PyObject*>::iterator it = rSrc.blocks.find(block);
+        if (it == rSrc.blocks.end()) {
+            PyObject* pRows;
+            if (!FetchBlock(rSrc, block, pRows)) {
+                return NULL;
+            }
+            it = rSrc.blocks.insert(std::make_pair(block, pRows)).first;
+        }
+        return PyTuple_GET_ITEM(it->second, row - block * rSrc.blockRows);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    GetCell( RangeObject* pSelf, long row, long col )
+    {
+        PyObject* pRow = SourceRow(*pSelf->pSource, pSelf->top + row);
+        if (!pRow) {
+            return NULL;
+        }
+        PyObject* pValue = PyTuple_GET_ITEM(pRow, pSelf->left + col);
+        Py_INCREF(pValue);
+        return pValue;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    GetRow( RangeObject* pSelf, long row )
+    {
+        PyObject* pRow = SourceRow(*pSelf->pSource, pSelf->top + row);
+        if (!pRow) {
+            return NULL;
+        }
+        if (pSelf->left == 0 && pSelf->cols == pSelf->pSource->cols) {
+            Py_INCREF(pRow);
+            return pRow;
+        }
+        return PyTuple_GetSlice(pRow, pSelf->left, pSelf->left + pSelf->cols);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    NewRange( RangeObject* pParent, long top, long left, long rows, long cols )
+    {
+        RangeObject* pRange = PyObject_New(RangeObject, &RangeType);
+        if (!pRange) {
+            return NULL;
+        }
+
+        RangeObject* pRoot = pParent->pRoot ? pParent->pRoot : pParent;
+        Py_INCREF(pRoot);
+        pRange->pRoot = pRoot;
+        pRange->pSource = pRoot->pSource;
+        pRange->top = pParent->top + top;
+        pRange->left = pParent->left + left;
+        pRange->rows = rows;
+        pRange->cols = cols;
+        return (PyObject*)pRange;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // An index is an int (negative counts from the end) or a slice with step 1.
+    // Ints collapse the dimension.
+
+    bool
+    ParseIndex( PyObject* pIndex, long size, long& rStart, long& rCount, bool& rbCollapse )
+    {
+        if (PySlice_Check(pIndex)) {
+            Py_ssize_t start, stop, step, length;
+#if PY_MAJOR_VERSION < 3 || PY_VERSION_HEX < 0x03020000
+            if (PySlice_GetIndicesEx((PySliceObject*)pIndex, size, &start, &stop, &step, &length) != 0) {
+#else
+            if (PySlice_GetIndicesEx(pIndex, size, &start, &stop, &step, &length) != 0) {
+#endif
+                return false;
+            }
+            if (step != 1) {
+                PyErr_SetString(PyExc_IndexError, "pyinex.Range slices can't have a step; use rows() first");
+                return false;
+            }
+            rStart = (long)start;
+            rCount = (long)length;
+            rbCollapse = false;
+            return true;
+        }
+
+        Py_ssize_t i = PyNumber_AsSsize_t(pIndex, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred()) {
+            return false;
+        }
+        if (i < 0) {
+            i += size;
+        }
+        if (i < 0 || i >= size) {
+            PyErr_SetString(PyExc_IndexError, "pyinex.Range index out of range");
+            return false;
+        }
+        rStart = (long)i;
+        rCount = 1;
+        rbCollapse = true;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    range_subscript( PyObject* pSelfObj, PyObject* pIndex )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        PyObject *pRowIndex = pIndex, *pColIndex = NULL;
+
+        if (PyTuple_Check(pIndex)) {
+            if (PyTuple_GET_SIZE(pIndex) != 2) {
+                PyErr_SetString(PyExc_IndexError, "pyinex.Range takes one or two indices");
+                return NULL;
+            }
+            pRowIndex = PyTuple_GET_ITEM(pIndex, 0);
+            pColIndex = PyTuple_GET_ITEM(pIndex, 1);
+        }
+
+        long top, rows, left = 0, cols = pSelf->cols;
+        bool bRowCollapse, bColCollapse = false;
+        if (!ParseIndex(pRowIndex, pSelf->rows, top, rows, bRowCollapse)) {
+            return NULL;
+        }
+        if (pColIndex && !ParseIndex(pColIndex, pSelf->cols, left, cols, bColCollapse)) {
+            return NULL;
+        }
+
+        if (bRowCollapse && bColCollapse) {
+            return GetCell(pSelf, top, left);
+        }
+
+        if (bRowCollapse && !pColIndex) {
+            return GetRow(pSelf, top);
+        }
+
+        if (bRowCollapse || bColCollapse) {
+            // One row or one column of the range, as a flat tuple
+            long n = bRowCollapse ? cols : rows;
+            PyObject* pTuple = PyTuple_New(n);
+            for (long k = 0; pTuple && k < n; ++k) {
+                PyObject* pValue = bRowCollapse ? GetCell(pSelf, top, left + k) : GetCell(pSelf, top + k, left);
+                if (!pValue) {
+                    Py_DECREF(pTuple);
+                    return NULL;
+                }
+                PyTuple_SET_ITEM(pTuple, k, pValue); // pValue reference stolen here
+            }
+            return pTuple;
+        }
+
+        return NewRange(pSelf, top, left, rows, cols);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Py_ssize_t
+    range_length( PyObject* pSelf )
+    {
+        return ((RangeObject*)pSelf)->rows;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // For iteration; yields rows
+
+    PyObject*
+    range_item( PyObject* pSelfObj, Py_ssize_t i )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        if (i < 0 || i >= pSelf->rows) {
+            PyErr_SetString(PyExc_IndexError, "pyinex.Range index out of range");
+            return NULL;
+        }
+        return GetRow(pSelf, (long)i);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    range_rows( PyObject* pSelfObj, PyObject* args )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        PyObject* pRows = PyTuple_New(pSelf->rows);
+        for (long i = 0; pRows && i < pSelf->rows; ++i) {
+            PyObject* pRow = GetRow(pSelf, i);
+            if (!pRow) {
+                Py_DECREF(pRows);
+                return NULL;
+            }
+            PyTuple_SET_ITEM(pRows, i, pRow); // pRow reference stolen here
+        }
+        return pRows;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Same shapes as PyCall: one cell is a scalar, one row a flat tuple, else rows
+
+    PyObject*
+    range_tuples( PyObject* pSelfObj, PyObject* args )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        if (pSelf->rows == 1 && pSelf->cols == 1) {
+            return GetCell(pSelf, 0, 0);
+        }
+        if (pSelf->rows == 1) {
+            return GetRow(pSelf, 0);
+        }
+        return range_rows(pSelfObj, args);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    range_array( PyObject* pSelfObj, PyObject* args )
+    {
+        PyObject* pDtype = Py_None;
+        if (!PyArg_ParseTuple(args, "|O", &pDtype)) {
+            return NULL;
+        }
+
+        PyObject* pNumpy = PyImport_ImportModule("numpy");
+        if (!pNumpy) {
+            return NULL;
+        }
+
+        PyObject* pResult = NULL;
+        PyObject* pRows = range_rows(pSelfObj, NULL);
+        if (pRows) {
+            pResult = PyObject_CallMethod(pNumpy, (char*)"array", (char*)"OO", pRows, pDtype);
+            Py_DECREF(pRows);
+        }
+        Py_DECREF(pNumpy);
+        return pResult;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    range_shape( PyObject* pSelfObj, void* closure )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        return Py_BuildValue("(ll)", pSelf->rows, pSelf->cols);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    PyObject*
+    range_repr( PyObject* pSelfObj )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+#if PY_MAJOR_VERSION < 3
+        return PyString_FromFormat("<pyinex.Range %ld x %ld>", pSelf->rows, pSelf->cols);
+#else
+        return PyUnicode_FromFormat("<pyinex.Range %ld x %ld>", pSelf->rows, pSelf->cols);
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    range_dealloc( PyObject* pSelfObj )
+    {
+        RangeObject* pSelf = (RangeObject*)pSelfObj;
+        if (pSelf->pRoot) {
+            Py_DECREF(pSelf->pRoot);
+        } else if (pSelf->pSource) {
+            std::map<long, PyObject*>::iterator it;
+            for (it = pSelf->pSource->blocks.begin(); it != pSelf->pSource->blocks.end(); ++it) {
+                Py_DECREF(it->second);
+            }
+            delete pSelf->pSource;
+        }
+        PyObject_Del(pSelfObj);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+    PyMethodDef RangeMethods[] = {
+        {"rows",      range_rows,    METH_NOARGS,  "Returns all the cells as a tuple of row tuples"},
+        {"tuples",    range_tuples,  METH_NOARGS,  "Returns the cells in the same shape PyCall would have passed them"},
+        {"__array__", range_array,   METH_VARARGS, "Returns the cells as a numpy array"},
+        {NULL, NULL, 0, NULL} /* Sentinel */
+    };
+
+    PyGetSetDef RangeGetSet[] = {
+        {(char*)"shape", range_shape, NULL, (char*)"(rows, columns)", NULL},
+        {NULL, NULL, NULL, NULL, NULL} /* Sentinel */
+    };
+
+    PySequenceMethods RangeAsSequence = {
+        range_length,               /* sq_length */
+        0,                          /* sq_concat */
+        0,                          /* sq_repeat */
+        range_item,                 /* sq_item */
+    };
+
+    PyMappingMethods RangeAsMapping = {
+        range_length,               /* mp_length */
+        range_subscript,            /* mp_subscript */
+        0,                          /* mp_ass_subscript */
+    };
+
+    PyTypeObject RangeType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        "pyinex.Range",             /* tp_name */
+        sizeof(RangeObject),        /* tp_basicsize */
+        0,                          /* tp_itemsize */
+        range_dealloc,              /* tp_dealloc */
+        0,                          /* tp_print */
+        0,                          /* tp_getattr */
+        0,                          /* tp_setattr */
+        0,                          /* tp_compare */
+        range_repr,                 /* tp_repr */
+        0,                          /* tp_as_number */
+        &RangeAsSequence,           /* tp_as_sequence */
+        &RangeAsMapping,            /* tp_as_mapping */
+        0,                          /* tp_hash */
+        0,                          /* tp_call */
+        0,                          /* tp_str */
+        0,                          /* tp_getattro */
+        0,                          /* tp_setattro */
+        0,                          /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT,         /* tp_flags */
+        "A lazily-read Excel range passed to PyCallRef", /* tp_doc */
+        0,                          /* tp_traverse */
+        0,                          /* tp_clear */
+        0,                          /* tp_richcompare */
+        0,                          /* tp_weaklistoffset */
+        0,                          /* tp_iter */
+        0,                          /* tp_iternext */
+        RangeMethods,               /* tp_methods */
+        0,                          /* tp_members */
+        RangeGetSet                 /* tp_getset */
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ReadyRangeType()
+    {
+        static bool bReady = false;
+        if (!bReady) {
+            if (PyType_Ready(&RangeType) < 0) {
+                return false;
+            }
+            g_pUncalculated = PyErr_NewException((char*)"pyinex.Uncalculated", NULL, NULL);
+            if (!g_pUncalculated) {
+                return false;
+            }
+            bReady = true;
+        }
+        return true;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+OpenRangeProxies()
+{
+    ++g_generation;
+    g_bUncalculated = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+CloseRangeProxies()
+{
+    ++g_generation;
+    return g_bUncalculated;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// For PyCallRef's annotated arguments, which read their references up front
+// (see MarshalPlan.cpp)
+
+void
+NoteUncalculatedCells()
+{
+    g_bUncalculated = true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+AddRangeTypes( PyObject* pModule )
+{
+    if (!ReadyRangeType()) {
+        return false;
+    }
+
+    Py_INCREF(&RangeType);
+    Py_INCREF(g_pUncalculated);
+    return PyModule_AddObject(pModule, "Range", (PyObject*)&RangeType) == 0 &&
+           PyModule_AddObject(pModule, "Uncalculated", g_pUncalculated) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Single-area references under Excel 2007 become a Range. Everything else -
+// values, arrays, multi-area references, Excel 2002/2003 - is converted up front,
+// as for PyCall.
+
+bool
+ConvertXlfOperToRangeProxy( XlfOper& rOper,
+                            PyObject*& rpObj,
+                            PyStringInterner* pInterner )
+{
+    rpObj = NULL;
+
+    if (!XlfExcel::Instance().excel12() || !ReadyRangeType()) {
+        return ConvertXlfOperToPyObject(rOper, rpObj, pInterner);
+    }
+
+    LPXLOPER12 pX = (LPXLOPER12) rOper.GetLPXLFOPER();
+    int type = pX->xltype & ~(xlbitXLFree | xlbitDLLFree);
+
+    const XLREF12* pRef = NULL;
+    DWORD idSheet = 0;
+    if (type == xltypeSRef) {
+        pRef = &pX->val.sref.ref;
+    } else if (type == xltypeRef && pX->val.mref.lpmref && pX->val.mref.lpmref->count == 1) {
+        pRef = &pX->val.mref.lpmref->reftbl[0];
+        idSheet = pX->val.mref.idSheet;
+    }
+
+    if (!pRef) {
+        return ConvertXlfOperToPyObject(rOper, rpObj, pInterner);
+    }
+
+    RangeObject* pRange = PyObject_New(RangeObject, &RangeType);
+    if (!pRange) {
+        return false;
+    }
+
+    RangeSource* pSrc = new RangeSource;
+    pSrc->bSRef = (type == xltypeSRef);
+    pSrc->idSheet = idSheet;
+    pSrc->rwFirst = pRef->rwFirst;
+    pSrc->colFirst = pRef->colFirst;
+    pSrc->rows = pRef->rwLast - pRef->rwFirst + 1;
+    pSrc->cols = pRef->colLast - pRef->colFirst + 1;
+    pSrc->blockRows = BLOCK_CELLS / pSrc->cols;
+    if (pSrc->blockRows < 1) {
+        pSrc->blockRows = 1;
+    }
+    pSrc->generation = g_generation;
+
+    pRange->pRoot = NULL;
+    pRange->pSource = pSrc;
+    pRange->top = 0;
+    pRange->left = 0;
+    pRange->rows = pSrc->rows;
+    pRange->cols = pSrc->cols;
+
+    rpObj = (PyObject*)pRange;
+    return true;
+}
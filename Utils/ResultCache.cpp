@@ -0,0 +1,1061 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// The result cache. While PyResultCache() (or PYINEX_RESULT_CACHE in the
+// environment, at startup) has a cache file open, the results of functions marked
+// with the pyinex.Cacheable decorator are kept in it, and PyCall looks there before
+// it converts the arguments or calls the function: a call whose script, function and
+// arguments match a stored result returns that result. It only looks once it has
+// found the function and seen the decorator (PyCall.cpp), so other functions' calls
+// make no key. The file outlives Excel, so a workbook opened the
+// next morning gets its expensive results back without computing them again.
+//
+// Entries are keyed by three 64-bit FNV-1a hashes: of the script file's contents
+// (cached, and recomputed when its size or write time changes), of the function
+// name, and of the arguments' values. Only the script's own file is hashed - not
+// the modules it imports - so the cache has to be cleared when those change.
+// A function whose result depends on anything other than its arguments (the
+// calling cell, the time, a database) shouldn't be marked cacheable.
+//
+// The file is mapped into memory, and laid out as
+//
+//      a header        magic, version, layout, a checksum of those, and the
+//                      writers' position in the data ring
+//      a slot table    open addressing; a key lives in one of the PROBE_SLOTS
+//                      slots from its hash, each giving the key and where its
+//                      record is in the ring
+//      a data ring     records - key, length, write stamp, checksum, then the
+//                      result - written one after another, wrapping at the end
+//
+// so the cache is bounded by its size, and the oldest results are overwritten
+// first. A slot whose record has been overwritten is simply stale; readers see
+// that the record no longer matches, and writers reuse the slot.
+//
+// Results are stored as CallTrace.cpp writes values: a tag byte and a payload,
+// 'n' f64, 's' u16 count and wchar_ts, 'b' u8, 'e' u16, '-' empty, and 'm' u32
+// rows, u32 cols and the cells.
+//
+// More than one Excel may use the same file. Writers take a mutex named for the
+// file; readers take nothing. A writer makes a slot's sequence number odd while it
+// changes it, so a reader copies a slot and keeps the copy only if the number was
+// even and unchanged; it then copies the record, and checks its key, stamp and
+// checksum, which together catch a record being overwritten under it. A writer
+// that dies halfway leaves nothing a reader will take.
+//
+// PyCall isn't registered as thread-safe, so within one Excel all of this happens
+// on the calc thread. Excel 2007 only.
+
+namespace {
+
+    const char          CACHE_MAGIC[8] = { 'P', 'Y', 'X', 'C', 'A', 'C', 'H', 'E' };
+    const unsigned long CACHE_VERSION = 1;
+    const unsigned long DEFAULT_CACHE_MB = 64;
+    const unsigned long MAX_CACHE_MB = 512;             // the view has to fit in a 32-bit Excel
+    const unsigned long HEADER_BYTES = 4096;
+    const unsigned long DATA_BYTES_PER_SLOT = 128;         // most results are single values
+    const unsigned long PROBE_SLOTS = 8;
+    const DWORD         LOCK_TIMEOUT_MS = 1000;
+    const ULONGLONG     HASH_MIX = 1099511628211ULL;
+
+    struct CacheHeader
+    {
+        char            magic[8];
+        unsigned long   version;
+        unsigned long   slotCount;      // a power of two
+        ULONGLONG       dataOffset;     // of the data ring, from the start of the file
+        ULONGLONG       dataBytes;
+        ULONGLONG       checksum;       // of the fields above
+        ULONGLONG       writePos;       // bytes ever written to the ring; writers only
+        unsigned long   nextStamp;      // writers only
+    };
+
+    struct CacheSlot
+    {
+        volatile LONG   seq;            // odd while a writer is changing the slot
+        unsigned long   length;         // of the record's result; zero if the slot is empty
+        unsigned long   offset;         // of the record in the data ring
+        unsigned long   stamp;          // write order; the oldest is evicted first
+        ResultCacheKey  key;
+    };
+
+    struct CacheRecord
+    {
+        ResultCacheKey  key;
+        unsigned long   length;
+        unsigned long   stamp;
+        ULONGLONG       checksum;       // of the result that follows
+    };
+
+    bool
+    SameKey( const ResultCacheKey& a, const ResultCacheKey& b )
+    {
+        return a.module == b.module && a.function == b.function && a.args == b.args;
+    }
+
+    // Reads a stored result, failing (rather than reading past the end) on a bad one
+    class PayloadReader
+    {
+    public:
+        PayloadReader( const unsigned char* p, size_t n ) : m_p(p), m_pEnd(p + n), m_bOk(true) {}
+
+        bool Ok() const { return m_bOk; }
+        bool AtEnd() const { return m_p == m_pEnd; }
+
+        void GetBytes( void* pData, size_t n )
+        {
+            if (!m_bOk || (size_t)(m_pEnd - m_p) < n) {
+                m_bOk = false;
+                memset(pData, 0, n);
+                return;
+            }
+            memcpy(pData, m_p, n);
+            m_p += n;
+        }
+
+        void Skip( size_t n )
+        {
+            if (!m_bOk || (size_t)(m_pEnd - m_p) < n) {
+                m_bOk = false;
+                return;
+            }
+            m_p += n;
+        }
+
+        template <typename T> T Get() { T value; GetBytes(&value, sizeof(T)); return value; }
+
+    private:
+        const unsigned char*    m_p;
+        const unsigned char*    m_pEnd;
+        bool                    m_bOk;
+    };
+
+    class ResultCache
+    {
+    public:
+        static ResultCache& Factory();
+
+        bool Open( const std::wstring& filename, unsigned long megabytes );
+        void Close();
+        bool Active() const { return m_pView != NULL; }
+        const std::wstring& Filename() const { return m_filename; }
+        bool Clear();
+        unsigned long Entries() const;
+        unsigned long Megabytes() const { return m_dataBytes >> 20; }
+        unsigned long Hits() const { return m_hits; }
+        unsigned long Misses() const { return m_misses; }
+        unsigned long Stores() const { return m_stores; }
+
+        bool MakeKey( const std::wstring& filename,
+                      const std::string& function,
+                      const xloper12* pArgs[],
+                      int count,
+                      ResultCacheKey& rKey );
+        bool Lookup( const ResultCacheKey& key, const xloper12*& rpResult );
+        void Store( const ResultCacheKey& key, const xloper12& result );
+
+    private:
+        ResultCache();
+        ~ResultCache();
+
+        bool Lock();
+        void Unlock() { ReleaseMutex(m_hMutex); }
+
+        bool MapFile( const std::wstring& filename, unsigned long megabytes );
+        bool ModuleHash( const std::wstring& filename, ULONGLONG& rHash );
+        unsigned long SlotIndex( const ResultCacheKey& key ) const;
+        CacheSlot* ChooseSlot( const ResultCacheKey& key );
+        bool RecordCurrent( const CacheSlot& slot ) const;
+        bool ReadRecord( const ResultCacheKey& key, unsigned long length, unsigned long offset, unsigned long stamp );
+        bool DecodeResult();
+
+        bool PutValue( const xloper12& x, bool bTop );
+
+        void PutBytes( const void* pData, size_t n )
+        {
+            const unsigned char* p = (const unsigned char*) pData;
+            m_bytes.insert(m_bytes.end(), p, p + n);
+        }
+        template <typename T> void Put( T value ) { PutBytes(&value, sizeof(T)); }
+
+    private:
+        struct ModuleHashEntry
+        {
+            FILETIME    lastWrite;
+            DWORD       sizeHigh;
+            DWORD       sizeLow;
+            ULONGLONG   hash;
+        };
+        typedef std::map<std::wstring, ModuleHashEntry> ModuleHashMap;
+
+        std::wstring                m_filename;
+        HANDLE                      m_hFile;
+        HANDLE                      m_hMapping;
+        HANDLE                      m_hMutex;
+        unsigned char*              m_pView;
+        CacheHeader*                m_pHeader;
+        CacheSlot*                  m_pSlots;
+        unsigned char*              m_pData;
+        unsigned long               m_slotMask;
+        unsigned long               m_dataBytes;
+
+        unsigned long               m_hits;
+        unsigned long               m_misses;
+        unsigned long               m_stores;
+
+        ModuleHashMap               m_moduleHashes;
+        std::vector<unsigned char>  m_bytes;        // a result or arguments, serialized
+        std::vector<unsigned char>  m_read;         // a result copied out of the file
+        std::vector<xloper12>       m_cells;        // the last hit, handed back to Excel
+        std::vector<wchar_t>        m_text;
+        xloper12                    m_result;
+
+        ResultCache( const ResultCache& );
+        ResultCache& operator=( const ResultCache& );
+    };
+
+    ULONGLONG
+    HeaderChecksum( const CacheHeader& header )
+    {
+        return HashBytes(&header, offsetof(CacheHeader, checksum), HASH_SEED);
+    }
+
+    ULONGLONG
+    DataOffset( unsigned long slotCount )
+    {
+        ULONGLONG slotBytes = (ULONGLONG) slotCount * sizeof(CacheSlot);
+        return HEADER_BYTES + (slotBytes + HEADER_BYTES - 1) / HEADER_BYTES * HEADER_BYTES;
+    }
+
+    void
+    LayOut( unsigned long megabytes, CacheHeader& rHeader )
+    {
+        if (megabytes == 0) {
+            megabytes = DEFAULT_CACHE_MB;
+        } else if (megabytes > MAX_CACHE_MB) {
+            megabytes = MAX_CACHE_MB;
+        }
+
+        memset(&rHeader, 0, sizeof(rHeader));
+        memcpy(rHeader.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        rHeader.version = CACHE_VERSION;
+        rHeader.dataBytes = (ULONGLONG) megabytes << 20;
+        rHeader.slotCount = PROBE_SLOTS;
+        while (rHeader.slotCount < rHeader.dataBytes / DATA_BYTES_PER_SLOT) {
+            rHeader.slotCount <<= 1;
+        }
+        rHeader.dataOffset = DataOffset(rHeader.slotCount);
+        rHeader.checksum = HeaderChecksum(rHeader);
+        rHeader.nextStamp = 1;
+    }
+
+    // The header is checked against the file's size as well as its checksum, since
+    // everything else is located through it
+    bool
+    ValidHeader( const CacheHeader& header, ULONGLONG fileBytes )
+    {
+        return memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+               header.version == CACHE_VERSION &&
+               header.checksum == HeaderChecksum(header) &&
+               header.slotCount >= PROBE_SLOTS &&
+               (header.slotCount & (header.slotCount - 1)) == 0 &&
+               header.dataOffset == DataOffset(header.slotCount) &&
+               header.dataBytes >= (1 << 20) &&
+               header.dataBytes <= ((ULONGLONG) MAX_CACHE_MB << 20) &&
+               fileBytes == header.dataOffset + header.dataBytes;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ResultCache&
+    ResultCache::Factory()
+    {
+        static ResultCache g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ResultCache::ResultCache() :
+        m_hFile(INVALID_HANDLE_VALUE),
+        m_hMapping(NULL),
+        m_hMutex(NULL),
+        m_pView(NULL),
+        m_pHeader(NULL),
+        m_pSlots(NULL),
+        m_pData(NULL),
+        m_slotMask(0),
+        m_dataBytes(0),
+        m_hits(0),
+        m_misses(0),
+        m_stores(0)
+    {
+        memset(&m_result, 0, sizeof(m_result));
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    ResultCache::~ResultCache()
+    {
+        Close();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ResultCache::Open( const std::wstring& filename, unsigned long megabytes )
+    {
+        Close();
+
+        wchar_t pFullFilename[MAX_PATH];
+        DWORD len = GetFullPathNameW(filename.c_str(), NELEMS(pFullFilename), pFullFilename, NULL);
+        if (len == 0 || len >= NELEMS(pFullFilename)) {
+            ERROUT("Couldn't get the full name of result cache %s", ASCII_REPR(filename));
+            return false;
+        }
+
+        // Writers in every Excel using the file take a mutex named for it
+        std::wstring lower(pFullFilename);
+        for (size_t i = 0; i < lower.size(); ++i) {
+            lower[i] = towlower(lower[i]);
+        }
+        std::wostringstream mutexName;
+        mutexName << L"Local\\PyinexResultCache-" << std::hex 
+                  << HashBytes(lower.data(), lower.size() * sizeof(wchar_t), HASH_SEED);
+
+        std::string errTxt;
+        m_hMutex = CreateMutexW(NULL, FALSE, mutexName.str().c_str());
+        if (!m_hMutex) {
+            GetWindowsErrorText(errTxt);
+            ERROUT("Couldn't create the result cache mutex: %s", errTxt.c_str());
+            return false;
+        }
+
+        m_hFile = CreateFileW(pFullFilename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            GetWindowsErrorText(errTxt);
+            ERROUT("Couldn't open result cache %s: %s", ASCII_REPR(filename), errTxt.c_str());
+            Close();
+            return false;
+        }
+
+        if (!Lock()) {
+            ERROUT("Timed out waiting for another Excel to finish with result cache %s", ASCII_REPR(filename));
+            Close();
+            return false;
+        }
+        bool rc = MapFile(filename, megabytes);
+        Unlock();
+
+        if (!rc) {
+            Close();
+            return false;
+        }
+
+        m_filename = pFullFilename;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Under the lock. A file that isn't a cache of this version - a new one, one
+    // from an older Pyinex, one whose header was torn by a crash - is started afresh
+    // at the requested size; an existing cache keeps its own size. m_filename isn't
+    // set until the file is mapped, so messages name the caller's filename.
+
+    bool
+    ResultCache::MapFile( const std::wstring& filename, unsigned long megabytes )
+    {
+        std::string errTxt;
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+
+        LARGE_INTEGER fileBytes;
+        LARGE_INTEGER start;
+        start.QuadPart = 0;
+        DWORD nRead = 0;
+        bool bValid = GetFileSizeEx(m_hFile, &fileBytes) &&
+                      fileBytes.QuadPart >= (LONGLONG) HEADER_BYTES &&
+                      SetFilePointerEx(m_hFile, start, NULL, FILE_BEGIN) &&
+                      ReadFile(m_hFile, &header, sizeof(header), &nRead, NULL) &&
+                      nRead == sizeof(header) &&
+                      ValidHeader(header, (ULONGLONG) fileBytes.QuadPart);
+
+        if (bValid) {
+            if (megabytes && (header.dataBytes >> 20) != megabytes) {
+                WARNOUT("Result cache %s keeps its size of %lu MB; delete the file to change it",
+                        ASCII_REPR(filename), (unsigned long)(header.dataBytes >> 20));
+            }
+        } else {
+            if (fileBytes.QuadPart > 0) {
+                WARNOUT("Result cache file isn't one this version of Pyinex can read; starting it afresh");
+            }
+            LayOut(megabytes, header);
+            LARGE_INTEGER end;
+            end.QuadPart = (LONGLONG)(header.dataOffset + header.dataBytes);
+            if (!SetFilePointerEx(m_hFile, end, NULL, FILE_BEGIN) || !SetEndOfFile(m_hFile)) {
+                GetWindowsErrorText(errTxt);
+                ERROUT("Couldn't size the result cache file: %s", errTxt.c_str());
+                return false;
+            }
+        }
+
+        m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (m_hMapping) {
+            m_pView = (unsigned char*) MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        }
+        if (!m_pView) {
+            GetWindowsErrorText(errTxt);
+            ERROUT("Couldn't map the result cache into memory (a smaller one may fit): %s", errTxt.c_str());
+            return false;
+        }
+
+        m_pHeader = (CacheHeader*) m_pView;
+        if (!bValid) {
+            // The header goes in last; until it does, the file isn't a cache
+            memset(m_pView, 0, (size_t) header.dataOffset);
+            *m_pHeader = header;
+        }
+
+        m_pSlots = (CacheSlot*)(m_pView + HEADER_BYTES);
+        m_pData = m_pView + header.dataOffset;
+        m_slotMask = header.slotCount - 1;
+        m_dataBytes = (unsigned long) header.dataBytes;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Unmapping writes what's changed back to the file in its own time
+
+    void
+    ResultCache::Close()
+    {
+        if (m_pView) {
+            UnmapViewOfFile(m_pView);
+        }
+        if (m_hMapping) {
+            CloseHandle(m_hMapping);
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_hFile);
+        }
+        if (m_hMutex) {
+            CloseHandle(m_hMutex);
+        }
+
+        m_filename.clear();
+        m_hFile = INVALID_HANDLE_VALUE;
+        m_hMapping = NULL;
+        m_hMutex = NULL;
+        m_pView = NULL;
+        m_pHeader = NULL;
+        m_pSlots = NULL;
+        m_pData = NULL;
+        m_slotMask = 0;
+        m_dataBytes = 0;
+        m_hits = m_misses = m_stores = 0;
+        m_moduleHashes.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // An abandoned mutex means a writer died holding it; what it left half-written,
+    // readers and writers both see isn't current
+
+    bool
+    ResultCache::Lock()
+    {
+        DWORD wait = WaitForSingleObject(m_hMutex, LOCK_TIMEOUT_MS);
+        return wait == WAIT_OBJECT_0 || wait == WAIT_ABANDONED;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    ResultCache::Clear()
+    {
+        if (!Active() || !Lock()) {
+            return false;
+        }
+
+        for (unsigned long i = 0; i <= m_slotMask; ++i) {
+            CacheSlot& rSlot = m_pSlots[i];
+            LONG seq = rSlot.seq | 1;
+            InterlockedExchange(&rSlot.seq, seq);
+            rSlot.length = 0;
+            InterlockedExchange(&rSlot.seq, seq + 1);
+        }
+        m_pHeader->writePos = 0;
+
+        Unlock();
+        m_hits = m_misses = m_stores = 0;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Including results that have since been overwritten, but whose slots haven't
+    // been reused yet
+
+    unsigned long
+    ResultCache::Entries() const
+    {
+        unsigned long count = 0;
+        for (unsigned long i = 0; Active() && i <= m_slotMask; ++i) {
+            if (m_pSlots[i].length) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Trailing missing arguments don't change the call, so they aren't hashed.
+    // Fails for arguments with no stored form; such calls aren't cached.
+
+    bool
+    ResultCache::MakeKey( const std::wstring& filename,
+                          const std::string& function,
+                          const xloper12* pArgs[],
+                          int count,
+                          ResultCacheKey& rKey )
+    {
+        if (!ModuleHash(filename, rKey.module)) {
+            return false;
+        }
+        rKey.function = HashBytes(function.data(), function.size(), HASH_SEED);
+
+        while (count > 0 && (pArgs[count - 1]->xltype & ~(xlbitXLFree | xlbitDLLFree)) == xltypeMissing) {
+            --count;
+        }
+        m_bytes.clear();
+        for (int i = 0; i < count; ++i) {
+            if (!PutValue(*pArgs[i], true)) {
+                return false;
+            }
+        }
+        rKey.args = HashBytes(m_bytes.empty() ? NULL : &m_bytes[0], m_bytes.size(), HASH_SEED);
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The script is read and hashed when it's first seen, and again whenever its
+    // size or write time changes
+
+    bool
+    ResultCache::ModuleHash( const std::wstring& filename, ULONGLONG& rHash )
+    {
+        WIN32_FILE_ATTRIBUTE_DATA info;
+        if (!GetFileAttributesExW(filename.c_str(), GetFileExInfoStandard, &info)) {
+            return false;
+        }
+
+        ModuleHashMap::const_iterator it = m_moduleHashes.find(filename);
+        if (it != m_moduleHashes.end() &&
+            CompareFileTime(&it->second.lastWrite, &info.ftLastWriteTime) == 0 &&
+            it->second.sizeHigh == info.nFileSizeHigh &&
+            it->second.sizeLow == info.nFileSizeLow) {
+            rHash = it->second.hash;
+            return true;
+        }
+
+        ULONGLONG hash;
+        if (!HashFileContents(filename, hash)) {
+            return false;
+        }
+
+        ModuleHashEntry entry;
+        entry.lastWrite = info.ftLastWriteTime;
+        entry.sizeHigh = info.nFileSizeHigh;
+        entry.sizeLow = info.nFileSizeLow;
+        entry.hash = hash;
+        m_moduleHashes[filename] = entry;
+
+        rHash = hash;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    unsigned long
+    ResultCache::SlotIndex( const ResultCacheKey& key ) const
+    {
+        ULONGLONG hash = key.args ^ (key.function * HASH_MIX) ^ (key.module * HASH_MIX * HASH_MIX);
+        return (unsigned long)(hash ^ (hash >> 32)) & m_slotMask;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // No lock. The result is valid until the next lookup.
+
+    bool
+    ResultCache::Lookup( const ResultCacheKey& key, const xloper12*& rpResult )
+    {
+        unsigned long first = SlotIndex(key);
+        for (unsigned long i = 0; i < PROBE_SLOTS; ++i) {
+            CacheSlot* pSlot = m_pSlots + ((first + i) & m_slotMask);
+
+            // Take a copy of the slot only if no writer was changing it meanwhile
+            LONG seq = pSlot->seq;
+            MemoryBarrier();
+            ResultCacheKey slotKey = pSlot->key;
+            unsigned long length = pSlot->length;
+            unsigned long offset = pSlot->offset;
+            unsigned long stamp = pSlot->stamp;
+            MemoryBarrier();
+            if ((seq & 1) || pSlot->seq != seq || length == 0 || !SameKey(slotKey, key)) {
+                continue;
+            }
+
+            if (ReadRecord(key, length, offset, stamp) && DecodeResult()) {
+                ++m_hits;
+                rpResult = &m_result;
+                return true;
+            }
+            break; // overwritten since
+        }
+
+        ++m_misses;
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Copies a slot's record out of the ring into m_read, and checks that it's
+    // still the one the slot was written for. The slot may have come from another
+    // process, so its offset and length aren't trusted either.
+
+    bool
+    ResultCache::ReadRecord( const ResultCacheKey& key, unsigned long length, unsigned long offset, unsigned long stamp )
+    {
+        if (offset > m_dataBytes - sizeof(CacheRecord) || length > m_dataBytes - sizeof(CacheRecord) - offset) {
+            return false;
+        }
+
+        CacheRecord record;
+        memcpy(&record, m_pData + offset, sizeof(record));
+        m_read.resize(length);
+        memcpy(&m_read[0], m_pData + offset + sizeof(record), length);
+
+        return SameKey(record.key, key) &&
+               record.length == length &&
+               record.stamp == stamp &&
+               record.checksum == HashBytes(&m_read[0], length, HASH_SEED);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The result in m_read becomes m_result, in two passes: the first checks it and
+    // counts the cells and characters it needs, the second fills them in
+
+    bool
+    ResultCache::DecodeResult()
+    {
+        PayloadReader measure(&m_read[0], m_read.size());
+        size_t cells = 0, chars = 0;
+        char tag = measure.Get<char>();
+        if (tag == 'm') {
+            unsigned long rows = measure.Get<unsigned long>();
+            unsigned long cols = measure.Get<unsigned long>();
+            cells = (size_t) rows * cols;
+            if (rows == 0 || cols == 0 || cells > m_read.size()) {
+                return false;
+            }
+        }
+        for (size_t i = 0; measure.Ok() && i < (tag == 'm' ? cells : 1); ++i) {
+            char cellTag = (tag == 'm') ? measure.Get<char>() : tag;
+            switch (cellTag) {
+                case 'n': measure.Get<double>(); break;
+                case 'b': measure.Get<unsigned char>(); break;
+                case 'e': measure.Get<unsigned short>(); break;
+                case '-': case '.': break;
+                case 's': {
+                    unsigned short len = measure.Get<unsigned short>();
+                    measure.Skip(len * sizeof(wchar_t));
+                    chars += len + 1;
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        if (!measure.Ok() || !measure.AtEnd()) {
+            return false;
+        }
+
+        m_cells.resize(cells ? cells : 1);
+        m_text.resize(chars ? chars : 1);
+        wchar_t* pText = &m_text[0];
+
+        PayloadReader r(&m_read[0], m_read.size());
+        r.Get<char>();
+        xloper12* pCells = &m_result;
+        if (tag == 'm') {
+            m_result.xltype = xltypeMulti;
+            m_result.val.array.rows = (RW) r.Get<unsigned long>();
+            m_result.val.array.columns = (COL) r.Get<unsigned long>();
+            m_result.val.array.lparray = &m_cells[0];
+            pCells = &m_cells[0];
+        } else {
+            cells = 1;
+        }
+
+        for (size_t i = 0; i < cells; ++i) {
+            xloper12& x = pCells[i];
+            switch ((tag == 'm') ? r.Get<char>() : tag) {
+                case 'n':
+                    x.xltype = xltypeNum;
+                    x.val.num = r.Get<double>();
+                    break;
+
+                case 's': {
+                    unsigned short len = r.Get<unsigned short>();
+                    pText[0] = (wchar_t) len;
+                    r.GetBytes(pText + 1, len * sizeof(wchar_t));
+                    x.xltype = xltypeStr;
+                    x.val.str = pText;
+                    pText += len + 1;
+                    break;
+                }
+
+                case 'b':
+                    x.xltype = xltypeBool;
+                    x.val.xbool = r.Get<unsigned char>();
+                    break;
+
+                case 'e':
+                    x.xltype = xltypeErr;
+                    x.val.err = r.Get<unsigned short>();
+                    break;
+
+                default: // '-' and '.'
+                    x.xltype = xltypeNil;
+                    break;
+            }
+        }
+        return r.Ok();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Values as CallTrace.cpp writes them, less the forms that can't be stored:
+    // references, and anything else Excel might pass. Missing arguments are
+    // written, as they're part of the key; a missing value in a result reads back
+    // as an empty cell.
+
+    bool
+    ResultCache::PutValue( const xloper12& x, bool bTop )
+    {
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:
+                Put('n');
+                Put(x.val.num);
+                return true;
+
+            case xltypeInt:
+                Put('n');
+                Put((double) x.val.w);
+                return true;
+
+            case xltypeStr:
+                Put('s');
+                Put((unsigned short) x.val.str[0]);
+                PutBytes(x.val.str + 1, x.val.str[0] * sizeof(wchar_t));
+                return true;
+
+            case xltypeBool:
+                Put('b');
+                Put((unsigned char) (x.val.xbool ? 1 : 0));
+                return true;
+
+            case xltypeErr:
+                Put('e');
+                Put((unsigned short) x.val.err);
+                return true;
+
+            case xltypeNil:
+                Put('-');
+                return true;
+
+            case xltypeMissing:
+                Put('.');
+                return true;
+
+            case xltypeMulti: {
+                if (!bTop) {
+                    return false;
+                }
+                Put('m');
+                Put((unsigned long) x.val.array.rows);
+                Put((unsigned long) x.val.array.columns);
+                size_t cells = (size_t) x.val.array.rows * x.val.array.columns;
+                for (size_t i = 0; i < cells; ++i) {
+                    if (!PutValue(x.val.array.lparray[i], false)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Under the lock. The key's own slot if it has one; otherwise an empty or stale
+    // slot; otherwise the slot holding the oldest result.
+
+    CacheSlot*
+    ResultCache::ChooseSlot( const ResultCacheKey& key )
+    {
+        CacheSlot* pFree = NULL;
+        CacheSlot* pOldest = NULL;
+        unsigned long first = SlotIndex(key);
+        for (unsigned long i = 0; i < PROBE_SLOTS; ++i) {
+            CacheSlot* pSlot = m_pSlots + ((first + i) & m_slotMask);
+            if (pSlot->length && SameKey(pSlot->key, key)) {
+                return pSlot;
+            }
+            if (pSlot->length == 0 || !RecordCurrent(*pSlot)) {
+                if (!pFree) {
+                    pFree = pSlot;
+                }
+            } else if (!pOldest || (LONG)(pSlot->stamp - pOldest->stamp) < 0) {
+                pOldest = pSlot;
+            }
+        }
+        return pFree ? pFree : pOldest;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Under the lock: whether the slot's record is still in the ring
+
+    bool
+    ResultCache::RecordCurrent( const CacheSlot& slot ) const
+    {
+        if (slot.offset > m_dataBytes - sizeof(CacheRecord)) {
+            return false;
+        }
+        CacheRecord record;
+        memcpy(&record, m_pData + slot.offset, sizeof(record));
+        return SameKey(record.key, slot.key) && record.stamp == slot.stamp;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Results bigger than a quarter of the ring aren't stored; they'd push out too
+    // much to be worth it. A record that won't fit before the end of the ring
+    // starts again at the beginning.
+
+    void
+    ResultCache::Store( const ResultCacheKey& key, const xloper12& result )
+    {
+        m_bytes.clear();
+        if (!PutValue(result, true) || m_bytes.size() > m_dataBytes / 4) {
+            return;
+        }
+
+        CacheRecord record;
+        record.key = key;
+        record.length = (unsigned long) m_bytes.size();
+        record.checksum = HashBytes(&m_bytes[0], m_bytes.size(), HASH_SEED);
+        unsigned long recordBytes = (unsigned long)(sizeof(record) + m_bytes.size() + 7) & ~7UL;
+
+        if (!Lock()) {
+            return;
+        }
+
+        ULONGLONG pos = m_pHeader->writePos;
+        unsigned long offset = (unsigned long)(pos % m_dataBytes);
+        if (recordBytes > m_dataBytes - offset) {
+            pos += m_dataBytes - offset;
+            offset = 0;
+        }
+
+        CacheSlot* pSlot = ChooseSlot(key);
+        record.stamp = m_pHeader->nextStamp++;
+
+        // Odd even if a writer died halfway through this slot
+        LONG seq = pSlot->seq | 1;
+        InterlockedExchange(&pSlot->seq, seq);
+        memcpy(m_pData + offset, &record, sizeof(record));
+        memcpy(m_pData + offset + sizeof(record), &m_bytes[0], m_bytes.size());
+        pSlot->key = key;
+        pSlot->length = record.length;
+        pSlot->offset = offset;
+        pSlot->stamp = record.stamp;
+        InterlockedExchange(&pSlot->seq, seq + 1);
+
+        m_pHeader->writePos = pos + recordBytes;
+        Unlock();
+        ++m_stores;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+OpenResultCache( const std::wstring& filename, unsigned long megabytes )
+{
+    return ResultCache::Factory().Open(filename, megabytes);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// PYINEX_RESULT_CACHE names the file, and PYINEX_RESULT_CACHE_MB its size; this
+// lets a workbook's first calculation use the cache, before any cell could open it
+
+void
+OpenResultCacheFromEnvironment()
+{
+    wchar_t pFilename[MAX_PATH];
+    DWORD len = GetEnvironmentVariableW(L"PYINEX_RESULT_CACHE", pFilename, NELEMS(pFilename));
+    if (len == 0 || len >= NELEMS(pFilename)) {
+        return;
+    }
+
+    unsigned long megabytes = DEFAULT_CACHE_MB;
+    char pSize[32];
+    len = GetEnvironmentVariableA("PYINEX_RESULT_CACHE_MB", pSize, sizeof(pSize));
+    if (len > 0 && len < sizeof(pSize)) {
+        megabytes = strtoul(pSize, NULL, 10);
+    }
+
+    ResultCache::Factory().Open(pFilename, megabytes);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+CloseResultCache()
+{
+    ResultCache::Factory().Close();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ResultCacheActive()
+{
+    return ResultCache::Factory().Active();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetResultCacheFile( std::wstring& filename )
+{
+    filename = ResultCache::Factory().Filename();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ClearResultCache()
+{
+    return ResultCache::Factory().Clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetResultCacheStats( unsigned long& rEntries,
+                     unsigned long& rHits,
+                     unsigned long& rMisses,
+                     unsigned long& rStores,
+                     unsigned long& rMegabytes )
+{
+    ResultCache& rCache = ResultCache::Factory();
+    rEntries = rCache.Entries();
+    rHits = rCache.Hits();
+    rMisses = rCache.Misses();
+    rStores = rCache.Stores();
+    rMegabytes = rCache.Megabytes();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+MakeResultCacheKey( const std::wstring& filename,
+                    const std::string& function,
+                    const xloper12* pArgs[],
+                    int count,
+                    ResultCacheKey& rKey )
+{
+    return ResultCache::Factory().Active() &&
+           ResultCache::Factory().MakeKey(filename, function, pArgs, count, rKey);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+LookUpCachedResult( const ResultCacheKey& key, const xloper12*& rpResult )
+{
+    return ResultCache::Factory().Active() &&
+           ResultCache::Factory().Lookup(key, rpResult);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+StoreCachedResult( const ResultCacheKey& key, const xloper12* pResult )
+{
+    if (pResult && ResultCache::Factory().Active()) {
+        ResultCache::Factory().Store(key, *pResult);
+    }
+}
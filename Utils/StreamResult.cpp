@@ -0,0 +1,282 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Results that are iterators or generators.
+//
+// The general result path needs a list or tuple with a known length, so a
+// script producing a large result had to collect every row into a list first,
+// holding the whole result twice over - once as Python rows, once as cells.
+// Here the iterator is consumed a row at a time: each row is converted into a
+// growing native array of cells and released before the next is asked for, so
+// a generator only ever has one row of Python objects alive.
+//
+// Each item is a row: a list, tuple, or other iterable of values, or a single
+// value for a one-cell row. Rows may be ragged; short ones are padded with
+// empty cells. Values are converted as in tables (TableResult.cpp).
+//
+// Excel can't display more than a sheet's worth of rows, and a runaway generator
+// could produce far more, so at most ResultRowLimit() rows are taken. The limit is
+// checked before each row is asked for, so no row past it is ever generated: the
+// generator is closed, and a warning is logged. Rows are held to a sheet's width
+// the same way, as they're consumed, so that an endless row fails the result
+// rather than hanging Excel.
+
+namespace {
+
+    const unsigned long MAX_ROWS = 1048576;     // Excel 2007's sheet size
+    const long MAX_COLS = 16384;
+
+    unsigned long g_rowLimit = MAX_ROWS;
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    IsText( PyObject* pObj )
+    {
+#if PY_MAJOR_VERSION < 3
+        return PyUnicode_Check(pObj) || PyString_Check(pObj);
+#else
+        return PyUnicode_Check(pObj) || PyBytes_Check(pObj);
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    AppendCell( PyObject* pValue, std::vector<XLOPER12>& rCells )
+    {
+        XLOPER12 x;
+        if (!WritePyValueToXloper12(pValue, x)) {
+            return false;
+        }
+        rCells.push_back(x);
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Stop a generator we didn't finish, so its finally: blocks run now rather
+    // than whenever it's collected
+
+    void
+    CloseIterator( PyObject* pObj )
+    {
+        if (PyObject_HasAttrString(pObj, "close")) {
+            PyObject* pRes = PyObject_CallMethod(pObj, (char*)"close", NULL);
+            if (pRes) {
+                Py_DECREF(pRes);
+            } else {
+                PyErr_Print();
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    ReportWideRow()
+    {
+        ERROUT("Returned iterator produced a row of more than %ld cells; Excel needs from 1 to %ld", MAX_COLS, MAX_COLS);
+    }
+
+    bool
+    AppendRow( PyObject* pRow, std::vector<XLOPER12>& rCells )
+    {
+        if (PyList_Check(pRow) || PyTuple_Check(pRow)) {
+            Py_ssize_t n = PySequence_Fast_GET_SIZE(pRow);
+            if (n > MAX_COLS) {
+                ReportWideRow();
+                return false;
+            }
+            PyObject** pItems = PySequence_Fast_ITEMS(pRow);
+            for (Py_ssize_t j = 0; j < n; ++j) {
+                if (!AppendCell(pItems[j], rCells)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        PyObject* pIter = IsText(pRow) ? NULL : PyObject_GetIter(pRow);
+        if (!pIter) {
+            PyErr_Clear();
+            return AppendCell(pRow, rCells);    // a one-cell row
+        }
+
+        // A cell past a sheet's width is the row's last; nothing more is asked of it
+        bool rc = true;
+        size_t start = rCells.size();
+        PyObject* pValue;
+        while (rc && (pValue = PyIter_Next(pIter)) != NULL) {
+            if (rCells.size() - start >= (size_t)MAX_COLS) {
+                ReportWideRow();
+                CloseIterator(pIter);
+                rc = false;
+            } else {
+                rc = AppendCell(pValue, rCells);
+            }
+            Py_DECREF(pValue);
+        }
+        Py_DECREF(pIter);
+        return rc && !PyErr_Occurred();
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertPyIterableToXloper12( PyObject* pObj, XLOPER12& rResult, bool& rbOk )
+{
+    rbOk = false;
+
+    // Sequences and mappings have their own paths
+    if (PyList_Check(pObj) || PyTuple_Check(pObj) || PyDict_Check(pObj) || IsText(pObj)) {
+        return false;
+    }
+
+    PyObject* pIter = PyObject_GetIter(pObj);
+    if (!pIter) {
+        PyErr_Clear();
+        return false;
+    }
+
+    std::vector<XLOPER12> cells;
+    std::vector<size_t> rowStarts;
+    size_t width = 0;
+    bool rc = true;
+    bool bTruncated = false;
+
+    // The limit is checked before the next row is asked for, so that it's never made
+    while (rc) {
+        if (rowStarts.size() >= g_rowLimit) {
+            bTruncated = true;
+            break;
+        }
+        PyObject* pRow = PyIter_Next(pIter);
+        if (!pRow) {
+            break;
+        }
+
+        size_t start = cells.size();
+        rowStarts.push_back(start);
+        rc = AppendRow(pRow, cells);
+        Py_DECREF(pRow); // the row's objects go as soon as it's converted
+
+        if (cells.size() - start > width) {
+            width = cells.size() - start;
+        }
+    }
+
+    if (PyErr_Occurred()) {
+        PyErr_Print(); // raised by the generator, or by a row
+        rc = false;
+    }
+
+    if (bTruncated) {
+        CloseIterator(pIter);
+        WARNOUT("Returned iterator was stopped after %lu rows; any more weren't generated (see PyRowLimit)", g_rowLimit);
+    }
+    Py_DECREF(pIter);
+
+    if (rc && rowStarts.empty()) {
+        ERROUT("Returned iterator produced no rows");
+        rc = false;
+    }
+    if (rc && (width == 0 || width > (size_t)MAX_COLS)) {
+        ERROUT("Returned iterator produced rows of %lu cells; Excel needs from 1 to %ld", (unsigned long)width, MAX_COLS);
+        rc = false;
+    }
+    if (!rc) {
+        return true;
+    }
+
+    // Lay the rows out as a rectangle, padding ragged ones
+    size_t rows = rowStarts.size();
+    XLOPER12 empty;
+    WritePyValueToXloper12(Py_None, empty);
+
+    rResult.xltype = xltypeMulti;
+    rResult.val.array.rows = (RW)rows;
+    rResult.val.array.columns = (COL)width;
+    rResult.val.array.lparray = (LPXLOPER12)XlfExcel::Instance().GetMemory(rows * width * sizeof(XLOPER12));
+
+    XLOPER12* pOut = rResult.val.array.lparray;
+    for (size_t i = 0; i < rows; ++i) {
+        size_t start = rowStarts[i];
+        size_t end = (i + 1 < rows) ? rowStarts[i + 1] : cells.size();
+        size_t j = 0;
+        for (; j < end - start; ++j) {
+            pOut[i * width + j] = cells[start + j];
+        }
+        for (; j < width; ++j) {
+            pOut[i * width + j] = empty;
+        }
+    }
+
+    rbOk = true;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+ResultRowLimit()
+{
+    return g_rowLimit;
+}
+
+void
+SetResultRowLimit( unsigned long rows )
+{
+    g_rowLimit = (rows == 0 || rows > MAX_ROWS) ? MAX_ROWS : rows;
+}
@@ -0,0 +1,452 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Tables returned from Python.
+//
+// The general result path only takes scalars and sequences of them, so a script
+// holding a table - a dict of columns, a list of records, a DataFrame - had to
+// loop over it in Python to build rows of tuples, which the converter then
+// walked again to build a CellMatrix, which XLW walked a third time to build
+// the XLOPER12 array.
+//
+// Here tables go straight into the XLOPER12 array, in XLW's temporary memory
+// (freed at the start of the next call, after Excel has copied the result):
+// a header row of column names, then the body, written a column at a time.
+//
+//     {name: column, ...}           columns are any sequences of equal length
+//     [{name: value, ...}, ...]     records; the header is every key seen, in
+//                                   order of first appearance, and missing
+//                                   values are left empty
+//     objects with to_dict()        DataFrames and the like: to_dict("list"),
+//                                   or to_dict(as_series=False)
+//     objects with __dataframe__    via pandas' interchange support
+//
+// Cells are written as in the scalar path, NaN as #N/A included, with two
+// additions for the values tables tend to hold: None is an empty cell; and anything
+// else is written as a number if Python can make it a float (numpy scalars,
+// Decimal) and as its str() otherwise (dates, timestamps).
+//
+// Excel 2007 and later only.
+
+namespace {
+
+    const long MAX_ROWS = 1048576;      // Excel 2007's sheet size
+    const long MAX_COLS = 16384;
+
+    XCHAR g_emptyText[1] = { 0 };       // counted string of length zero
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    SetEmpty( XLOPER12& x )
+    {
+        x.xltype = xltypeStr;
+        x.val.str = g_emptyText;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Strings get a buffer of their own in XLW's memory; numbers and bools don't
+    // need one. A string's length is counted in wchar_ts, which is what the buffer
+    // holds; Python 3.3 stopped storing strings that way.
+
+    bool
+    WriteScalar( PyObject* pObj, XLOPER12& x )
+    {
+        size_t len = 0;
+        if (PyUnicode_Check(pObj)) {
+#if PY_MAJOR_VERSION < 3 || PY_VERSION_HEX < 0x03030000
+            len = (size_t)PyUnicode_GetSize(pObj);
+#else
+            Py_ssize_t size = PyUnicode_AsWideChar(pObj, NULL, 0); // includes the terminator
+            len = size > 0 ? (size_t)size - 1 : 0;
+#endif
+#if PY_MAJOR_VERSION < 3
+        } else if (PyString_Check(pObj)) {
+            len = (size_t)PyString_GET_SIZE(pObj);
+#endif
+        }
+        if (len > 0x7FFF) {
+            len = 0x7FFF;
+        }
+
+        XCHAR small[2];
+        XCHAR* pText = small;
+        if (len > 0) {
+            pText = (XCHAR*)XlfExcel::Instance().GetMemory((len + 1) * sizeof(XCHAR));
+        }
+        if (!ConvertPyScalarToXloper12(pObj, x, pText, len + 1 > 2 ? len + 1 : 2)) {
+            return false;
+        }
+
+        // Empty strings share one buffer, rather than pointing at ours
+        if (x.xltype == xltypeStr && x.val.str[0] == 0) {
+            SetEmpty(x);
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    WriteCell( PyObject* pObj, XLOPER12& x )
+    {
+        if (pObj == Py_None) {
+            SetEmpty(x);
+            return true;
+        }
+
+        if (WriteScalar(pObj, x)) {
+            return true;
+        }
+
+        // Numbers Python doesn't call numbers - numpy.int64, Decimal
+        if (PyNumber_Check(pObj)) {
+            PyObject* pFloat = PyNumber_Float(pObj);
+            if (pFloat) {
+                bool rc = WriteCell(pFloat, x);
+                Py_DECREF(pFloat);
+                return rc;
+            }
+            PyErr_Clear();
+        }
+
+        PyObject* pStr = PyObject_Str(pObj);
+        if (!pStr) {
+            PyErr_Print();
+            ERROUT("Table cell of type %s can't be converted to text", Py_TYPE(pObj)->tp_name);
+            return false;
+        }
+        bool rc = WriteScalar(pStr, x);
+        Py_DECREF(pStr);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    WriteHeader( PyObject* pName, XLOPER12& x )
+    {
+        if (PyUnicode_Check(pName)
+#if PY_MAJOR_VERSION < 3
+            || PyString_Check(pName)
+#endif
+            ) {
+            return WriteScalar(pName, x);
+        }
+        PyObject* pStr = PyObject_Str(pName);
+        if (!pStr) {
+            PyErr_Print();
+            return false;
+        }
+        bool rc = WriteScalar(pStr, x);
+        Py_DECREF(pStr);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // bodyRows doesn't include the header
+
+    bool
+    AllocateTable( XLOPER12& rResult, long bodyRows, long cols )
+    {
+        if (cols < 1 || cols > MAX_COLS || bodyRows + 1 > MAX_ROWS) {
+            ERROUT("Table of %ld rows and %ld columns doesn't fit on a sheet", bodyRows + 1, cols);
+            return false;
+        }
+        size_t cells = (size_t)(bodyRows + 1) * (size_t)cols;
+        rResult.xltype = xltypeMulti;
+        rResult.val.array.rows = bodyRows + 1;
+        rResult.val.array.columns = cols;
+        rResult.val.array.lparray = (LPXLOPER12)XlfExcel::Instance().GetMemory(cells * sizeof(XLOPER12));
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A dict of equal-length columns. Each column is converted top to bottom in one
+    // pass; lists and tuples are read in place, other sequences are listed first.
+
+    bool
+    DictToTable( PyObject* pDict, XLOPER12& rResult )
+    {
+        Py_ssize_t cols = PyDict_Size(pDict);
+        if (cols == 0) {
+            ERROUT("Returned dict is empty");
+            return false;
+        }
+
+        std::vector<PyObject*> columns;  // from PySequence_Fast; owned
+        columns.reserve(cols);
+
+        bool rc = true;
+        long rows = -1;
+        Py_ssize_t pos = 0;
+        PyObject *pKey, *pValue;
+        while (rc && PyDict_Next(pDict, &pos, &pKey, &pValue)) {
+            PyObject* pColumn = NULL;
+            if (!PyUnicode_Check(pValue)
+#if PY_MAJOR_VERSION < 3
+                && !PyString_Check(pValue)
+#endif
+                ) {
+                pColumn = PySequence_Fast(pValue, "");
+            }
+            if (!pColumn) {
+                PyErr_Clear();
+                ERROUT("Value of a returned dict isn't a column (it's a %s); return a dict of lists", Py_TYPE(pValue)->tp_name);
+                rc = false;
+                break;
+            }
+            columns.push_back(pColumn);
+
+            long len = (long)PySequence_Fast_GET_SIZE(pColumn);
+            if (rows >= 0 && len != rows) {
+                ERROUT("Columns of a returned dict have different lengths (%ld and %ld)", rows, len);
+                rc = false;
+            }
+            rows = len;
+        }
+
+        rc = rc && AllocateTable(rResult, rows, (long)cols);
+
+        // Header, then each column in turn
+        pos = 0;
+        for (long j = 0; rc && PyDict_Next(pDict, &pos, &pKey, &pValue); ++j) {
+            XLOPER12* pCells = rResult.val.array.lparray;
+            rc = WriteHeader(pKey, pCells[j]);
+
+            PyObject** pItems = PySequence_Fast_ITEMS(columns[j]);
+            for (long i = 0; rc && i < rows; ++i) {
+                rc = WriteCell(pItems[i], pCells[(i + 1) * cols + j]);
+            }
+        }
+
+        for (size_t k = 0; k < columns.size(); ++k) {
+            Py_DECREF(columns[k]);
+        }
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // A list of dicts, one per row. The keys are gathered first, for the header;
+    // then each record is written into its row.
+
+    bool
+    RecordsToTable( PyObject* pRecords, XLOPER12& rResult )
+    {
+        PyObject* pFast = PySequence_Fast(pRecords, "");
+        if (!pFast) {
+            PyErr_Print();
+            return false;
+        }
+        long rows = (long)PySequence_Fast_GET_SIZE(pFast);
+        PyObject** pRows = PySequence_Fast_ITEMS(pFast);
+
+        // Column number for each key, as a Python dict so any hashable key works
+        PyObject* pIndex = PyDict_New();
+        PyObject* pNames = PyList_New(0);
+        bool rc = pIndex && pNames;
+
+        Py_ssize_t pos;
+        PyObject *pKey, *pValue;
+        for (long i = 0; rc && i < rows; ++i) {
+            if (!PyDict_Check(pRows[i])) {
+                ERROUT("Row %ld of a returned list of dicts is a %s, not a dict", i + 1, Py_TYPE(pRows[i])->tp_name);
+                rc = false;
+                break;
+            }
+            pos = 0;
+            while (rc && PyDict_Next(pRows[i], &pos, &pKey, &pValue)) {
+                if (!PyDict_GetItem(pIndex, pKey)) {
+                    PyObject* pCol = PyLong_FromSsize_t(PyList_GET_SIZE(pNames));
+                    rc = pCol && PyDict_SetItem(pIndex, pKey, pCol) == 0 && PyList_Append(pNames, pKey) == 0;
+                    Py_XDECREF(pCol);
+                }
+            }
+        }
+
+        long cols = rc ? (long)PyList_GET_SIZE(pNames) : 0;
+        rc = rc && AllocateTable(rResult, rows, cols);
+
+        XLOPER12* pCells = rc ? rResult.val.array.lparray : NULL;
+        for (long j = 0; rc && j < cols; ++j) {
+            rc = WriteHeader(PyList_GET_ITEM(pNames, j), pCells[j]);
+        }
+        for (long k = cols; rc && k < (rows + 1) * cols; ++k) {
+            SetEmpty(pCells[k]);
+        }
+
+        for (long i = 0; rc && i < rows; ++i) {
+            pos = 0;
+            while (rc && PyDict_Next(pRows[i], &pos, &pKey, &pValue)) {
+                long j = PyLong_AsLong(PyDict_GetItem(pIndex, pKey));
+                rc = WriteCell(pValue, pCells[(i + 1) * cols + j]);
+            }
+        }
+
+        if (!rc && PyErr_Occurred()) {
+            PyErr_Print();
+        }
+        Py_XDECREF(pIndex);
+        Py_XDECREF(pNames);
+        Py_DECREF(pFast);
+        return rc;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // New reference to a dict of columns from a DataFrame-like object, or NULL
+
+    PyObject*
+    FrameToDict( PyObject* pFrame )
+    {
+        PyObject* pDict = NULL;
+
+        if (PyObject_HasAttrString(pFrame, "to_dict")) {
+            // pandas
+            pDict = PyObject_CallMethod(pFrame, (char*)"to_dict", (char*)"s", "list");
+            if (!pDict) {
+                // polars
+                PyErr_Clear();
+                PyObject* pMethod = PyObject_GetAttrString(pFrame, "to_dict");
+                PyObject* pArgs = PyTuple_New(0);
+                PyObject* pKwargs = Py_BuildValue("{s:O}", "as_series", Py_False);
+                if (pMethod && pArgs && pKwargs) {
+                    pDict = PyObject_Call(pMethod, pArgs, pKwargs);
+                }
+                Py_XDECREF(pMethod);
+                Py_XDECREF(pArgs);
+                Py_XDECREF(pKwargs);
+            }
+        } else if (PyObject_HasAttrString(pFrame, "__dataframe__")) {
+            PyObject* pInterchange = PyImport_ImportModule("pandas.api.interchange");
+            PyObject* pPandasFrame = pInterchange ?
+                PyObject_CallMethod(pInterchange, (char*)"from_dataframe", (char*)"O", pFrame) : NULL;
+            if (pPandasFrame) {
+                pDict = PyObject_CallMethod(pPandasFrame, (char*)"to_dict", (char*)"s", "list");
+            }
+            Py_XDECREF(pPandasFrame);
+            Py_XDECREF(pInterchange);
+        }
+
+        if (pDict && !PyDict_Check(pDict)) {
+            Py_DECREF(pDict);
+            pDict = NULL;
+        }
+        if (!pDict) {
+            if (PyErr_Occurred()) {
+                PyErr_Print();
+            }
+            ERROUT("Couldn't get the columns of the returned %s", Py_TYPE(pFrame)->tp_name);
+        }
+        return pDict;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool
+    IsRecordList( PyObject* pObj )
+    {
+        if (PyList_Check(pObj)) {
+            return PyList_GET_SIZE(pObj) > 0 && PyDict_Check(PyList_GET_ITEM(pObj, 0));
+        }
+        if (PyTuple_Check(pObj)) {
+            return PyTuple_GET_SIZE(pObj) > 0 && PyDict_Check(PyTuple_GET_ITEM(pObj, 0));
+        }
+        return false;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+WritePyValueToXloper12( PyObject* pObj, XLOPER12& x )
+{
+    return WriteCell(pObj, x);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertPyTableToXloper12( PyObject* pObj, XLOPER12& rResult, bool& rbOk )
+{
+    rbOk = false;
+
+    if (PyDict_Check(pObj)) {
+        rbOk = DictToTable(pObj, rResult);
+        return true;
+    }
+
+    if (IsRecordList(pObj)) {
+        rbOk = RecordsToTable(pObj, rResult);
+        return true;
+    }
+
+    if (PyList_Check(pObj) || PyTuple_Check(pObj)) {
+        return false;
+    }
+
+    if (PyObject_HasAttrString(pObj, "to_dict") || PyObject_HasAttrString(pObj, "__dataframe__")) {
+        PyObject* pDict = FrameToDict(pObj);
+        if (pDict) {
+            rbOk = DictToTable(pDict, rResult);
+            Py_DECREF(pDict);
+        }
+        return true;
+    }
+
+    return false;
+}
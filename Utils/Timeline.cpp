@@ -0,0 +1,608 @@
+// $Id$
+
+/*
+<PyinexLicense>
+
+This file is part of Pyinex, a project to embed python in Excel.
+
+Copyright (c) 2010 Ross Levinsky
+
+All rights reserved.
+
+The Pyinex project is built using the xlw framework, found at
+http://xlw.sourceforge.net
+
+The Pyinex license is based on the BSD license template found at
+http://www.opensource.org/licenses/bsd-license.php
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+    Neither the name of Ross Levinsky nor the names of any other contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+</PyinexLicense>
+*/
+
+#include "stdafx.h"
+
+#include <process.h>
+
+using namespace xlw;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Timeline recording. While PyTimeline() has a file open, PyCall activity is
+// written to it as a Chrome trace - the JSON trace-event format that Perfetto
+// (ui.perfetto.dev) and chrome://tracing load - so a recalculation can be looked
+// at as a timeline, one track per thread. Each PyCall is a span named
+// "module!function" with its calling cell, inside which are spans for finding
+// the module, converting the arguments, running Python, and converting the
+// result. Each calculation is a span too. Module imports and reloads, and
+// garbage collections, are instant events.
+//
+// Recording has to be cheap, and has to work from whichever thread Excel calls
+// PyCall on, so events go into a buffer belonging to the recording thread (found
+// through a TLS slot; __declspec(thread) doesn't work in a DLL loaded with
+// LoadLibrary before Vista). A full buffer is handed to a background writer, which
+// formats and writes it; the recording thread takes nothing but its own buffer's
+// lock, which is only ever contended while the trace is being stopped. Stopping
+// hands over what's left in every thread's buffer, and waits for the writer to
+// finish the file.
+//
+// Times are in microseconds from the start of the recording.
+
+namespace {
+
+    const size_t BUFFER_EVENTS = 1024;          // handed to the writer when this full
+    const DWORD  WRITER_PERIOD_MS = 500;
+    const DWORD  STOP_TIMEOUT_MS = 5000;
+
+    struct TimelineEvent
+    {
+        char            phase;          // 'X' span, 'i' instant
+        const char*     pCategory;      // static strings
+        const char*     pDetailName;    // NULL if there's no detail
+        double          startUs;
+        double          durationUs;
+        std::string     name;
+        std::wstring    detail;
+    };
+
+    typedef std::vector<TimelineEvent> TimelineEvents;
+
+    // One per thread that has recorded an event; never freed, as threads come and
+    // go without telling us
+    struct ThreadBuffer
+    {
+        DWORD               threadId;
+        LONG                generation;     // the recording the events belong to
+        CRITICAL_SECTION    cs;
+        TimelineEvents      events;
+    };
+
+    struct TimelineBatch
+    {
+        DWORD               threadId;
+        TimelineEvents      events;
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    class Timeline
+    {
+    public:
+        static Timeline& Factory();
+
+        bool Start( const std::wstring& filename );
+        void Stop();
+        bool Active() const { return m_active != 0; }
+        void GetFile( std::wstring& filename ) const { filename = m_filename; }
+        unsigned long Events() const { return (unsigned long)m_events; }
+        double Clock() const;
+
+        void Record( char phase, const char* pCategory, const std::string& name, double startUs,
+                     double durationUs, const char* pDetailName, const std::wstring& detail );
+
+    private:
+        Timeline();
+        ~Timeline();
+
+        ThreadBuffer* Buffer();
+        void HandOver( ThreadBuffer* pBuffer );
+        void Drain();
+        void WriteEvent( DWORD threadId, const TimelineEvent& event );
+        void WriteString( const char* pText, size_t len );
+        void WriteString( const std::wstring& text );
+
+        static unsigned __stdcall WriterMain( void* pTimeline );
+
+    private:
+        volatile LONG   m_active;
+        volatile LONG   m_generation;
+        volatile LONG   m_events;
+        volatile LONG   m_stop;
+        DWORD           m_tlsIndex;
+        LARGE_INTEGER   m_frequency;
+        LARGE_INTEGER   m_origin;
+
+        // Guards the buffer list and the writer's queue
+        CRITICAL_SECTION m_cs;
+        std::vector<ThreadBuffer*> m_buffers;
+        std::vector<TimelineBatch*> m_queue;
+
+        // Calc thread only
+        std::wstring    m_filename;
+        HANDLE          m_hThread;
+        HANDLE          m_hWake;
+        HANDLE          m_hDone;
+        bool            m_bAbandoned;   // writer didn't finish in time; it keeps the file
+
+        // Owned by the writer thread while it runs
+        FILE*           m_pFile;
+        DWORD           m_processId;
+        std::string     m_text;
+
+        Timeline( const Timeline& );
+        Timeline& operator=( const Timeline& );
+    };
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Timeline&
+    Timeline::Factory()
+    {
+        static Timeline g_obj;
+        return g_obj;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    Timeline::Timeline() :
+        m_active(0),
+        m_generation(0),
+        m_events(0),
+        m_stop(0),
+        m_tlsIndex(TlsAlloc()),
+        m_hThread(NULL),
+        m_hWake(NULL),
+        m_hDone(NULL),
+        m_bAbandoned(false),
+        m_pFile(NULL),
+        m_processId(GetCurrentProcessId())
+    {
+        QueryPerformanceFrequency(&m_frequency);
+        m_origin.QuadPart = 0;
+        InitializeCriticalSection(&m_cs);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Runs inside DllMain at unload; Stop() waits on the writer's own signal, not
+    // its thread handle, as LogSink does. The thread buffers are left alone, as
+    // threads may still be running.
+
+    Timeline::~Timeline()
+    {
+        Stop();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Calc thread only. Overwrites the file.
+
+    bool
+    Timeline::Start( const std::wstring& filename )
+    {
+        Stop();
+
+        if (m_bAbandoned) {
+            ERROUT("The last timeline is still being written; a new one can't be started");
+            return false;
+        }
+        if (m_tlsIndex == TLS_OUT_OF_INDEXES) {
+            ERROUT("No TLS slot for the timeline; it can't be recorded");
+            return false;
+        }
+
+        m_pFile = _wfopen(filename.c_str(), L"wb");
+        if (!m_pFile) {
+            ERROUT("Couldn't open timeline file %s", ASCII_REPR(filename));
+            return false;
+        }
+
+        m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (m_hWake && m_hDone) {
+            m_stop = 0;
+            m_hThread = (HANDLE)_beginthreadex(NULL, 0, WriterMain, this, 0, NULL);
+        }
+        if (!m_hThread) {
+            std::string errTxt;
+            GetWindowsErrorText(errTxt);
+            ERROUT("Couldn't start the timeline writer: %s", errTxt.c_str());
+            if (m_hWake) {
+                CloseHandle(m_hWake);
+                m_hWake = NULL;
+            }
+            if (m_hDone) {
+                CloseHandle(m_hDone);
+                m_hDone = NULL;
+            }
+            fclose(m_pFile);
+            m_pFile = NULL;
+            return false;
+        }
+
+        fprintf(m_pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                         "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":0,\"args\":{\"name\":\"Excel\"}}",
+                m_processId);
+
+        m_filename = filename;
+        InterlockedExchange(&m_events, 0);
+        InterlockedIncrement(&m_generation);
+        QueryPerformanceCounter(&m_origin);
+        InterlockedExchange(&m_active, 1);
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    Timeline::Stop()
+    {
+        if (!m_hThread || m_bAbandoned) {
+            return;
+        }
+
+        // Events recorded after this are dropped, or thrown away by the next Start
+        InterlockedExchange(&m_active, 0);
+
+        EnterCriticalSection(&m_cs);
+        std::vector<ThreadBuffer*> buffers(m_buffers);
+        LeaveCriticalSection(&m_cs);
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            HandOver(buffers[i]);
+        }
+
+        InterlockedExchange(&m_stop, 1);
+        SetEvent(m_hWake);
+        if (WaitForSingleObject(m_hDone, STOP_TIMEOUT_MS) != WAIT_OBJECT_0) {
+            // Still writing (disk blocked?); don't touch anything it's using
+            ERROUT("The timeline writer didn't finish; %s is incomplete", ASCII_REPR(m_filename));
+            m_bAbandoned = true;
+            return;
+        }
+
+        fputs("\n]}\n", m_pFile);
+        if (fclose(m_pFile) != 0) {
+            ERROUT("Error writing timeline file %s; the timeline is incomplete", ASCII_REPR(m_filename));
+        }
+        CloseHandle(m_hThread);
+        CloseHandle(m_hWake);
+        CloseHandle(m_hDone);
+
+        m_pFile = NULL;
+        m_hThread = NULL;
+        m_hWake = NULL;
+        m_hDone = NULL;
+        m_filename.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Microseconds since the recording started
+
+    double
+    Timeline::Clock() const
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return (double)(now.QuadPart - m_origin.QuadPart) * 1.0e6 / (double)m_frequency.QuadPart;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Any thread
+
+    void
+    Timeline::Record( char phase, const char* pCategory, const std::string& name, double startUs,
+                      double durationUs, const char* pDetailName, const std::wstring& detail )
+    {
+        if (!m_active) {
+            return;
+        }
+
+        ThreadBuffer* pBuffer = Buffer();
+        if (!pBuffer) {
+            return;
+        }
+
+        bool bFull = false;
+        EnterCriticalSection(&pBuffer->cs);
+        if (pBuffer->generation != m_generation) {
+            pBuffer->events.clear(); // left over from an earlier recording
+            pBuffer->generation = m_generation;
+        }
+        pBuffer->events.push_back(TimelineEvent());
+        TimelineEvent& rEvent = pBuffer->events.back();
+        rEvent.phase = phase;
+        rEvent.pCategory = pCategory;
+        rEvent.pDetailName = pDetailName;
+        rEvent.startUs = startUs;
+        rEvent.durationUs = durationUs;
+        rEvent.name = name;
+        rEvent.detail = detail;
+        bFull = pBuffer->events.size() >= BUFFER_EVENTS;
+        LeaveCriticalSection(&pBuffer->cs);
+
+        InterlockedIncrement(&m_events);
+        if (bFull) {
+            HandOver(pBuffer);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // The calling thread's buffer, made on its first event
+
+    ThreadBuffer*
+    Timeline::Buffer()
+    {
+        ThreadBuffer* pBuffer = (ThreadBuffer*)TlsGetValue(m_tlsIndex);
+        if (pBuffer) {
+            return pBuffer;
+        }
+
+        pBuffer = new ThreadBuffer;
+        pBuffer->threadId = GetCurrentThreadId();
+        pBuffer->generation = m_generation;
+        InitializeCriticalSection(&pBuffer->cs);
+        pBuffer->events.reserve(BUFFER_EVENTS);
+        if (!TlsSetValue(m_tlsIndex, pBuffer)) {
+            DeleteCriticalSection(&pBuffer->cs);
+            delete pBuffer;
+            return NULL;
+        }
+
+        EnterCriticalSection(&m_cs);
+        m_buffers.push_back(pBuffer);
+        LeaveCriticalSection(&m_cs);
+        return pBuffer;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Queues the buffer's events for the writer, and gives the buffer fresh storage
+
+    void
+    Timeline::HandOver( ThreadBuffer* pBuffer )
+    {
+        TimelineBatch* pBatch = new TimelineBatch;
+        pBatch->threadId = pBuffer->threadId;
+
+        EnterCriticalSection(&pBuffer->cs);
+        if (pBuffer->generation == m_generation) {
+            pBatch->events.swap(pBuffer->events);
+        }
+        pBuffer->events.clear();
+        pBuffer->events.reserve(BUFFER_EVENTS);
+        LeaveCriticalSection(&pBuffer->cs);
+
+        if (pBatch->events.empty()) {
+            delete pBatch;
+            return;
+        }
+
+        EnterCriticalSection(&m_cs);
+        m_queue.push_back(pBatch);
+        LeaveCriticalSection(&m_cs);
+        SetEvent(m_hWake);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Writer thread
+
+    void
+    Timeline::Drain()
+    {
+        std::vector<TimelineBatch*> batches;
+        EnterCriticalSection(&m_cs);
+        batches.swap(m_queue);
+        LeaveCriticalSection(&m_cs);
+
+        for (size_t i = 0; i < batches.size(); ++i) {
+            for (size_t j = 0; j < batches[i]->events.size(); ++j) {
+                WriteEvent(batches[i]->threadId, batches[i]->events[j]);
+            }
+            delete batches[i];
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // One event, as a line of its own; the header is the array's first element
+
+    void
+    Timeline::WriteEvent( DWORD threadId, const TimelineEvent& event )
+    {
+        char numbers[160];
+        m_text = ",\n{\"name\":";
+        WriteString(event.name.c_str(), event.name.size());
+        m_text += ",\"cat\":\"";
+        m_text += event.pCategory;
+        if (event.phase == 'X') {
+            _snprintf(numbers, NELEMS(numbers) - 1, "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu",
+                      event.startUs, event.durationUs, m_processId, threadId);
+        } else {
+            _snprintf(numbers, NELEMS(numbers) - 1, "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu",
+                      event.startUs, m_processId, threadId);
+        }
+        numbers[NELEMS(numbers) - 1] = 0;
+        m_text += numbers;
+        if (event.pDetailName) {
+            m_text += ",\"args\":{\"";
+            m_text += event.pDetailName;
+            m_text += "\":";
+            WriteString(event.detail);
+            m_text += "}";
+        }
+        m_text += "}";
+        fwrite(m_text.data(), 1, m_text.size(), m_pFile);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    // Appends a quoted JSON string. Names are UTF-8 already; only quotes,
+    // backslashes and control characters need escaping.
+
+    void
+    Timeline::WriteString( const char* pText, size_t len )
+    {
+        m_text += '"';
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = (unsigned char)pText[i];
+            if (c == '"' || c == '\\') {
+                m_text += '\\';
+                m_text += (char)c;
+            } else if (c < 0x20) {
+                char escape[8];
+                _snprintf(escape, NELEMS(escape) - 1, "\\u%04x", c);
+                escape[NELEMS(escape) - 1] = 0;
+                m_text += escape;
+            } else {
+                m_text += (char)c;
+            }
+        }
+        m_text += '"';
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    void
+    Timeline::WriteString( const std::wstring& text )
+    {
+        std::string utf8;
+        int len = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+        if (len > 0) {
+            utf8.resize(len);
+            WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &utf8[0], len, NULL, NULL);
+        }
+        WriteString(utf8.c_str(), utf8.size());
+    }
+
+    //////////////////////////////////////////////////////////////////////////////
+
+    unsigned __stdcall
+    Timeline::WriterMain( void* pTimeline )
+    {
+        Timeline* pThis = (Timeline*)pTimeline;
+
+        for (;;) {
+            WaitForSingleObject(pThis->m_hWake, WRITER_PERIOD_MS);
+            pThis->Drain();
+            if (pThis->m_stop) {
+                // Handed over by Stop() just before it set the flag
+                pThis->Drain();
+                break;
+            }
+        }
+
+        SetEvent(pThis->m_hDone);
+        return 0;
+    }
+
+} // end anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StartTimeline( const std::wstring& filename )
+{
+    return Timeline::Factory().Start(filename);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+StopTimeline()
+{
+    Timeline::Factory().Stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+TimelineActive()
+{
+    return Timeline::Factory().Active();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+GetTimelineFile( std::wstring& filename )
+{
+    Timeline::Factory().GetFile(filename);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+unsigned long
+TimelineEventCount()
+{
+    return Timeline::Factory().Events();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+double
+TimelineClock()
+{
+    return Timeline::Factory().Clock();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+RecordTimelineSpan( const char* pCategory,
+                    const std::string& name,
+                    double startUs,
+                    double durationUs,
+                    const char* pDetailName,
+                    const std::wstring& detail )
+{
+    Timeline::Factory().Record('X', pCategory, name, startUs, durationUs, pDetailName, detail);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+RecordTimelineInstant( const char* pCategory,
+                       const std::string& name,
+                       const char* pDetailName,
+                       const std::wstring& detail )
+{
+    Timeline& rTimeline = Timeline::Factory();
+    rTimeline.Record('i', pCategory, name, rTimeline.Clock(), 0.0, pDetailName, detail);
+}
@@ -44,6 +44,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "stdafx.h"
+#include <float.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define PYINEX_SSE2
+#endif
 
 using namespace xlw;
 
@@ -57,30 +63,32 @@ PrintError(  pyxErrorSeverity severity,
              const char* msg,
              ... )
 {
+    // Filtered-out messages cost nothing beyond this test
+    if (!(LogSeverityMask() & severity)) {
+        return;
+    }
+
     // Error messages are specified with a C-style format string, so until we
-    // move to Boost.Format, we're stuck with printf and its derivatives.
-    // Using C++ ostringstream, too, to handle the prepended info, because I don't
-    // want to have to think hard about counting chars written by vsnprintf, and
-    // the performance hit of this function is irrelevant.
+    // move to Boost.Format, we're stuck with printf and its derivatives. The
+    // message and the location suffix are formatted into one buffer, which goes
+    // to the log queue; the console write happens on the log writer thread.
+    // Leave room for the suffix; overlong messages are truncated.
+
+    const int BUFLEN = 2048;
+    const int SUFFIXLEN = 512;
+    char text[BUFLEN];
+    text[0] = '\n';
 
-    const long BUFLEN = 8192;
-    char formattedText[BUFLEN];
     va_list argptr;
     va_start( argptr, msg);
-    if (-1 ==  vsnprintf_s(formattedText, BUFLEN - 1, _TRUNCATE, msg, argptr)) {
-        formattedText[BUFLEN - 1] = 0; // Don't know if truncation writes a terminating null
-        printf("Truncation of vsnprintf_s buffer; extend it and recompile\n");            
-    }
+    int len = _vsnprintf_s(text + 1, BUFLEN - SUFFIXLEN, _TRUNCATE, msg, argptr);
     va_end(argptr);
+    len = (len < 0) ? (int)strlen(text) : len + 1; // truncated, but null-terminated
 
-    // ostringstream is an output-only stringstream
-    std::ostringstream stm;
-    stm << "\n" << formattedText << "  (" << file << ":" << function << ":" << line << ")\n\n";
-
-    // Would use cout, but I'm not sure if the various redirected CRTs will work with C++ 
-    // output streams. So...
+    int suffix = _snprintf_s(text + len, BUFLEN - len, _TRUNCATE, "  (%s:%s:%d)\n\n", file, function, line);
+    len = (suffix < 0) ? (int)strlen(text) : len + suffix;
 
-    printf("%s", stm.str().c_str());
+    LogWrite(severity, text, (size_t)len);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -183,6 +191,49 @@ SplitPathBasenameExtension( const std::wstring& filename,
     return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+
+ULONGLONG
+HashBytes( const void* pData, size_t n, ULONGLONG hash )
+{
+    const unsigned char* p = (const unsigned char*) pData;
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+HashFileContents( const std::wstring& filename, ULONGLONG& rHash )
+{
+    HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    ULONGLONG hash = HASH_SEED;
+    unsigned char buffer[4096];
+    DWORD nRead = 0;
+    bool rc = true;
+    for (;;) {
+        if (!ReadFile(hFile, buffer, sizeof(buffer), &nRead, NULL)) {
+            rc = false;
+            break;
+        }
+        if (nRead == 0) {
+            break;
+        }
+        hash = HashBytes(buffer, nRead, hash);
+    }
+    CloseHandle(hFile);
+
+    rHash = hash;
+    return rc;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Code to convert FROM Excel TO Python
@@ -371,6 +422,353 @@ ConvertCellMatrixToPyObject( const CellMatrix& rCM,
     return rc;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Direct conversion of Excel 2007 XLOPER12s, skipping the CellMatrix
+//
+
+namespace {
+
+    bool g_bStringInterning = true;
+
+    // Strings longer than this are rarely repeated labels; don't pay to hash them
+    const size_t g_maxInternLength = 64;
+
+    // Bounds the table for text-heavy ranges with few repeats
+    const size_t g_maxInternEntries = 4096;
+
+    // Excel 2007 strings are counted UTF-16. Returns true if every code unit is
+    // below 0x80, checking eight units at a time where SSE2 is available.
+    bool
+    IsASCII( const wchar_t* pText, size_t len )
+    {
+        size_t i = 0;
+#ifdef PYINEX_SSE2
+        const __m128i highBits = _mm_set1_epi16((short) 0xFF80);
+        __m128i acc = _mm_setzero_si128();
+        for (; i + 8 <= len; i += 8) {
+            acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*) (pText + i)));
+        }
+        acc = _mm_and_si128(acc, highBits);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(acc, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+#endif
+        for (; i < len; ++i) {
+            if (pText[i] > 0x7F) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Builds the Python string in one shot from the counted Excel text, with the
+    // same type choices as ConvertCellValueToPyObject
+    PyObject*
+    NewPyString( const wchar_t* pText, size_t len )
+    {
+#if PY_MAJOR_VERSION < 3
+        // Excel 2007 calling into Python 2.x; ASCII becomes a str, as before
+        if (IsASCII(pText, len)) {
+            PyObject* pObj = PyString_FromStringAndSize(NULL, (Py_ssize_t) len);
+            if (pObj) {
+                char* pDest = PyString_AS_STRING(pObj);
+                for (size_t i = 0; i < len; ++i) {
+                    pDest[i] = (char) pText[i];
+                }
+            }
+            return pObj;
+        }
+        return PyUnicode_FromWideChar(pText, (Py_ssize_t) len);
+#elif PY_VERSION_HEX >= 0x03030000
+        // Compact ASCII string, filled in place
+        if (IsASCII(pText, len)) {
+            PyObject* pObj = PyUnicode_New((Py_ssize_t) len, 127);
+            if (pObj) {
+                Py_UCS1* pDest = PyUnicode_1BYTE_DATA(pObj);
+                for (size_t i = 0; i < len; ++i) {
+                    pDest[i] = (Py_UCS1) pText[i];
+                }
+            }
+            return pObj;
+        }
+        return PyUnicode_FromWideChar(pText, (Py_ssize_t) len);
+#else
+        // Python 3.0-3.2 store UTF-16 on Windows; this is a straight copy
+        return PyUnicode_FromWideChar(pText, (Py_ssize_t) len);
+#endif
+    }
+
+    size_t
+    HashText( const wchar_t* pText, size_t len )
+    {
+        size_t h = 2166136261U;
+        for (size_t i = 0; i < len; ++i) {
+            h ^= (size_t) pText[i];
+            h *= 16777619U;
+        }
+        return h;
+    }
+
+    bool
+    ConvertXloper12ToPyObject( const XLOPER12& x,
+                               PyObject*& rpObj,
+                               PyStringInterner* pInterner )
+    {
+        rpObj = NULL;
+
+        switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+            case xltypeNum:
+                rpObj = PyFloat_FromDouble(x.val.num);
+                break;
+
+            case xltypeStr: {
+                const wchar_t* pText = (const wchar_t*) (x.val.str + 1);
+                size_t len = (size_t) x.val.str[0];
+                rpObj = pInterner ? pInterner->GetString(pText, len) : NewPyString(pText, len);
+                break;
+            }
+
+            case xltypeBool:
+                rpObj = PyBool_FromLong( (long) (x.val.xbool > 0) );
+                break;
+
+            case xltypeErr:
+#if PY_MAJOR_VERSION < 3
+                rpObj = PyString_FromString( ExcelTextError(x.val.err) );
+#else 
+                rpObj = PyUnicode_FromString( ExcelTextError(x.val.err) );
+#endif
+                break;
+
+            case xltypeMissing:
+            case xltypeNil:
+                rpObj = Py_None;
+                Py_INCREF(rpObj);
+                break;
+
+            default:
+                ERROUT("Unexpected Excel cell type 0x%x", x.xltype);
+                return false;
+        }
+
+        return (rpObj != NULL);
+    }
+
+    // Same shapes as ConvertCellMatrixToPyObject: one cell is a scalar, one row is
+    // a flat tuple, anything else is a tuple of row tuples
+    bool
+    ConvertXlMultiToPyObject( const XLOPER12& multi,
+                              PyObject*& rpObj,
+                              PyStringInterner* pInterner )
+    {
+        bool rc = true;
+        long i, j;
+        long rows = multi.val.array.rows;
+        long cols = multi.val.array.columns;
+        const XLOPER12* pCells = multi.val.array.lparray;
+        PyObject *pCols, *pValue;
+
+        rpObj = NULL;
+        if (rows == 0 || cols == 0) {
+            ERROUT("Empty Excel array");
+            return false;
+        }
+
+        if (rows == 1 && cols == 1) {
+            rc = ConvertXloper12ToPyObject( pCells[0], rpObj, pInterner );
+            if (!rc) {
+                ERROUT("Failed to convert single cell to PyObject");
+            }
+        } else if (rows == 1) {
+            rpObj = PyTuple_New(cols);
+            for (j = 0; rc && rpObj && j < cols; ++j) {
+                rc = ConvertXloper12ToPyObject( pCells[j], pValue, pInterner );
+                if (rc) {
+                    PyTuple_SET_ITEM(rpObj, j, pValue); // pValue reference stolen here
+                } else {
+                    ERROUT("Failed to convert element %d of single-row cell to PyObject", j);
+                }
+            }
+            rc = rc && rpObj;
+        } else {
+            rpObj = PyTuple_New(rows);
+            for (i = 0; rc && rpObj && i < rows; ++i) {
+                pCols = PyTuple_New(cols);
+                if (!pCols) {
+                    rc = false;
+                    break;
+                }
+                PyTuple_SET_ITEM(rpObj, i, pCols); // pCols reference stolen here
+                for (j = 0; rc && j < cols; ++j) {
+                    rc = ConvertXloper12ToPyObject( pCells[i*cols + j], pValue, pInterner );
+                    if (rc) {
+                        PyTuple_SET_ITEM(pCols, j, pValue); // pValue reference stolen here
+                    } else {
+                        ERROUT("Failed to convert element %d, %d of matrix cell to PyObject", i, j);
+                    }
+                }
+            }
+            rc = rc && rpObj;
+        }
+
+        if (!rc) {
+            Py_XDECREF(rpObj); // Owns any elements already set
+            rpObj = NULL;
+        }
+        return rc;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+PyStringInterner::PyStringInterner()
+    : m_count(0)
+{
+}
+
+PyStringInterner::~PyStringInterner()
+{
+    for (size_t i = 0; i < m_table.size(); ++i) {
+        Py_XDECREF(m_table[i].pObj);
+    }
+}
+
+PyObject* 
+PyStringInterner::GetString( const wchar_t* pText, size_t len )
+{
+    if (len > g_maxInternLength) {
+        return NewPyString(pText, len);
+    }
+
+    size_t hash = HashText(pText, len);
+    size_t mask = m_table.size() - 1;
+    size_t slot = hash & mask;
+
+    if (!m_table.empty()) {
+        for (; m_table[slot].pObj; slot = (slot + 1) & mask) {
+            const Entry& e = m_table[slot];
+            if (e.hash == hash && e.len == len &&
+                (len == 0 || memcmp(&m_keys[e.keyOffset], pText, len * sizeof(wchar_t)) == 0)) {
+                Py_INCREF(e.pObj);
+                return e.pObj;
+            }
+        }
+    }
+
+    PyObject* pObj = NewPyString(pText, len);
+    if (!pObj || m_count >= g_maxInternEntries) {
+        return pObj;
+    }
+
+    // Keep the load factor at or below one half
+    if (2 * (m_count + 1) > m_table.size()) {
+        std::vector<Entry> old;
+        old.swap(m_table);
+        Entry empty = { 0, 0, 0, NULL };
+        m_table.assign(old.empty() ? 64 : 2 * old.size(), empty);
+        mask = m_table.size() - 1;
+        for (size_t i = 0; i < old.size(); ++i) {
+            if (old[i].pObj) {
+                size_t s = old[i].hash & mask;
+                while (m_table[s].pObj) {
+                    s = (s + 1) & mask;
+                }
+                m_table[s] = old[i];
+            }
+        }
+        for (slot = hash & mask; m_table[slot].pObj; slot = (slot + 1) & mask) {
+        }
+    }
+
+    // Keys are copied; the Excel text may be freed before the table is
+    Entry& e = m_table[slot];
+    e.hash = hash;
+    e.keyOffset = m_keys.size();
+    e.len = len;
+    e.pObj = pObj;
+    m_keys.insert(m_keys.end(), pText, pText + len);
+    ++m_count;
+
+    Py_INCREF(pObj); // One for the table, one for the caller
+    return pObj;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertXlfOperToPyObject( XlfOper& rOper,
+                          PyObject*& rpObj,
+                          PyStringInterner* pInterner )
+{
+    rpObj = NULL;
+
+    if (!XlfExcel::Instance().excel12()) {
+        // Excel 2002/2003 only passes single-byte strings; nothing to gain here
+        CellMatrix cm(rOper.AsCellMatrix());
+        return ConvertCellMatrixToPyObject(cm, rpObj);
+    }
+
+    LPXLOPER12 pX = (LPXLOPER12) rOper.GetLPXLFOPER();
+    int type = pX->xltype & ~(xlbitXLFree | xlbitDLLFree);
+
+    if (type == xltypeMulti) {
+        return ConvertXlMultiToPyObject(*pX, rpObj, pInterner);
+    }
+
+    if (type == xltypeRef || type == xltypeSRef) {
+        // Let Excel flatten the reference into an array
+        XLOPER12 xMulti, xType;
+        xType.xltype = xltypeInt;
+        xType.val.w = xltypeMulti;
+        if (XlfExcel::Instance().Call12(xlCoerce, &xMulti, 2, pX, &xType) != xlretSuccess) {
+            CellMatrix cm(rOper.AsCellMatrix());
+            return ConvertCellMatrixToPyObject(cm, rpObj);
+        }
+        bool rc = ConvertXlMultiToPyObject(xMulti, rpObj, pInterner);
+        XlfExcel::Instance().Call12(xlFree, NULL, 1, &xMulti);
+        return rc;
+    }
+
+    bool rc = ConvertXloper12ToPyObject(*pX, rpObj, pInterner);
+    if (!rc) {
+        ERROUT("Failed to convert single cell to PyObject");
+    }
+    return rc;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+ConvertXloper12CellToPyObject( const XLOPER12& x,
+                               PyObject*& rpObj,
+                               PyStringInterner* pInterner )
+{
+    return ConvertXloper12ToPyObject(x, rpObj, pInterner);
+}
+
+bool
+ConvertXloper12MultiToPyObject( const xloper12& multi,
+                                PyObject*& rpObj,
+                                PyStringInterner* pInterner )
+{
+    return ConvertXlMultiToPyObject(multi, rpObj, pInterner);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+StringInterningEnabled()
+{
+    return g_bStringInterning;
+}
+
+void
+SetStringInterning( bool bIntern )
+{
+    g_bStringInterning = bIntern;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Code to convert back FROM Python TO Excel
@@ -620,6 +1018,88 @@ ConvertPyObjectToCellMatrix( PyObject* pTopObj, CellMatrix& rMat )
 
 //////////////////////////////////////////////////////////////////////////////
 
+bool
+ConvertPyScalarToXloper12( PyObject* pObj, XLOPER12& rX, wchar_t* pText, size_t textLen )
+{
+    assert(pObj);
+    assert(textLen > 1);
+
+    if (PyBool_Check(pObj)) {
+        rX.xltype = xltypeBool;
+        rX.val.xbool = (pObj == Py_True);
+        return true;
+    }
+
+    // Excel can't show NaN or infinities; they're #N/A, as in tables and Arrow data
+    if (PyFloat_Check(pObj)) {
+        double d = PyFloat_AS_DOUBLE(pObj);
+        if (_finite(d)) {
+            rX.xltype = xltypeNum;
+            rX.val.num = d;
+        } else {
+            rX.xltype = xltypeErr;
+            rX.val.err = xlerrNA;
+        }
+        return true;
+    }
+
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(pObj)) {
+        rX.xltype = xltypeNum;
+        rX.val.num = (double)PyInt_AS_LONG(pObj);
+        return true;
+    }
+#endif
+
+    if (PyLong_Check(pObj)) {
+        double d = PyLong_AsDouble(pObj);
+        if (d == -1.0 && PyErr_Occurred()) {
+            // Too big for a double; leave it to the general path to report
+            PyErr_Clear();
+            return false;
+        }
+        rX.xltype = xltypeNum;
+        rX.val.num = d;
+        return true;
+    }
+
+    // Excel strings are counted, and limited to what a wchar_t can count
+    size_t maxLen = textLen - 1;
+    if (maxLen > 0x7FFF) {
+        maxLen = 0x7FFF;
+    }
+
+    if (PyUnicode_Check(pObj)) {
+        Py_ssize_t len = PyUnicode_GetSize(pObj);
+        if ((size_t)len > maxLen) {
+            len = (Py_ssize_t)maxLen;
+        }
+        PyUnicode_AsWideChar((PyUnicodeObject*)pObj, pText + 1, len);
+        pText[0] = (wchar_t)len;
+        rX.xltype = xltypeStr;
+        rX.val.str = pText;
+        return true;
+    }
+
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(pObj)) {
+        int len = MultiByteToWideChar(CP_ACP, 0, PyString_AS_STRING(pObj), (int)PyString_GET_SIZE(pObj),
+                                      pText + 1, (int)maxLen);
+        if (len == 0 && PyString_GET_SIZE(pObj) > 0) {
+            return false; // too long for the buffer
+        }
+        pText[0] = (wchar_t)len;
+        rX.xltype = xltypeStr;
+        rX.val.str = pText;
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 void
 CellMatrixDump( xlw::CellMatrix& rMat )
 {
@@ -53,8 +53,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 namespace xlw {
     class CellValue;
     class CellMatrix;
+    class XlfOper;
 }
 
+struct xloper12;
+
 
 // Severity codes are bitmasks; it will mildly simplify arbitrary output filtering 
 
@@ -62,7 +65,8 @@ enum pyxErrorSeverity
 {
     pyxError    = 0x1,
     pyxWarning  = 0x2,
-    pyxInfo     = 0x4
+    pyxInfo     = 0x4,
+    pyxOutput   = 0x8   // Python's own sys.stdout
 };
 
 // PrintError adds a newline at the end of each logged message; don't put them in msg
@@ -79,6 +83,43 @@ PrintError(  pyxErrorSeverity severity,
 #define WARNOUT(x, ...) (PrintError( pyxWarning, __FILE__, __FUNCTION__, __LINE__, x, __VA_ARGS__ ))
 #define INFOUT(x, ...)  (PrintError( pyxInfo,    __FILE__, __FUNCTION__, __LINE__, x, __VA_ARGS__ ))
 
+// Everything written to the console - PrintError output and Python's sys.stdout and
+// sys.stderr - goes through a lock-free queue drained by a background writer thread,
+// so logging doesn't stall the calc thread. See LogSink.cpp.
+//
+// Start the writer once the console exists; until then (and after it's stopped)
+// writes are synchronous. Text is UTF-8.
+
+bool
+StartLogWriter();
+
+void
+StopLogWriter();
+
+// Waits briefly for queued text to reach the console
+void
+FlushLog();
+
+// Messages whose severity isn't in the mask are discarded before formatting
+void
+LogWrite( pyxErrorSeverity severity, const char* pText, size_t len );
+
+unsigned long
+LogSeverityMask();
+
+void
+SetLogSeverityMask( unsigned long mask );
+
+// Messages lost because the queue was full
+unsigned long
+LogDroppedCount();
+
+// Also copy console output to a file, rotated to filename.1 ... filename.<keep> once
+// it reaches maxBytes (zero = never rotate). An empty filename closes the file.
+// Setting the same file again only changes its limits.
+void
+SetLogFile( const std::wstring& filename, unsigned long maxBytes, unsigned long keep );
+
 // Utility routine to facilitate printing of wstrings that may contain non-ASCII chars
 
 std::string
@@ -114,6 +155,16 @@ SplitPathBasenameExtension( const std::wstring& filename,
                            std::wstring& basename,
                            std::wstring& extension );
 
+// 64-bit FNV-1a, for content keys and checksums. Start with HASH_SEED; pass the
+// previous result to carry a hash on over more data.
+const ULONGLONG HASH_SEED = 14695981039346656037ULL;
+
+ULONGLONG
+HashBytes( const void* pData, size_t n, ULONGLONG hash );
+
+bool
+HashFileContents( const std::wstring& filename, ULONGLONG& rHash );
+
 // Different versions of python are compiled/linked against different CRTs, so the
 // loaded python DLL will potentially be calling printf through CRT handles that
 // are different than those our XLL will be using. In particular, python 2.5
@@ -158,6 +209,312 @@ GetPyModuleAndFunctionObjects(  const std::wstring& filename,
                                 PyObject*& rpModule,
                                 PyObject*& rpFunction );
 
+// Cooperative cancellation of running Python code; see Cancellation.cpp. PyCall brackets
+// the Python call with Begin/End so that interrupts only ever land in the call they were
+// meant for. A positive timeoutSeconds gives the call a time budget; End returns true if
+// the call overran it.
+void
+BeginCancellableCall( double timeoutSeconds );
+
+bool
+EndCancellableCall();
+
+// Cheap enough to call in a tight loop; asks Excel (xlAbort) at most every 100 ms.
+// Calc thread only, as are ClearBreak and SetBreakInterrupt.
+bool
+BreakRequested();
+
+void
+ClearBreak();
+
+// Any thread. Sets the break flag and raises KeyboardInterrupt in the running PyCall, if any.
+bool
+InterruptRunningCall();
+
+// Get/set flag that has Esc raise KeyboardInterrupt in running scripts
+bool
+BreakInterruptEnabled();
+
+void
+SetBreakInterrupt( bool bInterrupt );
+
+// Get/set the time budget for every PyCall, in seconds; zero = none. A function's own
+// budget (the pyinex.Timeout decorator) takes precedence.
+double
+CallTimeoutSeconds();
+
+void
+SetCallTimeout( double seconds );
+
+// Timeout statistics, keyed by "module!function"
+void
+RecordCallTimeout( const std::string& function );
+
+void
+GetCallTimeoutCounts( std::map<std::string, unsigned long>& rCounts );
+
+unsigned long
+TotalCallTimeouts();
+
+// The pyinex.CallTimeout exception type (borrowed reference); needs the GIL
+PyObject*
+CallTimeoutException();
+
+// Calculation cycles and garbage collection scheduling; see CalcCycle.cpp. PyCall
+// brackets each call with BeginCalcCall/EndCalcCall, and the first call after a cycle
+// has ended starts the next one. The PyCalcEnded command (Excel 2010) and an idle
+// timer end it. Calc thread only; all but EndCalcCycle need the GIL.
+void
+BeginCalcCall();
+
+void
+EndCalcCall();
+
+void
+EndCalcCycle( bool bFromEvent );
+
+bool
+CalcCycleActive();
+
+// Counts the cycles started so far, so that state kept for a cycle can tell when
+// the next one has begun
+unsigned long
+CalcCycleNumber();
+
+// Get/set flag that disables automatic collection during a calculation, and collects
+// at its end instead. Takes effect from the next calculation.
+bool
+GcScheduling();
+
+void
+SetGcScheduling( bool bSchedule );
+
+// Get/set the gen-0 count at which a young collection runs mid-calculation; zero = never
+unsigned long
+GcAllocationBudget();
+
+void
+SetGcAllocationBudget( unsigned long budget );
+
+struct GcStatistics
+{
+    unsigned long   cycles;                 // calculations seen
+    unsigned long   collections;            // all timed collections
+    unsigned long   scheduledCollections;   // full collections run as a calculation ended
+    unsigned long   budgetCollections;      // young collections run over budget
+    unsigned long   midCalcCollections;     // collections that ran during a calculation
+    double          totalPauseMs;
+    double          maxPauseMs;
+    double          lastPauseMs;
+};
+
+void
+GetGcStatistics( GcStatistics& rStats );
+
+// Registers a script function to be called, with no arguments, as each calculation
+// starts (bStart) or ends; see CalcCycle.cpp. Needs the GIL.
+void
+AddCalcHook( bool bStart, PyObject* pFunction );
+
+// Memory accounting; see MemoryAccount.cpp. While tracking is on, sampled Python
+// allocations are charged to the module tagged when they're made. Tags are set by
+// PyCall and by module import, and returned to the previous one afterwards. All of
+// these need the GIL. Tracking needs Python 3.5; StartMemoryTracking returns false
+// before that.
+int
+SetMemoryTag( const char* pModuleName );
+
+void
+RestoreMemoryTag( int tag );
+
+class MemoryTagScope
+{
+public:
+    explicit MemoryTagScope( const char* pModuleName ) : m_previous(SetMemoryTag(pModuleName)) {}
+    ~MemoryTagScope() { RestoreMemoryTag(m_previous); }
+
+private:
+    int m_previous;
+};
+
+bool
+StartMemoryTracking();
+
+void
+StopMemoryTracking();
+
+bool
+MemoryTrackingActive();
+
+// Get/set the soft limits, in MB; zero = none. The process limit applies to Excel's
+// address space, the module limit to each module's tracked bytes. bCollect forces a
+// full collection before warning. CheckMemoryLimits runs after each PyCall.
+void
+SetMemoryLimits( double processMB, double moduleMB, bool bCollect );
+
+void
+GetMemoryLimits( double& rProcessMB, double& rModuleMB, bool& rbCollect );
+
+void
+CheckMemoryLimits();
+
+struct MemoryUsage
+{
+    double  privateBytes;           // the process's committed private memory
+    double  addressSpaceBytes;      // virtual address space in use
+    double  addressSpaceFreeBytes;
+    double  trackedBytes;           // the sum of the modules' figures
+    std::vector<std::pair<double, std::string> > modules;  // live bytes by module, largest first
+};
+
+void
+GetMemoryUsage( MemoryUsage& rUsage );
+
+// Sampling profiler; see Profiler.cpp. While it runs, the Python stack of the PyCall in
+// progress is sampled hz times a second, and kept as collapsed stacks (for flame graphs)
+// under the call's module!function and, if bCells, its calling cell. PyCall brackets each
+// call with BeginProfiledCall/EndProfiledCall. Calc thread only, with the GIL.
+bool
+StartProfiler( double hz, bool bCells );
+
+void
+StopProfiler();
+
+// Stops the sampling thread for good; call before Py_Finalize
+void
+ShutdownProfiler();
+
+bool
+ProfilerActive();
+
+double
+ProfilerHz();
+
+bool
+ProfilerCells();
+
+unsigned long
+ProfileSampleCount();
+
+// Both borrowed; they must outlive the call
+void
+BeginProfiledCall( PyObject* pModule, PyObject* pFunction );
+
+void
+EndProfiledCall();
+
+// Each stack with its weight in microseconds, heaviest first
+void
+GetProfileStacks( std::vector<std::pair<std::string, double> >& rStacks );
+
+// One "stack weight" line per stack; the samples are kept for another write
+bool
+WriteProfile( const std::wstring& filename );
+
+// Timeline recording; see Timeline.cpp. While a timeline file is open, PyCalls, their
+// stages, calculations, module loads and garbage collections are written to it as
+// Chrome trace events. Start and stop on the calc thread; record from any thread.
+bool
+StartTimeline( const std::wstring& filename );
+
+void
+StopTimeline();
+
+bool
+TimelineActive();
+
+void
+GetTimelineFile( std::wstring& filename );
+
+unsigned long
+TimelineEventCount();
+
+// Microseconds since the timeline was started
+double
+TimelineClock();
+
+// pCategory and pDetailName must be static strings; pDetailName is NULL for no detail
+void
+RecordTimelineSpan( const char* pCategory,
+                    const std::string& name,
+                    double startUs,
+                    double durationUs,
+                    const char* pDetailName,
+                    const std::wstring& detail );
+
+void
+RecordTimelineInstant( const char* pCategory,
+                       const std::string& name,
+                       const char* pDetailName,
+                       const std::wstring& detail );
+
+// Persistent result cache; see ResultCache.cpp. While a cache file is open, results of
+// functions marked with pyinex.Cacheable are kept in it, and PyCall looks for a stored
+// result before calling Python. Calc thread only. Excel 2007 only.
+struct ResultCacheKey
+{
+    ULONGLONG   module;         // hash of the script file's contents
+    ULONGLONG   function;       // hash of the function name
+    ULONGLONG   args;           // hash of the argument values
+};
+
+// megabytes is only used for a new file; zero is the default size
+bool
+OpenResultCache( const std::wstring& filename, unsigned long megabytes );
+
+// Opens the file named by PYINEX_RESULT_CACHE, if it's set
+void
+OpenResultCacheFromEnvironment();
+
+void
+CloseResultCache();
+
+bool
+ResultCacheActive();
+
+void
+GetResultCacheFile( std::wstring& filename );
+
+bool
+ClearResultCache();
+
+// Hits, misses and stores are counted since the cache was opened or cleared
+void
+GetResultCacheStats( unsigned long& rEntries,
+                     unsigned long& rHits,
+                     unsigned long& rMisses,
+                     unsigned long& rStores,
+                     unsigned long& rMegabytes );
+
+// Fails if the cache isn't open, the script can't be read, or an argument can't be stored
+bool
+MakeResultCacheKey( const std::wstring& filename,
+                    const std::string& function,
+                    const xloper12* pArgs[],
+                    int count,
+                    ResultCacheKey& rKey );
+
+// rpResult points into the cache's storage, and is valid until the next lookup
+bool
+LookUpCachedResult( const ResultCacheKey& key, const xloper12*& rpResult );
+
+void
+StoreCachedResult( const ResultCacheKey& key, const xloper12* pResult );
+
+// Module snapshots; see ModuleSnapshot.cpp. ModuleCache brackets each import or reload
+// of a script with these. BeginModuleImport returns true if the module will be restored
+// from a snapshot; EndModuleImport (pModule is NULL if the import failed) restores it,
+// or takes a snapshot if it was run in full, and returns false if restoring failed,
+// when the module has to be run again. Needs the GIL.
+bool
+BeginModuleImport( const std::wstring& filename, const std::string& moduleName );
+
+bool
+ModuleRestoring( const std::string& moduleName );
+
+bool
+EndModuleImport( PyObject* pModule );
+
 // Get/set flag that turns on checking of module file write times and reloads stale modules
 bool
 ModuleFreshnessCheckEnabled();
@@ -170,6 +527,127 @@ bool
 ConvertCellMatrixToPyObject( const xlw::CellMatrix& rCM,
                              PyObject*& rpObj );
 
+// Per-call table of Python strings made from Excel text, so that a label repeated
+// down a column (a currency code, a header) becomes one shared object. Only short
+// strings are interned. Holds a reference to each string until destroyed, so it
+// must not outlive the call (or the GIL).
+//
+class PyStringInterner
+{
+public:
+    PyStringInterner();
+    ~PyStringInterner();
+
+    // Returns a new reference, or NULL with a Python error set
+    PyObject* GetString( const wchar_t* pText, size_t len );
+
+private:
+    struct Entry {
+        size_t     hash;
+        size_t     keyOffset; // into m_keys
+        size_t     len;
+        PyObject*  pObj;
+    };
+
+    std::vector<Entry>    m_table;  // open addressing; pObj == NULL marks an empty slot
+    std::vector<wchar_t>  m_keys;
+    size_t                m_count;
+
+    PyStringInterner( const PyStringInterner& );
+    PyStringInterner& operator=( const PyStringInterner& );
+};
+
+// Converts an Excel argument straight from its XLOPER12, without going through a
+// CellMatrix and a std::wstring per string cell. Shapes are the same as for 
+// ConvertCellMatrixToPyObject. Falls back to the CellMatrix path under Excel 2002/2003.
+// pInterner may be NULL.
+//
+bool
+ConvertXlfOperToPyObject( xlw::XlfOper& rOper,
+                          PyObject*& rpObj,
+                          PyStringInterner* pInterner );
+
+// One cell of an Excel 2007 array; no shape handling. Errors become their text.
+//
+bool
+ConvertXloper12CellToPyObject( const xloper12& x,
+                               PyObject*& rpObj,
+                               PyStringInterner* pInterner );
+
+// A whole Excel 2007 array, in the shapes ConvertXlfOperToPyObject gives it. Makes no
+// calls to Excel, so also serves for arrays that didn't come from one.
+//
+bool
+ConvertXloper12MultiToPyObject( const xloper12& multi,
+                                PyObject*& rpObj,
+                                PyStringInterner* pInterner );
+
+// PyCallRef passes single-area references to Python as pyinex.Range objects, which
+// read cells from Excel only as they're indexed; see RangeProxy.cpp. Anything else
+// is converted as ConvertXlfOperToPyObject would. Ranges can only read from Excel
+// between Open and Close; Close returns true if one of them found uncalculated cells,
+// in which case Excel will call the function again and its result doesn't matter.
+// Other readers of PyCallRef's references report uncalculated cells the same way,
+// through NoteUncalculatedCells.
+//
+bool
+ConvertXlfOperToRangeProxy( xlw::XlfOper& rOper,
+                            PyObject*& rpObj,
+                            PyStringInterner* pInterner );
+
+void
+OpenRangeProxies();
+
+bool
+CloseRangeProxies();
+
+void
+NoteUncalculatedCells();
+
+// Adds the Range type and the Uncalculated exception to the pyinex module
+bool
+AddRangeTypes( PyObject* pModule );
+
+// Conversions compiled from a function's annotations - int, float, bool, str, lists of
+// those, numpy.ndarray - so that annotated arguments are built directly in the type the
+// function asked for. See MarshalPlan.cpp. The plan is compiled on first use and kept
+// in the function's __dict__; a borrowed reference is returned, or NULL if no argument
+// has a usable annotation.
+//
+PyObject*
+GetMarshalPlan( PyObject* pFunction, const char* pFunctionName );
+
+// Zero if the argument has no planned conversion
+int
+MarshalPlanEntry( PyObject* pPlan, int argIndex );
+
+// Converts as planned; a zero entry, or Excel 2002/2003, converts as ConvertXlfOperToPyObject
+bool
+ConvertXlfOperByPlan( xlw::XlfOper& rOper,
+                      int entry,
+                      PyObject*& rpObj,
+                      PyStringInterner* pInterner );
+
+// Exports rows x cols cells - a header row of names, then the body - as a new
+// pyinex.ArrowTable, which hands its columns over through the Arrow C Data Interface.
+// See ArrowBridge.cpp. Returns NULL, with a Python error set, on failure. Python 3 only.
+//
+PyObject*
+NewArrowTable( const xloper12* pCells,
+               long rows,
+               long cols );
+
+// Adds the ArrowTable type to the pyinex module
+bool
+AddArrowTypes( PyObject* pModule );
+
+// Get/set flag that turns on string interning for PyCall arguments
+bool
+StringInterningEnabled();
+
+void
+SetStringInterning( bool bIntern );
+
 // Would like for pObj to be const, but Python headers make that
 // impossible (too many internal functions take a non-const ptr)
 //
@@ -177,6 +655,171 @@ bool
 ConvertPyObjectToCellMatrix( PyObject* pObj, 
                              xlw::CellMatrix& rMat );
 
+// Fast path for single-value results: numbers, bools and strings are written
+// straight into rX, with no CellMatrix and no allocation. NaN and infinities,
+// which Excel can't show, are #N/A, as in tables and Arrow results. String
+// results are copied into pText, which holds textLen wchar_ts (the first is
+// Excel's count), and are cut short if they don't fit. Returns false, leaving rX
+// alone, for anything else - None, sequences - which must take
+// ConvertPyObjectToCellMatrix.
+//
+bool
+ConvertPyScalarToXloper12( PyObject* pObj, 
+                           xloper12& rX, 
+                           wchar_t* pText, 
+                           size_t textLen );
+
+// Tables - a dict of equal-length columns, a list of dicts, or a DataFrame-like
+// object - are written straight into an XLOPER12 array (in XLW's temporary memory)
+// as a header row of column names and a body. See TableResult.cpp. Returns false,
+// leaving rResult alone, if pObj isn't a table; otherwise returns true, and rbOk
+// says whether the conversion worked (failures are logged). Excel 2007 only.
+//
+bool
+ConvertPyTableToXloper12( PyObject* pObj,
+                          xloper12& rResult,
+                          bool& rbOk );
+
+// Objects exporting Arrow data (__arrow_c_array__ or __arrow_c_stream__) are read
+// from their Arrow buffers into a header row and body. Same contract as
+// ConvertPyTableToXloper12. Python 3 only.
+//
+bool
+ConvertPyArrowToXloper12( PyObject* pObj,
+                          xloper12& rResult,
+                          bool& rbOk );
+
+// One value of a table or streamed result, with strings in XLW's temporary memory.
+// None is an empty cell, NaN is #N/A; other non-native values are written through
+// float() or str().
+//
+bool
+WritePyValueToXloper12( PyObject* pObj,
+                        xloper12& x );
+
+// Iterators and generators are consumed a row at a time into a native array, so
+// the script never needs to build the whole result as a list. See StreamResult.cpp.
+// Same contract as ConvertPyTableToXloper12: false if pObj isn't an iterable that
+// takes this path, else true with rbOk set.
+//
+bool
+ConvertPyIterableToXloper12( PyObject* pObj,
+                             xloper12& rResult,
+                             bool& rbOk );
+
+// Get/set the most rows taken from an iterator result; zero means a full sheet
+unsigned long
+ResultRowLimit();
+
+void
+SetResultRowLimit( unsigned long rows );
+
+// PyCall's and PyCallRef's argument slots, after the file and function names
+const long PYCALL_ARGS = 15;
+
+// Where a result that goes back to Excel without a CellMatrix is written; it must
+// outlive the XlfOper CallPythonFunction returns
+struct PyCallResultBuffer
+{
+    xloper12    x;
+    wchar_t     text[32768];    // counted string; Excel 2007's maximum length
+};
+
+// How long each stage of a PyCall took, in microseconds; stages the call didn't
+// reach are zero
+struct PyCallStages
+{
+    double      lookupUs;       // finding the module and the function
+    double      argumentsUs;    // converting the arguments
+    double      pythonUs;
+    double      resultUs;       // converting the result
+};
+
+// A PyCall's entry in the result cache (see ResultCache.cpp), for a caller that has
+// one open. CallPythonFunction makes the key only once it has found the function
+// and seen that it's marked with pyinex.Cacheable, so other calls don't pay for it.
+struct PyCallCacheEntry
+{
+    ResultCacheKey  key;
+    bool            bKeyed;         // key was made; the result may be stored under it
+    bool            bFound;         // the result came from the cache, not from Python
+};
+
+// A PyCall from Excel's arguments (PYCALL_ARGS of them) to Excel's result: the
+// function's lookup, argument conversion, the call and the result's conversion.
+// See PyCall.cpp. bRangeArgs makes references into pyinex.Range objects, as for
+// PyCallRef. rbCacheable is set if the call worked, and the function is marked
+// with pyinex.Cacheable. pStages, if given, gets the time each stage took. pCache,
+// if given, is looked up before the arguments are converted; a result found there
+// is returned without calling Python. Needs the GIL.
+//
+xlw::XlfOper
+CallPythonFunction( xlw::XlfOper& xlFilename,
+                    xlw::XlfOper& xlFunction,
+                    xlw::XlfOper* arrCM[],
+                    bool bRangeArgs,
+                    PyCallResultBuffer& rBuffer,
+                    bool& rbCacheable,
+                    PyCallStages* pStages = NULL,
+                    PyCallCacheEntry* pCache = NULL );
+
+// Call tracing; see CallTrace.cpp. While a trace is open, PyCall and PyCallRef append
+// each call - arguments, result and timing - to it. Calc thread only. Excel 2007 only.
+bool
+StartCallTrace( const std::wstring& filename );
+
+void
+StopCallTrace();
+
+bool
+CallTraceActive();
+
+void
+GetCallTraceFile( std::wstring& filename );
+
+unsigned long
+TracedCallCount();
+
+// Seconds since the trace was started
+double
+CallTraceClock();
+
+void
+RecordTracedCall( const std::wstring& filename,
+                  const std::string& function,
+                  const xloper12* pArgs[],
+                  int count,
+                  bool bRangeArgs,
+                  const xloper12* pResult,
+                  double startSeconds,
+                  double elapsedSeconds );
+
+// One call read back from a trace. args and pResult point into storage, so these
+// are handed around by pointer; FreeCallTrace deletes them.
+struct TracedCall
+{
+    std::wstring                    filename;
+    std::string                     function;
+    std::wstring                    caller;         // sheet!RxCy; empty if not called from a cell
+    bool                            bRangeArgs;     // recorded from PyCallRef
+    double                          startSeconds;
+    double                          elapsedSeconds;
+    std::vector<const xloper12*>    args;           // trailing missing arguments aren't recorded
+    const xloper12*                 pResult;        // as handed back to Excel
+    std::vector<double>             storage;
+};
+
+bool
+LoadCallTrace( const std::wstring& filename, std::vector<TracedCall*>& rCalls );
+
+void
+FreeCallTrace( std::vector<TracedCall*>& rCalls );
+
+// Whether a replayed call's result, as CallPythonFunction handed it back, would
+// show on the sheet as the recorded one did
+bool
+SameTracedResult( const xloper12& result, const xloper12& expected );
+
 // Diagnostic use only
 //
 void
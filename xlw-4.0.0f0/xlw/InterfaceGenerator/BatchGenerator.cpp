@@ -0,0 +1,353 @@
+//
+//
+//                                    BatchGenerator.cpp
+//
+//
+/*
+ Copyright (C) 2006 Mark Joshi
+
+ This file is part of XLW, a free-software/open-source C++ wrapper of the
+ Excel C API - http://xlw.sourceforge.net/
+
+ XLW is free software: you can redistribute it and/or modify it under the
+ terms of the XLW license.  You should have received a copy of the
+ license along with this program; if not, please email xlw-users@lists.sf.net
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE.  See the license for more details.
+*/
+#ifdef _MSC_VER
+#if _MSC_VER < 1250
+#pragma warning(disable:4786)
+#endif
+#endif
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <cstdio>
+#include "BatchGenerator.h"
+#include "Generator.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // the generator is built on its own, without xlw, so it gets its
+    // own minimal mutex rather than XlfMutex
+
+    class Mutex
+    {
+    public:
+#ifdef _WIN32
+        Mutex() { InitializeCriticalSection(&cs); }
+        ~Mutex() { DeleteCriticalSection(&cs); }
+        void Lock() { EnterCriticalSection(&cs); }
+        void Unlock() { LeaveCriticalSection(&cs); }
+    private:
+        CRITICAL_SECTION cs;
+#else
+        Mutex() { pthread_mutex_init(&m, 0); }
+        ~Mutex() { pthread_mutex_destroy(&m); }
+        void Lock() { pthread_mutex_lock(&m); }
+        void Unlock() { pthread_mutex_unlock(&m); }
+    private:
+        pthread_mutex_t m;
+#endif
+        Mutex(const Mutex&);
+        Mutex& operator=(const Mutex&);
+    };
+
+    class Lock
+    {
+    public:
+        explicit Lock(Mutex& m_) : m(m_) { m.Lock(); }
+        ~Lock() { m.Unlock(); }
+    private:
+        Mutex& m;
+        Lock(const Lock&);
+        Lock& operator=(const Lock&);
+    };
+
+    typedef unsigned long long HashType;
+
+    // 64 bit FNV-1a, good enough to detect edits and cheap to compute
+    HashType Hash(HashType h, const char* data, size_t size)
+    {
+        for (size_t i=0; i < size; ++i)
+        {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    HashType HashInput(const std::vector<char>& input, const std::string& inputfile, bool clw)
+    {
+        // the file name ends up in the output (include line, library name)
+        // so it is part of the key along with the version and the mode
+        HashType h = 14695981039346656037ULL;
+        std::string key(GeneratorVersion);
+        key += clw ? "|c|" : "|x|";
+        key += inputfile;
+        key += '|';
+        h = Hash(h, key.c_str(), key.size());
+        if (!input.empty())
+            h = Hash(h, &input[0], input.size());
+        return h;
+    }
+
+    std::string HashToString(HashType h)
+    {
+        char buf[17];
+        std::sprintf(buf, "%08lx%08lx", static_cast<unsigned long>(h >> 32), static_cast<unsigned long>(h & 0xffffffffUL));
+        return std::string(buf);
+    }
+
+    struct CacheEntry
+    {
+        std::string hash;
+        std::string outputfile;
+    };
+
+    typedef std::map<std::string, CacheEntry> Cache;
+
+    // one line per input: hash <tab> inputfile <tab> outputfile
+    Cache ReadCache(const std::string& cachefile)
+    {
+        Cache cache;
+        std::ifstream in(cachefile.c_str());
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::string::size_type tab1 = line.find('\t');
+            std::string::size_type tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1+1);
+            if (tab2 == std::string::npos)
+                continue;
+
+            CacheEntry entry;
+            entry.hash = line.substr(0, tab1);
+            entry.outputfile = line.substr(tab2+1);
+            cache[line.substr(tab1+1, tab2-tab1-1)] = entry;
+        }
+        return cache;
+    }
+
+    void WriteCache(const std::string& cachefile, const Cache& cache)
+    {
+        std::ofstream out(cachefile.c_str());
+        if (!out)
+        {
+            std::cerr << "could not write cache file " << cachefile << "\n";
+            return;
+        }
+        for (Cache::const_iterator it = cache.begin(); it != cache.end(); ++it)
+            out << it->second.hash << '\t' << it->first << '\t' << it->second.outputfile << '\n';
+    }
+
+    bool FileExists(const std::string& filename)
+    {
+        std::ifstream f(filename.c_str());
+        return f.good();
+    }
+
+    struct Job
+    {
+        Job() : failed(false), cached(false), written(false) {}
+        std::string inputfile;
+        std::string outputfile;
+        std::string hash;
+        std::string error;
+        bool failed;
+        bool cached;
+        bool written;
+    };
+
+    struct Batch
+    {
+        std::vector<Job> jobs;
+        const Cache* previous;
+        bool clw;
+        size_t next;
+        Mutex queueMutex;
+        Mutex generatorMutex;
+    };
+
+    void RunJob(Batch& batch, Job& job)
+    {
+        try
+        {
+            std::vector<char> input(ReadInputFile(job.inputfile));
+            job.hash = HashToString(HashInput(input, job.inputfile, batch.clw));
+
+            Cache::const_iterator it = batch.previous->find(job.inputfile);
+            if (it != batch.previous->end() &&
+                it->second.hash == job.hash &&
+                it->second.outputfile == job.outputfile &&
+                FileExists(job.outputfile))
+            {
+                job.cached = true;
+                return;
+            }
+
+            std::vector<char> output;
+            {
+                Lock lock(batch.generatorMutex);
+                output = GenerateInterface(input, job.inputfile, batch.clw, false);
+            }
+
+            job.written = WriteIfChanged(job.outputfile, output);
+        }
+        catch (const char *c)
+        {
+            job.failed = true;
+            job.error = c;
+        }
+        catch (std::string c)
+        {
+            job.failed = true;
+            job.error = c;
+        }
+        catch (...)
+        {
+            job.failed = true;
+            job.error = "exception thrown";
+        }
+    }
+
+    void WorkerLoop(Batch& batch)
+    {
+        while (true)
+        {
+            size_t i;
+            {
+                Lock lock(batch.queueMutex);
+                if (batch.next == batch.jobs.size())
+                    return;
+                i = batch.next++;
+            }
+            RunJob(batch, batch.jobs[i]);
+        }
+    }
+
+#ifdef _WIN32
+    unsigned __stdcall WorkerThread(void* arg)
+    {
+        WorkerLoop(*static_cast<Batch*>(arg));
+        return 0;
+    }
+#else
+    void* WorkerThread(void* arg)
+    {
+        WorkerLoop(*static_cast<Batch*>(arg));
+        return 0;
+    }
+#endif
+
+    void RunWorkers(Batch& batch, unsigned long threads)
+    {
+        if (threads > batch.jobs.size())
+            threads = static_cast<unsigned long>(batch.jobs.size());
+
+        // the calling thread is one of the workers
+#ifdef _WIN32
+        std::vector<HANDLE> handles;
+        for (unsigned long t=1; t < threads; ++t)
+        {
+            HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(0, 0, WorkerThread, &batch, 0, 0));
+            if (h)
+                handles.push_back(h);
+        }
+        WorkerLoop(batch);
+        for (size_t t=0; t < handles.size(); ++t)
+        {
+            WaitForSingleObject(handles[t], INFINITE);
+            CloseHandle(handles[t]);
+        }
+#else
+        std::vector<pthread_t> handles;
+        for (unsigned long t=1; t < threads; ++t)
+        {
+            pthread_t h;
+            if (pthread_create(&h, 0, WorkerThread, &batch) == 0)
+                handles.push_back(h);
+        }
+        WorkerLoop(batch);
+        for (size_t t=0; t < handles.size(); ++t)
+            pthread_join(handles[t], 0);
+#endif
+    }
+}
+
+unsigned long DefaultThreadCount()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<unsigned long>(n) : 1;
+#endif
+}
+
+unsigned long GenerateBatch(const std::vector<std::string>& inputfiles,
+                            bool clw,
+                            unsigned long threads,
+                            const std::string& cachefile)
+{
+    Cache cache;
+    if (!cachefile.empty())
+        cache = ReadCache(cachefile);
+
+    Batch batch;
+    batch.previous = &cache;
+    batch.clw = clw;
+    batch.next = 0;
+    batch.jobs.resize(inputfiles.size());
+    for (size_t i=0; i < inputfiles.size(); ++i)
+    {
+        batch.jobs[i].inputfile = inputfiles[i];
+        batch.jobs[i].outputfile = DefaultOutputName(inputfiles[i], clw);
+    }
+
+    RunWorkers(batch, threads > 0 ? threads : 1);
+
+    // report in input order, whatever order the workers finished in
+    unsigned long failures = 0;
+    for (size_t i=0; i < batch.jobs.size(); ++i)
+    {
+        Job& job = batch.jobs[i];
+        if (job.failed)
+        {
+            ++failures;
+            cache.erase(job.inputfile);
+            std::cout << "***ERROR*** " << job.inputfile << "\n" << job.error << "\n";
+            continue;
+        }
+
+        CacheEntry entry;
+        entry.hash = job.hash;
+        entry.outputfile = job.outputfile;
+        cache[job.inputfile] = entry;
+
+        if (job.cached)
+            std::cout << job.inputfile << ": unchanged, skipped\n";
+        else if (job.written)
+            std::cout << job.inputfile << ": written to " << job.outputfile << "\n";
+        else
+            std::cout << job.inputfile << ": regenerated, " << job.outputfile << " is up to date\n";
+    }
+
+    if (!cachefile.empty())
+        WriteCache(cachefile, cache);
+
+    return failures;
+}
@@ -0,0 +1,43 @@
+/*
+ Copyright (C) 2006 Mark Joshi
+
+ This file is part of XLW, a free-software/open-source C++ wrapper of the
+ Excel C API - http://xlw.sourceforge.net/
+
+ XLW is free software: you can redistribute it and/or modify it under the
+ terms of the XLW license.  You should have received a copy of the
+ license along with this program; if not, please email xlw-users@lists.sf.net
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE.  See the license for more details.
+*/
+
+#ifndef BATCH_GENERATOR_H
+#define BATCH_GENERATOR_H
+
+#include <string>
+#include <vector>
+
+/*
+    Multi-file mode of the interface generator.
+
+    Each header is read and hashed (together with the generator version and
+    the output mode) on a pool of worker threads. Headers whose hash matches
+    the cache entry from the previous run, and whose output still exists, are
+    skipped. Everything else is regenerated and only written when the content
+    has changed, so a touched-but-unchanged header doesn't trigger a rebuild.
+
+    The type and include registries are singletons, so the codegen step itself
+    is serialised; reading, hashing, comparing and writing run in parallel.
+*/
+
+unsigned long DefaultThreadCount();
+
+// returns the number of files that failed
+unsigned long GenerateBatch(const std::vector<std::string>& inputfiles,
+                            bool clw,
+                            unsigned long threads,
+                            const std::string& cachefile);
+
+#endif
@@ -0,0 +1,146 @@
+//
+//
+//                                    Generator.cpp
+//
+//
+/*
+ Copyright (C) 2006 Mark Joshi
+
+ This file is part of XLW, a free-software/open-source C++ wrapper of the
+ Excel C API - http://xlw.sourceforge.net/
+
+ XLW is free software: you can redistribute it and/or modify it under the
+ terms of the XLW license.  You should have received a copy of the
+ license along with this program; if not, please email xlw-users@lists.sf.net
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE.  See the license for more details.
+*/
+#ifdef _MSC_VER
+#if _MSC_VER < 1250
+#pragma warning(disable:4786)
+#endif
+#endif
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include "Generator.h"
+#include "Functionizer.h"
+#include "FunctionModel.h"
+#include "FunctionType.h"
+#include "IncludeRegister.h"
+#include "Outputter.h"
+#include "ParserData.h"
+#include "Tokenizer.h"
+#include "Strip.h"
+
+const char* GeneratorVersion = "xlw-4.0.0f0/1";
+
+std::string DefaultOutputName(const std::string& inputfile, bool clw)
+{
+  std::string outputfile;
+  if (clw)
+    outputfile= "clw";
+  else
+    outputfile = "xlw";
+
+  for (unsigned long i=0; i < inputfile.size(); i++)
+  {
+    if (inputfile[i] == '.')
+      break;
+    PushBack(outputfile,inputfile[i]);
+  }
+
+  outputfile += ".cpp";
+  return outputfile;
+}
+
+std::vector<char> ReadInputFile(const std::string& inputfile)
+{
+  std::ifstream input(inputfile.c_str());
+  if (!input)
+    throw("input file not found :"+inputfile+"\n");
+
+  std::vector<char> inputvector((std::istreambuf_iterator<char>(input)),
+                                std::istreambuf_iterator<char>());
+
+  for (std::vector<char>::iterator it = inputvector.begin(); it != inputvector.end(); ++it)
+  {
+    int i = static_cast<int>(*it);
+    if (i<32 && *it!='\n')
+      *it=' '; // strip out special characters
+  }
+
+  return inputvector;
+}
+
+std::vector<char> GenerateInterface(const std::vector<char>& inputvector,
+                                    const std::string& inputfile,
+                                    bool clw,
+                                    bool verbose)
+{
+  // the registry remembers which types the previous file used
+  IncludeRegistry::Instance().ResetUsage();
+
+  std::vector<Token> tokenVector1(Tokenize(inputvector));
+  if (verbose)
+    std::cout << "file has been tokenized\n";
+
+  std::vector<Token> tokenVector2(Strip(tokenVector1));
+  if (verbose)
+    std::cout << "file has been stripped\n";
+
+  std::string LibraryName(inputfile);// use input file name as default library name
+
+  std::vector<FunctionModel> modelVector(ConvertToFunctionModel(tokenVector2,LibraryName));
+
+  if (verbose)
+    std::cout << "file has been function modeled\n";
+
+  std::vector<FunctionDescription> functionVector(FunctionTyper(modelVector));
+
+  if (verbose)
+    std::cout << "file has been function described\n";
+
+  std::vector<char> outputVector;
+
+  if (clw)
+    outputVector = OutputFileCreatorCL(functionVector,
+                                       inputfile);
+  else
+    outputVector = OutputFileCreator(functionVector,
+                                     inputfile,LibraryName);
+
+  if (verbose)
+    std::cout << "new file is a vector\n";
+
+  return outputVector;
+}
+
+bool WriteIfChanged(const std::string& outputfile, const std::vector<char>& outputVector)
+{
+  {
+    // read back in text mode, the same way it was written
+    std::ifstream existing(outputfile.c_str());
+    if (existing)
+    {
+      std::vector<char> current((std::istreambuf_iterator<char>(existing)),
+                                std::istreambuf_iterator<char>());
+      if (current == outputVector)
+        return false;
+    }
+  }
+
+  std::ofstream output(outputfile.c_str());
+  if (!output)
+    throw("output file not created");
+
+  if (!outputVector.empty())
+    output.write(&outputVector[0], static_cast<std::streamsize>(outputVector.size()));
+
+  if (!output)
+    throw("output file not written: "+outputfile);
+
+  return true;
+}
@@ -0,0 +1,45 @@
+/*
+ Copyright (C) 2006 Mark Joshi
+
+ This file is part of XLW, a free-software/open-source C++ wrapper of the
+ Excel C API - http://xlw.sourceforge.net/
+
+ XLW is free software: you can redistribute it and/or modify it under the
+ terms of the XLW license.  You should have received a copy of the
+ license along with this program; if not, please email xlw-users@lists.sf.net
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE.  See the license for more details.
+*/
+
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <string>
+#include <vector>
+
+// bump this whenever the generated code changes for an unchanged header,
+// it is folded into the hash cache so stale outputs get regenerated
+extern const char* GeneratorVersion;
+
+// "xlwFoo.cpp" or "clwFoo.cpp" for "Foo.h"
+std::string DefaultOutputName(const std::string& inputfile, bool clw);
+
+// reads the whole header in one go, control characters other than
+// newlines are replaced by spaces as the tokenizer expects
+std::vector<char> ReadInputFile(const std::string& inputfile);
+
+// tokenize, strip, model and output one header
+// the type and include registries are process wide so calls must not overlap
+std::vector<char> GenerateInterface(const std::vector<char>& input,
+                                    const std::string& inputfile,
+                                    bool clw,
+                                    bool verbose);
+
+// leaves the file (and its timestamp) alone if the content is unchanged,
+// so that make and the IDE don't rebuild the generated source
+// returns true if the file was written
+bool WriteIfChanged(const std::string& outputfile, const std::vector<char>& output);
+
+#endif
@@ -52,3 +52,9 @@ void IncludeRegistry::UseArg(const std::string& arg)
     if (it != ArgUsed.end())
         it->second =true;
 }
+
+void IncludeRegistry::ResetUsage()
+{
+    for (std::map<std::string,bool>::iterator it = ArgUsed.begin(); it!=ArgUsed.end(); ++it)
+        it->second = false;
+}
@@ -41,6 +41,10 @@ public:
     void Register(const std::string& arg, const std::string& include);
     void UseArg(const std::string& arg);
 
+    // forgets which args have been used, so that one process can generate
+    // several files without the includes of one leaking into the next
+    void ResetUsage();
+
     std::set<std::string> GetIncludes() const; 
 
 private:
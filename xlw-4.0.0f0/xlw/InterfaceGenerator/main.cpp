@@ -24,13 +24,9 @@ FOR A PARTICULAR PURPOSE.  See the license for more details.
 #endif
 #include <iostream>
 #include <fstream>
-#include"Functionizer.h"
-#include "FunctionModel.h"
-#include "FunctionType.h"
-#include "Outputter.h"
-#include "ParserData.h"
-#include "Tokenizer.h"
-#include "Strip.h"
+#include <cstdlib>
+#include "BatchGenerator.h"
+#include "Generator.h"
 using namespace std;
 
 
@@ -47,105 +43,79 @@ int main(int argc, char *argv[])
       std::string arg(argv[i]);
       if (arg.size()>0 && arg[0] =='-')
         options.push_back(arg);
+      else if (arg.size()>1 && arg[0] =='@')
+      {
+        // response file, one header per line
+        ifstream list(arg.substr(1).c_str());
+        if (!list)
+          throw("list file not found :"+arg.substr(1)+"\n");
+        std::string line;
+        while (getline(list,line))
+        {
+          if (line.size()>0 && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+          if (line.size()>0)
+            args.push_back(line);
+        }
+      }
       else
         args.push_back(arg);
 
     }
 
-    if (args.size() < 1 || args.size() > 2)
-      throw("usage is inputfile outputfile (outputfile is optional)");
-    std::string inputfile(args[0]);
-
     bool clw = false;
+    bool multi = false;
+    unsigned long threads = 0;
+    std::string cachefile;
 
     for (std::vector<std::string>::const_iterator it = options.begin(); it != options.end(); ++it)
     {
       if (*it == "-c")
         clw = true;
+      else if (*it == "-m")
+        multi = true;
+      else if (it->substr(0,2) == "-j")
+        threads = std::strtoul(it->c_str()+2, 0, 10);
+      else if (it->substr(0,7) == "-cache=")
+        cachefile = it->substr(7);
       else
         std::cerr << "unknown option ignored: " << *it << "\n";
 
     }
 
+    if (multi)
+    {
+      if (args.size() < 1)
+        throw("usage is -m [-c] [-jthreads] [-cache=cachefile] inputfile... (or @listfile)");
+
+      if (threads == 0)
+        threads = DefaultThreadCount();
+
+      unsigned long failures = GenerateBatch(args, clw, threads, cachefile);
+      std::cout << args.size() - failures << " of " << args.size() << " files done\n";
+      return failures > 0 ? 1 : 0;
+    }
+
+    if (args.size() < 1 || args.size() > 2)
+      throw("usage is inputfile outputfile (outputfile is optional)");
+    std::string inputfile(args[0]);
 
     std::string outputfile;
 
     if (args.size()==2)
       outputfile = args[1];
     else
-    {   
-      if (clw)
-        outputfile= "clw"; 
-      else
-        outputfile = "xlw";
+      outputfile = DefaultOutputName(inputfile, clw);
 
-      for (unsigned long i=0; i < inputfile.size(); i++)
-      {
-        if (inputfile[i] == '.')
-          break;
-        PushBack(outputfile,inputfile[i]);
-      }
-
-      outputfile += ".cpp";
-    }
-
-    ifstream input(inputfile.c_str());
-    if (!input)
-      throw("input file not found :"+inputfile+"\n");
-
-    std::vector<char> inputvector;
-
-    char c;
-    while (input.get(c))
-    {
-      int i = static_cast<int>(c);
-      if (i<32 && c!='\n')
-        c=' '; // strip out special characters
-      inputvector.push_back(c);
-    }
+    std::vector<char> inputvector(ReadInputFile(inputfile));
     std::cout << "file has been read in\n";
 
-    std::vector<Token> tokenVector1(Tokenize(inputvector));
-    std::cout << "file has been tokenized\n";
-
-    std::vector<Token> tokenVector2(Strip(tokenVector1));
-    std::cout << "file has been stripped\n";
-
-    std::string LibraryName(inputfile);// use input file name as default library name
-
-    std::vector<FunctionModel> modelVector(ConvertToFunctionModel(tokenVector2,LibraryName));
-
-    std::cout << "file has been function modeled\n";
+    std::vector<char> outputVector(GenerateInterface(inputvector, inputfile, clw, true));
 
-    std::vector<FunctionDescription> functionVector(FunctionTyper(modelVector));
-
-    std::cout << "file has been function described\n";
-
-   
-    std::vector<char> outputVector;
-    
-    if (clw)
-     outputVector = OutputFileCreatorCL(functionVector,  
-                                          inputfile);
+    if (WriteIfChanged(outputfile, outputVector))
+      std::cout << "all done\n";
     else
-      outputVector = OutputFileCreator(functionVector,  
-                                          inputfile,LibraryName);
-
-
-    std::cout << "new file is a vector\n";
-
-    ofstream output(outputfile.c_str());
-    if (!output)
-      throw("output file not created");
-
-    std::vector<char>::const_iterator it= outputVector.begin();
-    while (it != outputVector.end())
-    {
-      output.put(*it);
-      ++it;
-    }
-
-    std::cout << "all done\n";
+      std::cout << "all done, output unchanged\n";
 
   }
   catch (const char *c)
@@ -8,6 +8,7 @@
 #define DISPATCHER_H
 #include <map>
 #include <string>
+#include <vector>
 #include <xlw/CellMatrix.h>
 
 #include <xlw/ArgList.h>
@@ -23,6 +24,15 @@ clw
  typedef xlw::CellMatrix (*FunctionToCall)( xlw::ArgumentList);
 
   
+// outcome of one call in a batch, an exception doesn't stop the others
+struct DispatchResult
+{
+  DispatchResult() : Failed(false) {}
+
+  bool Failed;
+  std::string Error;
+  xlw::CellMatrix Value;
+};
   
 class Dispatcher
 {
@@ -36,6 +46,12 @@ public:
 
   xlw::CellMatrix CallFunction(const xlw::ArgumentList&) const;
 
+  // runs the calls on the given number of threads (0 for one per processor),
+  // idle threads steal work from busy ones, results are in input order
+  // the registered functions must be safe to call concurrently
+  std::vector<DispatchResult> CallFunctions(const std::vector<xlw::ArgumentList>& args,
+                                            unsigned long threads) const;
+
   void RegisterFunction(std::string FunctionId, FunctionToCall);
 
 
@@ -44,6 +60,8 @@ private:
   Dispatcher(){}
   Dispatcher(const Dispatcher&){}
 
+  FunctionToCall Find(const std::string& id) const;
+
   std::map<std::string, FunctionToCall> DispatchMap;
 
   std::string KnownFunctions;
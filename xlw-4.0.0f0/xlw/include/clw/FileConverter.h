@@ -7,13 +7,38 @@
 #ifndef FILE_CONVERTER_H
 #define FILE_CONVERTER_H
 
+#include <string>
 #include <vector>
 #include <xlw/ArgList.h>
 
 namespace clw
 {
+  // blocks of rows separated by at least gapSize empty rows each become an
+  // argument list; cells are comma separated, numbers are recognised as such
   std::vector<xlw::ArgumentList> FileConversion(const std::vector<char>& inputFile,
     unsigned long gapSize);
+
+  // receives each argument list as soon as its block has been parsed
+  class ArgumentListSink
+  {
+  public:
+    virtual ~ArgumentListSink() {}
+    virtual void Receive(const xlw::ArgumentList& args) = 0;
+  };
+
+  void FileConversion(const char* begin, const char* end,
+    unsigned long gapSize, ArgumentListSink& sink);
+
+  // reads the file in chunks, so only the block being parsed is held in memory
+  void FileConversion(const std::string& fileName,
+    unsigned long gapSize, ArgumentListSink& sink);
+
+  // parses the file and calls the Dispatcher on each block as soon as it is
+  // read, on the given number of worker threads, so the registered functions
+  // must be safe to call concurrently when threads > 1
+  // results are in file order, a block that threw gets the error message
+  std::vector<xlw::CellMatrix> DispatchFile(const std::string& fileName,
+    unsigned long gapSize, unsigned long threads);
 }
 
 #endif
@@ -0,0 +1,84 @@
+//
+//
+//                    WorkerThreads.h
+//
+//
+
+#ifndef WORKER_THREADS_H
+#define WORKER_THREADS_H
+
+namespace clw
+{
+  // the minimum needed to run clw work on several threads
+  // the platform's types are kept in WorkerThreads.cpp, so that including
+  // this header doesn't bring in windows.h or pthread.h
+
+  class Mutex
+  {
+  public:
+    Mutex();
+    ~Mutex();
+    void Lock();
+    void Unlock();
+
+  private:
+    struct Impl;
+    Impl* impl;
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+  };
+
+  class Lock
+  {
+  public:
+    explicit Lock(Mutex& m_) : m(m_) { m.Lock(); }
+    ~Lock() { m.Unlock(); }
+
+  private:
+    Mutex& m;
+    Lock(const Lock&);
+    Lock& operator=(const Lock&);
+  };
+
+  class Semaphore
+  {
+  public:
+    explicit Semaphore(unsigned long initial);
+    ~Semaphore();
+    void Wait();
+    void Post();
+
+  private:
+    struct Impl;
+    Impl* impl;
+    Semaphore(const Semaphore&);
+    Semaphore& operator=(const Semaphore&);
+  };
+
+  unsigned long HardwareThreads();
+
+  // threads each running work(arg), waited for by Join or on destruction
+  class ThreadGroup
+  {
+  public:
+    ThreadGroup(void (*work)(void*), void* arg);
+    ~ThreadGroup();
+
+    // returns how many of the threads could actually be started
+    unsigned long Start(unsigned long threads);
+    void Join();
+
+  private:
+    struct Impl;
+    Impl* impl;
+    ThreadGroup(const ThreadGroup&);
+    ThreadGroup& operator=(const ThreadGroup&);
+  };
+
+  // runs work(arg) on the given number of threads, the calling thread
+  // being one of them, and returns when they have all finished
+  // returns how many threads ran it, which is 1 if none could be started
+  unsigned long RunOnThreads(unsigned long threads, void (*work)(void*), void* arg);
+}
+
+#endif
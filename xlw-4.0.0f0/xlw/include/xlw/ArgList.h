@@ -32,6 +32,10 @@ namespace xlw {
 
     void MakeLowerCase(std::string& input);
 
+    // argument names are case insensitive, so adding or parsing a name that
+    // differs only in case from one already present throws "Same argument name
+    // used twice"; parsed input throws if one argument's data reaches into cells
+    // another has already used
     class ArgumentList
     {
     public:
@@ -100,26 +104,45 @@ namespace xlw {
 
     private:
 
+        // one entry per argument, in insertion order, parallel to ArgumentNames
+        // vector, matrix, cells and list values are not copied out when parsing,
+        // they are views into Cells and only materialised when asked for
+        struct Argument
+        {
+            bool Used;
+            double Number;
+            bool Boolean;
+            std::string String;
+            size_t Top;
+            size_t Left;
+            size_t Rows;
+            size_t Columns;
+        };
+
         std::string StructureName;
 
         std::vector<std::pair<std::string, ArgumentType> > ArgumentNames;
-        std::map<std::string,double> DoubleArguments;
-        std::map<std::string,MyArray> ArrayArguments;
-        std::map<std::string,MyMatrix> MatrixArguments;
-        std::map<std::string,std::string> StringArguments;
-        std::map<std::string,CellMatrix> ListArguments;
+        std::vector<Argument> Arguments;
 
+        // open addressing, linear probing, case insensitive on the name
+        // a slot holds the argument index plus one, zero means empty
+        std::vector<size_t> Index;
 
-        std::map<std::string,CellMatrix> CellArguments;
-        std::map<std::string,bool> BoolArguments;
+        // the parsed input, with anything added as a block appended at the bottom
+        CellMatrix Cells;
 
-        std::map<std::string,ArgumentType> Names;
+        void Parse(const CellMatrix& cells, size_t top, size_t left,
+                   size_t rows, size_t columns, const std::string& ErrorId);
 
-        std::map<std::string,bool> ArgumentsUsed;
+        size_t Find(const std::string& ArgumentName) const;
+        const Argument& Use(const std::string& ArgumentName, ArgumentType type, const char* description);
 
-        void GenerateThrow(std::string message, size_t row, size_t column);
-        void UseArgumentName(const std::string& ArgumentName); // private as no error checking performed
-        void RegisterName(const std::string& ArgumentName, ArgumentType type);
+        void GenerateThrow(const std::string& message, size_t row, size_t column) const;
+        Argument& RegisterName(const std::string& ArgumentName, ArgumentType type);
+        void RegisterBlock(const std::string& ArgumentName, ArgumentType type, const CellMatrix& values);
+        void RegisterView(const std::string& ArgumentName, ArgumentType type,
+                          size_t top, size_t left, size_t rows, size_t columns);
+        CellMatrix View(const Argument& argument) const;
     };
 
 }
@@ -109,6 +109,8 @@ namespace xlw {
 
         void PushBottom(const CellMatrix& newRows);
 
+        void swap(CellMatrix& other);
+
     private:
 
         std::vector<std::vector<CellValue> > Cells;
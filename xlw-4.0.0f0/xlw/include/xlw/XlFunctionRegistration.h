@@ -100,6 +100,42 @@ namespace xlw {
     };
 
 
+    // A command (a macro taking no arguments), optionally run by Excel on the
+    // given events (xlEventCalculationEnded etc.). Events need Excel 2010; where
+    // xlEventRegister fails, the command is still registered.
+    class XLCommandRegistrationData
+    {
+    public:
+        XLCommandRegistrationData(const std::string& CommandName_,
+                         const std::string& ExcelCommandName_,
+                         const std::string& CommandDescription_,
+                         const int Events_[],
+                         int NoOfEvents_);
+
+        std::string GetCommandName() const;
+        std::string GetExcelCommandName() const;
+        std::string GetCommandDescription() const;
+        std::vector<int> GetEvents() const;
+
+    private:
+        std::string CommandName;
+        std::string ExcelCommandName;
+        std::string CommandDescription;
+        std::vector<int> Events;
+    };
+
+    class XLCommandRegistrationHelper
+    {
+    public:
+
+        XLCommandRegistrationHelper(const std::string& CommandName,
+                         const std::string& ExcelCommandName,
+                         const std::string& CommandDescription,
+                         const int Events[] = 0,
+                         int NoOfEvents = 0);
+    };
+
+
     // singleton pattern, cf the Factory
     class ExcelFunctionRegistrationRegistry
     {
@@ -109,12 +145,14 @@ namespace xlw {
 
         void DoTheRegistrations() const;
         void AddFunction(const XLFunctionRegistrationData&);
+        void AddCommand(const XLCommandRegistrationData&);
 
     private:
         ExcelFunctionRegistrationRegistry();
         ExcelFunctionRegistrationRegistry(const ExcelFunctionRegistrationRegistry& original);
 
         std::list<XLFunctionRegistrationData> RegistrationData;
+        std::list<XLCommandRegistrationData> CommandRegistrationData;
 
     };
 
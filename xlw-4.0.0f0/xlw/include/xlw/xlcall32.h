@@ -383,6 +383,12 @@ int pascal Excel12v(int xlfn, LPXLOPER12 operRes, int count, LPXLOPER12 opers[])
 /* GetFooInfo are valid only for calls to LPenHelper */
 #define xlGetFmlaInfo    (14 | xlSpecial)
 #define xlGetMouseInfo    (15 | xlSpecial)
+/* Excel 2010 */
+#define xlEventRegister  (17 | xlSpecial)
+
+/* xlEventRegister events */
+#define xlEventCalculationEnded     1
+#define xlEventCalculationCanceled  2
 
 /* edit modes */
 #define xlModeReady    0    // not in edit mode
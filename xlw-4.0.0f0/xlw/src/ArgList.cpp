@@ -22,6 +22,7 @@
 
 #include <xlw/ArgList.h>
 #include <algorithm>
+#include <cctype>
 #include <sstream>
 
 namespace
@@ -31,6 +32,100 @@ namespace
     {
         return i > j ? i : j;
     }
+
+    size_t HashName(const std::string& name)
+    {
+        // FNV-1a on the lower cased characters
+        size_t h = 2166136261U;
+        for (size_t i=0; i < name.size(); i++)
+        {
+            h ^= static_cast<size_t>(tolower(static_cast<unsigned char>(name[i])));
+            h *= 16777619U;
+        }
+        return h;
+    }
+
+    bool SameName(const std::string& a, const std::string& b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i=0; i < a.size(); i++)
+            if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        return true;
+    }
+
+    // the order AllData has always written the argument types in
+    int TypeRank(xlw::ArgumentList::ArgumentType type)
+    {
+        switch (type)
+        {
+        case xlw::ArgumentList::number:  return 0;
+        case xlw::ArgumentList::vector:  return 1;
+        case xlw::ArgumentList::matrix:  return 2;
+        case xlw::ArgumentList::string:  return 3;
+        case xlw::ArgumentList::boolean: return 4;
+        case xlw::ArgumentList::cells:   return 5;
+        default:                         return 6;
+        }
+    }
+
+    class AllDataOrder
+    {
+    public:
+        explicit AllDataOrder(const std::vector<std::pair<std::string, xlw::ArgumentList::ArgumentType> >& names_)
+            : names(names_) {}
+
+        bool operator()(size_t i, size_t j) const
+        {
+            int ri = TypeRank(names[i].second);
+            int rj = TypeRank(names[j].second);
+            if (ri != rj)
+                return ri < rj;
+            return names[i].first < names[j].first;
+        }
+
+    private:
+        const std::vector<std::pair<std::string, xlw::ArgumentList::ArgumentType> >& names;
+    };
+
+    // the part of the input being parsed, cells are marked as they are consumed
+    // rather than cleared so the input never has to be copied
+    class Region
+    {
+    public:
+        Region(const xlw::CellMatrix& cells_, size_t top_, size_t left_, size_t rows_, size_t columns_)
+            : cells(cells_), top(top_), left(left_), rows(rows_), columns(columns_), consumed(rows_*columns_, false) {}
+
+        const xlw::CellValue& operator()(size_t i, size_t j) const
+        {
+            return cells(top+i, left+j);
+        }
+
+        bool IsFree(size_t i, size_t j) const
+        {
+            return consumed[i*columns+j] || cells(top+i, left+j).IsEmpty();
+        }
+
+        bool IsConsumed(size_t i, size_t j) const
+        {
+            return consumed[i*columns+j];
+        }
+
+        void Consume(size_t i, size_t j)
+        {
+            consumed[i*columns+j] = true;
+        }
+
+        const xlw::CellMatrix& cells;
+        size_t top;
+        size_t left;
+        size_t rows;
+        size_t columns;
+
+    private:
+        std::vector<bool> consumed;
+    };
 }
 
 void xlw::MakeLowerCase(std::string& input)
@@ -55,131 +150,40 @@ std::string ConvertToString(unsigned long Number)
 }
 
 
-xlw::CellMatrix ExtractCells(xlw::CellMatrix& cells,
-                        size_t row,
-                        size_t column,
-                        std::string ErrorId,
-                        std::string thisName,
-                        bool nonNumeric)
-{
-    if (!cells(row,column).IsANumber())
-        throw(ErrorId+" "+thisName+" rows and columns expected.");
-    if (cells.ColumnsInStructure() <= column+1)
-        throw(ErrorId+" "+thisName+" rows and columns expected.");
-    if (!cells(row,column+1).IsANumber())
-        throw(ErrorId+" "+thisName+" rows and columns expected.");
-
-    unsigned long numberRows_UL = cells(row,column);
-    unsigned long numberColumns_UL = cells(row,column+1);
-
-	size_t numberRows = static_cast<size_t>(numberRows_UL);
-    size_t numberColumns = static_cast<size_t>(numberColumns_UL);
-
-    cells(row,column).clear();
-    cells(row,column+1).clear();
-
-    xlw::CellMatrix result(numberRows,numberColumns);
-
-    if (numberRows +row+1>cells.RowsInStructure())
-        throw(ErrorId+" "+thisName+" insufficient rows in structure");
-
-    if (numberColumns +column>cells.ColumnsInStructure())
-        throw(ErrorId+" "+thisName+" insufficient columns in structure");
-
-    for (size_t i=0; i < numberRows; i++)
-        for (size_t j=0; j < numberColumns; j++)
-        {
-            result(i,j) = cells(row+1+i,column+j);
-            cells(row+1+i,column+j).clear();
-
-            if (!result(i,j).IsANumber())
-                nonNumeric = true;
-        }
-
-
-    return result;
-
-
-}
-
-
 void xlw::ArgumentList::add(const std::string& ArgumentName, const std::string& value)
 {
-    ArgumentType thisOne = string;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-
-    std::pair<std::string,std::string> valuePair(ArgumentName,value);
-    StringArguments.insert(valuePair);
-
-    RegisterName(ArgumentName, thisOne);
+    RegisterName(ArgumentName, string).String = value;
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, double value)
 {
-    ArgumentType thisOne = number;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-
-    std::pair<std::string,double> valuePair(ArgumentName,value);
-    DoubleArguments.insert(valuePair);
-
-    RegisterName(ArgumentName, thisOne);
-
+    RegisterName(ArgumentName, number).Number = value;
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, const MyArray& value)
 {
-    ArgumentType thisOne = vector;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-    ArrayArguments.insert(std::make_pair(ArgumentName,value));
-
-    RegisterName(ArgumentName, thisOne);
+    RegisterBlock(ArgumentName, vector, CellMatrix(value));
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, const MyMatrix& value)
 {
-    ArgumentType thisOne = matrix;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-    MatrixArguments.insert(std::make_pair(ArgumentName,value));
-
-    RegisterName(ArgumentName, thisOne);
+    RegisterBlock(ArgumentName, matrix, CellMatrix(value));
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, bool value)
 {
-    ArgumentType thisOne = boolean;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-    BoolArguments.insert(std::make_pair(ArgumentName,value));
-
-    RegisterName(ArgumentName, thisOne);
-
+    RegisterName(ArgumentName, boolean).Boolean = value;
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, const CellMatrix& values)
 {
-    ArgumentType thisOne = cells;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-    CellArguments.insert(std::make_pair(ArgumentName,values));
-
-    RegisterName(ArgumentName, thisOne);
-
+    RegisterBlock(ArgumentName, cells, values);
 }
 
 
 void xlw::ArgumentList::addList(const std::string& ArgumentName, const CellMatrix& values)
 {
-    ArgumentType thisOne = list;
-    std::pair<std::string, ArgumentType> thisPair(ArgumentName,thisOne);
-    ArgumentNames.push_back(thisPair);
-    ListArguments.insert(std::make_pair(ArgumentName,values));
-
-
-    RegisterName(ArgumentName, thisOne);
+    RegisterBlock(ArgumentName, list, values);
 }
 
 void xlw::ArgumentList::add(const std::string& ArgumentName, const ArgumentList& values)
@@ -191,35 +195,37 @@ void xlw::ArgumentList::add(const std::string& ArgumentName, const ArgumentList&
 xlw::ArgumentList::ArgumentList(CellMatrix cells,
                            std::string ErrorId)
 {
-    CellValue empty;
-    size_t rows = cells.RowsInStructure();
-    size_t columns = cells.ColumnsInStructure();
+    Cells.swap(cells);
+    Parse(Cells, 0, 0, Cells.RowsInStructure(), Cells.ColumnsInStructure(), ErrorId);
+}
 
+// one pass over the input: each row band is checked for stray data as soon
+// as the arguments starting on it have been read, and blocks are recorded
+// as views into cells rather than copied out
+// error messages are only put together when something is actually wrong
+void xlw::ArgumentList::Parse(const CellMatrix& input,
+                              size_t top,
+                              size_t left,
+                              size_t rows,
+                              size_t columns,
+                              const std::string& ErrorId)
+{
     if (rows == 0)
         throw(std::string("Argument List requires non empty cell matix ")+ErrorId);
 
-    //if (!cells(0,0).IsAString())
-    if (!cells(0,0).IsAString() && !cells(0,0).IsAWstring())//FIXME
+    Region region(input, top, left, rows, columns);
+
+    if (!region(0,0).IsAString() && !region(0,0).IsAWstring())//FIXME
         throw(std::string("a structure name must be specified for argument list class ")+ErrorId);
-    else
-    {
-        StructureName = cells(0,0).StringValueLowerCase();
-        cells(0,0) = empty;
-    }
 
+    StructureName = region(0,0).StringValueLowerCase();
+    region.Consume(0,0);
 
     {for (size_t i=1; i < columns; i++)
-        if (!cells(0,i).IsEmpty() )
+        if (!region(0,i).IsEmpty() )
             throw("An argument list should only have the structure name on the first line: "+StructureName+ " " + ErrorId);
     }
 
-    ErrorId +=" "+StructureName;
-
-    {for (size_t i=1; i < rows; i++)
-        for (size_t j=0; j < columns; j++)
-            if (cells(i,j).IsError())
-                GenerateThrow("Error Cell passed in ",i,j);}
-
     size_t row=1UL;
 
     while (row < rows)
@@ -229,12 +235,12 @@ xlw::ArgumentList::ArgumentList(CellMatrix cells,
 
         while (column < columns)
         {
-            if (cells(row,column).IsEmpty())
+            if (region.IsFree(row,column))
             {
                 // check nothing else in row
                 while (column< columns)
                 {
-                    if (!cells(row,column).IsEmpty())
+                    if (!region.IsFree(row,column))
                         GenerateThrow("data or value where unexpected.",row, column);
 
                     ++column;
@@ -242,11 +248,16 @@ xlw::ArgumentList::ArgumentList(CellMatrix cells,
             }
             else // we have data
             {
-                //if (!cells(row,column).IsAString())
-                if (!cells(row,column).IsAString() && !cells(row,column).IsAWstring())//FIXME
+                const CellValue& nameCell = region(row,column);
+
+                if (!nameCell.IsAString() && !nameCell.IsAWstring())//FIXME
+                {
+                    if (nameCell.IsError())
+                        GenerateThrow("Error Cell passed in ", row, column);
                     GenerateThrow("data  where name expected.", row, column);
+                }
 
-                std::string thisName(cells(row,column).StringValueLowerCase());
+                std::string thisName(nameCell.StringValueLowerCase());
 
                 if (thisName =="")
                     GenerateThrow("empty name not permissible.", row, column);
@@ -254,103 +265,129 @@ xlw::ArgumentList::ArgumentList(CellMatrix cells,
                 if (rows == row+1)
                     GenerateThrow("No space where data expected below name", row, column);
 
-                cells(row,column).clear();
-                // weird syntax to satisfy VC6
-                //CellValue* belowPtr = &cells(row+1,column);
-                //CellValue& cellBelow = *belowPtr;
-                CellValue& cellBelow = cells(row+1,column);
+                region.Consume(row,column);
 
-                if (cellBelow.IsEmpty())
+                if (region.IsFree(row+1,column))
                     GenerateThrow("Data expected below name", row, column);
 
+                const CellValue& cellBelow = region(row+1,column);
+
+                if (cellBelow.IsError())
+                    GenerateThrow("Error Cell passed in ", row+1, column);
+
+                region.Consume(row+1,column);
+
                 if (cellBelow.IsANumber())
                 {
                     add(thisName, cellBelow.NumericValue());
-
                     column++;
-
-                    cellBelow=empty;
                 }
                 else
                     if (cellBelow.IsBoolean())
                     {
                         add(thisName, cellBelow.BooleanValue());
-
                         column++;
-
-                        cellBelow=empty;
                     }
                     else // ok it's a string
                     {
                         std::string stringVal = cellBelow.StringValueLowerCase();
 
-                        if ( (cellBelow.StringValueLowerCase() == "list") ||
-                            (cellBelow.StringValueLowerCase() == "matrix") ||
-                            (cellBelow.StringValueLowerCase() == "cells") )
+                        if (stringVal == "list" || stringVal == "matrix" || stringVal == "cells")
                         {
-                            bool nonNumeric = false;
-                            CellMatrix extracted(ExtractCells(cells,row+2,column,ErrorId,thisName,nonNumeric));
+                            size_t dimensionsRow = row+2;
 
+                            if (dimensionsRow >= rows ||
+                                columns <= column+1 ||
+                                region.IsConsumed(dimensionsRow,column) ||
+                                region.IsConsumed(dimensionsRow,column+1) ||
+                                !region(dimensionsRow,column).IsANumber() ||
+                                !region(dimensionsRow,column+1).IsANumber())
+                                throw(ErrorId+" "+StructureName+" "+thisName+" rows and columns expected.");
 
-                            if (cellBelow.StringValueLowerCase() == "list")
-                            {
-                                ArgumentList value(extracted,ErrorId+":"+thisName);
+                            size_t numberRows = static_cast<size_t>(static_cast<unsigned long>(region(dimensionsRow,column)));
+                            size_t numberColumns = static_cast<size_t>(static_cast<unsigned long>(region(dimensionsRow,column+1)));
 
-                                addList(thisName, extracted); //note not value
+                            region.Consume(dimensionsRow,column);
+                            region.Consume(dimensionsRow,column+1);
 
-                            }
+                            if (numberRows+dimensionsRow+1 > rows)
+                                throw(ErrorId+" "+StructureName+" "+thisName+" insufficient rows in structure");
 
-                            if (cellBelow.StringValueLowerCase() == "cells")
-                            {
-                                add(thisName,extracted);
-                            }
+                            if (numberColumns+column > columns)
+                                throw(ErrorId+" "+StructureName+" "+thisName+" insufficient columns in structure");
+
+                            bool nonNumeric = false;
 
+                            for (size_t i=0; i < numberRows; i++)
+                                for (size_t j=0; j < numberColumns; j++)
+                                {
+                                    size_t r = dimensionsRow+1+i;
+                                    size_t c = column+j;
 
-                            if (cellBelow.StringValueLowerCase() == "matrix")
-                            {
-                                if (nonNumeric)
-                                    throw("Non numerical value in matrix argument :"+thisName+ " "+ErrorId);
+                                    if (region.IsConsumed(r,c))
+                                        GenerateThrow("overlapping data.", r, c);
 
-                                MyMatrix value(extracted.RowsInStructure(),extracted.ColumnsInStructure());
+                                    const CellValue& value = region(r,c);
 
-                                for (size_t i=0; i < extracted.RowsInStructure(); i++)
-                                    for (size_t j=0; j < extracted.ColumnsInStructure(); j++)
-                                        ChangingElement(value,i,j) = extracted(i,j);
+                                    if (value.IsError())
+                                        GenerateThrow("Error Cell passed in ", r, c);
 
-                                add(thisName,value);
+                                    if (!value.IsANumber())
+                                        nonNumeric = true;
 
+                                    region.Consume(r,c);
+                                }
+
+                            if (stringVal == "list")
+                            {
+                                // validated in place, the copy is only made when it's asked for
+                                ArgumentList value("");
+                                value.Parse(input, top+dimensionsRow+1, left+column, numberRows, numberColumns,
+                                            ErrorId+" "+StructureName+":"+thisName);
                             }
 
-                            cellBelow = empty;
-                            rowsDown = maxi(rowsDown,extracted.RowsInStructure()+2);
-                            column+= extracted.ColumnsInStructure();
+                            if (stringVal == "matrix" && nonNumeric)
+                                throw("Non numerical value in matrix argument :"+thisName+ " "+ErrorId+" "+StructureName);
+
+                            ArgumentType type = stringVal == "list" ? list : (stringVal == "matrix" ? matrix : cells);
+                            RegisterView(thisName, type, top+dimensionsRow+1, left+column, numberRows, numberColumns);
+
+                            rowsDown = maxi(rowsDown,numberRows+2);
+                            column+= numberColumns;
                         }
                         else // ok it's an array or boring string
                         {
-                            if (cellBelow.StringValueLowerCase() == "array"
-                                ||cellBelow.StringValueLowerCase() == "vector" )
+                            if (stringVal == "array" || stringVal == "vector" )
                             {
-                                cellBelow.clear();
-
                                 if (row+2>= rows)
-                                    throw(ErrorId+" data expected below array "+thisName);
+                                    throw(ErrorId+" "+StructureName+" data expected below array "+thisName);
 
-                                size_t size = static_cast<size_t>((unsigned long)cells(row+2,column));
-                                cells(row+2,column).clear();
-
-                                if (row+2+size>=rows)
-                                    throw(ErrorId+" more data expected below array "+thisName);
+                                if (region.IsConsumed(row+2,column) || !region(row+2,column).IsANumber())
+                                    throw(ErrorId+" "+StructureName+" size expected below array "+thisName);
 
+                                size_t size = static_cast<size_t>(static_cast<unsigned long>(region(row+2,column)));
+                                region.Consume(row+2,column);
 
-                                MyArray theArray(size);
+                                if (row+2+size>=rows)
+                                    throw(ErrorId+" "+StructureName+" more data expected below array "+thisName);
 
                                 for (size_t i=0; i < size; i++)
                                 {
-                                    theArray[i] = cells(row+3+i,column);
-                                    cells(row+3+i,column).clear();
+                                    size_t r = row+3+i;
+
+                                    if (region.IsConsumed(r,column))
+                                        GenerateThrow("overlapping data.", r, column);
+
+                                    if (region(r,column).IsError())
+                                        GenerateThrow("Error Cell passed in ", r, column);
+
+                                    if (!region(r,column).IsANumber())
+                                        GenerateThrow("non numerical value in array "+thisName, r, column);
+
+                                    region.Consume(r,column);
                                 }
 
-                                add(thisName,theArray);
+                                RegisterView(thisName, vector, top+row+3, left+column, size, 1);
 
                                 rowsDown = maxi(rowsDown,size+2);
 
@@ -358,11 +395,8 @@ xlw::ArgumentList::ArgumentList(CellMatrix cells,
                             }
                             else
                             {
-                                std::string value = cellBelow.StringValueLowerCase();
-                                add(thisName,value);
+                                add(thisName,stringVal);
                                 column++;
-
-                                cellBelow=empty;
                             }
                         }
 
@@ -370,165 +404,200 @@ xlw::ArgumentList::ArgumentList(CellMatrix cells,
             }
 
         }
+
+        // nothing below can reach back into this band, so anything in it
+        // that hasn't been consumed by now is extraneous
+        size_t bandEnd = std::min(row+rowsDown+1, rows);
+        for (size_t i=row; i < bandEnd; i++)
+            for (size_t j=0; j < columns; j++)
+                if (!region.IsFree(i,j))
+                {
+                    if (region(i,j).IsError())
+                        GenerateThrow("Error Cell passed in ",i,j);
+                    GenerateThrow("extraneous data "+ErrorId+" "+StructureName,i,j);
+                }
+
         row+=rowsDown+1;
 
     }
-
-    {for (size_t i=0; i < rows; i++)
-        for (size_t j=0; j < columns; j++)
-            if (!cells(i,j).IsEmpty())
-            {
-               GenerateThrow("extraneous data "+ErrorId,i,j);
-    }}
 }
 
-void xlw::ArgumentList::RegisterName(const std::string& ArgumentName, ArgumentType type)
+size_t xlw::ArgumentList::Find(const std::string& ArgumentName) const
 {
-    ArgumentNames.push_back(std::make_pair(ArgumentName,type));
-    if (!(Names.insert(*ArgumentNames.rbegin()).second) )
-                throw("Same argument name used twice "+ArgumentName);
+    if (Index.empty())
+        return Arguments.size();
 
-    ArgumentsUsed.insert(std::pair<std::string,bool>(ArgumentName,false));
+    size_t mask = Index.size()-1;
+    for (size_t slot = HashName(ArgumentName) & mask; Index[slot] != 0; slot = (slot+1) & mask)
+        if (SameName(ArgumentNames[Index[slot]-1].first, ArgumentName))
+            return Index[slot]-1;
 
+    return Arguments.size();
 }
 
-std::string xlw::ArgumentList::GetStructureName() const
+xlw::ArgumentList::Argument& xlw::ArgumentList::RegisterName(const std::string& ArgumentName, ArgumentType type)
 {
-    return StructureName;
-}
+    if (Find(ArgumentName) != Arguments.size())
+        throw("Same argument name used twice "+ArgumentName);
 
-const std::vector<std::pair<std::string, xlw::ArgumentList::ArgumentType> >& xlw::ArgumentList::GetArgumentNamesAndTypes() const
-{
-    return ArgumentNames;
+    // keep the load factor at or below a half
+    if (2*(Arguments.size()+1) > Index.size())
+    {
+        size_t capacity = maxi(size_t(8), 2*Index.size());
+        Index.assign(capacity, 0);
+        for (size_t i=0; i < ArgumentNames.size(); i++)
+        {
+            size_t slot = HashName(ArgumentNames[i].first) & (capacity-1);
+            while (Index[slot] != 0)
+                slot = (slot+1) & (capacity-1);
+            Index[slot] = i+1;
+        }
+    }
+
+    size_t slot = HashName(ArgumentName) & (Index.size()-1);
+    while (Index[slot] != 0)
+        slot = (slot+1) & (Index.size()-1);
+
+    ArgumentNames.push_back(std::make_pair(ArgumentName,type));
+    Arguments.push_back(Argument());
+    Index[slot] = Arguments.size();
+
+    Argument& argument = Arguments.back();
+    argument.Used = false;
+    argument.Number = 0.0;
+    argument.Boolean = false;
+    argument.Top = argument.Left = argument.Rows = argument.Columns = 0;
+    return argument;
 }
 
-void xlw::ArgumentList::UseArgumentName(const std::string& ArgumentName)
+void xlw::ArgumentList::RegisterView(const std::string& ArgumentName, ArgumentType type,
+                                     size_t top, size_t left, size_t rows, size_t columns)
 {
-    std::map<std::string,bool>::iterator it= ArgumentsUsed.find(ArgumentName);
-    it->second =true;
+    Argument& argument = RegisterName(ArgumentName, type);
+    argument.Top = top;
+    argument.Left = left;
+    argument.Rows = rows;
+    argument.Columns = columns;
 }
 
-std::string xlw::ArgumentList::GetStringArgumentValue(const std::string& ArgumentName_)
+void xlw::ArgumentList::RegisterBlock(const std::string& ArgumentName, ArgumentType type, const CellMatrix& values)
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, std::string>::const_iterator it = StringArguments.find(ArgumentName);
-
-    if (it == StringArguments.end())
-        throw(StructureName+std::string(" unknown string argument asked for :")+ArgumentName);
-
-    UseArgumentName(ArgumentName);
+    // check the name before the values are appended
+    if (Find(ArgumentName) != Arguments.size())
+        throw("Same argument name used twice "+ArgumentName);
 
-    return it->second;
+    size_t top = Cells.RowsInStructure();
+    Cells.PushBottom(values);
+    RegisterView(ArgumentName, type, top, 0, values.RowsInStructure(), values.ColumnsInStructure());
+}
 
+xlw::CellMatrix xlw::ArgumentList::View(const Argument& argument) const
+{
+    CellMatrix result(argument.Rows, argument.Columns);
+    for (size_t i=0; i < argument.Rows; i++)
+        for (size_t j=0; j < argument.Columns; j++)
+            result(i,j) = Cells(argument.Top+i, argument.Left+j);
+    return result;
 }
 
-unsigned long xlw::ArgumentList::GetULArgumentValue(const std::string& ArgumentName_)
+const xlw::ArgumentList::Argument& xlw::ArgumentList::Use(const std::string& ArgumentName,
+                                                         ArgumentType type,
+                                                         const char* description)
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, double>::const_iterator it = DoubleArguments.find(ArgumentName);
+    size_t i = Find(ArgumentName);
 
-    if (it == DoubleArguments.end())
-        throw(StructureName+std::string(" unknown unsigned long argument asked for :")+ArgumentName);
+    if (i == Arguments.size() || ArgumentNames[i].second != type)
+    {
+        std::string name(ArgumentName);
+        MakeLowerCase(name);
+        throw(StructureName+" unknown "+description+" argument asked for :"+name);
+    }
 
-    UseArgumentName(ArgumentName);
-    return static_cast<unsigned long>(it->second);
+    Arguments[i].Used = true;
+    return Arguments[i];
 }
-double xlw::ArgumentList::GetDoubleArgumentValue(const std::string& ArgumentName_)
-{
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, double>::const_iterator it = DoubleArguments.find(ArgumentName);
-
-    if (it == DoubleArguments.end())
-        throw(StructureName+std::string(" unknown double argument asked for :")+ArgumentName);
 
-    UseArgumentName(ArgumentName);
-    return it->second;
+std::string xlw::ArgumentList::GetStructureName() const
+{
+    return StructureName;
 }
-xlw::MyArray xlw::ArgumentList::GetArrayArgumentValue(const std::string& ArgumentName_)
+
+const std::vector<std::pair<std::string, xlw::ArgumentList::ArgumentType> >& xlw::ArgumentList::GetArgumentNamesAndTypes() const
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, MyArray>::const_iterator it = ArrayArguments.find(ArgumentName);
+    return ArgumentNames;
+}
 
-    if (it == ArrayArguments.end())
-        throw(StructureName+std::string(" unknown array argument asked for :")+ArgumentName);
+std::string xlw::ArgumentList::GetStringArgumentValue(const std::string& ArgumentName)
+{
+    return Use(ArgumentName, string, "string").String;
+}
 
-    UseArgumentName(ArgumentName);
-    return it->second;
+unsigned long xlw::ArgumentList::GetULArgumentValue(const std::string& ArgumentName)
+{
+    return static_cast<unsigned long>(Use(ArgumentName, number, "unsigned long").Number);
+}
 
+double xlw::ArgumentList::GetDoubleArgumentValue(const std::string& ArgumentName)
+{
+    return Use(ArgumentName, number, "double").Number;
 }
 
-xlw::MyMatrix xlw::ArgumentList::GetMatrixArgumentValue(const std::string& ArgumentName_)
+xlw::MyArray xlw::ArgumentList::GetArrayArgumentValue(const std::string& ArgumentName)
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, MyMatrix>::const_iterator it = MatrixArguments.find(ArgumentName);
+    const Argument& argument = Use(ArgumentName, vector, "array");
 
-    if (it == MatrixArguments.end())
-        throw(StructureName+std::string(" unknown matrix argument asked for :")+ArgumentName);
+    MyArray result(argument.Rows);
+    for (size_t i=0; i < argument.Rows; i++)
+        result[i] = Cells(argument.Top+i, argument.Left).NumericValue();
 
-    UseArgumentName(ArgumentName);
-    return it->second;
+    return result;
 }
-bool xlw::ArgumentList::GetBoolArgumentValue(const std::string& ArgumentName_)
+
+xlw::MyMatrix xlw::ArgumentList::GetMatrixArgumentValue(const std::string& ArgumentName)
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, bool>::const_iterator it = BoolArguments.find(ArgumentName);
+    const Argument& argument = Use(ArgumentName, matrix, "matrix");
 
-    if (it == BoolArguments.end())
-        throw(StructureName+std::string(" unknown bool argument asked for :")+ArgumentName);
+    MyMatrix result(argument.Rows, argument.Columns);
+    for (size_t i=0; i < argument.Rows; i++)
+        for (size_t j=0; j < argument.Columns; j++)
+            ChangingElement(result,i,j) = Cells(argument.Top+i, argument.Left+j).NumericValue();
 
-    UseArgumentName(ArgumentName);
-    return it->second;
+    return result;
+}
 
+bool xlw::ArgumentList::GetBoolArgumentValue(const std::string& ArgumentName)
+{
+    return Use(ArgumentName, boolean, "bool").Boolean;
 }
 
 
 xlw::ArgumentList xlw::ArgumentList::GetArgumentListArgumentValue(const std::string& ArgumentName_)
 {
+    const Argument& argument = Use(ArgumentName_, list, "ArgList");
+
     std::string ArgumentName(ArgumentName_);
     MakeLowerCase(ArgumentName);
-    std::map<std::string, CellMatrix>::const_iterator it = ListArguments.find(ArgumentName);
-
-    if (it == ListArguments.end())
-        throw(StructureName+std::string(" unknown ArgList argument asked for :")+ArgumentName);
-
-    UseArgumentName(ArgumentName);
-    return ArgumentList(it->second,ArgumentName);
+    return ArgumentList(View(argument),ArgumentName);
 }
 
-xlw::CellMatrix xlw::ArgumentList::GetCellsArgumentValue(const std::string& ArgumentName_)
+xlw::CellMatrix xlw::ArgumentList::GetCellsArgumentValue(const std::string& ArgumentName)
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    std::map<std::string, CellMatrix>::const_iterator it = CellArguments.find(ArgumentName);
-
-    if (it == CellArguments.end())
-        throw(StructureName+std::string(" unknown Cells argument asked for :")+ArgumentName);
-
-    UseArgumentName(ArgumentName);
-    return it->second;
+    return View(Use(ArgumentName, cells, "Cells"));
 }
-bool xlw::ArgumentList::IsArgumentPresent(const std::string& ArgumentName_) const
+
+bool xlw::ArgumentList::IsArgumentPresent(const std::string& ArgumentName) const
 {
-    std::string ArgumentName(ArgumentName_);
-    MakeLowerCase(ArgumentName);
-    return (Names.find(ArgumentName) != Names.end());
+    return Find(ArgumentName) != Arguments.size();
 }
 
 void xlw::ArgumentList::CheckAllUsed(const std::string& ErrorId) const
 {
     std::string unusedList;
 
-    for (std::map<std::string,bool>::const_iterator it = ArgumentsUsed.begin();
-        it != ArgumentsUsed.end(); it++)
+    for (size_t i=0; i < Arguments.size(); i++)
     {
-        if (!it->second)
-            unusedList+=it->first + std::string(", ");
+        if (!Arguments[i].Used)
+            unusedList+=ArgumentNames[i].first + std::string(", ");
     }
 
     if (unusedList !="")
@@ -536,7 +605,7 @@ void xlw::ArgumentList::CheckAllUsed(const std::string& ErrorId) const
 
 }
 
-void xlw::ArgumentList::GenerateThrow(std::string message, size_t row, size_t column)
+void xlw::ArgumentList::GenerateThrow(const std::string& message, size_t row, size_t column) const
 {
     throw(StructureName+" "+message+" row:"+ConvertToString(static_cast<unsigned long>(row))+"; column:"+ConvertToString(static_cast<unsigned long>(column))+".");
 }
@@ -551,88 +620,54 @@ xlw::CellMatrix xlw::ArgumentList::AllData() const
     CellMatrix results(1,1);
     results(0,0)= StructureName;
 
-    {for (std::map<std::string,double>::const_iterator it= DoubleArguments.begin();
-            it != DoubleArguments.end(); it++)
-    {
-         CellMatrix tmp(2,1);
-         tmp(0,0) = it->first;
-         tmp(1,0) = it->second;
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,MyArray>::const_iterator it= ArrayArguments.begin();
-            it != ArrayArguments.end(); it++)
-    {
-        CellMatrix tmp(3+it->second.size(),1);
-         tmp(0,0) = it->first;
-         tmp(1,0) = std::string("array");
-         tmp(2,0) = static_cast<double>(it->second.size());
-         for (size_t i=0; i < it->second.size(); i++)
-             tmp(i+3,0)=it->second[i];
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,MyMatrix>::const_iterator it= MatrixArguments.begin();
-            it != MatrixArguments.end(); it++)
-    {
-         CellMatrix tmp(3+it->second.size1(),maxi(size_t(2), it->second.size2()));
-         tmp(0,0) = it->first;
-         tmp(1,0) = std::string("matrix");
-         tmp(2,0) = static_cast<double>(it->second.size1());
-         tmp(2,1) = static_cast<double>(it->second.size2());
-         for (size_t i=0; i < it->second.size1(); i++)
-             for (size_t j=0; j < it->second.size2(); j++)
-                 tmp(i+3,j)=Element(it->second,i,j);
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,std::string>::const_iterator it= StringArguments.begin();
-            it != StringArguments.end(); it++)
-    {
-         CellMatrix tmp(2,1);
-         tmp(0,0) = it->first;
-         tmp(1,0) = it->second;
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,bool>::const_iterator it= BoolArguments.begin();
-            it != BoolArguments.end(); it++)
-    {
-         CellMatrix tmp(2,1);
-         tmp(0,0) = it->first;
-         tmp(1,0) = it->second;
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,CellMatrix>::const_iterator it= CellArguments.begin();
-            it != CellArguments.end(); it++)
-    {
-        CellMatrix tmp(3+it->second.RowsInStructure(),maxi(size_t(2),it->second.ColumnsInStructure()));
-         tmp(0,0) = it->first;
-         tmp(1,0) = std::string("cells");
-         tmp(2,0) = static_cast<double>(it->second.RowsInStructure());
-         tmp(2,1) = static_cast<double>(it->second.ColumnsInStructure());
-         for (size_t i=0; i < it->second.RowsInStructure(); i++)
-             for (size_t j=0; j < it->second.ColumnsInStructure(); j++)
-                 tmp(i+3,j)=it->second(i,j);
-         results.PushBottom(tmp);
-    }}
-
-    {for (std::map<std::string,CellMatrix>::const_iterator it= ListArguments.begin();
-        it != ListArguments.end(); it++)
-    {
-        CellMatrix tmp(3+it->second.RowsInStructure(),maxi(size_t(2),it->second.ColumnsInStructure()));
-         tmp(0,0) = it->first;
-         tmp(1,0) = std::string("list");
-         tmp(2,0) = static_cast<double>(it->second.RowsInStructure());
-         tmp(2,1) = static_cast<double>(it->second.ColumnsInStructure());
-         for (size_t i=0; i < it->second.RowsInStructure(); i++)
-             for (size_t j=0; j < it->second.ColumnsInStructure(); j++)
-                 tmp(i+3,j)=it->second(i,j);
-         results.PushBottom(tmp);
-    }}
+    // grouped by type and sorted by name within each type, as when
+    // the arguments were kept in one map per type
+    std::vector<size_t> order(Arguments.size());
+    for (size_t i=0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), AllDataOrder(ArgumentNames));
 
+    for (size_t k=0; k < order.size(); k++)
+    {
+        const std::string& name = ArgumentNames[order[k]].first;
+        ArgumentType type = ArgumentNames[order[k]].second;
+        const Argument& argument = Arguments[order[k]];
 
+        if (type == number || type == string || type == boolean)
+        {
+            CellMatrix tmp(2,1);
+            tmp(0,0) = name;
+            if (type == number)
+                tmp(1,0) = argument.Number;
+            else if (type == string)
+                tmp(1,0) = argument.String;
+            else
+                tmp(1,0) = argument.Boolean;
+            results.PushBottom(tmp);
+        }
+        else if (type == vector)
+        {
+            CellMatrix tmp(3+argument.Rows,1);
+            tmp(0,0) = name;
+            tmp(1,0) = std::string("array");
+            tmp(2,0) = static_cast<double>(argument.Rows);
+            for (size_t i=0; i < argument.Rows; i++)
+                tmp(i+3,0) = Cells(argument.Top+i, argument.Left);
+            results.PushBottom(tmp);
+        }
+        else
+        {
+            CellMatrix tmp(3+argument.Rows,maxi(size_t(2),argument.Columns));
+            tmp(0,0) = name;
+            tmp(1,0) = std::string(type == matrix ? "matrix" : (type == cells ? "cells" : "list"));
+            tmp(2,0) = static_cast<double>(argument.Rows);
+            tmp(2,1) = static_cast<double>(argument.Columns);
+            for (size_t i=0; i < argument.Rows; i++)
+                for (size_t j=0; j < argument.Columns; j++)
+                    tmp(i+3,j) = Cells(argument.Top+i, argument.Left+j);
+            results.PushBottom(tmp);
+        }
+    }
 
     return results;
 }
@@ -322,6 +322,13 @@ xlw::CellMatrix xlw::MergeCellMatrices(const CellMatrix& Top, const CellMatrix&
     return merged;
 }
 
+void xlw::CellMatrix::swap(CellMatrix& other)
+{
+    Cells.swap(other.Cells);
+    std::swap(Rows, other.Rows);
+    std::swap(Columns, other.Columns);
+}
+
 void xlw::CellMatrix::PushBottom(const CellMatrix& newRows)
 {
     CellMatrix newRowsResize(newRows);
@@ -15,25 +15,191 @@
 */
 
 #include <clw/Dispatcher.h>
+#include <clw/WorkerThreads.h>
 
 #include <xlw/ArgList.h>
+
+namespace
+{
+  // each thread starts with a contiguous share of the calls and takes them
+  // from the front, a thread that runs out steals the back half of the
+  // largest remaining share, so uneven call costs still keep every thread busy
+  struct Share
+  {
+    clw::Mutex mutex;
+    size_t next;
+    size_t end;
+  };
+
+  struct Batch
+  {
+    const clw::Dispatcher* dispatcher;
+    const std::vector<xlw::ArgumentList>* args;
+    std::vector<clw::DispatchResult>* results;
+    std::vector<Share*> shares;
+    clw::Mutex mutex;
+    size_t threadsStarted;
+  };
+
+  bool TakeOwn(Share& share, size_t& task)
+  {
+    clw::Lock lock(share.mutex);
+    if (share.next == share.end)
+      return false;
+    task = share.next++;
+    return true;
+  }
+
+  size_t Remaining(Share& share)
+  {
+    clw::Lock lock(share.mutex);
+    return share.end - share.next;
+  }
+
+  bool Steal(Batch& batch, Share& own)
+  {
+    size_t victim = batch.shares.size();
+    size_t most = 0;
+    for (size_t i=0; i < batch.shares.size(); ++i)
+    {
+      // only used to pick a victim, the share may change once unlocked
+      if (batch.shares[i] == &own)
+        continue;
+      size_t left = Remaining(*batch.shares[i]);
+      if (left > most)
+      {
+        most = left;
+        victim = i;
+      }
+    }
+
+    if (victim == batch.shares.size())
+      return false;
+
+    size_t begin, end;
+    {
+      Share& share = *batch.shares[victim];
+      clw::Lock lock(share.mutex);
+      size_t left = share.end - share.next;
+      if (left == 0)
+        return true; // emptied meanwhile, look again
+      end = share.end;
+      begin = share.end - (left+1)/2;
+      share.end = begin;
+    }
+
+    clw::Lock lock(own.mutex);
+    own.next = begin;
+    own.end = end;
+    return true;
+  }
+
+  void Call(Batch& batch, size_t task)
+  {
+    clw::DispatchResult& result = (*batch.results)[task];
+    try
+    {
+      result.Value = batch.dispatcher->CallFunction((*batch.args)[task]);
+    }
+    catch (const char* c)
+    {
+      result.Failed = true;
+      result.Error = c;
+    }
+    catch (const std::string& c)
+    {
+      result.Failed = true;
+      result.Error = c;
+    }
+    catch (...)
+    {
+      result.Failed = true;
+      result.Error = "exception thrown";
+    }
+  }
+
+  void Work(void* arg)
+  {
+    Batch& batch = *static_cast<Batch*>(arg);
+
+    size_t id;
+    {
+      clw::Lock lock(batch.mutex);
+      id = batch.threadsStarted++;
+    }
+    Share& own = *batch.shares[id];
+
+    while (true)
+    {
+      size_t task;
+      while (TakeOwn(own, task))
+        Call(batch, task);
+
+      if (!Steal(batch, own))
+        return;
+    }
+  }
+}
+
 namespace
 clw
 {
   using namespace xlw;
-  CellMatrix Dispatcher::CallFunction(const ArgumentList& args) const
+
+  FunctionToCall Dispatcher::Find(const std::string& id) const
   {
-    std::string Id = args.GetStructureName();
+    // parsed structure names are already lower case, so only
+    // lower case a copy when the exact lookup misses
+    std::map<std::string, FunctionToCall>::const_iterator it = DispatchMap.find(id);
+    if (it != DispatchMap.end())
+      return it->second;
 
+    std::string Id(id);
     xlw::MakeLowerCase(Id);
-    if  (DispatchMap.find(Id) == DispatchMap.end())
+    it = DispatchMap.find(Id);
+    if (it != DispatchMap.end())
+      return it->second;
+
+    std::string message(Id+" is an unknown function. Known functions are "+KnownFunctions);
+    throw message;
+  }
+
+  CellMatrix Dispatcher::CallFunction(const ArgumentList& args) const
+  {
+    return Find(args.GetStructureName())(args);
+  }
+
+  std::vector<DispatchResult> Dispatcher::CallFunctions(const std::vector<ArgumentList>& args,
+                                                        unsigned long threads) const
+  {
+    std::vector<DispatchResult> results(args.size());
+
+    if (threads == 0)
+      threads = HardwareThreads();
+    if (threads > args.size())
+      threads = static_cast<unsigned long>(args.size());
+    if (threads == 0)
+      return results;
+
+    Batch batch;
+    batch.dispatcher = this;
+    batch.args = &args;
+    batch.results = &results;
+    batch.threadsStarted = 0;
+
+    // a share that no thread was started for is simply stolen
+    Share* shares = new Share[threads];
+    for (unsigned long t=0; t < threads; ++t)
     {
-      std::string message(Id+" is an unknown function. Known functions are "+KnownFunctions);
-      throw message;
+      shares[t].next = args.size()*t/threads;
+      shares[t].end = args.size()*(t+1)/threads;
+      batch.shares.push_back(&shares[t]);
     }
 
-    return (DispatchMap.find(Id)->second)(args);
+    RunOnThreads(threads, Work, &batch);
+    delete[] shares;
 
+    return results;
   }
 
 
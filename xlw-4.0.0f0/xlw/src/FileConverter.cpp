@@ -19,168 +19,453 @@
  FOR A PARTICULAR PURPOSE.  See the license for more details.
 */
 #include <clw/FileConverter.h>
+#include <clw/Dispatcher.h>
+#include <clw/WorkerThreads.h>
 #include <xlw/CellMatrix.h>
 #include <xlw/ArgList.h>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
 using namespace xlw;
 
 namespace
 {
-  CellValue CellFromString(const std::string value)
+  const double PowersOfTen[] =
   {
-    std::string::const_iterator it = value.begin();
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+    1e21, 1e22
+  };
+
+  // [+-]digits[.digits][(e|E)[+-]digits], at least one mantissa digit, and
+  // nothing else, in one pass over the token
+  // up to 15 significant digits with a small exponent are converted exactly
+  // without strtod; anything longer falls back to it
+  bool ParseNumber(const char* p, size_t n, double& value)
+  {
+    size_t i = 0;
+    bool negative = false;
+    if (i < n && (p[i] == '+' || p[i] == '-'))
+    {
+      negative = p[i] == '-';
+      ++i;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
 
-    bool nonnumber = false;
-    bool decpointfound = false;
+    for (; i < n && p[i] >= '0' && p[i] <= '9'; ++i)
+    {
+      anyDigits = true;
+      int d = p[i] - '0';
+      if (mantissa == 0 && d == 0)
+        continue;
+      if (digits < 19)
+      {
+        mantissa = mantissa*10 + d;
+        ++digits;
+      }
+      else
+        ++exponent;
+    }
 
-    while (it != value.end())
+    if (i < n && p[i] == '.')
     {
-      if (*it != '.' || decpointfound)
-        if ( *it < '0' || *it > '9' )
-          nonnumber = true;
+      for (++i; i < n && p[i] >= '0' && p[i] <= '9'; ++i)
+      {
+        anyDigits = true;
+        int d = p[i] - '0';
+        if (mantissa == 0 && d == 0)
+        {
+          --exponent;
+          continue;
+        }
+        if (digits < 19)
+        {
+          mantissa = mantissa*10 + d;
+          ++digits;
+          --exponent;
+        }
+      }
+    }
 
-      if (*it == '.')
-        decpointfound = true;
+    if (!anyDigits)
+      return false;
 
-      ++it;
+    if (i < n && (p[i] == 'e' || p[i] == 'E'))
+    {
+      ++i;
+      bool negativeExponent = false;
+      if (i < n && (p[i] == '+' || p[i] == '-'))
+      {
+        negativeExponent = p[i] == '-';
+        ++i;
+      }
+      if (i == n || p[i] < '0' || p[i] > '9')
+        return false;
+
+      int e = 0;
+      for (; i < n && p[i] >= '0' && p[i] <= '9'; ++i)
+        if (e < 100000)
+          e = e*10 + (p[i] - '0');
+
+      exponent += negativeExponent ? -e : e;
     }
 
+    if (i != n)
+      return false;
 
-    if (nonnumber)
-      return CellValue(value);
+    if (mantissa == 0)
+      value = 0.0;
+    else if (digits <= 15 && exponent >= -22 && exponent <= 22)
+    {
+      value = static_cast<double>(mantissa);
+      if (exponent < 0)
+        value /= PowersOfTen[-exponent];
+      else
+        value *= PowersOfTen[exponent];
+    }
     else
-      return CellValue(atof(value.c_str()));
+    {
+      std::string token(p, n);
+      value = std::strtod(token.c_str(), 0);
+      return true;
+    }
 
+    if (negative)
+      value = -value;
+    return true;
   }
-}
 
-namespace clw
-{
-  std::vector<ArgumentList> FileConversion(const std::vector<char>& inputFile,
-    unsigned long gapSize)
+  CellValue CellFromToken(const char* p, size_t n)
   {
-    std::vector<char>::const_iterator it = inputFile.begin();
+    if (n == 0)
+      return CellValue();
 
+    double value;
+    if (ParseNumber(p, n, value))
+      return CellValue(value);
 
-    std::vector<std::vector<std::string> > Cells;
-    Cells.resize(1);
-    std::string currentCell;
+    return CellValue(std::string(p, n));
+  }
 
-    while (it != inputFile.end())
+  // builds the current block row by row as characters arrive, token text is
+  // kept in one buffer and only turned into cells when the block is complete
+  class BlockBuilder
+  {
+  public:
+    BlockBuilder(unsigned long gapSize_, clw::ArgumentListSink& sink_)
+      : gapSize(gapSize_ > 0 ? gapSize_ : 1), sink(sink_),
+        rowStart(0), cellStart(0), emptyRun(0), maxColumns(0)
     {
-      char c = *it;
-      ++it;
+    }
 
-      switch (c)
+    void Feed(const char* it, const char* end)
+    {
+      while (it != end)
       {
-      case  ',' : // end of cell but not line
-        { 
-          (*Cells.rbegin()).push_back(currentCell);
-          currentCell = "";
+        const char* run = it;
+        while (it != end && *it != ',' && *it != '\n' && *it != '\r')
+          ++it;
+        text.append(run, it);
+
+        if (it == end)
           break;
-        } 
-      case '\n' : // new line so move on;
+
+        switch (*it)
         {
-          Cells.push_back(std::vector<std::string>());
-          if (currentCell != "") 
-          {
-            (*Cells.rbegin()).push_back(currentCell);
-            currentCell = "";
-          }
+        case ',' : // end of cell but not line
+          tokenEnds.push_back(text.size());
+          cellStart = text.size();
+          break;
+        case '\n' : // new line so move on
+          EndRow();
+          break;
+        default : // carriage returns are dropped
           break;
         }
-      default:
-        {
-          currentCell.push_back(c);
-        }
+        ++it;
       }
+    }
 
+    void Finish()
+    {
+      if (text.size() > cellStart || tokenEnds.size() > rowStart)
+        EndRow();
+      if (!rowEnds.empty())
+        Emit();
     }
 
+  private:
+    unsigned long gapSize;
+    clw::ArgumentListSink& sink;
 
-    std::vector<std::vector<CellValue> > cellValues(Cells.size());
-    for (unsigned long i=0; i < Cells.size(); ++i)
+    std::string text;
+    std::vector<size_t> tokenEnds;  // token k is text[tokenEnds[k-1], tokenEnds[k])
+    std::vector<size_t> rowEnds;    // number of tokens up to the end of each row
+    size_t rowStart;                // first token of the current row
+    size_t cellStart;               // start of the current cell in text
+    unsigned long emptyRun;         // empty rows since the last non empty one
+    size_t maxColumns;
+
+    void EndRow()
     {
-      
-      cellValues[i].reserve(Cells[i].size());
-      for (unsigned long j=0; j < Cells[i].size(); ++j)
-        cellValues[i].push_back( CellFromString(Cells[i][j]));
-    }
+      if (text.size() > cellStart)
+        tokenEnds.push_back(text.size());
+      cellStart = text.size();
+
+      size_t columns = tokenEnds.size() - rowStart;
 
+      if (columns == 0)
+      {
+        // leading empty rows are dropped, short gaps stay in the block
+        if (!rowEnds.empty() && ++emptyRun >= gapSize)
+          Emit();
+        return;
+      }
 
-    size_t rows =cellValues.size();
-    std::vector<CellMatrix> cellMatrices;
+      for (; emptyRun > 0; --emptyRun)
+        rowEnds.push_back(rowStart);
+
+      rowEnds.push_back(tokenEnds.size());
+      rowStart = tokenEnds.size();
+      if (columns > maxColumns)
+        maxColumns = columns;
+    }
 
-    size_t currentRow=0;
+    void Emit()
+    {
+      CellMatrix block(rowEnds.size(), maxColumns);
 
+      size_t token = 0;
+      size_t start = 0;
+      for (size_t i=0; i < rowEnds.size(); ++i)
+        for (size_t j=0; token < rowEnds[i]; ++j, ++token)
+        {
+          size_t end = tokenEnds[token];
+          block(i,j) = CellFromToken(text.data()+start, end-start);
+          start = end;
+        }
 
-    // now divide into CellMatrices
+      text.clear();
+      tokenEnds.clear();
+      rowEnds.clear();
+      rowStart = 0;
+      cellStart = 0;
+      emptyRun = 0;
+      maxColumns = 0;
 
-    while (currentRow < rows)
+      sink.Receive(ArgumentList(block,"clw"));
+    }
+  };
+
+  class CollectingSink : public clw::ArgumentListSink
+  {
+  public:
+    void Receive(const ArgumentList& args)
     {
-      while( currentRow < rows && cellValues[currentRow].size() == 0) 
-        ++currentRow;
+      results.push_back(args);
+    }
 
-      size_t startRow = currentRow;
+    std::vector<ArgumentList> results;
+  };
 
+  CellMatrix Call(const ArgumentList& args)
+  {
+    try
+    {
+      return clw::Dispatcher::Instance().CallFunction(args);
+    }
+    catch (const char* c)
+    {
+      return CellMatrix(c);
+    }
+    catch (const std::string& c)
+    {
+      return CellMatrix(c);
+    }
+    catch (...)
+    {
+      return CellMatrix("exception thrown");
+    }
+  }
 
-      if (currentRow < rows)
+  // parsing runs on the calling thread and feeds a bounded queue, so that a
+  // large file is never held in memory as a whole, the consumer threads take
+  // blocks off it; with no consumer running the blocks are called inline
+  class DispatchQueue : public clw::ArgumentListSink
+  {
+  public:
+    DispatchQueue(const std::string& fileName_, unsigned long gapSize_, unsigned long workers)
+      : failed(false), fileName(fileName_), gapSize(gapSize_), consumers(0),
+        freeSlots(4*workers), items(0)
+    {
+    }
+
+    void Receive(const ArgumentList& args)
+    {
+      if (consumers == 0)
       {
-        size_t firstEmpty;
-        bool endNotFound = true;  
-        do
-        {
-          while( currentRow < rows && cellValues[currentRow].size() != 0) 
-            ++currentRow;
+        results.push_back(Call(args));
+        return;
+      }
 
-          if (currentRow < rows)
-          {
-            firstEmpty = currentRow;
+      freeSlots.Wait();
+      {
+        clw::Lock lock(mutex);
+        queue.push_back(std::make_pair(results.size(), new ArgumentList(args)));
+        results.push_back(CellMatrix());
+      }
+      items.Post();
+    }
 
-            while( currentRow < rows && cellValues[currentRow].size() == 0) 
-              ++currentRow;
+    void Produce(unsigned long consumers_)
+    {
+      consumers = consumers_;
 
-            if (currentRow == rows || (currentRow - firstEmpty) >=gapSize)
-              endNotFound = false;
+      try
+      {
+        clw::FileConversion(fileName, gapSize, *this);
+      }
+      catch (const char* c)
+      {
+        failed = true;
+        error = c;
+      }
+      catch (const std::string& c)
+      {
+        failed = true;
+        error = c;
+      }
+      catch (...)
+      {
+        failed = true;
+        error = "exception thrown reading "+fileName;
+      }
 
-          }
-          else
-            endNotFound=false;
+      // one end marker per consumer
+      for (unsigned long i=0; i < consumers; ++i)
+      {
+        freeSlots.Wait();
+        {
+          clw::Lock lock(mutex);
+          queue.push_back(std::make_pair(size_t(0), static_cast<ArgumentList*>(0)));
         }
-        while (endNotFound);
+        items.Post();
+      }
+    }
 
-        if (currentRow == rows)
-          firstEmpty = rows;
+    static void Consume(void* arg)
+    {
+      DispatchQueue& self = *static_cast<DispatchQueue*>(arg);
 
-        if (startRow < firstEmpty)
+      while (true)
+      {
+        self.items.Wait();
+        std::pair<size_t, ArgumentList*> item;
         {
-          size_t maxColSize=0;
-
-          for (size_t j=startRow; j < firstEmpty; ++j)
-            maxColSize = std::max<size_t>(maxColSize, cellValues.size());
-
-          CellMatrix thisOne(firstEmpty-startRow,maxColSize);
+          clw::Lock lock(self.mutex);
+          item = self.queue.front();
+          self.queue.pop_front();
+        }
+        self.freeSlots.Post();
 
-          for (size_t i=startRow; i < firstEmpty; ++i)
-            for (size_t j=0; j < cellValues[i].size(); ++j)
-              thisOne(i-startRow,j) = cellValues[i][j];
+        if (!item.second)
+          return;
 
-          cellMatrices.push_back(thisOne);
+        CellMatrix result(Call(*item.second));
+        delete item.second;
 
-        }
+        clw::Lock lock(self.mutex);
+        self.results[item.first] = result;
       }
     }
 
-    std::vector<ArgumentList> args;
-    for (unsigned long i=0; i < cellMatrices.size(); ++i)
-      args.push_back(ArgumentList(cellMatrices[i],"clw"));
+    std::vector<CellMatrix> results;
+    bool failed;
+    std::string error;
+
+  private:
+    std::string fileName;
+    unsigned long gapSize;
+    unsigned long consumers;
+
+    clw::Mutex mutex;
+    clw::Semaphore freeSlots;
+    clw::Semaphore items;
+    std::deque<std::pair<size_t, ArgumentList*> > queue;
+  };
+}
+
+namespace clw
+{
+  std::vector<ArgumentList> FileConversion(const std::vector<char>& inputFile,
+    unsigned long gapSize)
+  {
+    CollectingSink sink;
+    if (!inputFile.empty())
+      FileConversion(&inputFile[0], &inputFile[0]+inputFile.size(), gapSize, sink);
+    return sink.results;
+  }
+
+  void FileConversion(const char* begin, const char* end,
+    unsigned long gapSize, ArgumentListSink& sink)
+  {
+    BlockBuilder builder(gapSize, sink);
+    builder.Feed(begin, end);
+    builder.Finish();
+  }
+
+  void FileConversion(const std::string& fileName,
+    unsigned long gapSize, ArgumentListSink& sink)
+  {
+    FILE* file = std::fopen(fileName.c_str(), "rb");
+    if (!file)
+      throw("input file not found :"+fileName);
+
+    // a multi-GB file can't be mapped in one go into a 32 bit process,
+    // reading in fixed chunks keeps memory flat whatever the file size
+    std::vector<char> chunk(1 << 20);
+    BlockBuilder builder(gapSize, sink);
 
-    return args;
+    try
+    {
+      size_t read;
+      while ((read = std::fread(&chunk[0], 1, chunk.size(), file)) > 0)
+        builder.Feed(&chunk[0], &chunk[0]+read);
 
+      if (std::ferror(file))
+        throw("error reading "+fileName);
 
+      builder.Finish();
+    }
+    catch (...)
+    {
+      std::fclose(file);
+      throw;
+    }
+
+    std::fclose(file);
   }
 
+  std::vector<CellMatrix> DispatchFile(const std::string& fileName,
+    unsigned long gapSize, unsigned long threads)
+  {
+    if (threads == 0)
+      threads = 1;
 
+    DispatchQueue queue(fileName, gapSize, threads);
+    {
+      // threads that could not be started leave fewer consumers, or none
+      ThreadGroup consumers(DispatchQueue::Consume, &queue);
+      queue.Produce(consumers.Start(threads));
+    }
 
+    if (queue.failed)
+      throw(queue.error);
 
+    return queue.results;
+  }
 }
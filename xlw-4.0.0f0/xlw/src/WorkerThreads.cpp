@@ -0,0 +1,233 @@
+/*
+ Copyright (C) 2006 Mark Joshi
+
+
+ This file is part of XLW, a free-software/open-source C++ wrapper of the
+ Excel C API - http://xlw.sourceforge.net/
+
+ XLW is free software: you can redistribute it and/or modify it under the
+ terms of the XLW license.  You should have received a copy of the
+ license along with this program; if not, please email xlw-users@lists.sf.net
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE.  See the license for more details.
+*/
+
+#include <clw/WorkerThreads.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  struct Task
+  {
+    void (*work)(void*);
+    void* arg;
+  };
+
+#ifdef _WIN32
+  unsigned __stdcall ThreadMain(void* start)
+  {
+    Task* task = static_cast<Task*>(start);
+    task->work(task->arg);
+    return 0;
+  }
+#else
+  void* ThreadMain(void* start)
+  {
+    Task* task = static_cast<Task*>(start);
+    task->work(task->arg);
+    return 0;
+  }
+#endif
+}
+
+namespace
+clw
+{
+#ifdef _WIN32
+
+  struct Mutex::Impl
+  {
+    CRITICAL_SECTION cs;
+  };
+
+  struct Semaphore::Impl
+  {
+    HANDLE h;
+  };
+
+  struct ThreadGroup::Impl
+  {
+    Task task;
+    std::vector<HANDLE> handles;
+  };
+
+  Mutex::Mutex() : impl(new Impl) { InitializeCriticalSection(&impl->cs); }
+  Mutex::~Mutex() { DeleteCriticalSection(&impl->cs); delete impl; }
+  void Mutex::Lock() { EnterCriticalSection(&impl->cs); }
+  void Mutex::Unlock() { LeaveCriticalSection(&impl->cs); }
+
+  Semaphore::Semaphore(unsigned long initial) : impl(new Impl)
+  {
+    impl->h = CreateSemaphore(NULL, static_cast<LONG>(initial), 0x7fffffff, NULL);
+    if (!impl->h)
+    {
+      delete impl;
+      throw("semaphore could not be created");
+    }
+  }
+
+  Semaphore::~Semaphore() { CloseHandle(impl->h); delete impl; }
+  void Semaphore::Wait() { WaitForSingleObject(impl->h, INFINITE); }
+  void Semaphore::Post() { ReleaseSemaphore(impl->h, 1, NULL); }
+
+  unsigned long HardwareThreads()
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+  }
+
+  unsigned long ThreadGroup::Start(unsigned long threads)
+  {
+    unsigned long started = 0;
+    for (unsigned long t=0; t < threads; ++t)
+    {
+      HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(0, 0, ThreadMain, &impl->task, 0, 0));
+      if (h)
+      {
+        impl->handles.push_back(h);
+        ++started;
+      }
+    }
+    return started;
+  }
+
+  void ThreadGroup::Join()
+  {
+    for (size_t t=0; t < impl->handles.size(); ++t)
+    {
+      WaitForSingleObject(impl->handles[t], INFINITE);
+      CloseHandle(impl->handles[t]);
+    }
+    impl->handles.clear();
+  }
+
+#else
+
+  struct Mutex::Impl
+  {
+    pthread_mutex_t m;
+  };
+
+  struct Semaphore::Impl
+  {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    unsigned long count;
+  };
+
+  struct ThreadGroup::Impl
+  {
+    Task task;
+    std::vector<pthread_t> handles;
+  };
+
+  Mutex::Mutex() : impl(new Impl) { pthread_mutex_init(&impl->m, 0); }
+  Mutex::~Mutex() { pthread_mutex_destroy(&impl->m); delete impl; }
+  void Mutex::Lock() { pthread_mutex_lock(&impl->m); }
+  void Mutex::Unlock() { pthread_mutex_unlock(&impl->m); }
+
+  Semaphore::Semaphore(unsigned long initial) : impl(new Impl)
+  {
+    impl->count = initial;
+    pthread_mutex_init(&impl->m, 0);
+    pthread_cond_init(&impl->c, 0);
+  }
+
+  Semaphore::~Semaphore()
+  {
+    pthread_cond_destroy(&impl->c);
+    pthread_mutex_destroy(&impl->m);
+    delete impl;
+  }
+
+  void Semaphore::Wait()
+  {
+    pthread_mutex_lock(&impl->m);
+    while (impl->count == 0)
+      pthread_cond_wait(&impl->c, &impl->m);
+    --impl->count;
+    pthread_mutex_unlock(&impl->m);
+  }
+
+  void Semaphore::Post()
+  {
+    pthread_mutex_lock(&impl->m);
+    ++impl->count;
+    pthread_cond_signal(&impl->c);
+    pthread_mutex_unlock(&impl->m);
+  }
+
+  unsigned long HardwareThreads()
+  {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<unsigned long>(n) : 1;
+  }
+
+  unsigned long ThreadGroup::Start(unsigned long threads)
+  {
+    unsigned long started = 0;
+    for (unsigned long t=0; t < threads; ++t)
+    {
+      pthread_t h;
+      if (pthread_create(&h, 0, ThreadMain, &impl->task) == 0)
+      {
+        impl->handles.push_back(h);
+        ++started;
+      }
+    }
+    return started;
+  }
+
+  void ThreadGroup::Join()
+  {
+    for (size_t t=0; t < impl->handles.size(); ++t)
+      pthread_join(impl->handles[t], 0);
+    impl->handles.clear();
+  }
+
+#endif
+
+  ThreadGroup::ThreadGroup(void (*work)(void*), void* arg) : impl(new Impl)
+  {
+    impl->task.work = work;
+    impl->task.arg = arg;
+  }
+
+  ThreadGroup::~ThreadGroup()
+  {
+    Join();
+    delete impl;
+  }
+
+  unsigned long RunOnThreads(unsigned long threads, void (*work)(void*), void* arg)
+  {
+    ThreadGroup group(work, arg);
+    unsigned long started = threads > 1 ? group.Start(threads-1) : 0;
+
+    work(arg);
+
+    group.Join();
+    return started+1;
+  }
+}
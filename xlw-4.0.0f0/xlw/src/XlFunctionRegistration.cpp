@@ -22,6 +22,7 @@
 
 #include <xlw/XlFunctionRegistration.h>
 #include <xlw/xlfFuncDesc.h>
+#include <xlw/XlfCmdDesc.h>
 #include <xlw/xlfArgDescList.h>
 
 using namespace xlw;
@@ -130,6 +131,55 @@ XLFunctionRegistrationHelper::XLFunctionRegistrationHelper(const std::string& Fu
     ExcelFunctionRegistrationRegistry::Instance().AddFunction(tmp);
 }
 
+XLCommandRegistrationData::XLCommandRegistrationData(const std::string& CommandName_,
+                     const std::string& ExcelCommandName_,
+                     const std::string& CommandDescription_,
+                     const int Events_[],
+                     int NoOfEvents_)
+    :                CommandName(CommandName_),
+                     ExcelCommandName(ExcelCommandName_),
+                     CommandDescription(CommandDescription_)
+{
+    for (int i=0; i < NoOfEvents_; i++)
+    {
+        Events.push_back(Events_[i]);
+    }
+}
+
+std::string XLCommandRegistrationData::GetCommandName() const
+{
+    return CommandName;
+}
+
+std::string XLCommandRegistrationData::GetExcelCommandName() const
+{
+    return ExcelCommandName;
+}
+
+std::string XLCommandRegistrationData::GetCommandDescription() const
+{
+    return CommandDescription;
+}
+
+std::vector<int> XLCommandRegistrationData::GetEvents() const
+{
+    return Events;
+}
+
+XLCommandRegistrationHelper::XLCommandRegistrationHelper(const std::string& CommandName,
+                     const std::string& ExcelCommandName,
+                     const std::string& CommandDescription,
+                     const int Events[],
+                     int NoOfEvents)
+{
+    XLCommandRegistrationData tmp(CommandName,
+                                  ExcelCommandName,
+                                  CommandDescription,
+                                  Events,
+                                  NoOfEvents);
+    ExcelFunctionRegistrationRegistry::Instance().AddCommand(tmp);
+}
+
 ExcelFunctionRegistrationRegistry& ExcelFunctionRegistrationRegistry::Instance()
 {
     static ExcelFunctionRegistrationRegistry SingleInstance;
@@ -164,12 +214,35 @@ void ExcelFunctionRegistrationRegistry::DoTheRegistrations() const
          xlFunction.Register();
     }
 
+    // Commands come after the functions, so that a failure here can't cost any of them.
+    // Excel before 2010 doesn't know xlEventRegister, and fails it; that's not an error.
+    for (std::list<XLCommandRegistrationData>::const_iterator it = CommandRegistrationData.begin(); it != CommandRegistrationData.end(); ++it)
+    {
+        XlfCmdDesc xlCommand(it->GetCommandName(),
+                             it->GetExcelCommandName(),
+                             it->GetCommandDescription(),
+                             false);
+        xlCommand.Register();
+
+        std::vector<int> events = it->GetEvents();
+        for (std::vector<int>::const_iterator ev = events.begin(); ev != events.end() && XlfExcel::Instance().excel12(); ++ev)
+        {
+            XlfExcel::Instance().Call(xlEventRegister, NULL, 2,
+                                      (LPXLFOPER)XlfOper(it->GetExcelCommandName()),
+                                      (LPXLFOPER)XlfOper(static_cast<double>(*ev)));
+        }
+    }
 }
 void ExcelFunctionRegistrationRegistry::AddFunction(const XLFunctionRegistrationData& data)
 {
     RegistrationData.push_back(data);
 }
 
+void ExcelFunctionRegistrationRegistry::AddCommand(const XLCommandRegistrationData& data)
+{
+    CommandRegistrationData.push_back(data);
+}
+
 ExcelFunctionRegistrationRegistry::ExcelFunctionRegistrationRegistry()
 {
 }